@@ -1,11 +1,24 @@
+// memfd_create(2)
+#define _GNU_SOURCE
+
 #include "asm.h"
-#include "visitor.h"
+#include "cgen.h"
+#include "ir.h"
+#include "regalloc.h"
+#include "peephole.h"
 #include "global.h"
 #include "types.h"
 #include "lexer.h"
 #include "flags.h"
 #include "utils.h"
 #include "kwds.h"
+#include "mem.h"
+#include "objcache.h"
+#include "io.h"
+#include "reach.h"
+#include "x64.h"
+#include "obj.h"
+#include "ds/smap.h"
 
 #include <forge/err.h>
 #include <forge/utils.h>
@@ -13,11 +26,14 @@
 #include <forge/str.h>
 #include <forge/array.h>
 #include <forge/io.h>
-#include <forge/cmd.h>
 
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 /*
 calling order: rdi, rsi, rdx, rcx, r8, r9.
@@ -41,686 +57,644 @@ calling order: rdi, rsi, rdx, rcx, r8, r9.
   %r15 %r15d %r15w %r15b
  */
 
-#define REGAT(i, j, mat) mat[(i) * g_regs_c + (j)]
-
-static char *g_regs[] = {
-        "rcx", "ecx",  "cx",   "cl",
-        "rdx", "edx",  "dx",   "dl",
-        "rsi", "esi",  "si",   "sil",
-        "rdi", "edi",  "di",   "dil",
-        "r8",  "r8d",  "r8w",  "r8b",
-        "r9",  "r9d",  "r9w",  "r9b",
-        "r10", "r10d", "r10w", "r10b",
-        "r11", "r11d", "r11w", "r11b",
-};
-
-const size_t g_regs_n = sizeof(g_regs)/sizeof(*g_regs);
-#define g_regs_r 8
-#define g_regs_c 4
-
-static int g_inuse_regs[g_regs_r * g_regs_c] = {
-        0, 0, 0, 0,
-        0, 0, 0, 0,
-        0, 0, 0, 0,
-        0, 0, 0, 0,
-        0, 0, 0, 0,
-        0, 0, 0, 0,
-        0, 0, 0, 0,
-        0, 0, 0, 0,
-};
-
 typedef struct {
-        FILE *out;
+        FILE *out;        // the rendered assembly, see write_asm()
         symtbl *tbl;
         const char *modname;
+        const char *stem; // <stem>.o
+        char *asm_fp;     // what nasm reads, see open_asm()
+        int asm_unlink;   // whether asm_fp is ours to remove
+        x64_item_array code;
+        str_array strs;   // labels, names and lines that code refers to
+        smap names;       // symbol -> its copy in strs
+        char *text;       // code as nasm source, see asm_text()
         str_array globals;
         str_array data_section;
         str_array externs;
-        str_array pushed_regs;
-        int_array pushed_regs_idxs;
-        str_array obj_filepaths;
+        smap unit;        // --whole-program: src_filepath of every module in it
+        int vbase;        // where the spill slots start, see vreg()
+        regalloc *ra;     // of the procedure being generated
+        int trial;        // generating code only to measure it, see trial_without_dce()
+        int text_bytes;   // -v: of the code of the module, before the peephole optimiser
+        int dce_bytes;    // and of what ir_dce() removed from it
+        const char **blocks; // the label of every block of the IR
 } asm_context;
 
-static str_array g_already_assembled = dyn_array_empty(str_array);
+// A program that turns the code into an object. Both its
+// command line and the object cache key come from here.
+typedef struct {
+        const char *name;
+        const char *const *flags; // NULL-terminated
+} asm_tool;
+
+static const asm_tool g_nasm = {"nasm", (const char *const[]){"-f", "elf64", "-g", "-F", "dwarf", NULL}};
+static const asm_tool g_gas  = {"as", (const char *const[]){"--64", "-g", NULL}};
+// The code is in C, of which -fwrapv and -fno-strict-aliasing
+// keep what the native code does. -masm=intel is for embeds.
+static const asm_tool g_cc   = {"cc", (const char *const[]){
+        "-x", "c", "-std=gnu11", "-O2", "-g", "-masm=intel", "-fwrapv", "-fno-strict-aliasing",
+        "-fno-pie", "-fno-stack-protector", "-fcf-protection=none", "-w", NULL,
+}};
+
+// Every module is generated and assembled once per process,
+// src_filepath -> its object file.
+static smap g_generated = {0};
+
+static void open_asm(asm_context *ctx);
 
 static void
-assemble(asm_context *ctx)
+format_insn(forge_str *out, const x64_insn *in, int gas)
 {
-        int (*_cmd)(const char *) = (g_config.flags & FLAG_TYPE_VERBOSE) == 0
-                ? cmd_s
-                : cmd;
+        int (*fmt)(const x64_insn *, char *, size_t) = gas ? x64_format_gas : x64_format;
+        char buf[256];
 
-        /* char *nasm = forge_cstr_builder("nasm -f elf64 -g -F dwarf ", g_config.filepath, ".asm -o ", */
-        /*                                 g_config.outname, ".o", NULL); */
+        int n = fmt(in, buf, sizeof(buf));
+        if ((size_t)n < sizeof(buf)) {
+                forge_str_concat(out, buf);
+        } else {
+                char *big = (char *)alloc(n + 1);
+                fmt(in, big, n + 1);
+                forge_str_concat(out, big);
+                free(big);
+        }
+}
 
-        const char *src_filepath = ctx->tbl->src_filepath;
+// `lbl: db "text", 10, 0` as string literals are written.
+static void
+gas_db(forge_str *out, const char *line, const char *db)
+{
+        for (const char *p = line; p < db; ++p) {
+                forge_str_append(out, *p);
+        }
+        forge_str_append(out, ':');
+
+        for (const char *p = db + strlen(": db "); *p; ) {
+                if (*p == ' ' || *p == ',') {
+                        ++p;
+                } else if (*p == '"') {
+                        forge_str_concat(out, "\n.ascii \"");
+                        for (++p; *p && *p != '"'; ++p) {
+                                if (*p == '\\') forge_str_append(out, '\\');
+                                forge_str_append(out, *p);
+                        }
+                        forge_str_append(out, '"');
+                        if (*p) ++p;
+                } else {
+                        size_t n = strcspn(p, " ,");
+                        forge_str_concat(out, "\n.byte ");
+                        for (size_t i = 0; i < n; ++i) forge_str_append(out, p[i]);
+                        p += n;
+                }
+        }
+}
 
-        // Check to see if we have already assembled this file...
-        for (size_t i = 0; i < g_already_assembled.len; ++i) {
-                if (!strcmp(g_already_assembled.data[i], src_filepath)) {
-                        return;
+// A line of nasm, which is what the directives here and
+// embeds are written in, as gas reads it.
+static void
+gas_text(forge_str *out, const char *line)
+{
+        const char *db = strstr(line, ": db ");
+        x64_insn in;
+
+        if (!strcmp(line, "section .note.GNU-stack")) {
+                forge_str_concat(out, ".section .note.GNU-stack,\"\",@progbits");
+        } else if (!strncmp(line, "section ", 8)) {
+                forge_str_concat(out, ".section ");
+                forge_str_concat(out, line + 8);
+        } else if (!strncmp(line, "global ", 7)) {
+                forge_str_concat(out, ".globl ");
+                forge_str_concat(out, line + 7);
+        } else if (!strncmp(line, "extern ", 7)) {
+                forge_str_concat(out, ".extern ");
+                forge_str_concat(out, line + 7);
+        } else if (db) {
+                gas_db(out, line, db);
+        } else {
+                // Instructions this assembler does not know are
+                // mostly spelled the same.
+                char *copy = strdup(line);
+                if (x64_parse(copy, &in) == 0) {
+                        format_insn(out, &in, 1);
+                } else {
+                        forge_str_concat(out, line);
                 }
+                free(copy);
         }
+}
 
-        const char *basename = forge_io_basename(src_filepath);
+// The code as nasm or gas source. It is only rendered for
+// what needs the text: the assembler, --asm and the object
+// cache.
+static const char *
+asm_text(asm_context *ctx)
+{
+        if (ctx->text) return ctx->text;
 
-        char *nasm = forge_cstr_builder("nasm -f elf64 -g -F dwarf ", basename, ".asm -o ",
-                                        basename, ".o", NULL);
-        _cmd(nasm);
+        int gas = g_config.assembler == ASSEMBLER_GAS;
+        forge_str out = forge_str_create();
 
-        dyn_array_append(g_already_assembled, strdup(src_filepath));
+        if (gas) {
+                forge_str_concat(&out, ".intel_syntax noprefix\n");
+        }
 
-        char *rm_asm = forge_cstr_builder("rm ", basename, ".asm", NULL);
-        if ((g_config.flags & FLAG_TYPE_ASM) == 0) {
-                _cmd(rm_asm);
+        for (size_t i = 0; i < ctx->code.len; ++i) {
+                const x64_item *it = &ctx->code.data[i];
+                switch (it->kind) {
+                case X64_ITEM_INSN:
+                        format_insn(&out, &it->in, gas);
+                        break;
+                case X64_ITEM_LABEL:
+                        forge_str_concat(&out, it->s);
+                        forge_str_append(&out, ':');
+                        break;
+                case X64_ITEM_TEXT:
+                        if (gas) {
+                                gas_text(&out, it->s);
+                        } else {
+                                forge_str_concat(&out, it->s);
+                        }
+                        break;
+                }
+                forge_str_append(&out, '\n');
         }
 
-        free(nasm);
-        free(rm_asm);
+        ctx->text = out.data ? out.data : strdup("");
+        return ctx->text;
 }
 
+// Writes the assembly out for nasm or the user, in one go.
 static void
-write_txt(asm_context *ctx,
-          const char  *txt,
-          int          newline)
+write_asm(asm_context *ctx)
 {
-        assert(ctx->out);
+        if (ctx->out) return;
 
-        fwrite(txt, 1, strlen(txt), ctx->out);
-        if (newline) fwrite("\n", 1, 1, ctx->out);
+        const char *text = asm_text(ctx);
+        open_asm(ctx);
+        if (fwrite(text, 1, strlen(text), ctx->out) != strlen(text) || fflush(ctx->out) != 0) {
+                perror("fwrite");
+                exit(1);
+        }
 }
 
-static void
-take_txt(asm_context *ctx,
-         char        *txt,
-         int          newline)
-{
-        assert(ctx->out);
-
-        fwrite(txt, 1, strlen(txt), ctx->out);
+// A module between code generation and assembly. The
+// code in ctx is kept until it has been assembled.
+struct asm_job {
+        asm_context ctx;
+        char *obj_fp;
+        char key[65];  // in the object cache
+        char *obj;    // set once there is an object
+};
 
-        if (newline) fwrite("\n", 1, 1, ctx->out);
+static const asm_tool *
+asm_tool_of(void)
+{
+        if (g_config.emit == EMIT_C) return &g_cc;
+        return g_config.assembler == ASSEMBLER_GAS ? &g_gas : &g_nasm;
+}
 
-        free(txt);
+// Runs `t` with its flags, then `files`.
+static pid_t
+spawn_tool(const asm_tool *t, const char *const files[], size_t nfiles)
+{
+        size_t nflags = 0;
+        while (t->flags[nflags]) ++nflags;
+
+        const char **argv = (const char **)alloc((nflags + nfiles + 2) * sizeof(char *));
+        argv[0] = t->name;
+        memcpy(argv + 1, t->flags, nflags * sizeof(char *));
+        memcpy(argv + 1 + nflags, files, nfiles * sizeof(char *));
+        argv[1 + nflags + nfiles] = NULL;
+
+        pid_t pid = spawn_start((char *const *)argv);
+        free(argv);
+        return pid;
 }
 
-// Note: This function is used to fix any
-//       `cmp imm, imm` assembler errors.
-//       Use this function in conditionals
-//       to maybe convert `imm` to `reg`.
-static int
-is_register(const char *s)
+// Looks for the object in the cache, which may save running nasm.
+static void
+assemble_cached(asm_job *j)
 {
-        if (!s) return 0;
-        for (size_t i = 0; i < g_regs_n; ++i) {
-                if (!strcmp(s, g_regs[i])) {
-                        return 1;
-                }
+        asm_context *ctx = &j->ctx;
+
+        // The integrated assembler is part of cruc, and falls
+        // back to nasm.
+        const asm_tool *tool = asm_tool_of();
+        int integrated = g_config.emit != EMIT_C && g_config.assembler == ASSEMBLER_INTEGRATED;
+
+        sha256_ctx c;
+        sha256_init(&c);
+        objcache_toolchain(&c, tool->name);
+        sha256_cstr(&c, integrated ? "integrated" : "");
+        for (size_t i = 0; tool->flags[i]; ++i) {
+                sha256_cstr(&c, tool->flags[i]);
+        }
+        // Only a file kept with --asm is named in the debug
+        // info in a way that outlives this process.
+        sha256_cstr(&c, (g_config.flags & FLAG_TYPE_ASM) ? ctx->asm_fp : "");
+        sha256_cstr(&c, asm_text(ctx));
+        sha256_hex(&c, j->key);
+
+        char *cached = objcache_get(j->key);
+        if (cached && !g_config.build_dir) {
+                j->obj = cached;
+                return;
         }
-        return 0;
+        // The build directory wants its own copy.
+        if (cached && objcache_copy(cached, j->obj_fp)) {
+                j->obj = strdup(j->obj_fp);
+        }
+        free(cached);
 }
 
-static const char *
-get_reg_from_size(const char *reg, int sz)
+// Encodes the code as it is, without going through text.
+// Returns 0 if the object was written, or -1 if there is
+// something in it that only nasm knows.
+static int
+assemble_integrated(asm_job *j)
 {
+        asm_context *ctx = &j->ctx;
+        obj *o = obj_create();
+        x64_asm *a = x64_asm_begin(o);
         char *err = NULL;
 
-        if (!strcmp(reg, "rax") || !strcmp(reg, "eax") || !strcmp(reg, "ax") || !strcmp(reg, "al")) {
-                switch (sz) {
-                case 8: return "rax";
-                case 4: return "eax";
-                case 2: return "ax";
-                case 1: return "al";
-                default: err = "invalid size"; goto bad;
+        for (size_t i = 0; i < ctx->code.len; ++i) {
+                const x64_item *it = &ctx->code.data[i];
+                int r = 0;
+                switch (it->kind) {
+                case X64_ITEM_INSN:  r = x64_asm_insn(a, &it->in); break;
+                case X64_ITEM_LABEL: r = x64_asm_label(a, it->s);  break;
+                case X64_ITEM_TEXT:  r = x64_asm_line(a, it->s);   break;
                 }
+                if (r != 0) break;
         }
 
-        // Find the register family by checking all registers in g_regs
-        for (size_t i = 0; i < g_regs_r; ++i) {
-                for (size_t j = 0; j < g_regs_c; ++j) {
-                        if (!strcmp(REGAT(i, j, g_regs), reg)) {
-                                switch (sz) {
-                                case 8: return REGAT(i, 0, g_regs); // 64-bit (e.g., rax, rcx)
-                                case 4: return REGAT(i, 1, g_regs); // 32-bit (e.g., eax, ecx)
-                                case 2: return REGAT(i, 2, g_regs); // 16-bit (e.g., ax, cx)
-                                case 1: return REGAT(i, 3, g_regs); // 8-bit (e.g., al, cl)
-                                default: err = "invalid size"; goto bad;
-                                }
-                        }
-                }
+        int r = x64_asm_end(a, &err);
+        if (r == 0 && obj_write_elf(o, j->obj_fp) != 0) {
+                forge_err_wargs("could not write `%s`: %s", j->obj_fp, strerror(errno));
         }
+        if (r != 0 && (g_config.flags & FLAG_TYPE_VERBOSE)) {
+                printf("%s: %s, using nasm\n", ctx->tbl->src_filepath, err);
+        }
+
+        obj_free(o);
+        free(err);
 
-        err = "no matching register found";
- bad:
-        forge_err_wargs("get_reg_from_size(): could not get register (%s) of size %d: %s",
-                        reg, sz, err);
-        return NULL; // unreachable
+        return r;
 }
 
-static char *
-genlbl(const char *name/*=NULL*/)
+pid_t
+asm_assemble_start(asm_job *j)
 {
-        static int g_loop_iter = 0;
-        char buf[256] = {0};
-        if (name) {
-                sprintf(buf, "%s%d", name, g_loop_iter);
-        } else {
-                sprintf(buf, "t%d", g_loop_iter);
+        if (j->obj) return 0;
+
+        if (g_config.emit == EMIT_C) {
+                write_asm(&j->ctx);
+
+                const char *const files[] = {"-c", "-o", j->obj_fp, j->ctx.asm_fp};
+                return spawn_tool(&g_cc, files, 4);
+        }
+
+        if (g_config.assembler == ASSEMBLER_INTEGRATED && assemble_integrated(j) == 0) {
+                return 0;
         }
-        ++g_loop_iter;
-        return strdup(buf);
+
+        write_asm(&j->ctx);
+
+        const char *const files[] = {"-o", j->obj_fp, j->ctx.asm_fp};
+        return spawn_tool(asm_tool_of(), files, 3);
 }
 
-static void
-free_reg_literal(const char *reg)
+char *
+asm_assemble_finish(asm_job *j, int status)
 {
-        if (!reg) return;
+        asm_context *ctx = &j->ctx;
+        char *obj = j->obj;
+
+        if (!obj && status != 0) {
+                fprintf(stderr, "could not %s `%s`\n",
+                        g_config.emit == EMIT_C ? "compile the C of" : "assemble",
+                        ctx->tbl->src_filepath);
+        } else if (!obj && g_config.cache_dir) {
+                obj = objcache_put(j->key, j->obj_fp, g_config.build_dir != NULL);
+                if (g_config.build_dir) {
+                        free(obj);
+                        obj = strdup(j->obj_fp);
+                }
+        } else if (!obj) {
+                obj = strdup(j->obj_fp);
+        }
 
-        if (!is_register(reg)) return;
+        if (ctx->out) {
+                fclose(ctx->out);
+        }
+        if (ctx->asm_unlink) {
+                unlink(ctx->asm_fp);
+        }
 
-        for (size_t i = 0; i < g_regs_n; ++i) {
-                if (!strcmp(reg, g_regs[i])) {
-                        g_inuse_regs[i] = 0;
-                        return;
-                }
+        if (obj) {
+                smap_insert(&g_generated, ctx->tbl->src_filepath, obj);
         }
+
+        for (size_t i = 0; i < ctx->strs.len; ++i) {
+                free(ctx->strs.data[i]);
+        }
+        dyn_array_free(ctx->strs);
+        dyn_array_free(ctx->code);
+        smap_free(&ctx->names);
+        free(ctx->text);
+        free(ctx->asm_fp);
+        free(j->obj_fp);
+        free(j);
+
+        return obj;
 }
 
-static int
-alloc_reg(int sz)
+// Strings the code refers to live as long as it does.
+static char *
+keep(asm_context *ctx, char *s)
 {
-        for (size_t i = 0; i < g_regs_r; ++i) {
-                int ok = 1;
-                for (size_t j = 0; j < g_regs_c; ++j) {
-                        if (REGAT(i, j, g_inuse_regs)) {
-                                ok = 0;
-                                break;
-                        }
-                }
-                if (!ok) continue;
-                switch (sz) {
-                case 8:
-                        REGAT(i, 0, g_inuse_regs) = 1;
-                        return i * g_regs_c + 0;
-                case 4:
-                        REGAT(i, 1, g_inuse_regs) = 1;
-                        return i * g_regs_c + 1;
-                case 2:
-                        REGAT(i, 2, g_inuse_regs) = 1;
-                        return i * g_regs_c + 2;
-                case 1:
-                        REGAT(i, 3, g_inuse_regs) = 1;
-                        return i * g_regs_c + 3;
-                default: forge_err_wargs("alloc_reg(): cannot alloc register with size %d", sz);
-                }
-        }
-        forge_err("alloc_reg(): no more registers");
+        dyn_array_append(ctx->strs, s);
+        return s;
 }
 
-static int
-alloc_param_regs(int sz)
+// The symbol `a` `b`, one copy per module.
+static const char *
+symname(asm_context *ctx, const char *a, const char *b)
 {
-        static const size_t param_reg_indices[] = {12, 8, 4, 0, 16, 20};
-        static const size_t param_reg_count = sizeof(param_reg_indices)/sizeof(*param_reg_indices);
-        int col;
-
-        switch (sz) {
-        case 8: col = 0; break;
-        case 4: col = 1; break;
-        case 2: col = 2; break;
-        case 1: col = 3; break;
-        default: forge_err_wargs("alloc_param_regs(): cannot allocate register with size %d", sz);
-        }
-
-        for (size_t i = 0; i < param_reg_count; ++i) {
-                size_t base_idx = param_reg_indices[i];
-                int row = base_idx / g_regs_c;
-                if (REGAT(row, col, g_inuse_regs) <= 0) {
-                        int reg_free = 1;
-                        for (size_t j = 0; j < g_regs_c; ++j) {
-                                if (REGAT(row, j, g_inuse_regs) > 0) {
-                                        reg_free = 0;
-                                        break;
-                                }
-                        }
-                        if (reg_free) {
-                                REGAT(row, col, g_inuse_regs) = 1;
-                                return base_idx + col;
-                        }
-                }
-        }
+        char buf[512];
+        snprintf(buf, sizeof(buf), "%s%s", a, b ? b : "");
 
-        forge_err("alloc_param_regs(): no available parameter registers");
-        return -1; // unreachable
+        const char *s = (const char *)smap_get(&ctx->names, buf);
+        if (!s) {
+                s = keep(ctx, strdup(buf));
+                smap_insert(&ctx->names, buf, (void *)s);
+        }
+        return s;
 }
 
-static void
-free_reg(int reg)
+static x64_opnd
+opnd_reg(x64_reg reg, int sz)
 {
-        g_inuse_regs[reg] = 0;
+        x64_opnd o = {X64_OPND_REG, (uint8_t)sz, (int8_t)reg, X64_NOREG, 1, 0, NULL};
+        return o;
 }
 
-static void
-push_inuse_regs(asm_context *ctx)
+static x64_opnd
+opnd_imm(int64_t imm)
 {
-        size_t old_len = ctx->pushed_regs_idxs.len;
+        x64_opnd o = {X64_OPND_IMM, 0, X64_NOREG, X64_NOREG, 1, imm, NULL};
+        return o;
+}
 
-        for (size_t i = 0; i < g_regs_r; ++i) {
-                for (size_t j = 0; j < g_regs_c; ++j) {
-                        if (REGAT(i, j, g_inuse_regs)) {
-                                char *reg = REGAT(i, 0, g_regs);
+static x64_opnd
+opnd_sym(const char *sym)
+{
+        x64_opnd o = {X64_OPND_SYM, 0, X64_NOREG, X64_NOREG, 1, 0, sym};
+        return o;
+}
 
-                                //REGAT(i, j, g_inuse_regs)--;
-                                REGAT(i, j, g_inuse_regs) = 0;
+// [base+disp], `sz` bytes of it.
+static x64_opnd
+opnd_mem(x64_reg base, int64_t disp, int sz)
+{
+        x64_opnd o = {X64_OPND_MEM, (uint8_t)sz, (int8_t)base, X64_NOREG, 1, disp, NULL};
+        return o;
+}
 
-                                take_txt(ctx, forge_cstr_builder("push ", reg, NULL), 1);
-                                dyn_array_append(ctx->pushed_regs, reg);
-                                dyn_array_append(ctx->pushed_regs_idxs, i * g_regs_c + j);
-                        }
-                }
-        }
+// A local at [rbp-offset].
+static x64_opnd
+opnd_local(int offset, int sz)
+{
+        return opnd_mem(X64_RBP, -(int64_t)offset, sz);
+}
 
-        for (size_t i = 0; i < old_len; ++i) {
-                g_inuse_regs[ctx->pushed_regs_idxs.data[i]]--;
-        }
+// `o` as `sz` bytes: the low ones of a register, or what a
+// size specifier in front of the rest says.
+static x64_opnd
+opnd_sized(x64_opnd o, int sz)
+{
+        o.sz = (uint8_t)sz;
+        return o;
 }
 
 static void
-pop_inuse_regs(asm_context *ctx)
+emit(asm_context *ctx, x64_op op, int n, const x64_opnd *o)
 {
-        assert(ctx->pushed_regs.len == ctx->pushed_regs_idxs.len);
-
-        for (int i = ctx->pushed_regs.len-1; i >= 0; --i) {
-                if (g_inuse_regs[ctx->pushed_regs_idxs.data[i]] == 0) {
-                        take_txt(ctx, forge_cstr_builder("pop ", ctx->pushed_regs.data[i], NULL), 1);
-                        g_inuse_regs[ctx->pushed_regs_idxs.data[i]] = 1;
-                        dyn_array_rm_at(ctx->pushed_regs, i);
-                        dyn_array_rm_at(ctx->pushed_regs_idxs, i);
-                } else {
-                        g_inuse_regs[ctx->pushed_regs_idxs.data[i]]++;
-                }
-        }
+        x64_item it;
+        memset(&it, 0, sizeof(it));
+        it.kind  = X64_ITEM_INSN;
+        it.in.op = (uint8_t)op;
+        it.in.n  = (uint8_t)n;
+        for (int i = 0; i < n; ++i) it.in.o[i] = o[i];
+        dyn_array_append(ctx->code, it);
 }
 
-static const char *
-szspec(int sz)
+static void
+emit0(asm_context *ctx, x64_op op)
 {
-        switch (sz) {
-        case 8: return "QWORD";
-        case 4: return "DWORD";
-        case 2: return "WORD";
-        case 1: return "BYTE";
-        default: forge_err_wargs("szspec(): cannot get size specfifier for size %d", sz);
-        }
-        return NULL; // unreachable
+        emit(ctx, op, 0, NULL);
 }
 
 static void
-prologue(asm_context *ctx, int rsp_n)
+emit1(asm_context *ctx, x64_op op, x64_opnd a)
 {
-        // Next multiple of 16.
-        int aligned_rsp_n = (rsp_n + 15) & ~15;
-        char rsp[1024] = {0};
-        sprintf(rsp, "%d", aligned_rsp_n);
-
-        write_txt(ctx, "push rbp", 1);
-        write_txt(ctx, "mov rbp, rsp", 1);
-        take_txt(ctx, forge_cstr_builder("sub rsp, ", rsp, NULL), 1);
+        emit(ctx, op, 1, &a);
 }
 
 static void
-epilogue(asm_context *ctx)
+emit2(asm_context *ctx, x64_op op, x64_opnd a, x64_opnd b)
 {
-        write_txt(ctx, "leave", 1);
-        write_txt(ctx, "ret", 1);
+        x64_opnd o[2] = {a, b};
+        emit(ctx, op, 2, o);
 }
 
-static void *
-visit_expr_binary(visitor *v, expr_bin *e)
+static void
+emit_jcc(asm_context *ctx, x64_cc cc, const char *lbl)
 {
-        asm_context *ctx = (asm_context *)v->context;
-
-        // Pointer arithmetic
-        if ((e->op->ty == TOKEN_TYPE_PLUS ||
-             e->op->ty == TOKEN_TYPE_MINUS ||
-             e->op->ty == TOKEN_TYPE_ASTERISK ||
-             e->op->ty == TOKEN_TYPE_FORWARDSLASH ||
-             e->op->ty == TOKEN_TYPE_PERCENT) &&
-            (e->lhs->type->kind == TYPE_KIND_PTR || e->rhs->type->kind == TYPE_KIND_PTR)) {
-                expr *ptr_expr = e->lhs->type->kind == TYPE_KIND_PTR ? e->lhs : e->rhs;
-                expr *int_expr = e->lhs->type->kind == TYPE_KIND_PTR ? e->rhs : e->lhs;
-                size_t elemty_sz = ((type_ptr *)ptr_expr->type)->to->sz;
-                char *elemty_sz_cstr = int_to_cstr(elemty_sz);
-                const char *int_spec = szspec(int_expr->type->sz);
-
-                char *ptr_value = ptr_expr->accept(ptr_expr, v);
-                char *int_value = int_expr->accept(int_expr, v);
-
-                int ptr_regi = alloc_reg(8);
-                char *ptr_reg = g_regs[ptr_regi];
-                int int_regi = alloc_reg(int_expr->type->sz);
-                char *int_reg = g_regs[int_regi];
-
-                // Move pointer to register
-                if (!is_register(ptr_value)) {
-                        take_txt(ctx, forge_cstr_builder("mov QWORD ", ptr_reg, ", ", ptr_value, NULL), 1);
-                } else if (strcmp(ptr_value, ptr_reg)) {
-                        take_txt(ctx, forge_cstr_builder("mov QWORD ", ptr_reg, ", ", ptr_value, NULL), 1);
-                }
-
-                // Move integer to register
-                if (!is_register(int_value)) {
-                        take_txt(ctx, forge_cstr_builder("mov ", int_spec, " ", int_reg, ", ", int_value, NULL), 1);
-                } else if (strcmp(int_value, int_reg)) {
-                        take_txt(ctx, forge_cstr_builder("mov ", int_spec, " ", int_reg, ", ", int_value, NULL), 1);
-                }
+        emit1(ctx, X64_JCC, opnd_sym(lbl));
+        ctx->code.data[ctx->code.len-1].in.cc = (uint8_t)cc;
+}
 
-                // Scale
-                take_txt(ctx, forge_cstr_builder("imul ", int_reg, ", ", elemty_sz_cstr, NULL), 1);
+static void
+emit_label(asm_context *ctx, const char *lbl)
+{
+        x64_item it;
+        memset(&it, 0, sizeof(it));
+        it.kind = X64_ITEM_LABEL;
+        it.s    = lbl;
+        dyn_array_append(ctx->code, it);
+}
 
-                switch (e->op->ty) {
-                case TOKEN_TYPE_PLUS:
-                        take_txt(ctx, forge_cstr_builder("add ", ptr_reg, ", ", int_reg, NULL), 1);
-                        break;
-                case TOKEN_TYPE_MINUS:
-                        take_txt(ctx, forge_cstr_builder("sub ", ptr_reg, ", ", int_reg, NULL), 1);
-                        break;
-                case TOKEN_TYPE_ASTERISK:
-                        take_txt(ctx, forge_cstr_builder("imul ", ptr_reg, ", ", int_reg, NULL), 1);
-                        break;
-                case TOKEN_TYPE_FORWARDSLASH: {
-                        write_txt(ctx, "xor rdx, rdx", 1);
-                        take_txt(ctx, forge_cstr_builder("mov rax, ", int_reg, NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("idiv ", int_spec, " ", int_reg, NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("mov ", int_spec, " ", int_reg, ", rax", NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("imul ", ptr_reg, ", ", int_reg, NULL), 1);
-                        break;
-                }
-                case TOKEN_TYPE_PERCENT: {
-                        write_txt(ctx, "xor rdx, rdx", 1);
-                        take_txt(ctx, forge_cstr_builder("mov rax, ", int_reg, NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("idiv ", int_spec, " ", int_reg, NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("mov ", int_spec, " ", int_reg, ", rdx", NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("imul ", ptr_reg, ", ", int_reg, NULL), 1);
-                        break;
-                }
-                default:
-                        forge_err_wargs("visit_expr_binary(): unsupported pointer arithmetic operator `%s`", e->op->lx);
-                        free_reg(ptr_regi);
-                        free_reg(int_regi);
-                        free(elemty_sz_cstr);
-                        free_reg_literal(ptr_value);
-                        free_reg_literal(int_value);
-                        return NULL;
-                }
+// A line of nasm as it is.
+static void
+emit_text(asm_context *ctx, const char *line)
+{
+        x64_item it;
+        memset(&it, 0, sizeof(it));
+        it.kind = X64_ITEM_TEXT;
+        it.s    = line;
+        dyn_array_append(ctx->code, it);
+}
 
-                free_reg(ptr_regi);
-                free_reg(int_regi);
-                free(elemty_sz_cstr);
-                free_reg_literal(ptr_value);
-                free_reg_literal(int_value);
-
-                return ptr_reg;
-        }
-
-        // Logical operations [boolean] (1 byte)
-        if (e->op->ty == TOKEN_TYPE_DOUBLE_EQUALS ||
-            e->op->ty == TOKEN_TYPE_BANG_EQUALS ||
-            e->op->ty == TOKEN_TYPE_LESSTHAN ||
-            e->op->ty == TOKEN_TYPE_GREATERTHAN ||
-            e->op->ty == TOKEN_TYPE_LESSTHAN_EQUALS ||
-            e->op->ty == TOKEN_TYPE_GREATERTHAN_EQUALS ||
-            e->op->ty == TOKEN_TYPE_DOUBLE_AMPERSAND ||
-            e->op->ty == TOKEN_TYPE_DOUBLE_PIPE) {
-                // Use 1-byte register for boolean result
-                const char *spec = "BYTE";
-                int regi = alloc_reg(1);
-                char *reg = g_regs[regi];
-
-                // Evaluate left-hand side
-                char *v1 = e->lhs->accept(e->lhs, v);
-                const char *lhs_spec = szspec(e->lhs->type->sz);
-                int lhs_regi = alloc_reg(e->lhs->type->sz);
-                char *lhs_reg = g_regs[lhs_regi];
-                if (!is_register(v1)) {
-                        take_txt(ctx, forge_cstr_builder("mov ", lhs_spec, " ", lhs_reg, ", ", v1, NULL), 1);
-                } else if (strcmp(v1, lhs_reg)) {
-                        take_txt(ctx, forge_cstr_builder("mov ", lhs_spec, " ", lhs_reg, ", ", v1, NULL), 1);
-                }
-                free_reg_literal(v1);
-
-                // Evaluate right-hand side
-                char *v2 = NULL;
-                int rhs_regi = -1;
-                char *rhs_reg = NULL;
-                if (e->op->ty != TOKEN_TYPE_DOUBLE_AMPERSAND && e->op->ty != TOKEN_TYPE_DOUBLE_PIPE) {
-                        v2 = e->rhs->accept(e->rhs, v);
-                        const char *rhs_spec = szspec(e->rhs->type->sz);
-                        rhs_regi = alloc_reg(e->rhs->type->sz);
-                        rhs_reg = g_regs[rhs_regi];
-                        if (!is_register(v2)) {
-                                take_txt(ctx, forge_cstr_builder("mov ", rhs_spec, " ", rhs_reg, ", ", v2, NULL), 1);
-                        } else if (strcmp(v2, rhs_reg)) {
-                                take_txt(ctx, forge_cstr_builder("mov ", rhs_spec, " ", rhs_reg, ", ", v2, NULL), 1);
-                        }
-                }
+// Labels are numbered across every module of the process.
+static int g_lbl = 0;
 
-                switch (e->op->ty) {
-                case TOKEN_TYPE_DOUBLE_EQUALS:
-                case TOKEN_TYPE_BANG_EQUALS:
-                case TOKEN_TYPE_LESSTHAN:
-                case TOKEN_TYPE_GREATERTHAN:
-                case TOKEN_TYPE_LESSTHAN_EQUALS:
-                case TOKEN_TYPE_GREATERTHAN_EQUALS: {
-                        char *lbl_true = genlbl(NULL);
-                        char *lbl_done = genlbl(NULL);
-                        const char *cmp_op = NULL;
-                        switch (e->op->ty) {
-                        case TOKEN_TYPE_DOUBLE_EQUALS:      cmp_op = "je";  break;
-                        case TOKEN_TYPE_BANG_EQUALS:        cmp_op = "jne"; break;
-                        case TOKEN_TYPE_LESSTHAN:           cmp_op = "jl";  break;
-                        case TOKEN_TYPE_GREATERTHAN:        cmp_op = "jg";  break;
-                        case TOKEN_TYPE_LESSTHAN_EQUALS:    cmp_op = "jle"; break;
-                        case TOKEN_TYPE_GREATERTHAN_EQUALS: cmp_op = "jge"; break;
-                        default: forge_err_wargs("unimplemented comparison op `%s`", e->op->lx);
-                        }
-                        take_txt(ctx, forge_cstr_builder("cmp ", lhs_reg, ", ", rhs_reg, NULL), 1);
-                        take_txt(ctx, forge_cstr_builder(cmp_op, " ", lbl_true, NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("mov ", spec, " ", reg, ", 0", NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("jmp ", lbl_done, NULL), 1);
-                        take_txt(ctx, forge_cstr_builder(lbl_true, ":", NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("mov ", spec, " ", reg, ", 1", NULL), 1);
-                        take_txt(ctx, forge_cstr_builder(lbl_done, ":", NULL), 1);
-                        free(lbl_true);
-                        free(lbl_done);
-                        free_reg(rhs_regi);
-                        free_reg_literal(v2);
-                        break;
-                }
-                case TOKEN_TYPE_DOUBLE_AMPERSAND: {
-                        char *lbl_false = genlbl("false");
-                        char *lbl_done = genlbl("done");
-                        take_txt(ctx, forge_cstr_builder("cmp ", lhs_spec, " ", lhs_reg, ", 0", NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("je ", lbl_false, NULL), 1);
-                        free_reg(lhs_regi);
-                        v2 = e->rhs->accept(e->rhs, v);
-                        rhs_regi = alloc_reg(e->rhs->type->sz);
-                        rhs_reg = g_regs[rhs_regi];
-                        const char *rhs_spec = szspec(e->rhs->type->sz);
-                        if (!is_register(v2)) {
-                                take_txt(ctx, forge_cstr_builder("mov ", rhs_spec, " ", rhs_reg, ", ", v2, NULL), 1);
-                        } else if (strcmp(v2, rhs_reg)) {
-                                take_txt(ctx, forge_cstr_builder("mov ", rhs_spec, " ", rhs_reg, ", ", v2, NULL), 1);
-                        }
-                        take_txt(ctx, forge_cstr_builder("cmp ", rhs_spec, " ", rhs_reg, ", 0", NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("je ", lbl_false, NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("mov ", spec, " ", reg, ", 1", NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("jmp ", lbl_done, NULL), 1);
-                        take_txt(ctx, forge_cstr_builder(lbl_false, ":", NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("mov ", spec, " ", reg, ", 0", NULL), 1);
-                        take_txt(ctx, forge_cstr_builder(lbl_done, ":", NULL), 1);
-                        free(lbl_false);
-                        free(lbl_done);
-                        free_reg(rhs_regi);
-                        free_reg_literal(v2);
-                        break;
-                }
-                case TOKEN_TYPE_DOUBLE_PIPE: {
-                        char *lbl_true = genlbl("true");
-                        char *lbl_done = genlbl("done");
-                        take_txt(ctx, forge_cstr_builder("cmp ", lhs_spec, " ", lhs_reg, ", 0", NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("jne ", lbl_true, NULL), 1);
-                        free_reg(lhs_regi);
-                        v2 = e->rhs->accept(e->rhs, v);
-                        rhs_regi = alloc_reg(e->rhs->type->sz);
-                        rhs_reg = g_regs[rhs_regi];
-                        const char *rhs_spec = szspec(e->rhs->type->sz);
-                        if (!is_register(v2)) {
-                                take_txt(ctx, forge_cstr_builder("mov ", rhs_spec, " ", rhs_reg, ", ", v2, NULL), 1);
-                        } else if (strcmp(v2, rhs_reg)) {
-                                take_txt(ctx, forge_cstr_builder("mov ", rhs_spec, " ", rhs_reg, ", ", v2, NULL), 1);
-                        }
-                        take_txt(ctx, forge_cstr_builder("cmp ", rhs_spec, " ", rhs_reg, ", 0", NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("jne ", lbl_true, NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("mov ", spec, " ", reg, ", 0", NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("jmp ", lbl_done, NULL), 1);
-                        take_txt(ctx, forge_cstr_builder(lbl_true, ":", NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("mov ", spec, " ", reg, ", 1", NULL), 1);
-                        take_txt(ctx, forge_cstr_builder(lbl_done, ":", NULL), 1);
-                        free(lbl_true);
-                        free(lbl_done);
-                        free_reg(rhs_regi);
-                        free_reg_literal(v2);
-                        break;
-                }
-                default:
-                        forge_err_wargs("unimplemented binop `%s`", e->op->lx);
-                }
-                free_reg(lhs_regi);
-                return reg;
+static char *
+genlbl(asm_context *ctx, const char *name/*=NULL*/)
+{
+        char buf[256] = {0};
+        if (name) {
+                sprintf(buf, "%s%d", name, g_lbl);
+        } else {
+                sprintf(buf, "t%d", g_lbl);
         }
-        // Arithmetic operations
-        const char *spec = szspec(e->lhs->type->sz);
-        char *v1 = e->lhs->accept(e->lhs, v);
+        ++g_lbl;
+        return keep(ctx, strdup(buf));
+}
 
-        int regi = alloc_reg(e->lhs->type->sz);
-        char *reg = g_regs[regi];
+static void
+prologue(asm_context *ctx, int rsp_n)
+{
+        // Next multiple of 16.
+        int aligned_rsp_n = (rsp_n + 15) & ~15;
 
-        take_txt(ctx, forge_cstr_builder("mov ", spec, " ", reg, ", ", v1, NULL), 1);
-        free_reg_literal(v1);
+        emit1(ctx, X64_PUSH, opnd_reg(X64_RBP, 8));
+        emit2(ctx, X64_MOV, opnd_reg(X64_RBP, 8), opnd_reg(X64_RSP, 8));
+        emit2(ctx, X64_SUB, opnd_reg(X64_RSP, 8), opnd_imm(aligned_rsp_n));
+}
 
-        char *v2 = e->rhs->accept(e->rhs, v);
+static const x64_reg g_arg_regs[] = {X64_RDI, X64_RSI, X64_RDX, X64_RCX, X64_R8, X64_R9};
 
-        switch (e->op->ty) {
-        case TOKEN_TYPE_PLUS:
-                take_txt(ctx, forge_cstr_builder("add ", spec, " ", reg, ", ", v2, NULL), 1);
-                break;
-        case TOKEN_TYPE_MINUS:
-                take_txt(ctx, forge_cstr_builder("sub ", spec, " ", reg, ", ", v2, NULL), 1);
-                break;
-        case TOKEN_TYPE_ASTERISK:
-                if (e->lhs->type->sz == 1) {
-                        // Special case for 8-bit multiplication
-                        int rhs_regi = alloc_reg(8);
-                        char *rhs_reg = g_regs[rhs_regi];
-                        // Zero-extend to rax
-                        take_txt(ctx, forge_cstr_builder("movzx rax, ", spec, " ", reg, NULL), 1);
-                        // Zero-extend v2 to rcx
-                        take_txt(ctx, forge_cstr_builder("movzx ", rhs_reg, ", ", spec, " ", v2, NULL), 1);
-                        // Multiply rax by rcx, result in rax
-                        take_txt(ctx, forge_cstr_builder("mul ", rhs_reg, NULL), 1);
-                        // Move low byte to reg
-                        take_txt(ctx, forge_cstr_builder("mov ", spec, " ", reg, ", al", NULL), 1);
-                        free_reg(rhs_regi);
-                } else {
-                        take_txt(ctx, forge_cstr_builder("imul ", reg, ", ", v2, NULL), 1);
-                }
-                break;
-        case TOKEN_TYPE_FORWARDSLASH: {
-                write_txt(ctx, "xor rdx, rdx", 1);
-                take_txt(ctx, forge_cstr_builder("mov rax, ", v1, NULL), 1);
-                take_txt(ctx, forge_cstr_builder("idiv ", spec, " ", v2, NULL), 1);
-                take_txt(ctx, forge_cstr_builder("mov ", spec, " ", reg, ", rax", NULL), 1);
-                break;
-        }
-        case TOKEN_TYPE_PERCENT: {
-                write_txt(ctx, "xor rdx, rdx", 1);
-                take_txt(ctx, forge_cstr_builder("mov rax, ", v1, NULL), 1);
-                take_txt(ctx, forge_cstr_builder("idiv ", spec, " ", v2, NULL), 1);
-                take_txt(ctx, forge_cstr_builder("mov ", spec, " ", reg, ", rdx", NULL), 1);
-                break;
-        }
-        default:
-                forge_err_wargs("unimplemented binop `%s`", e->op->lx);
+// Where the register allocator put `v`, as an operand of `sz`
+// bytes: its register, or its spill slot below the locals.
+static x64_opnd
+vreg(asm_context *ctx, int v, int sz)
+{
+        if (ctx->ra->reg[v] != X64_NOREG) {
+                return opnd_reg(ctx->ra->reg[v], sz);
         }
+        assert(ctx->ra->slot[v] >= 0);
+        return opnd_local(ctx->vbase + 8 * (ctx->ra->slot[v] + 1), sz);
+}
 
-        free_reg_literal(v2);
-        return reg;
+// Where the ith callee-saved register in use is kept, below
+// the spill slots.
+static x64_opnd
+saved_slot(asm_context *ctx, int i)
+{
+        return opnd_local(ctx->vbase + 8 * (ctx->ra->nslots + i + 1), 8);
+}
+
+static void
+epilogue(asm_context *ctx)
+{
+        for (int i = 0; i < ctx->ra->nsaved; ++i) {
+                emit2(ctx, X64_MOV, opnd_reg(ctx->ra->saved[i], 8), saved_slot(ctx, i));
+        }
+        emit0(ctx, X64_LEAVE);
+        emit0(ctx, X64_RET);
 }
 
-static void *
-visit_expr_identifier(visitor *v, expr_identifier *e)
+static x64_opnd
+rax(int sz)
 {
-        asm_context *ctx = (asm_context *)v->context;
+        return opnd_reg(X64_RAX, sz);
+}
 
+static x64_opnd
+rcx(int sz)
+{
+        return opnd_reg(X64_RCX, sz);
+}
 
-        assert(e->resolved);
+// The register that holds `v`, which is `scratch` if it had
+// to be loaded there.
+static x64_reg
+use(asm_context *ctx, int v, x64_reg scratch)
+{
+        if (ctx->ra->reg[v] != X64_NOREG) {
+                return (x64_reg)ctx->ra->reg[v];
+        }
+        emit2(ctx, X64_MOV, opnd_reg(scratch, 8), vreg(ctx, v, 8));
+        return scratch;
+}
 
-        int regi = alloc_reg(e->resolved->ty->sz);
-        char *reg = g_regs[regi];
+// `reg` = `v`.
+static void
+copy(asm_context *ctx, x64_reg reg, int v)
+{
+        if (ctx->ra->reg[v] != reg) {
+                emit2(ctx, X64_MOV, opnd_reg(reg, 8), vreg(ctx, v, 8));
+        }
+}
 
-        if (e->resolved->extern_ || ((expr *)e)->type->kind == TYPE_KIND_PROC) {
-                if (!e->resolved->extern_) {
-                        take_txt(ctx, forge_cstr_builder("mov ", reg, ", ", e->resolved->modname, "_", e->id->lx, NULL), 1);
-                } else {
-                        take_txt(ctx, forge_cstr_builder("mov ", reg, ", ", e->id->lx, NULL), 1);
-                }
-        } else {
-                char *offset_s = int_to_cstr(e->resolved->stack_offset);
-                const char *spec = szspec(e->resolved->ty->sz);
-                take_txt(ctx, forge_cstr_builder("mov ", spec, " ", reg, ", [rbp-", offset_s, "]", NULL), 1);
+// Where to compute the result of `in`: its own register, unless
+// the operand `keep` that is yet to be read is in it too.
+static x64_reg
+target(asm_context *ctx, const ir_insn *in, int keep)
+{
+        int reg = ctx->ra->reg[in->dst];
+        if (reg == X64_NOREG || (keep >= 0 && ctx->ra->reg[keep] == reg)) {
+                return X64_RAX;
         }
+        return (x64_reg)reg;
+}
 
-        return reg;
+// The result of `in` is in `reg`.
+static void
+set(asm_context *ctx, const ir_insn *in, x64_reg reg)
+{
+        if (ctx->ra->reg[in->dst] != reg) {
+                emit2(ctx, X64_MOV, vreg(ctx, in->dst, 8), opnd_reg(reg, 8));
+        }
 }
 
-static void *
-visit_expr_integer_literal(visitor *v, expr_integer_literal *e)
+// `reg` = the `sz` bytes at `src`, zero-extended.
+static void
+load_zx(asm_context *ctx, x64_reg reg, x64_opnd src, int sz)
 {
-        NOOP(v);
-        return e->i->lx;
+        src = opnd_sized(src, sz);
+        if (sz < 4) {
+                emit2(ctx, X64_MOVZX, opnd_reg(reg, 4), src);
+        } else if (sz == 4 || src.kind != X64_OPND_REG || src.reg != reg) {
+                emit2(ctx, X64_MOV, opnd_reg(reg, sz), src);
+        }
 }
 
-static void *
-visit_expr_string_literal(visitor *v, expr_string_literal *e)
+// `reg` = the `sz` bytes at `src`, extended to 8 bytes as
+// `flags` say.
+static void
+load_ext(asm_context *ctx, x64_reg reg, x64_opnd src, int sz, int flags)
 {
-        asm_context *ctx = (asm_context *)v->context;
+        if (sz == 8 || (flags & IR_UNSIGNED)) {
+                load_zx(ctx, reg, src, sz);
+        } else {
+                emit2(ctx, X64_MOVSX, opnd_reg(reg, 8), opnd_sized(src, sz));
+        }
+}
 
-        char *lbl = genlbl(NULL);
+// `lbl: db "text", 10, 0` in the data section.
+static const char *
+string_literal(asm_context *ctx, const char *s)
+{
+        char *lbl = genlbl(ctx, NULL);
         forge_str out = forge_str_create();
         forge_str_concat(&out, lbl);
         forge_str_concat(&out, ": db ");
-        const char *actual = e->s->lx;
         int alpha = 0;
 
-        for (size_t i = 0; actual[i]; ++i) {
-                if (actual[i] == '\n' || actual[i] == '\t') {
+        for (size_t i = 0; s[i]; ++i) {
+                if (s[i] == '\n' || s[i] == '\t') {
                         if (alpha) forge_str_concat(&out, "\"");
                         if (i != 0) forge_str_concat(&out, ", ");
-
-                        switch (actual[i]) {
-                        case '\n': forge_str_concat(&out, " 10 "); break;
-                        case '\t': forge_str_concat(&out, " 9 ");  break;
-                        default:   assert(0);
-                        }
-
+                        forge_str_concat(&out, s[i] == '\n' ? " 10 " : " 9 ");
                         alpha = 0;
                 } else {
                         if (!alpha) {
                                 if (i != 0) forge_str_concat(&out, ", ");
                                 forge_str_concat(&out, "\"");
                         }
-                        forge_str_append(&out, actual[i]);
+                        forge_str_append(&out, s[i]);
                         alpha = 1;
                 }
         }
@@ -730,1055 +704,419 @@ visit_expr_string_literal(visitor *v, expr_string_literal *e)
         }
         forge_str_concat(&out, ", 0");
 
-        dyn_array_append(ctx->data_section, out.data);
+        if (ctx->trial) {
+                free(out.data);
+        } else {
+                dyn_array_append(ctx->data_section, out.data);
+        }
         return lbl;
 }
 
-static void *
-visit_expr_proccall(visitor *v, expr_proccall *e)
+// rax = a / b, rdx = a % b, as the flags of `in` say.
+static void
+divide(asm_context *ctx, const ir_insn *in)
 {
-        assert(e->args.len <= 6 && "only 6 procedure arguments are supported right now");
-
-        asm_context *ctx = (asm_context *)v->context;
-
-        push_inuse_regs(ctx);
-
-        int_array pregs = dyn_array_empty(int_array);
-
-        for (size_t i = 0; i < e->args.len; ++i) {
-                expr *arg = e->args.data[i];
-                char *value = arg->accept(arg, v);
-
-                int pregi = alloc_param_regs(arg->type->sz);
-                char *preg = g_regs[pregi];
-                const char *spec = szspec(arg->type->sz);
+        int sz = in->sz < 4 ? 4 : in->sz;
+
+        if (in->flags & IR_UNSIGNED) {
+                load_zx(ctx, X64_RAX, vreg(ctx, in->a, 0), in->sz);
+                load_zx(ctx, X64_RCX, vreg(ctx, in->b, 0), in->sz);
+                emit2(ctx, X64_XOR, opnd_reg(X64_RDX, 4), opnd_reg(X64_RDX, 4));
+                emit1(ctx, X64_DIV, rcx(sz));
+                return;
+        }
 
-                dyn_array_append(pregs, pregi);
+        if (in->sz < 4) {
+                emit2(ctx, X64_MOVSX, rax(4), vreg(ctx, in->a, in->sz));
+                emit2(ctx, X64_MOVSX, rcx(4), vreg(ctx, in->b, in->sz));
+        } else {
+                emit2(ctx, X64_MOV, rax(sz), vreg(ctx, in->a, sz));
+                emit2(ctx, X64_MOV, rcx(sz), vreg(ctx, in->b, sz));
+        }
+        emit0(ctx, sz == 8 ? X64_CQO : X64_CDQ);
+        emit1(ctx, X64_IDIV, rcx(sz));
+}
 
-                take_txt(ctx, forge_cstr_builder("mov ", spec, " ", preg, ", ", value, NULL), 1);
+static x64_cc
+cond_code(const ir_insn *in)
+{
+        int u = in->flags & IR_UNSIGNED;
+        switch (in->op) {
+        case IR_EQ: return X64_CC_E;
+        case IR_NE: return X64_CC_NE;
+        case IR_LT: return u ? X64_CC_B  : X64_CC_L;
+        case IR_GT: return u ? X64_CC_A  : X64_CC_G;
+        case IR_LE: return u ? X64_CC_BE : X64_CC_LE;
+        default:    return u ? X64_CC_AE : X64_CC_GE;
+        }
+}
 
-                free_reg_literal(value);
+// Moves the arguments of `in` into their registers all at once,
+// since some may be in the registers of others. A cycle is
+// broken through rax.
+static void
+pass_args(asm_context *ctx, const ir_insn *in)
+{
+        x64_reg dst[6];
+        x64_opnd src[6];
+        int n = 0;
+
+        for (int i = 0; i < in->nargs; ++i) {
+                x64_opnd o = vreg(ctx, in->args[i], 8);
+                if (o.kind != X64_OPND_REG || o.reg != g_arg_regs[i]) {
+                        dst[n] = g_arg_regs[i];
+                        src[n++] = o;
+                }
         }
 
-        int export = 0;
-        int variadic = 0;
-        type_array params = dyn_array_empty(type_array);
-        type *rettype = NULL;
+        while (n) {
+                int i, cycle = -1;
+                for (i = 0; i < n; ++i) {
+                        int read = 0;
+                        for (int j = 0; j < n; ++j) {
+                                if (j != i && src[j].kind == X64_OPND_REG && src[j].reg == dst[i]) {
+                                        read = 1;
+                                        cycle = j;
+                                }
+                        }
+                        if (!read) break;
+                }
 
-        assert(e->lhs->type->kind == TYPE_KIND_PROC || e->lhs->type->kind == TYPE_KIND_PROCPTR);
-        //type_proc *proc_ty = (type_proc *)e->lhs->type;
+                if (i == n) {
+                        x64_reg r = (x64_reg)src[cycle].reg;
+                        emit2(ctx, X64_MOV, rax(8), opnd_reg(r, 8));
+                        for (int j = 0; j < n; ++j) {
+                                if (src[j].kind == X64_OPND_REG && src[j].reg == r) src[j] = rax(8);
+                        }
+                        continue;
+                }
 
-        if (e->lhs->type->kind == TYPE_KIND_PROC) {
-                type_proc *proc_ty = (type_proc *)e->lhs->type;
-                export = proc_ty->export;
-                variadic = proc_ty->variadic;
-                type_get_types_from_proc(proc_ty, &params, &rettype);
-        } else {
-                type_procptr *proc_ty = (type_procptr *)e->lhs->type;
-                export = 0;
-                variadic = proc_ty->variadic;
-                params = proc_ty->param_types;
-                rettype = proc_ty->rettype;
+                emit2(ctx, X64_MOV, opnd_reg(dst[i], 8), src[i]);
+                dst[i] = dst[--n];
+                src[i] = src[n];
         }
+}
 
-        // Clear RAX for variadic procedures.
-        if (variadic) {
-                write_txt(ctx, "xor rax, rax", 1);
+static void
+gen_call(asm_context *ctx, const ir_insn *in)
+{
+        // Before its register can be taken by an argument.
+        if (!in->sym) {
+                emit2(ctx, X64_MOV, opnd_reg(X64_R11, 8), vreg(ctx, in->a, 8));
         }
 
-        char *callee = e->lhs->accept(e->lhs, v);
-
-        // Free all alloc'd parameter registers from procedure arguments
-        for (size_t i = 0; i < pregs.len; ++i) {
-                free_reg(pregs.data[i]);
-        } dyn_array_free(pregs);
+        pass_args(ctx, in);
 
-        take_txt(ctx, forge_cstr_builder("call ", callee, NULL), 1);
-        free_reg_literal(callee);
-        pop_inuse_regs(ctx);
+        // Variadic callees take the number of vector registers
+        // in al.
+        if (in->flags & IR_VARIADIC) {
+                emit2(ctx, X64_XOR, rax(4), rax(4));
+        }
 
-        // Void return type case.
-        if (rettype->kind == TYPE_KIND_VOID
-            || rettype->kind == TYPE_KIND_NORETURN) {
-                return "rax";
+        if (in->sym) {
+                emit1(ctx, X64_CALL, opnd_sym(symname(ctx, in->sym, NULL)));
+        } else {
+                emit1(ctx, X64_CALL, opnd_reg(X64_R11, 8));
         }
+        ctx->code.data[ctx->code.len-1].in.nargs = (uint8_t)in->nargs;
 
-        return (void *)get_reg_from_size("rax", rettype->sz);
+        set(ctx, in, X64_RAX);
 }
 
-static void *
-visit_expr_mut(visitor *v, expr_mut *e)
+// `next` is the block laid out after `b`, which needs no jump.
+static void
+gen_insn(asm_context *ctx, const ir_block *b, const ir_insn *in, int next)
 {
-        asm_context *ctx = (asm_context *)v->context;
-
-        switch (e->lhs->kind) {
-        case EXPR_KIND_IDENTIFIER: {
-                sym *sym = ((expr_identifier *)e->lhs)->resolved;
-                assert(sym);
-
-                const char *spec = szspec(sym->ty->sz);
-                char *offset = int_to_cstr(sym->stack_offset);
-                char *rvalue = e->rhs->accept(e->rhs, v);
-
-                int regi = alloc_reg(sym->ty->sz);
-                char *reg = g_regs[regi];
-
-                // Handle pointer arithmetic for compound assignments
-                if ((e->op->ty == TOKEN_TYPE_PLUS_EQUALS ||
-                     e->op->ty == TOKEN_TYPE_MINUS_EQUALS ||
-                     e->op->ty == TOKEN_TYPE_ASTERISK_EQUALS ||
-                     e->op->ty == TOKEN_TYPE_FORWARDSLASH_EQUALS ||
-                     e->op->ty == TOKEN_TYPE_PERCENT_EQUALS) &&
-                    sym->ty->kind == TYPE_KIND_PTR) {
-                        size_t elemty_sz = ((type_ptr *)sym->ty)->to->sz;
-                        char *elemty_sz_cstr = int_to_cstr(elemty_sz);
-                        const char *rvalue_spec = szspec(e->rhs->type->sz);
-
-                        // Load the pointer value
-                        take_txt(ctx, forge_cstr_builder("mov QWORD ", reg, ", [rbp-", offset, "]", NULL), 1);
-
-                        // Load rvalue into a temporary register
-                        int temp_regi = alloc_reg(e->rhs->type->sz);
-                        char *temp_reg = g_regs[temp_regi];
-                        if (!is_register(rvalue)) {
-                                take_txt(ctx, forge_cstr_builder("mov ", rvalue_spec, " ", temp_reg, ", ", rvalue, NULL), 1);
-                        } else if (strcmp(rvalue, temp_reg)) {
-                                take_txt(ctx, forge_cstr_builder("mov ", rvalue_spec, " ", temp_reg, ", ", rvalue, NULL), 1);
-                        }
-
-                        // Scale the rvalue
-                        take_txt(ctx, forge_cstr_builder("imul ", temp_reg, ", ", elemty_sz_cstr, NULL), 1);
-
-                        switch (e->op->ty) {
-                        case TOKEN_TYPE_PLUS_EQUALS:
-                                take_txt(ctx, forge_cstr_builder("add ", reg, ", ", temp_reg, NULL), 1);
-                                break;
-                        case TOKEN_TYPE_MINUS_EQUALS:
-                                take_txt(ctx, forge_cstr_builder("sub ", reg, ", ", temp_reg, NULL), 1);
-                                break;
-                        case TOKEN_TYPE_ASTERISK_EQUALS:
-                                take_txt(ctx, forge_cstr_builder("imul ", reg, ", ", temp_reg, NULL), 1);
-                                break;
-                        case TOKEN_TYPE_FORWARDSLASH_EQUALS: {
-                                write_txt(ctx, "xor rdx, rdx", 1);
-                                take_txt(ctx, forge_cstr_builder("mov rax, ", reg, NULL), 1);
-                                take_txt(ctx, forge_cstr_builder("idiv ", temp_reg, NULL), 1);
-                                take_txt(ctx, forge_cstr_builder("mov ", reg, ", rax", NULL), 1);
-                                break;
-                        }
-                        case TOKEN_TYPE_PERCENT_EQUALS: {
-                                write_txt(ctx, "xor rdx, rdx", 1);
-                                take_txt(ctx, forge_cstr_builder("mov rax, ", reg, NULL), 1);
-                                take_txt(ctx, forge_cstr_builder("idiv ", temp_reg, NULL), 1);
-                                take_txt(ctx, forge_cstr_builder("mov ", reg, ", rdx", NULL), 1);
-                                break;
-                        }
-                        default:
-                                forge_err_wargs("visit_expr_mut(): unsupported pointer arithmetic operator `%s`", e->op->lx);
-                        }
+        x64_reg t, r;
 
-                        // Store back to the pointer
-                        take_txt(ctx, forge_cstr_builder("mov QWORD [rbp-", offset, "], ", reg, NULL), 1);
-
-                        free(elemty_sz_cstr);
-                        free_reg(temp_regi);
-                        free_reg_literal(rvalue);
-                        free(offset);
-                        return reg;
+        switch (in->op) {
+        case IR_CONST:
+                if (ctx->ra->reg[in->dst] != X64_NOREG || in->imm == (int32_t)in->imm) {
+                        emit2(ctx, X64_MOV, vreg(ctx, in->dst, 8), opnd_imm(in->imm));
+                } else {
+                        emit2(ctx, X64_MOV, rax(8), opnd_imm(in->imm));
+                        set(ctx, in, X64_RAX);
                 }
-
-                // Non-pointer case
-                switch (e->op->ty) {
-                case TOKEN_TYPE_EQUALS: {
-                        // Load rvalue
-                        if (!is_register(rvalue)) {
-                                take_txt(ctx, forge_cstr_builder("mov ", spec, " ", reg, ", ", rvalue, NULL), 1);
-                        } else if (strcmp(rvalue, reg)) {
-                                take_txt(ctx, forge_cstr_builder("mov ", spec, " ", reg, ", ", rvalue, NULL), 1);
-                        }
-                        // Store
-                        take_txt(ctx, forge_cstr_builder("mov ", spec, " [rbp-", offset, "], ", reg, NULL), 1);
-                        break;
+                break;
+        case IR_SYM:
+        case IR_STR:
+                t = target(ctx, in, -1);
+                emit2(ctx, X64_MOV, opnd_reg(t, 8),
+                      opnd_sym(in->op == IR_SYM ? symname(ctx, in->sym, NULL) : string_literal(ctx, in->sym)));
+                set(ctx, in, t);
+                break;
+        case IR_SLOTADDR:
+                t = target(ctx, in, -1);
+                emit2(ctx, X64_LEA, opnd_reg(t, 8), opnd_local((int)in->imm, 0));
+                set(ctx, in, t);
+                break;
+        case IR_PARAM:
+                set(ctx, in, g_arg_regs[in->imm]);
+                break;
+        case IR_LDSLOT:
+                t = target(ctx, in, -1);
+                load_zx(ctx, t, opnd_local((int)in->imm, 0), in->sz);
+                set(ctx, in, t);
+                break;
+        case IR_STSLOT:
+                r = use(ctx, in->a, X64_RAX);
+                emit2(ctx, X64_MOV, opnd_local((int)in->imm, in->sz), opnd_reg(r, in->sz));
+                break;
+        case IR_LOAD:
+                r = use(ctx, in->a, X64_RAX);
+                t = target(ctx, in, -1);
+                load_zx(ctx, t, opnd_mem(r, 0, 0), in->sz);
+                set(ctx, in, t);
+                break;
+        case IR_STORE:
+                r = use(ctx, in->a, X64_RAX);
+                t = use(ctx, in->b, X64_RCX);
+                emit2(ctx, X64_MOV, opnd_mem(r, 0, in->sz), opnd_reg(t, in->sz));
+                break;
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL: {
+                // There is no imul of bytes, the low ones are the
+                // same either way.
+                int sz = in->op == IR_MUL && in->sz < 4 ? 4 : in->sz;
+                x64_op op = in->op == IR_ADD ? X64_ADD : in->op == IR_SUB ? X64_SUB : X64_IMUL;
+                int x = in->a, y = in->b;
+
+                // Commuted when the result goes where y is.
+                if (in->op != IR_SUB && ctx->ra->reg[y] != X64_NOREG
+                    && ctx->ra->reg[y] == ctx->ra->reg[in->dst]) {
+                        x = in->b;
+                        y = in->a;
                 }
-                case TOKEN_TYPE_PLUS_EQUALS:
-                        take_txt(ctx, forge_cstr_builder("mov ", spec, " ", reg, ", [rbp-", offset, "]", NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("add ", spec, " ", reg, ", ", rvalue, NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("mov ", spec, " [rbp-", offset, "], ", reg, NULL), 1);
-                        break;
-                case TOKEN_TYPE_MINUS_EQUALS:
-                        take_txt(ctx, forge_cstr_builder("mov ", spec, " ", reg, ", [rbp-", offset, "]", NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("sub ", spec, " ", reg, ", ", rvalue, NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("mov ", spec, " [rbp-", offset, "], ", reg, NULL), 1);
-                        break;
-                case TOKEN_TYPE_ASTERISK_EQUALS:
-                        take_txt(ctx, forge_cstr_builder("mov ", spec, " ", reg, ", [rbp-", offset, "]", NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("imul ", spec, " ", reg, ", ", rvalue, NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("mov ", spec, " [rbp-", offset, "], ", reg, NULL), 1);
-                        break;
-                case TOKEN_TYPE_FORWARDSLASH_EQUALS: {
-                        write_txt(ctx, "xor rdx, rdx", 1);
-                        take_txt(ctx, forge_cstr_builder("mov ", spec, " rax, [rbp-", offset, "]", NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("idiv ", spec, " ", rvalue, NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("mov ", spec, " ", reg, ", rax", NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("mov ", spec, " [rbp-", offset, "], ", reg, NULL), 1);
-                        break;
-                }
-                case TOKEN_TYPE_PERCENT_EQUALS: {
-                        write_txt(ctx, "xor rdx, rdx", 1);
-                        take_txt(ctx, forge_cstr_builder("mov ", spec, " rax, [rbp-", offset, "]", NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("idiv ", spec, " ", rvalue, NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("mov ", spec, " ", reg, ", rdx", NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("mov ", spec, " [rbp-", offset, "], ", reg, NULL), 1);
-                        break;
-                }
-                default:
-                        forge_err_wargs("visit_expr_mut(): unsupported operator `%s`", e->op->lx);
-                }
-
-                free(offset);
-                free_reg_literal(rvalue);
-                return reg;
+                t = target(ctx, in, y);
+                copy(ctx, t, x);
+                emit2(ctx, op, opnd_reg(t, sz), vreg(ctx, y, sz));
+                set(ctx, in, t);
         } break;
-        case EXPR_KIND_INDEX: {
-                expr_index *idx_expr = (expr_index *)e->lhs;
-                size_t elemty_sz = ((type_list *)idx_expr->lhs->type)->elemty->sz;
-                const char *spec = szspec(elemty_sz);
-                const char *idxspec = szspec(idx_expr->idx->type->sz);
-                char *elemty_sz_cstr = int_to_cstr(elemty_sz);
-
-                char *lhs_value = idx_expr->lhs->accept(idx_expr->lhs, v);
-                char *ptr_load_reg = g_regs[alloc_reg(8)];
-                take_txt(ctx, forge_cstr_builder("mov QWORD ", ptr_load_reg, ", ", lhs_value, NULL), 1);
-                free_reg_literal(lhs_value);
-
-                char *idx_value = idx_expr->idx->accept(idx_expr->idx, v);
-                char *idx_reg = g_regs[alloc_reg(idx_expr->idx->type->sz)];
-                take_txt(ctx, forge_cstr_builder("mov ", idxspec, " ", idx_reg, ", ", idx_value, NULL), 1);
-                take_txt(ctx, forge_cstr_builder("imul ", idx_reg, ", ", elemty_sz_cstr, NULL), 1);
-                take_txt(ctx, forge_cstr_builder("add ", ptr_load_reg, ", ", idx_reg, NULL), 1);
-                free(elemty_sz_cstr);
-                free_reg_literal(idx_value);
-                free_reg_literal(idx_reg);
-                int regi = alloc_reg(elemty_sz);
-                char *reg = g_regs[regi];
-
-                char *rvalue = e->rhs->accept(e->rhs, v);
-
-                switch (e->op->ty) {
-                case TOKEN_TYPE_EQUALS: {
-                        if (!is_register(rvalue)) {
-                                take_txt(ctx, forge_cstr_builder("mov ", spec, " ", reg, ", ", rvalue, NULL), 1);
-                        } else if (strcmp(rvalue, reg)) {
-                                take_txt(ctx, forge_cstr_builder("mov ", spec, " ", reg, ", ", rvalue, NULL), 1);
-                        }
-                        take_txt(ctx, forge_cstr_builder("mov ", spec, " [", ptr_load_reg, "], ", reg, NULL), 1);
-                        break;
-                }
-                case TOKEN_TYPE_PLUS_EQUALS: {
-                        take_txt(ctx, forge_cstr_builder("mov ", spec, " ", reg, ", [", ptr_load_reg, "]", NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("add ", spec, " ", reg, ", ", rvalue, NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("mov ", spec, " [", ptr_load_reg, "], ", reg, NULL), 1);
-                        break;
-                }
-                case TOKEN_TYPE_MINUS_EQUALS: {
-                        take_txt(ctx, forge_cstr_builder("mov ", spec, " ", reg, ", [", ptr_load_reg, "]", NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("sub ", spec, " ", reg, ", ", rvalue, NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("mov ", spec, " [", ptr_load_reg, "], ", reg, NULL), 1);
-                        break;
-                }
-                case TOKEN_TYPE_ASTERISK_EQUALS: {
-                        take_txt(ctx, forge_cstr_builder("mov ", spec, " ", reg, ", [", ptr_load_reg, "]", NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("imul ", spec, " ", reg, ", ", rvalue, NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("mov ", spec, " [", ptr_load_reg, "], ", reg, NULL), 1);
-                        break;
-                }
-                case TOKEN_TYPE_FORWARDSLASH_EQUALS: {
-                        write_txt(ctx, "xor rdx, rdx", 1);
-                        take_txt(ctx, forge_cstr_builder("mov ", spec, " rax, [", ptr_load_reg, "]", NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("idiv ", spec, " ", rvalue, NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("mov ", spec, " ", reg, ", rax", NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("mov ", spec, " [", ptr_load_reg, "], ", reg, NULL), 1);
-                        break;
-                }
-                case TOKEN_TYPE_PERCENT_EQUALS: {
-                        write_txt(ctx, "xor rdx, rdx", 1);
-                        take_txt(ctx, forge_cstr_builder("mov ", spec, " rax, [", ptr_load_reg, "]", NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("idiv ", spec, " ", rvalue, NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("mov ", spec, " ", reg, ", rdx", NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("mov ", spec, " [", ptr_load_reg, "], ", reg, NULL), 1);
-                        break;
-                }
-                default:
-                        forge_err_wargs("visit_expr_mut(): unsupported operator `%s` for array indexing", e->op->lx);
-                }
-
-                free_reg_literal(ptr_load_reg);
-                free_reg_literal(rvalue);
-                return reg;
-        } break;
-        case EXPR_KIND_UNARY: {
-                expr_un *un_expr = (expr_un *)e->lhs;
-                if (un_expr->op->ty != TOKEN_TYPE_ASTERISK) {
-                        forge_err_wargs("visit_expr_mut(): unsupported unary operator `%s` for lvalue", un_expr->op->lx);
+        case IR_DIV:
+        case IR_MOD:
+                divide(ctx, in);
+                set(ctx, in, in->op == IR_DIV ? X64_RAX : X64_RDX);
+                break;
+        case IR_NEG:
+        case IR_NOT:
+                t = target(ctx, in, -1);
+                copy(ctx, t, in->a);
+                emit1(ctx, in->op == IR_NEG ? X64_NEG : X64_NOT, opnd_reg(t, in->sz));
+                set(ctx, in, t);
+                break;
+        case IR_EQ: case IR_NE: case IR_LT: case IR_GT: case IR_LE: case IR_GE:
+                r = use(ctx, in->a, X64_RAX);
+                emit2(ctx, X64_CMP, opnd_reg(r, in->asz), vreg(ctx, in->b, in->asz));
+                t = target(ctx, in, -1);
+                emit1(ctx, X64_SETCC, opnd_reg(t, 1));
+                ctx->code.data[ctx->code.len-1].in.cc = (uint8_t)cond_code(in);
+                emit2(ctx, X64_MOVZX, opnd_reg(t, 4), opnd_reg(t, 1));
+                set(ctx, in, t);
+                break;
+        case IR_EXT:
+                t = target(ctx, in, -1);
+                load_ext(ctx, t, vreg(ctx, in->a, 8), in->asz, in->flags);
+                set(ctx, in, t);
+                break;
+        case IR_MOV:
+                if (ctx->ra->reg[in->dst] != X64_NOREG) {
+                        copy(ctx, (x64_reg)ctx->ra->reg[in->dst], in->a);
+                } else {
+                        set(ctx, in, use(ctx, in->a, X64_RAX));
                 }
-                if (un_expr->rhs->type->kind != TYPE_KIND_PTR) {
-                        forge_err_wargs("visit_expr_mut(): dereference operator requires a pointer type, got kind `%d`", (int)un_expr->rhs->type->kind);
+                break;
+        case IR_CALL:
+                gen_call(ctx, in);
+                break;
+        case IR_ZERO:
+                emit2(ctx, X64_LEA, opnd_reg(X64_RDI, 8), opnd_local((int)in->imm, 0));
+                emit2(ctx, X64_XOR, rax(4), rax(4));
+                emit2(ctx, X64_MOV, rcx(4), opnd_imm(in->imm2));
+                emit0(ctx, X64_REP_STOSB);
+                break;
+        case IR_EMBED:
+                for (size_t i = 0; i < in->embed->lns.len; ++i) {
+                        const char *ln = in->embed->lns.data[i]->lx;
+                        emit_text(ctx, keep(ctx, strndup(ln, strcspn(ln, "\n"))));
                 }
-
-                size_t elemty_sz = ((type_ptr *)un_expr->rhs->type)->to->sz;
-                const char *spec = szspec(elemty_sz);
-                char *ptr_value = un_expr->rhs->accept(un_expr->rhs, v);
-                int ptr_regi = alloc_reg(8);
-                char *ptr_reg = g_regs[ptr_regi];
-
-                if (!is_register(ptr_value)) {
-                        take_txt(ctx, forge_cstr_builder("mov QWORD ", ptr_reg, ", ", ptr_value, NULL), 1);
-                } else if (strcmp(ptr_value, ptr_reg)) {
-                        take_txt(ctx, forge_cstr_builder("mov QWORD ", ptr_reg, ", ", ptr_value, NULL), 1);
+                break;
+        case IR_JMP:
+                if (b->succ[0] != next) {
+                        emit1(ctx, X64_JMP, opnd_sym(ctx->blocks[b->succ[0]]));
                 }
-                free_reg_literal(ptr_value);
-
-                char *rvalue = e->rhs->accept(e->rhs, v);
-                int regi = alloc_reg(elemty_sz);
-                char *reg = g_regs[regi];
-
-                switch (e->op->ty) {
-                case TOKEN_TYPE_EQUALS: {
-                        if (!is_register(rvalue)) {
-                                take_txt(ctx, forge_cstr_builder("mov ", spec, " ", reg, ", ", rvalue, NULL), 1);
-                        } else if (strcmp(rvalue, reg)) {
-                                take_txt(ctx, forge_cstr_builder("mov ", spec, " ", reg, ", ", rvalue, NULL), 1);
+                break;
+        case IR_BR:
+                r = use(ctx, in->a, X64_RAX);
+                emit2(ctx, X64_TEST, opnd_reg(r, in->sz), opnd_reg(r, in->sz));
+                if (b->succ[0] == next) {
+                        emit_jcc(ctx, X64_CC_E, ctx->blocks[b->succ[1]]);
+                } else {
+                        emit_jcc(ctx, X64_CC_NE, ctx->blocks[b->succ[0]]);
+                        if (b->succ[1] != next) {
+                                emit1(ctx, X64_JMP, opnd_sym(ctx->blocks[b->succ[1]]));
                         }
-                        take_txt(ctx, forge_cstr_builder("mov ", spec, " [", ptr_reg, "], ", reg, NULL), 1);
-                        break;
-                }
-                case TOKEN_TYPE_PLUS_EQUALS: {
-                        take_txt(ctx, forge_cstr_builder("mov ", spec, " ", reg, ", [", ptr_reg, "]", NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("add ", spec, " ", reg, ", ", rvalue, NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("mov ", spec, " [", ptr_reg, "], ", reg, NULL), 1);
-                        break;
-                }
-                case TOKEN_TYPE_MINUS_EQUALS: {
-                        take_txt(ctx, forge_cstr_builder("mov ", spec, " ", reg, ", [", ptr_reg, "]", NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("sub ", spec, " ", reg, ", ", rvalue, NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("mov ", spec, " [", ptr_reg, "], ", reg, NULL), 1);
-                        break;
-                }
-                case TOKEN_TYPE_ASTERISK_EQUALS: {
-                        take_txt(ctx, forge_cstr_builder("mov ", spec, " ", reg, ", [", ptr_reg, "]", NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("imul ", spec, " ", reg, ", ", rvalue, NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("mov ", spec, " [", ptr_reg, "], ", reg, NULL), 1);
-                        break;
-                }
-                case TOKEN_TYPE_FORWARDSLASH_EQUALS: {
-                        write_txt(ctx, "xor rdx, rdx", 1);
-                        take_txt(ctx, forge_cstr_builder("mov ", spec, " rax, [", ptr_reg, "]", NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("idiv ", spec, " ", rvalue, NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("mov ", spec, " ", reg, ", rax", NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("mov ", spec, " [", ptr_reg, "], ", reg, NULL), 1);
-                        break;
-                }
-                case TOKEN_TYPE_PERCENT_EQUALS: {
-                        write_txt(ctx, "xor rdx, rdx", 1);
-                        take_txt(ctx, forge_cstr_builder("mov ", spec, " rax, [", ptr_reg, "]", NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("idiv ", spec, " ", rvalue, NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("mov ", spec, " ", reg, ", rdx", NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("mov ", spec, " [", ptr_reg, "], ", reg, NULL), 1);
-                        break;
-                }
-                default:
-                        forge_err_wargs("visit_expr_mut(): unsupported operator `%s` for dereference lvalue", e->op->lx);
-                }
-
-                free_reg(ptr_regi);
-                free_reg_literal(rvalue);
-                return reg;
-        } break;
-        default: {
-                forge_err_wargs("visit_expr_mut(): lvalue of kind `%d` is unimplemented", (int)e->lhs->kind);
-        } break;
-        }
-
-        return NULL; // unreachable
-}
-
-static void *
-visit_expr_brace_init(visitor *v, expr_brace_init *e)
-{
-        asm_context *ctx = (asm_context *)v->context;
-
-        for (size_t i = 0; i < e->resolved_syms->len; ++i) {
-                const sym *sym = e->resolved_syms->data[i];
-                const char *spec = szspec(sym->ty->sz);
-                char *offset = int_to_cstr(sym->stack_offset);
-                char *value = e->exprs.data[i]->accept(e->exprs.data[i], v);
-
-                take_txt(ctx, forge_cstr_builder("mov ", spec, " [rbp-", offset, "], ", value, NULL), 1);
-
-                free_reg_literal(value);
-                free(offset);
-        }
-
-        return "rax";
-}
-
-static void *
-visit_expr_namespace(visitor *v, expr_namespace *e)
-{
-        return e->e->accept(e->e, v);
-}
-
-static void *
-visit_expr_arrayinit(visitor *v, expr_arrayinit *e)
-{
-        asm_context *ctx = (asm_context *)v->context;
-
-        type_list *ty = (type_list *)((expr *)e)->type;
-        size_t szsum = ty->elemty->sz * ty->len; // Total size of the array in bytes
-
-        // Zero the array if e->zeroed is true
-        if (e->zeroed) {
-                // Save registers that rep stosd will clobber (rax, rdi, rcx)
-                push_inuse_regs(ctx);
-
-                // Zero the array using rep stosd
-                write_txt(ctx, "xor eax, eax", 1); // eax = 0
-                char *offset = int_to_cstr(e->stack_offset_base + szsum);
-                take_txt(ctx, forge_cstr_builder("lea rdi, [rbp-", offset, "]", NULL), 1);
-                free(offset);
-                char *count = int_to_cstr(ty->len); // Number of elements
-                take_txt(ctx, forge_cstr_builder("mov rcx, ", count, NULL), 1);
-                free(count);
-                write_txt(ctx, "cld", 1); // Clear direction flag (increment rdi)
-                write_txt(ctx, "rep stosd", 1); // Zero ty->len * 4 bytes
-
-                // Restore registers
-                pop_inuse_regs(ctx);
-        }
-
-        // Process explicit initializers, if any
-        size_t init_offset = 0;
-        for (size_t i = 0; i < e->exprs.len; ++i) {
-                expr *eidx = e->exprs.data[i];
-                char *res = eidx->accept(eidx, v);
-                const char *spec = szspec(eidx->type->sz);
-                init_offset += eidx->type->sz;
-                char *offset = int_to_cstr(e->stack_offset_base + init_offset);
-
-                take_txt(ctx, forge_cstr_builder("mov ", spec, " [rbp-", offset, "], ", res, NULL), 1);
-
-                free(offset);
-                free_reg_literal(res);
-        }
-
-        // Return the address of the array (lea of the first element)
-        char *ptr_reg = g_regs[alloc_reg(8)];
-        char *last_elem_offset = int_to_cstr(e->stack_offset_base + szsum);
-        take_txt(ctx, forge_cstr_builder("lea ", ptr_reg, ", [rbp-", last_elem_offset, "]", NULL), 1);
-        free(last_elem_offset);
-        return ptr_reg;
-}
-
-static void *
-visit_expr_index(visitor *v, expr_index *e)
-{
-        asm_context *ctx = (asm_context *)v->context;
-
-        // TODO: Also allow for pointers.
-        size_t elemty_sz = ((type_list *)e->lhs->type)->elemty->sz;
-        char *elemty_sz_cstr = int_to_cstr(elemty_sz);
-        const char *spec = szspec(elemty_sz);
-        const char *idxspec = szspec(e->idx->type->sz);
-
-        char *lhs_value = e->lhs->accept(e->lhs, v);
-        char *ptr_load_reg = g_regs[alloc_reg(8)];
-
-        take_txt(ctx, forge_cstr_builder("mov QWORD ",
-                                         ptr_load_reg, ", ",
-                                         lhs_value, NULL), 1);
-
-        free_reg_literal(lhs_value);
-        char *idx_value = e->idx->accept(e->idx, v);
-        char *updated_idx_reg = g_regs[alloc_reg(e->idx->type->sz)];
-
-        take_txt(ctx, forge_cstr_builder("mov ", idxspec, " ", updated_idx_reg, ", ", idx_value, NULL), 1);
-        take_txt(ctx, forge_cstr_builder("imul ", updated_idx_reg, ", ", elemty_sz_cstr, NULL), 1);
-        take_txt(ctx, forge_cstr_builder("add ", ptr_load_reg,
-                                         ", ", updated_idx_reg, NULL), 1);
-
-        free(elemty_sz_cstr);
-        free_reg_literal(idx_value);
-        free_reg_literal(updated_idx_reg);
-
-        // TODO: Also allow for pointers.
-        char *res = g_regs[alloc_reg(elemty_sz)];
-
-        take_txt(ctx, forge_cstr_builder("mov ", spec, " ",
-                                         res, ", [", ptr_load_reg, "]",
-                                         NULL), 1);
-
-        free_reg_literal(ptr_load_reg);
-
-        return res;
-}
-
-static void *
-visit_expr_un(visitor *v, expr_un *e)
-{
-        asm_context *ctx = (asm_context *)v->context;
-
-        if (e->op->ty == TOKEN_TYPE_AMPERSAND) {
-                int regi = alloc_reg(8);
-                char *reg = g_regs[regi];
-
-                switch (e->rhs->kind) {
-                case EXPR_KIND_IDENTIFIER: {
-                        expr_identifier *id = (expr_identifier *)e->rhs;
-                        assert(id->resolved);
-
-                        // Address of the variable [rbp - offset]
-                        char *offset = int_to_cstr(id->resolved->stack_offset);
-                        take_txt(ctx, forge_cstr_builder("lea ", reg, ", [rbp-", offset, "]", NULL), 1);
-                        free(offset);
-                        break;
                 }
-                case EXPR_KIND_INDEX: {
-                        expr_index *idx = (expr_index *)e->rhs;
-                        size_t elemty_sz = ((type_list *)idx->lhs->type)->elemty->sz;
-                        char *elemty_sz_cstr = int_to_cstr(elemty_sz);
-                        const char *idxspec = szspec(idx->idx->type->sz);
-
-                        // Get base address
-                        char *lhs_value = idx->lhs->accept(idx->lhs, v);
-                        char *ptr_load_reg = g_regs[alloc_reg(8)];
-                        take_txt(ctx, forge_cstr_builder("mov QWORD ", ptr_load_reg, ", ", lhs_value, NULL), 1);
-                        free_reg_literal(lhs_value);
-
-                        // Get offset
-                        char *idx_value = idx->idx->accept(idx->idx, v);
-                        char *idx_reg = g_regs[alloc_reg(idx->idx->type->sz)];
-                        take_txt(ctx, forge_cstr_builder("mov ", idxspec, " ", idx_reg, ", ", idx_value, NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("imul ", idx_reg, ", ", elemty_sz_cstr, NULL), 1);
-                        take_txt(ctx, forge_cstr_builder("add ", ptr_load_reg, ", ", idx_reg, NULL), 1);
-
-                        // LEA of the indexed element
-                        take_txt(ctx, forge_cstr_builder("lea ", reg, ", [", ptr_load_reg, "]", NULL), 1);
-
-                        free(elemty_sz_cstr);
-                        free_reg_literal(idx_value);
-                        free_reg_literal(idx_reg);
-                        free_reg_literal(ptr_load_reg);
-                        break;
-                }
-                default:
-                        forge_err_wargs("visit_expr_un(): address-of operator not supported for operand kind `%d`", (int)e->rhs->kind);
-                }
-
-                return reg;
-        }
-
-        if (e->op->ty == TOKEN_TYPE_ASTERISK) {
-                size_t elemty_sz = ((type_ptr *)e->rhs->type)->to->sz;
-                const char *spec = szspec(elemty_sz);
-
-                char *ptr_value = e->rhs->accept(e->rhs, v);
-
-                int ptr_regi = alloc_reg(8);
-                char *ptr_reg = g_regs[ptr_regi];
-
-                if (!is_register(ptr_value)) {
-                        take_txt(ctx, forge_cstr_builder("mov QWORD ", ptr_reg, ", ", ptr_value, NULL), 1);
-                } else if (strcmp(ptr_value, ptr_reg)) {
-                        take_txt(ctx, forge_cstr_builder("mov QWORD ", ptr_reg, ", ", ptr_value, NULL), 1);
+                break;
+        case IR_RET:
+                if (in->a >= 0) {
+                        copy(ctx, X64_RAX, in->a);
                 }
-                free_reg_literal(ptr_value);
-
-                int result_regi = alloc_reg(elemty_sz);
-                char *result_reg = g_regs[result_regi];
-
-                // Load the value from the address
-                take_txt(ctx, forge_cstr_builder("mov ", spec, " ", result_reg, ", [", ptr_reg, "]", NULL), 1);
-
-                free_reg(ptr_regi);
-
-                return result_reg;
-        }
-
-        char *rhs_value = e->rhs->accept(e->rhs, v);
-        const char *spec = szspec(e->rhs->type->sz);
-
-        int regi = alloc_reg(e->rhs->type->sz);
-        char *reg = g_regs[regi];
-
-        if (!is_register(rhs_value)) {
-                take_txt(ctx, forge_cstr_builder("mov ", spec, " ", reg, ", ", rhs_value, NULL), 1);
-        } else if (strcmp(rhs_value, reg)) {
-                take_txt(ctx, forge_cstr_builder("mov ", spec, " ", reg, ", ", rhs_value, NULL), 1);
-        }
-
-        free_reg_literal(rhs_value);
-
-        switch (e->op->ty) {
-        case TOKEN_TYPE_MINUS:
-                take_txt(ctx, forge_cstr_builder("neg ", spec, " ", reg, NULL), 1);
+                epilogue(ctx);
                 break;
-
-        case TOKEN_TYPE_BANG: {
-                char *lbl_true = genlbl("true");
-                char *lbl_done = genlbl("done");
-
-                // Compare operand to 0
-                take_txt(ctx, forge_cstr_builder("cmp ", spec, " ", reg, ", 0", NULL), 1);
-                // If zero, set result to 1
-                take_txt(ctx, forge_cstr_builder("je ", lbl_true, NULL), 1);
-                // Otherwise, set result to 0
-                take_txt(ctx, forge_cstr_builder("mov ", spec, " ", reg, ", 0", NULL), 1);
-                take_txt(ctx, forge_cstr_builder("jmp ", lbl_done, NULL), 1);
-                take_txt(ctx, forge_cstr_builder(lbl_true, ":", NULL), 1);
-                take_txt(ctx, forge_cstr_builder("mov ", spec, " ", reg, ", 1", NULL), 1);
-                take_txt(ctx, forge_cstr_builder(lbl_done, ":", NULL), 1);
-
-                free(lbl_true);
-                free(lbl_done);
+        case IR_EXIT:
+                copy(ctx, X64_RDI, in->a);
+                emit2(ctx, X64_MOV, rax(8), opnd_imm(60));
+                emit0(ctx, X64_SYSCALL);
                 break;
-        }
-
-        case TOKEN_TYPE_TILDE:
-                take_txt(ctx, forge_cstr_builder("not ", spec, " ", reg, NULL), 1);
+        case IR_UNREACHABLE:
                 break;
-
         default:
-                forge_err_wargs("visit_expr_un(): unsupported unary operator `%s`", e->op->lx);
+                forge_err_wargs("%sno code for the IR instruction %d", loc_err(in->loc), (int)in->op);
         }
-
-        return reg;
-}
-
-static void *
-visit_expr_character_literal(visitor                *v,
-                             expr_character_literal *e)
-{
-        NOOP(v);
-        static char buf[256] = {0};
-        memset(buf, 0, sizeof(buf));
-        sprintf(buf, "%d", e->c->lx[0]);
-        return buf;
 }
 
-static void *
-visit_expr_cast(visitor *v, expr_cast *e)
+// The size of the code from `from` on as it is encoded,
+// without embeds.
+static int
+text_bytes(asm_context *ctx, size_t from)
 {
-        asm_context *ctx         = (asm_context *)v->context;
-        int          is_unsigned = type_is_unsigned(e->rhs->type);
-        int          rhs_sz      = e->rhs->type->sz;
-        int          cast_sz     = ((expr *)e)->type->sz;
-        const char  *cast_spec   = szspec(cast_sz);
-        const char  *rhs_spec    = szspec(rhs_sz);
-        char        *rhs_val     = (char *)e->rhs->accept(e->rhs, v);
-        int          regi        = alloc_reg(cast_sz);
-        char        *reg         = g_regs[regi];
-
-        if (rhs_sz < cast_sz) {
-                // Cast up
-                if (is_unsigned) {
-                        take_txt(ctx, forge_cstr_builder("movzx ", reg, ", ", rhs_spec, " ", rhs_val, NULL), 1);
-                } else {
-                        take_txt(ctx, forge_cstr_builder("movsx ", reg, ", ", rhs_spec, " ", rhs_val, NULL), 1);
-                }
-        } else if (cast_sz < rhs_sz) {
-                // Cast down
-                if (is_register(rhs_val)) {
-                        const char *rhs_reg_sub = get_reg_from_size(rhs_val, cast_sz);
-                        // If rhs_val is a register, use its sub-register
-                        take_txt(ctx, forge_cstr_builder("mov ", cast_spec, " ", reg, ", ", rhs_reg_sub, NULL), 1);
-                } else {
-                        // If rhs_val is a memory location or imm, just move with truncation
-                        take_txt(ctx, forge_cstr_builder("mov ", cast_spec, " ", reg, ", ", rhs_val, NULL), 1);
-                }
-        } else {
-                // Same size
-                if (!is_register(rhs_val) || strcmp(rhs_val, reg)) {
-                        take_txt(ctx, forge_cstr_builder("mov ", cast_spec, " ", reg, ", ", rhs_val, NULL), 1);
+        uint8_t buf[X64_MAX_INSN];
+        x64_fixup fix;
+        int n = 0;
+
+        for (size_t i = from; i < ctx->code.len; ++i) {
+                if (ctx->code.data[i].kind == X64_ITEM_INSN) {
+                        int len = x64_encode(&ctx->code.data[i].in, buf, &fix);
+                        if (len > 0) n += len;
                 }
         }
-
-        free_reg_literal(rhs_val);
-        return reg;
-}
-
-static void *
-visit_expr_bool_literal(visitor *v, expr_bool_literal *e)
-{
-        NOOP(v);
-        static char *one  = "1";
-        static char *zero = "0";
-        return (void *)(strcmp(e->b->lx, KWD_TRUE) == 0 ? one : zero);
+        return n;
 }
 
-static void *
-visit_expr_null(visitor *v, expr_null *e)
-{
-        NOOP(v, e);
-        static char *zero = "0";
-        return zero;
-}
-
-static void *
-visit_stmt_let(visitor *v, stmt_let *s)
+// The code of the IR `p`. Below the locals are the spill slots
+// and then the callee-saved registers in use.
+static void
+gen_ir(asm_context *ctx, const ir_proc *p)
 {
-        asm_context *ctx = (asm_context *)v->context;
-
-        char *value = (char *)s->e->accept(s->e, v);
+        size_t from = ctx->code.len;
 
-        if (s->resolved->ty->kind != TYPE_KIND_STRUCT) {
-                int offset = s->resolved->stack_offset;
-                char *offset_s = int_to_cstr(offset);
-                const char *spec = szspec(s->e->type->sz);
-
-                take_txt(ctx, forge_cstr_builder("mov ", spec, " [rbp-", offset_s, "], ", value, NULL), 1);
-                free(offset_s);
+        ctx->ra = regalloc_run(p);
+        ctx->vbase = (p->s->rsp + 7) & ~7;
+        ctx->blocks = (const char **)alloc(p->blocks.len * sizeof(char *));
+        for (size_t i = 0; i < p->blocks.len; ++i) {
+                ctx->blocks[i] = genlbl(ctx, "bb");
         }
 
-        free_reg_literal(value);
-
-        return NULL;
-}
-
-static void *
-visit_stmt_expr(visitor *v, stmt_expr *s)
-{
-        char *value = s->e->accept(s->e, v);
-        free_reg_literal(value);
-
-        return NULL;
-}
-
-static void *
-visit_stmt_block(visitor *v, stmt_block *s)
-{
-        for (size_t i = 0; i < s->stmts.len; ++i) {
-                stmt *stmt = s->stmts.data[i];
-                stmt->accept(stmt, v);
+        prologue(ctx, ctx->vbase + 8 * (ctx->ra->nslots + ctx->ra->nsaved));
+        for (int i = 0; i < ctx->ra->nsaved; ++i) {
+                emit2(ctx, X64_MOV, saved_slot(ctx, i), opnd_reg(ctx->ra->saved[i], 8));
         }
-        return NULL;
-}
 
-static void *
-visit_stmt_proc(visitor *v, stmt_proc *s)
-{
-        asm_context *ctx = (asm_context *)v->context;
+        for (size_t i = 0; i < p->blocks.len; ++i) {
+                const ir_block *b = &p->blocks.data[i];
+                int next = i + 1 < p->blocks.len ? (int)i + 1 : -1;
 
-        if (s->export) {
-                dyn_array_append(ctx->globals, s->id->lx);
+                if (i) emit_label(ctx, ctx->blocks[i]);
+                for (size_t j = 0; j < b->insns.len; ++j) {
+                        gen_insn(ctx, b, &b->insns.data[j], next);
+                }
         }
 
-        if (!strcmp(s->id->lx, "_start") || !strcmp(s->id->lx, "main")) {
-                take_txt(ctx, forge_cstr_builder(s->id->lx, ":", NULL), 1);
-        } else {
-                const char *modname = ctx->tbl->modname;
-                take_txt(ctx, forge_cstr_builder(modname, "_", s->id->lx, ":", NULL), 1);
+        free(ctx->blocks);
+        ctx->blocks = NULL;
+        regalloc_free(ctx->ra);
+        ctx->ra = NULL;
+
+        // Before the peephole optimiser, which would also remove
+        // some of what ir_dce() does.
+        if (g_config.flags & FLAG_TYPE_VERBOSE) {
+                int n = text_bytes(ctx, from);
+                if (ctx->trial) {
+                        ctx->dce_bytes += n;
+                } else {
+                        ctx->dce_bytes -= n;
+                        ctx->text_bytes += n;
+                }
         }
-        prologue(ctx, s->rsp);
-
-        const char *param_regs[] = { "rdi", "rsi", "rdx", "rcx", "r8", "r9" };
-
-        // Put procedure parameters onto the stack.
-        for (size_t i = 0; i < s->params.len; ++i) {
-                sym *param = s->params.data[i].resolved;
-                assert(param);
-                int sz = param->ty->sz;
-                char *offset = int_to_cstr(param->stack_offset);
-                take_txt(ctx, forge_cstr_builder("mov ", szspec(sz), " [rbp-", offset, "], ",
-                                                 get_reg_from_size(param_regs[i], sz), NULL),
-                         1);
+        if (ctx->trial) {
+                ctx->code.len = from;
+                return;
         }
 
-        // TODO: procedure parameters
-        s->blk->accept(s->blk, v);
-
-        epilogue(ctx);
-        return NULL;
-}
-
-static void *
-visit_stmt_return(visitor *v, stmt_return *s)
-{
-        asm_context *ctx = (asm_context *)v->context;
-
-        if (s->e) {
-                char *value = s->e->accept(s->e, v);
-                int sz = s->e->type->sz;
-                const char *ret_reg = get_reg_from_size("rax", sz);
-                take_txt(ctx, forge_cstr_builder("mov ", szspec(sz), " ",
-                                                 ret_reg, ", ",
-                                                 value, NULL), 1);
-                free_reg_literal(value);
-                write_txt(ctx, "leave", 1);
-                write_txt(ctx, "ret", 1);
-
-                return (void *)ret_reg;
-        }
-        write_txt(ctx, "leave", 1);
-        write_txt(ctx, "ret", 1);
-        return "rax";
-}
-
-static void *
-visit_stmt_exit(visitor *v, stmt_exit *s)
-{
-        asm_context *ctx = (asm_context *)v->context;
-
-        char *reg = NULL;
-
-        if (s->e) {
-                reg = s->e->accept(s->e, v);
+        if (g_config.peephole) {
+                peephole_run(&ctx->code, from, g_config.peephole);
         }
-
-        if (reg) {
-                const char *syscall_reg = get_reg_from_size("rdi", s->e->type->sz);
-                const char *spec = szspec(s->e->type->sz);
-                take_txt(ctx, forge_cstr_builder("mov ", spec, " ", syscall_reg, ", ", reg, NULL), 1);
-                write_txt(ctx, "mov rax, 60", 1);
-                free_reg_literal(reg);
-        } else {
-                write_txt(ctx, "mov rax, 60", 1);
-                write_txt(ctx, "mov rdi, 0", 1);
-        }
-
-        write_txt(ctx, "syscall", 1);
-
-        return NULL;
 }
 
-static void *
-visit_stmt_extern_proc(visitor *v, stmt_extern_proc *s)
-{
-        asm_context *ctx = (asm_context *)v->context;
-        dyn_array_append(ctx->externs, s->id->lx);
-        return NULL;
-}
-
-static void *
-visit_stmt_if(visitor *v, stmt_if *s)
+// For -v: the code of `s` as it would be without ir_dce(),
+// which is measured and thrown away. The labels it took are
+// given back, so that -v does not change the code.
+static void
+trial_without_dce(asm_context *ctx, const stmt_proc *s)
 {
-        asm_context *ctx = (asm_context *)v->context;
-
-        char *cond = s->e->accept(s->e, v);
-        const char *spec = szspec(s->e->type->sz);
-
-        char *cond_reg = NULL;
-        int temp_reg_idx = -1;
-        if (!is_register(cond)) {
-                temp_reg_idx = alloc_reg(s->e->type->sz);
-                cond_reg = g_regs[temp_reg_idx];
-                take_txt(ctx, forge_cstr_builder("mov ", spec, " ", cond_reg, ", ", cond, NULL), 1);
-        } else {
-                cond_reg = cond;
-        }
-
-        char *lbl_else = s->else_ ? genlbl("else") : NULL;
-        char *lbl_done = genlbl("done");
-
-        // Compare condition to 0
-        // NOTE: Changed this line after boolean support to "fix" assembler warnings
-        take_txt(ctx, forge_cstr_builder("cmp ", cond_reg, ", 0", NULL), 1);
-        //take_txt(ctx, forge_cstr_builder("cmp ", spec, " ", cond_reg, ", 0", NULL), 1);
+        ir_proc *p = ir_lower(s, ctx->modname);
+        int lbl = g_lbl;
+        ir_promote(p);
+        ir_destruct_ssa(p);
 
-        // Jump to `else` (if present) or done if `false`
-        take_txt(ctx, forge_cstr_builder("je ", s->else_ ? lbl_else : lbl_done, NULL), 1);
+        ctx->trial = 1;
+        gen_ir(ctx, p);
+        ctx->trial = 0;
+        g_lbl = lbl;
 
-        s->then->accept(s->then, v);
-
-        if (s->else_) {
-                take_txt(ctx, forge_cstr_builder("jmp ", lbl_done, NULL), 1);
-                take_txt(ctx, forge_cstr_builder(lbl_else, ":", NULL), 1);
-                s->else_->accept(s->else_, v);
-                free(lbl_else);
-        }
-
-        take_txt(ctx, forge_cstr_builder(lbl_done, ":", NULL), 1);
-        free(lbl_done);
-
-        if (temp_reg_idx != -1) {
-                free_reg(temp_reg_idx);
-        }
-        free_reg_literal(cond);
-
-        return NULL;
+        ir_free(p);
 }
 
-static void *
-visit_stmt_while(visitor *v, stmt_while *s)
+static void
+gen_proc(asm_context *ctx, stmt_proc *s)
 {
-        asm_context *ctx            = (asm_context *)v->context;
-        const char  *spec           = szspec(s->e->type->sz);
-        char        *lbl_loop_begin = genlbl("loop");
-        char        *lbl_loop_end   = genlbl("end");
-        s->asm_begin_lbl            = lbl_loop_begin;
-        s->asm_end_lbl              = lbl_loop_end;
-
-        take_txt(ctx, forge_cstr_builder(lbl_loop_begin, ":", NULL), 1);
-        char *cond = s->e->accept(s->e, v);
-
-        char *cond_reg = NULL;
-        int temp_reg_idx = -1;
-        if (!is_register(cond)) {
-                temp_reg_idx = alloc_reg(s->e->type->sz);
-                cond_reg = g_regs[temp_reg_idx];
-                take_txt(ctx, forge_cstr_builder("mov ", spec, " ", cond_reg, ", ", cond, NULL), 1);
-        } else {
-                cond_reg = cond;
+        char *symbol = reach_symbol(ctx->tbl->modname, s->id->lx);
+        int live = reach_is_live(symbol);
+        free(symbol);
+        if (!live) {
+                return;
         }
 
-        // NOTE: Changed this line after boolean support to "fix" assembler warnings
-        take_txt(ctx, forge_cstr_builder("cmp ", cond_reg, ", 0", NULL), 1);
-        //take_txt(ctx, forge_cstr_builder("cmp ", spec, " ", cond_reg, ", 0", NULL), 1);
-
-        take_txt(ctx, forge_cstr_builder("je ", lbl_loop_end, NULL), 1);
-
-        (void)s->body->accept(s->body, v);
-        take_txt(ctx, forge_cstr_builder("jmp ", lbl_loop_begin, NULL), 1);
-
-        take_txt(ctx, forge_cstr_builder(lbl_loop_end, ":", NULL), 1);
-
-        if (temp_reg_idx != -1) {
-                free_reg(temp_reg_idx);
-        }
-        free_reg_literal(cond);
-
-        free(lbl_loop_begin);
-        free(lbl_loop_end);
-
-        return NULL;
-}
-
-static void *
-visit_stmt_for(visitor *v, stmt_for *s)
-{
-        asm_context *ctx     = (asm_context *)v->context;
-        const char *e_spec   = szspec(s->e->type->sz);
-        char *lbl_for_begin  = genlbl("loop");
-        char *lbl_for_end    = genlbl("end");
-
-        s->asm_begin_lbl = lbl_for_begin;
-        s->asm_end_lbl = lbl_for_end;
-
-        free_reg_literal(s->init->accept(s->init, v));
-        take_txt(ctx, forge_cstr_builder(lbl_for_begin, ":", NULL), 1);
-
-        char *cond = s->e->accept(s->e, v);
-
-        char *cond_reg = NULL;
-        int temp_reg_idx = -1;
-        if (!is_register(cond)) {
-                temp_reg_idx = alloc_reg(s->e->type->sz);
-                cond_reg = g_regs[temp_reg_idx];
-                take_txt(ctx, forge_cstr_builder("mov ", e_spec, " ", cond_reg, ", ", cond, NULL), 1);
-        } else {
-                cond_reg = cond;
+        if (s->export) {
+                dyn_array_append(ctx->globals, s->id->lx);
         }
 
-        // NOTE: Changed this line after boolean support to "fix" assembler warnings
-        take_txt(ctx, forge_cstr_builder("cmp ", cond_reg, ", 0", NULL), 1);
-        //take_txt(ctx, forge_cstr_builder("cmp ", e_spec, " ", cond_reg, ", 0", NULL), 1);
-
-        take_txt(ctx, forge_cstr_builder("je ", lbl_for_end, NULL), 1);
-
-        if (temp_reg_idx != -1) {
-                free_reg(temp_reg_idx);
+        ir_proc *p = ir_lower(s, ctx->modname);
+        ir_promote(p);
+        if (g_config.flags & FLAG_TYPE_VERBOSE) {
+                trial_without_dce(ctx, s);
         }
-        free_reg_literal(cond);
-
-        (void)s->body->accept(s->body, v);
-        free_reg_literal(s->after->accept(s->after, v));
-        take_txt(ctx, forge_cstr_builder("jmp ", lbl_for_begin, NULL), 1);
-
-        take_txt(ctx, forge_cstr_builder(lbl_for_end, ":", NULL), 1);
-
-        free(lbl_for_begin);
-        free(lbl_for_end);
-
-        return NULL;
-}
-
-static void *
-visit_stmt_break(visitor *v, stmt_break *s)
-{
-        asm_context *ctx = (asm_context *)v->context;
-
-        char *lbl = NULL;
-        switch (((stmt *)s->resolved_parent)->kind) {
-        case STMT_KIND_FOR:
-                lbl = ((stmt_for *)s->resolved_parent)->asm_end_lbl;
-                break;
-        case STMT_KIND_WHILE:
-                lbl = ((stmt_while *)s->resolved_parent)->asm_end_lbl;
-                break;
-        default: assert(0);
+        ir_dce(p);
+        if (g_config.flags & FLAG_TYPE_DUMP_IR) {
+                ir_dump(p, stdout);
         }
+        ir_destruct_ssa(p);
 
-        take_txt(ctx, forge_cstr_builder("jmp ", lbl, NULL), 1);
+        emit_label(ctx, symname(ctx, p->symbol, NULL));
+        gen_ir(ctx, p);
 
-        return NULL;
+        ir_free(p);
 }
 
-static void *
-visit_stmt_continue(visitor *v, stmt_continue *s)
+static void
+gen_extern_proc(asm_context *ctx, stmt_extern_proc *s)
 {
-        asm_context *ctx = (asm_context *)v->context;
-
-        char *lbl = NULL;
-        switch (((stmt *)s->resolved_parent)->kind) {
-        case STMT_KIND_FOR:
-                lbl = ((stmt_for *)s->resolved_parent)->asm_begin_lbl;
-                break;
-        case STMT_KIND_WHILE:
-                lbl = ((stmt_while *)s->resolved_parent)->asm_begin_lbl;
-                break;
-        default: assert(0);
+        if (reach_is_live(s->id->lx)) {
+                dyn_array_append(ctx->externs, strdup(s->id->lx));
         }
-
-        take_txt(ctx, forge_cstr_builder("jmp ", lbl, NULL), 1);
-
-        return NULL;
 }
 
-static void *
-visit_stmt_struct(visitor *v, stmt_struct *s)
-{
-        NOOP(v, s);
-        return NULL;
-}
-
-static void *
-visit_stmt_module(visitor *v, stmt_module *s)
-{
-        NOOP(v, s);
-        return NULL;
-}
-
-static void *
-visit_stmt_import(visitor *v, stmt_import *s)
+static void
+gen_import(asm_context *ctx, stmt_import *s)
 {
-        asm_context *ctx = (asm_context *)v->context;
-        symtbl *import_tbl = NULL;
-
-        for (size_t i = 0; i < s->filepaths.len; ++i) {
-                const char *filepath = s->filepaths.data[i];
+        // Wildcard imports that were never used resolved to nothing.
+        for (size_t i = 0; i < s->resolved_tbls.len; ++i) {
+                symtbl *import_tbl = s->resolved_tbls.data[i];
 
-                for (size_t j = 0; j < ctx->tbl->imports.len; ++j) {
-                        if (!strcmp(filepath, ctx->tbl->imports.data[j]->src_filepath)) {
-                                import_tbl = ctx->tbl->imports.data[j];
-                                break;
-                        }
-                }
-
-                assert(import_tbl);
-
-                str_array obj_filepaths = asm_gen(import_tbl->program, import_tbl);
-
-                for (size_t j = 0; j < obj_filepaths.len; ++j) {
-                        dyn_array_append(ctx->obj_filepaths, obj_filepaths.data[j]);
+                // Generated along with this one.
+                if (ctx->unit.tbl.entries && smap_has(&ctx->unit, import_tbl->src_filepath)) {
+                        continue;
                 }
 
                 for (size_t j = 0; j < import_tbl->export_syms.len; ++j) {
@@ -1792,163 +1130,277 @@ visit_stmt_import(visitor *v, stmt_import *s)
                         } else {
                                 exp = forge_cstr_builder(s->resolved_modnames.data[i], "_", sym->id, NULL);
                         }
+                        if (!reach_is_live(exp)) {
+                                free(exp);
+                                continue;
+                        }
                         dyn_array_append(ctx->externs, exp);
                 }
         }
-
-
-        return NULL;
-}
-
-static void *
-visit_stmt_embed(visitor *v, stmt_embed *s)
-{
-        asm_context *ctx = (asm_context *)v->context;
-
-        for (size_t i = 0; i < s->lns.len; ++i) {
-                write_txt(ctx, s->lns.data[i]->lx, 1);
-        }
-
-        return NULL;
 }
 
-static void *
-visit_stmt_empty(visitor *v, stmt_empty *s)
-{
-        NOOP(v, s);
-        return NULL;
-}
-
-static visitor *
-asm_visitor_alloc(asm_context *ctx)
+// The extension of the file the generated code is written to.
+static const char *
+asm_ext(void)
 {
-        return visitor_alloc(
-                (void *)ctx,
-                visit_expr_binary,
-                visit_expr_identifier,
-                visit_expr_integer_literal,
-                visit_expr_string_literal,
-                visit_expr_proccall,
-                visit_expr_mut,
-                visit_expr_brace_init,
-                visit_expr_namespace,
-                visit_expr_arrayinit,
-                visit_expr_index,
-                visit_expr_un,
-                visit_expr_character_literal,
-                visit_expr_cast,
-                visit_expr_bool_literal,
-                visit_expr_null,
-
-                visit_stmt_let,
-                visit_stmt_expr,
-                visit_stmt_block,
-                visit_stmt_proc,
-                visit_stmt_return,
-                visit_stmt_exit,
-                visit_stmt_extern_proc,
-                visit_stmt_if,
-                visit_stmt_while,
-                visit_stmt_for,
-                visit_stmt_break,
-                visit_stmt_continue,
-                visit_stmt_struct,
-                visit_stmt_module,
-                visit_stmt_import,
-                visit_stmt_embed,
-                visit_stmt_empty
-        );
+        if (g_config.emit == EMIT_C) return ".c";
+        return g_config.assembler == ASSEMBLER_GAS ? ".s" : ".asm";
 }
 
+// The assembly only touches the disk when it is asked for
+// with --asm. Otherwise it stays in a memfd that nasm reads
+// through /proc, falling back to the private temp directory.
 static void
-init(asm_context *ctx, symtbl *tbl)
+open_asm(asm_context *ctx)
 {
-        const char *basename = forge_io_basename(tbl->src_filepath);
-        char *asm_fp = forge_cstr_builder(basename, ".asm", NULL);
+        const char *base = forge_io_basename(ctx->stem);
 
-        ctx->out = fopen(asm_fp, "w");
-        free(asm_fp);
+        ctx->asm_unlink = 0;
+
+        if (g_config.flags & FLAG_TYPE_ASM) {
+                // Next to the object in a build directory,
+                // otherwise where the user can find it.
+                ctx->asm_fp = forge_cstr_builder(g_config.build_dir ? ctx->stem : base, asm_ext(), NULL);
+                ctx->out = fopen(ctx->asm_fp, "w+");
+        } else {
+                // Several can be open while assemblers run, so
+                // they are not inherited: nasm opens ours by pid.
+                int fd = memfd_create(base, MFD_CLOEXEC);
+                if (fd >= 0) {
+                        char path[64];
+                        snprintf(path, sizeof(path), "/proc/%d/fd/%d", (int)getpid(), fd);
+                        ctx->asm_fp = strdup(path);
+                        ctx->out = fdopen(fd, "w+");
+                } else {
+                        ctx->asm_fp = forge_cstr_builder(private_tmpdir(), "/", base, asm_ext(), NULL);
+                        ctx->asm_unlink = 1;
+                        ctx->out = fopen(ctx->asm_fp, "w+");
+                }
+        }
 
         if (!ctx->out) {
                 perror("fopen");
                 exit(1);
         }
+}
+
+static void
+init(asm_context *ctx, module *m)
+{
+        symtbl *tbl = m->tbl;
+
+        ctx->stem = modcache_outbase(m);
 
         ctx->tbl              = tbl;
         ctx->modname          = tbl->modname;
+        ctx->unit             = (smap){0};
+        ctx->code             = dyn_array_empty(x64_item_array);
+        ctx->strs             = dyn_array_empty(str_array);
+        ctx->names            = smap_create(NULL);
         ctx->globals          = dyn_array_empty(str_array);
         ctx->data_section     = dyn_array_empty(str_array);
         ctx->externs          = dyn_array_empty(str_array);
-        ctx->pushed_regs      = dyn_array_empty(str_array);
-        ctx->pushed_regs_idxs = dyn_array_empty(int_array);
-        ctx->obj_filepaths    = dyn_array_empty(str_array);
 
-        dyn_array_append(ctx->obj_filepaths, forge_cstr_builder(basename, ".o", NULL));
-
-        write_txt(ctx, "section .text", 1);
+        emit_text(ctx, "section .text");
 }
 
+// ctx->code and ctx->strs stay around for assembling.
 static void
 cleanup(asm_context *ctx)
 {
-        fclose(ctx->out);
         dyn_array_free(ctx->globals);
         dyn_array_free(ctx->data_section);
+        dyn_array_free(ctx->externs);
+        if (ctx->unit.tbl.entries) smap_free(&ctx->unit);
 }
 
 static void
 write_globals(asm_context *ctx)
 {
         for (size_t i = 0; i < ctx->globals.len; ++i) {
-                write_txt(ctx, "global ", 0);
-                if (strcmp(ctx->globals.data[i], "_start") && strcmp(ctx->globals.data[i], "main")) {
-                        write_txt(ctx, ctx->tbl->modname, 0);
-                        write_txt(ctx, "_", 0);
+                const char *id = ctx->globals.data[i];
+                if (strcmp(id, "_start") && strcmp(id, "main")) {
+                        emit_text(ctx, keep(ctx, forge_cstr_builder("global ", ctx->tbl->modname, "_", id, NULL)));
+                } else {
+                        emit_text(ctx, keep(ctx, forge_cstr_builder("global ", id, NULL)));
                 }
-                write_txt(ctx, ctx->globals.data[i], 1);
         }
+        ctx->globals.len = 0;
 }
 
 static void
 write_data_section(asm_context *ctx)
 {
-        write_txt(ctx, "section .data", 1);
+        emit_text(ctx, "section .data");
         for (size_t i = 0; i < ctx->data_section.len; ++i) {
-                take_txt(ctx, ctx->data_section.data[i], 1);
+                emit_text(ctx, keep(ctx, ctx->data_section.data[i]));
         }
 }
 
+// Once each, several modules of a unit may import the same.
 static void
 write_externs(asm_context *ctx)
 {
+        smap seen = smap_create(NULL);
         for (size_t i = 0; i < ctx->externs.len; ++i) {
-                write_txt(ctx, "extern ", 0);
-                take_txt(ctx, ctx->externs.data[i], 1);
+                char *name = ctx->externs.data[i];
+                if (!smap_has(&seen, name)) {
+                        smap_insert(&seen, name, name);
+                        emit_text(ctx, keep(ctx, forge_cstr_builder("extern ", name, NULL)));
+                }
+                free(name);
         }
+        smap_free(&seen);
 }
 
-str_array
-asm_gen(program *p, symtbl *tbl)
+static void
+gen_module(asm_context *ctx, module *m)
 {
-        NOOP(tbl, free_reg, alloc_param_regs);
+        program *p = m->program;
 
-        asm_context ctx = {0};
-        visitor *v = asm_visitor_alloc(&ctx);
-        init((asm_context *)v->context, tbl);
+        ctx->tbl     = m->tbl;
+        ctx->modname = m->tbl->modname;
 
         for (size_t i = 0; i < p->stmts.len; ++i) {
                 stmt *s = p->stmts.data[i];
-                s->accept(s, v);
+                switch (s->kind) {
+                case STMT_KIND_PROC:        gen_proc(ctx, (stmt_proc *)s);               break;
+                case STMT_KIND_EXTERN_PROC: gen_extern_proc(ctx, (stmt_extern_proc *)s); break;
+                case STMT_KIND_IMPORT:      gen_import(ctx, (stmt_import *)s);           break;
+                default:                    break;
+                }
+        }
+
+        write_globals(ctx);
+
+        if ((g_config.flags & FLAG_TYPE_VERBOSE) && ctx->text_bytes) {
+                printf("dce: %s: %d of %d bytes of .text removed\n", ctx->modname,
+                       ctx->dce_bytes, ctx->text_bytes + ctx->dce_bytes);
+        }
+        ctx->text_bytes = ctx->dce_bytes = 0;
+
+        if (g_config.peephole && (g_config.flags & FLAG_TYPE_VERBOSE)) {
+                peephole_report(ctx->modname);
+        }
+}
+
+// The rest of asm_codegen() and asm_codegen_program(), once
+// the code is there.
+static asm_job *
+finish_codegen(asm_job *j)
+{
+        asm_context *ctx = &j->ctx;
+
+        if (!g_generated.tbl.entries) {
+                g_generated = smap_create(NULL);
+        }
+
+        // C comes with all it needs.
+        if (!ctx->text) {
+                write_externs(ctx);
+                write_data_section(ctx);
+                emit_text(ctx, "section .note.GNU-stack");
+        }
+
+        cleanup(ctx);
+
+        // --asm keeps the text even if nasm never needs it.
+        if (g_config.flags & FLAG_TYPE_ASM) {
+                write_asm(ctx);
+        }
+
+        j->obj_fp = forge_cstr_builder(ctx->stem, ".o", NULL);
+        if (g_config.cache_dir) {
+                assemble_cached(j);
+        }
+
+        return j;
+}
+
+asm_job *
+asm_codegen(module *m)
+{
+        asm_job *j = (asm_job *)alloc(sizeof(asm_job));
+        memset(j, 0, sizeof(asm_job));
+
+        asm_context *ctx = &j->ctx;
+        init(ctx, m);
+
+        if (g_config.emit == EMIT_C) {
+                module_array one = dyn_array_empty(module_array);
+                dyn_array_append(one, m);
+                ctx->text = cgen_source(one);
+                dyn_array_free(one);
+        } else {
+                gen_module(ctx, m);
+        }
+
+        return finish_codegen(j);
+}
+
+asm_job *
+asm_codegen_program(module_array mods)
+{
+        module *entry = mods.data[mods.len - 1];
+
+        asm_job *j = (asm_job *)alloc(sizeof(asm_job));
+        memset(j, 0, sizeof(asm_job));
+
+        asm_context *ctx = &j->ctx;
+        init(ctx, entry);
+
+        ctx->unit = smap_create(NULL);
+        for (size_t i = 0; i < mods.len; ++i) {
+                if (mods.data[i]->program) {
+                        smap_insert(&ctx->unit, mods.data[i]->tbl->src_filepath, mods.data[i]);
+                }
         }
 
-        write_globals(&ctx);
-        write_externs(&ctx);
-        write_data_section(&ctx);
-        write_txt(&ctx, "section .note.GNU-stack", 1);
+        // Those from libcrstd.a have no program, their code is
+        // linked from there.
+        module_array unit = dyn_array_empty(module_array);
+        for (size_t i = 0; i < mods.len; ++i) {
+                if (mods.data[i]->program) {
+                        dyn_array_append(unit, mods.data[i]);
+                }
+        }
+        if (g_config.emit == EMIT_C) {
+                ctx->text = cgen_source(unit);
+        } else {
+                for (size_t i = 0; i < unit.len; ++i) {
+                        gen_module(ctx, unit.data[i]);
+                }
+        }
+        dyn_array_free(unit);
 
-        cleanup((asm_context *)v->context);
+        // Messages about the unit name the entry.
+        ctx->tbl     = entry->tbl;
+        ctx->modname = entry->tbl->modname;
 
-        assemble(&ctx);
+        return finish_codegen(j);
+}
+
+char *
+asm_gen(module *m)
+{
+        if (!g_generated.tbl.entries) {
+                g_generated = smap_create(NULL);
+        }
+
+        // Modules imported by more than one program in
+        // a batch are only generated once.
+        char *done = (char *)smap_get(&g_generated, m->tbl->src_filepath);
+        if (done) {
+                return done;
+        }
+
+        asm_job *j = asm_codegen(m);
+        int status = spawn_wait(asm_assemble_start(j));
+        char *obj = asm_assemble_finish(j, status);
+
+        if (!obj) {
+                exit(1);
+        }
 
-        return ctx.obj_filepaths;
+        return obj;
 }
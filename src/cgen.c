@@ -0,0 +1,1196 @@
+#include "cgen.h"
+#include "visitor.h"
+#include "types.h"
+#include "lexer.h"
+#include "kwds.h"
+#include "mem.h"
+#include "reach.h"
+#include "ds/smap.h"
+
+#include <forge/err.h>
+#include <forge/utils.h>
+#include <forge/cstr.h>
+#include <forge/str.h>
+#include <forge/array.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A struct type is known by the members it was declared with,
+// which is all that its type_struct keeps of it.
+typedef struct {
+        const parameter_array *members;
+        char *name;
+} cgen_struct;
+
+DYN_ARRAY_TYPE(cgen_struct, cgen_struct_array);
+
+typedef struct {
+        symtbl *tbl;
+        forge_str *out;      // where visits write: decls or defs
+        forge_str decls;     // types and prototypes, ahead of...
+        forge_str defs;      // ...the procedures
+        smap globals;        // every name at file scope, each declared once
+        smap unit;           // src_filepath of every module in this source
+        cgen_struct_array structs;
+        sym_array locals;    // of the procedure, which embeds refer to by offset
+        type *rettype;       // of the procedure
+        int depth;
+} cgen_context;
+
+// `exit` is the system call, as it is in the native code: it
+// does not go through libc, which may not be there.
+static const char *g_prelude =
+        "#include <stddef.h>\n"
+        "#include <stdint.h>\n"
+        "\n"
+        "static inline _Noreturn void\n"
+        "cruc_exit(int64_t status)\n"
+        "{\n"
+        "        __asm__ volatile(\"syscall\" :: \"a\"(60), \"D\"(status) : \"rcx\", \"r11\", \"memory\");\n"
+        "        __builtin_unreachable();\n"
+        "}\n";
+
+// Names that a crucible identifier cannot keep in C.
+static const char *g_ckwds[] = {
+        "auto", "break", "case", "char", "const", "continue", "default", "do",
+        "double", "else", "enum", "extern", "float", "for", "goto", "if",
+        "inline", "int", "long", "register", "restrict", "return", "short",
+        "signed", "sizeof", "static", "struct", "switch", "typedef", "union",
+        "unsigned", "void", "volatile", "while", "asm", "typeof",
+        "_Bool", "_Noreturn", "_Alignas", "_Alignof", "_Atomic", "_Generic",
+        "_Static_assert", "_Thread_local", "NULL", "offsetof",
+        "int8_t", "int16_t", "int32_t", "int64_t", "uint8_t", "uint16_t",
+        "uint32_t", "uint64_t", "uintptr_t", "size_t", "ptrdiff_t", "cruc_exit",
+};
+
+// Everything the assembly may clobber but rbp and rsp.
+#define EMBED_CLOBBERS "\"rax\", \"rbx\", \"rcx\", \"rdx\", \"rsi\", \"rdi\", " \
+        "\"r8\", \"r9\", \"r10\", \"r11\", \"r12\", \"r13\", \"r14\", \"r15\", " \
+        "\"memory\", \"cc\""
+
+static int
+is_ckwd(const char *s)
+{
+        for (size_t i = 0; i < sizeof(g_ckwds)/sizeof(*g_ckwds); ++i) {
+                if (!strcmp(s, g_ckwds[i])) return 1;
+        }
+        return 0;
+}
+
+// A struct member `id` as C names it.
+static char *
+member_name(const char *id)
+{
+        return is_ckwd(id) ? forge_cstr_builder(id, "_", NULL) : strdup(id);
+}
+
+// A local `id` as C names it, out of the way of keywords
+// and of everything at file scope.
+static char *
+cname(cgen_context *ctx, const char *id)
+{
+        char *s = strdup(id);
+        while (is_ckwd(s) || smap_has(&ctx->globals, s)) {
+                char *t = forge_cstr_builder(s, "_", NULL);
+                free(s);
+                s = t;
+        }
+        return s;
+}
+
+static void
+put(cgen_context *ctx, const char *s)
+{
+        forge_str_concat(ctx->out, s);
+}
+
+// put() that frees `s`.
+static void
+put_free(cgen_context *ctx, char *s)
+{
+        put(ctx, s);
+        free(s);
+}
+
+static void
+indent(cgen_context *ctx)
+{
+        for (int i = 0; i < ctx->depth; ++i) {
+                put(ctx, "        ");
+        }
+}
+
+static void
+gen(visitor *v, expr *e)
+{
+        e->accept(e, v);
+}
+
+static const char *
+struct_name(cgen_context *ctx, const type_struct *t)
+{
+        for (size_t i = 0; i < ctx->structs.len; ++i) {
+                if (ctx->structs.data[i].members == t->members) {
+                        return ctx->structs.data[i].name;
+                }
+        }
+        forge_err("the C backend can only use structs declared in the same source");
+        return NULL; // unreachable
+}
+
+static char *declare(cgen_context *ctx, const type *t, const char *name);
+
+// The parameter list of a procedure type.
+static void
+param_types(cgen_context *ctx, forge_str *s, type_array params, int variadic)
+{
+        for (size_t i = 0; i < params.len; ++i) {
+                if (i) forge_str_concat(s, ", ");
+                char *p = declare(ctx, params.data[i], "");
+                forge_str_concat(s, p);
+                free(p);
+        }
+        if (variadic && params.len) {
+                forge_str_concat(s, ", ...");
+        } else if (!params.len && !variadic) {
+                forge_str_concat(s, "void");
+        }
+}
+
+// The C declaration of `name` as `t`, or the type by itself
+// if `name` is "".
+static char *
+declare(cgen_context *ctx, const type *t, const char *name)
+{
+        static const type u8 = {TYPE_KIND_U8, 1};
+        const char *base = NULL;
+
+        switch (t ? t->kind : TYPE_KIND_VOID) {
+        case TYPE_KIND_I8:       base = "int8_t";   break;
+        case TYPE_KIND_I16:      base = "int16_t";  break;
+        case TYPE_KIND_I32:      base = "int32_t";  break;
+        case TYPE_KIND_I64:      base = "int64_t";  break;
+        case TYPE_KIND_U8:       base = "uint8_t";  break;
+        case TYPE_KIND_U16:      base = "uint16_t"; break;
+        case TYPE_KIND_U32:      base = "uint32_t"; break;
+        case TYPE_KIND_U64:      base = "uint64_t"; break;
+        case TYPE_KIND_SIZET:    base = "size_t";   break;
+        case TYPE_KIND_NUMBER:   base = "int32_t";  break;
+        case TYPE_KIND_BOOL:     base = "uint8_t";  break;
+        case TYPE_KIND_VOID:
+        case TYPE_KIND_NORETURN: base = "void";     break;
+        case TYPE_KIND_STRUCT:   base = struct_name(ctx, (const type_struct *)t); break;
+        case TYPE_KIND_STR:
+        case TYPE_KIND_PTR:
+        case TYPE_KIND_LIST: {
+                // Lists are pointers to their first element.
+                const type *to = t->kind == TYPE_KIND_PTR  ? ((const type_ptr *)t)->to
+                               : t->kind == TYPE_KIND_LIST ? ((const type_list *)t)->elemty
+                               : &u8;
+                char *inner = forge_cstr_builder("*", name, NULL);
+                char *s = declare(ctx, to, inner);
+                free(inner);
+                return s;
+        }
+        case TYPE_KIND_PROC:
+        case TYPE_KIND_PROCPTR: {
+                type_array params = dyn_array_empty(type_array);
+                type *rettype = NULL;
+                int variadic = 0;
+
+                if (t->kind == TYPE_KIND_PROC) {
+                        type_get_types_from_proc((const type_proc *)t, &params, &rettype);
+                        variadic = ((const type_proc *)t)->variadic;
+                } else {
+                        params = ((const type_procptr *)t)->param_types;
+                        rettype = ((const type_procptr *)t)->rettype;
+                        variadic = ((const type_procptr *)t)->variadic;
+                }
+
+                forge_str s = forge_str_create();
+                forge_str_concat(&s, "(*");
+                forge_str_concat(&s, name);
+                forge_str_concat(&s, ")(");
+                param_types(ctx, &s, params, variadic);
+                forge_str_append(&s, ')');
+
+                if (t->kind == TYPE_KIND_PROC) {
+                        dyn_array_free(params);
+                }
+
+                char *r = declare(ctx, rettype, s.data);
+                forge_str_destroy(&s);
+                return r;
+        }
+        default:
+                forge_err_wargs("the C backend has no type for `%s`", type_to_cstr(t));
+        }
+
+        return *name ? forge_cstr_builder(base, " ", name, NULL) : strdup(base);
+}
+
+// The declarator of the procedure `name`, naming its parameters
+// if it is to be defined.
+static char *
+signature(cgen_context  *ctx,
+          const char    *name,
+          const parameter_array *params,
+          int            variadic,
+          type          *rettype,
+          int            define)
+{
+        forge_str s = forge_str_create();
+        forge_str_concat(&s, name);
+        forge_str_append(&s, '(');
+
+        for (size_t i = 0; i < params->len; ++i) {
+                char *pname = define ? cname(ctx, params->data[i].id->lx) : strdup("");
+                char *p = declare(ctx, params->data[i].type, pname);
+                if (i) forge_str_concat(&s, ", ");
+                forge_str_concat(&s, p);
+                free(pname);
+                free(p);
+        }
+        if (variadic && params->len) {
+                forge_str_concat(&s, ", ...");
+        } else if (!params->len && !variadic) {
+                forge_str_concat(&s, "void");
+        }
+        forge_str_append(&s, ')');
+
+        char *r = declare(ctx, rettype, s.data);
+        forge_str_destroy(&s);
+
+        if (rettype->kind == TYPE_KIND_NORETURN) {
+                char *nr = forge_cstr_builder("_Noreturn ", r, NULL);
+                free(r);
+                r = nr;
+        }
+        return r;
+}
+
+// `e` where a `to` is expected. C converts numbers by itself,
+// pointers of another type are cast as the native code
+// does not care.
+static void
+conv(visitor *v, expr *e, type *to)
+{
+        cgen_context *ctx = (cgen_context *)v->context;
+
+        if (to && (to->kind == TYPE_KIND_PTR || to->kind == TYPE_KIND_LIST
+                   || to->kind == TYPE_KIND_PROCPTR || to->kind == TYPE_KIND_STR)) {
+                char *want = declare(ctx, to, "");
+                char *have = declare(ctx, e->type, "");
+                int same = !strcmp(want, have);
+                free(have);
+
+                if (!same) {
+                        put(ctx, "((");
+                        put_free(ctx, want);
+                        put(ctx, ")");
+                        gen(v, e);
+                        put(ctx, ")");
+                        return;
+                }
+                free(want);
+        }
+
+        gen(v, e);
+}
+
+// Whether arithmetic on `t` wraps at its width, which C has
+// to be told with a cast after promoting it to int.
+static int
+is_integer(const type *t)
+{
+        return t && t->kind <= TYPE_KIND_NUMBER;
+}
+
+// `ptr <op> n`, for the operators that C has no pointer
+// arithmetic for: the native code scales n and goes on.
+static void
+ptr_arith(visitor *v, expr *ptr, const char *op, expr *n)
+{
+        cgen_context *ctx = (cgen_context *)v->context;
+        char sz[32];
+        snprintf(sz, sizeof(sz), "%d", ((type_ptr *)ptr->type)->to ? ((type_ptr *)ptr->type)->to->sz : 1);
+
+        put(ctx, "((");
+        put_free(ctx, declare(ctx, ptr->type, ""));
+        put(ctx, ")((uintptr_t)");
+        gen(v, ptr);
+        put(ctx, " ");
+        put(ctx, op);
+        put(ctx, " (uintptr_t)");
+        gen(v, n);
+        put(ctx, " * ");
+        put(ctx, sz);
+        put(ctx, "))");
+}
+
+static void *
+visit_expr_binary(visitor *v, expr_bin *e)
+{
+        cgen_context *ctx = (cgen_context *)v->context;
+        token_type op = e->op->ty;
+        type *ty = ((expr *)e)->type;
+
+        if ((op == TOKEN_TYPE_ASTERISK || op == TOKEN_TYPE_FORWARDSLASH || op == TOKEN_TYPE_PERCENT)
+            && (e->lhs->type->kind == TYPE_KIND_PTR || e->rhs->type->kind == TYPE_KIND_PTR)) {
+                int lptr = e->lhs->type->kind == TYPE_KIND_PTR;
+                ptr_arith(v, lptr ? e->lhs : e->rhs, e->op->lx, lptr ? e->rhs : e->lhs);
+                return NULL;
+        }
+
+        // Pointer arithmetic is scaled in C as it is natively.
+        int wrap = is_integer(ty);
+        if (wrap) {
+                put(ctx, "((");
+                put_free(ctx, declare(ctx, ty, ""));
+                put(ctx, ")");
+        }
+        put(ctx, "(");
+        gen(v, e->lhs);
+        put(ctx, " ");
+        put(ctx, e->op->lx);
+        put(ctx, " ");
+        gen(v, e->rhs);
+        put(ctx, ")");
+        if (wrap) {
+                put(ctx, ")");
+        }
+
+        return NULL;
+}
+
+static void *
+visit_expr_identifier(visitor *v, expr_identifier *e)
+{
+        cgen_context *ctx = (cgen_context *)v->context;
+        const sym *s = e->resolved;
+
+        assert(s);
+
+        if (s->extern_) {
+                put(ctx, e->id->lx);
+        } else if (s->ty->kind == TYPE_KIND_PROC) {
+                put_free(ctx, reach_symbol(s->modname, e->id->lx));
+        } else {
+                put_free(ctx, cname(ctx, e->id->lx));
+        }
+
+        return NULL;
+}
+
+static void *
+visit_expr_integer_literal(visitor *v, expr_integer_literal *e)
+{
+        cgen_context *ctx = (cgen_context *)v->context;
+        put(ctx, e->i->lx);
+        return NULL;
+}
+
+static void *
+visit_expr_string_literal(visitor *v, expr_string_literal *e)
+{
+        cgen_context *ctx = (cgen_context *)v->context;
+
+        put(ctx, "((uint8_t *)\"");
+        for (const unsigned char *p = (const unsigned char *)e->s->lx; *p; ++p) {
+                char buf[8];
+                switch (*p) {
+                case '\\': put(ctx, "\\\\"); break;
+                case '"':  put(ctx, "\\\""); break;
+                case '\n': put(ctx, "\\n");  break;
+                case '\t': put(ctx, "\\t");  break;
+                default:
+                        if (*p < ' ' || *p >= 0x7f) {
+                                snprintf(buf, sizeof(buf), "\\%03o", *p);
+                                put(ctx, buf);
+                        } else {
+                                forge_str_append(ctx->out, (char)*p);
+                        }
+                }
+        }
+        put(ctx, "\")");
+
+        return NULL;
+}
+
+static void *
+visit_expr_proccall(visitor *v, expr_proccall *e)
+{
+        cgen_context *ctx = (cgen_context *)v->context;
+
+        type_array params = dyn_array_empty(type_array);
+        type *rettype = NULL;
+        int owned = 0;
+
+        assert(e->lhs->type->kind == TYPE_KIND_PROC || e->lhs->type->kind == TYPE_KIND_PROCPTR);
+
+        if (e->lhs->type->kind == TYPE_KIND_PROC) {
+                type_get_types_from_proc((type_proc *)e->lhs->type, &params, &rettype);
+                owned = 1;
+        } else {
+                params = ((type_procptr *)e->lhs->type)->param_types;
+        }
+
+        gen(v, e->lhs);
+        put(ctx, "(");
+        for (size_t i = 0; i < e->args.len; ++i) {
+                if (i) put(ctx, ", ");
+                // Variadic arguments are promoted as C does it.
+                conv(v, e->args.data[i], i < params.len ? params.data[i] : NULL);
+        }
+        put(ctx, ")");
+
+        if (owned) {
+                dyn_array_free(params);
+        }
+
+        return NULL;
+}
+
+static void *
+visit_expr_mut(visitor *v, expr_mut *e)
+{
+        cgen_context *ctx = (cgen_context *)v->context;
+        token_type op = e->op->ty;
+
+        if ((op == TOKEN_TYPE_ASTERISK_EQUALS || op == TOKEN_TYPE_FORWARDSLASH_EQUALS || op == TOKEN_TYPE_PERCENT_EQUALS)
+            && e->lhs->type->kind == TYPE_KIND_PTR) {
+                char bin[2] = {e->op->lx[0], 0};
+                put(ctx, "(");
+                gen(v, e->lhs);
+                put(ctx, " = ");
+                ptr_arith(v, e->lhs, bin, e->rhs);
+                put(ctx, ")");
+                return NULL;
+        }
+
+        put(ctx, "(");
+        gen(v, e->lhs);
+        put(ctx, " ");
+        put(ctx, e->op->lx);
+        put(ctx, " ");
+        if (op == TOKEN_TYPE_EQUALS) {
+                conv(v, e->rhs, e->lhs->type);
+        } else {
+                gen(v, e->rhs);
+        }
+        put(ctx, ")");
+
+        return NULL;
+}
+
+static type *
+member_type(const type_struct *t, const char *id)
+{
+        for (size_t i = 0; i < t->members->len; ++i) {
+                if (!strcmp(t->members->data[i].id->lx, id)) {
+                        return t->members->data[i].type;
+                }
+        }
+        return NULL;
+}
+
+static void *
+visit_expr_brace_init(visitor *v, expr_brace_init *e)
+{
+        cgen_context *ctx = (cgen_context *)v->context;
+        const type_struct *ty = (const type_struct *)((expr *)e)->type;
+
+        put(ctx, "((");
+        put(ctx, struct_name(ctx, ty));
+        put(ctx, "){");
+        for (size_t i = 0; i < e->exprs.len; ++i) {
+                put(ctx, i ? ", ." : " .");
+                put_free(ctx, member_name(e->ids.data[i]->lx));
+                put(ctx, " = ");
+                conv(v, e->exprs.data[i], member_type(ty, e->ids.data[i]->lx));
+        }
+        put(ctx, " })");
+
+        return NULL;
+}
+
+static void *
+visit_expr_namespace(visitor *v, expr_namespace *e)
+{
+        gen(v, e->e);
+        return NULL;
+}
+
+// A compound literal, which lives as long as the block it is
+// in, like the stack slots of the native code. The expressions
+// come last element first, as they are stored.
+static void *
+visit_expr_arrayinit(visitor *v, expr_arrayinit *e)
+{
+        cgen_context *ctx = (cgen_context *)v->context;
+        type_list *ty = (type_list *)((expr *)e)->type;
+        int len = ty->len > (int)e->exprs.len ? ty->len : (int)e->exprs.len;
+        char buf[32];
+
+        snprintf(buf, sizeof(buf), "[%d]", len);
+
+        put(ctx, "((");
+        put_free(ctx, declare(ctx, ty->elemty, buf));
+        put(ctx, "){");
+        if (e->exprs.len == 0) {
+                put(ctx, "0");
+        }
+        for (size_t i = e->exprs.len; i-- > 0;) {
+                snprintf(buf, sizeof(buf), "[%d] = ", len - 1 - (int)i);
+                put(ctx, buf);
+                conv(v, e->exprs.data[i], ty->elemty);
+                if (i) put(ctx, ", ");
+        }
+        put(ctx, "})");
+
+        return NULL;
+}
+
+static void *
+visit_expr_index(visitor *v, expr_index *e)
+{
+        cgen_context *ctx = (cgen_context *)v->context;
+
+        gen(v, e->lhs);
+        put(ctx, "[");
+        gen(v, e->idx);
+        put(ctx, "]");
+
+        return NULL;
+}
+
+static void *
+visit_expr_un(visitor *v, expr_un *e)
+{
+        cgen_context *ctx = (cgen_context *)v->context;
+        type *ty = ((expr *)e)->type;
+        int wrap = (e->op->ty == TOKEN_TYPE_MINUS || e->op->ty == TOKEN_TYPE_TILDE) && is_integer(ty);
+
+        if (wrap) {
+                put(ctx, "((");
+                put_free(ctx, declare(ctx, ty, ""));
+                put(ctx, ")");
+        }
+        put(ctx, "(");
+        put(ctx, e->op->lx);
+        gen(v, e->rhs);
+        put(ctx, ")");
+        if (wrap) {
+                put(ctx, ")");
+        }
+
+        return NULL;
+}
+
+static void *
+visit_expr_character_literal(visitor                *v,
+                             expr_character_literal *e)
+{
+        cgen_context *ctx = (cgen_context *)v->context;
+        char buf[8];
+        snprintf(buf, sizeof(buf), "%d", (unsigned char)e->c->lx[0]);
+        put(ctx, buf);
+        return NULL;
+}
+
+static void *
+visit_expr_cast(visitor *v, expr_cast *e)
+{
+        cgen_context *ctx = (cgen_context *)v->context;
+
+        put(ctx, "((");
+        put_free(ctx, declare(ctx, ((expr *)e)->type, ""));
+        put(ctx, ")");
+        gen(v, e->rhs);
+        put(ctx, ")");
+
+        return NULL;
+}
+
+static void *
+visit_expr_bool_literal(visitor *v, expr_bool_literal *e)
+{
+        cgen_context *ctx = (cgen_context *)v->context;
+        put(ctx, strcmp(e->b->lx, KWD_TRUE) == 0 ? "1" : "0");
+        return NULL;
+}
+
+static void *
+visit_expr_null(visitor *v, expr_null *e)
+{
+        NOOP(e);
+        cgen_context *ctx = (cgen_context *)v->context;
+        put(ctx, "((void *)0)");
+        return NULL;
+}
+
+// `let` without the statement around it, which is also what
+// goes into the first clause of `for`.
+static void
+let_decl(visitor *v, stmt_let *s)
+{
+        cgen_context *ctx = (cgen_context *)v->context;
+        char *name = cname(ctx, s->id->lx);
+
+        dyn_array_append(ctx->locals, s->resolved);
+
+        put_free(ctx, declare(ctx, s->type, name));
+        put(ctx, " = ");
+        conv(v, s->e, s->type);
+
+        free(name);
+}
+
+static void *
+visit_stmt_let(visitor *v, stmt_let *s)
+{
+        cgen_context *ctx = (cgen_context *)v->context;
+
+        indent(ctx);
+        let_decl(v, s);
+        put(ctx, ";\n");
+
+        return NULL;
+}
+
+static void *
+visit_stmt_expr(visitor *v, stmt_expr *s)
+{
+        cgen_context *ctx = (cgen_context *)v->context;
+
+        indent(ctx);
+        gen(v, s->e);
+        put(ctx, ";\n");
+
+        return NULL;
+}
+
+// ` { <s> }` as the body of a procedure or statement, without
+// a block of its own if `s` is one.
+static void
+body(visitor *v, stmt *s)
+{
+        cgen_context *ctx = (cgen_context *)v->context;
+
+        put(ctx, " {\n");
+        ++ctx->depth;
+        if (s->kind == STMT_KIND_BLOCK) {
+                stmt_block *blk = (stmt_block *)s;
+                for (size_t i = 0; i < blk->stmts.len; ++i) {
+                        blk->stmts.data[i]->accept(blk->stmts.data[i], v);
+                }
+        } else {
+                s->accept(s, v);
+        }
+        --ctx->depth;
+        indent(ctx);
+        put(ctx, "}");
+}
+
+static void *
+visit_stmt_block(visitor *v, stmt_block *s)
+{
+        cgen_context *ctx = (cgen_context *)v->context;
+
+        indent(ctx);
+        put(ctx, "{\n");
+        ++ctx->depth;
+        for (size_t i = 0; i < s->stmts.len; ++i) {
+                stmt *stmt = s->stmts.data[i];
+                stmt->accept(stmt, v);
+        }
+        --ctx->depth;
+        indent(ctx);
+        put(ctx, "}\n");
+
+        return NULL;
+}
+
+static void *
+visit_stmt_proc(visitor *v, stmt_proc *s)
+{
+        cgen_context *ctx = (cgen_context *)v->context;
+
+        char *symbol = reach_symbol(ctx->tbl->modname, s->id->lx);
+        if (!reach_is_live(symbol)) {
+                free(symbol);
+                return NULL;
+        }
+
+        ctx->locals.len = 0;
+        ctx->rettype = s->type;
+        for (size_t i = 0; i < s->params.len; ++i) {
+                assert(s->params.data[i].resolved);
+                dyn_array_append(ctx->locals, s->params.data[i].resolved);
+        }
+
+        put(ctx, "\n");
+        // The kernel enters with the stack aligned to 16 bytes,
+        // a call leaves it 8 off.
+        if (!strcmp(s->id->lx, "_start")) {
+                put(ctx, "__attribute__((force_align_arg_pointer))\n");
+        }
+        if (!s->export) {
+                put(ctx, "static ");
+        }
+        put_free(ctx, signature(ctx, symbol, &s->params, s->variadic, s->type, 1));
+        body(v, s->blk);
+        put(ctx, "\n");
+
+        free(symbol);
+        return NULL;
+}
+
+static void *
+visit_stmt_return(visitor *v, stmt_return *s)
+{
+        cgen_context *ctx = (cgen_context *)v->context;
+
+        indent(ctx);
+        if (s->e) {
+                put(ctx, "return ");
+                conv(v, s->e, ctx->rettype);
+                put(ctx, ";\n");
+        } else {
+                put(ctx, "return;\n");
+        }
+
+        return NULL;
+}
+
+static void *
+visit_stmt_exit(visitor *v, stmt_exit *s)
+{
+        cgen_context *ctx = (cgen_context *)v->context;
+
+        indent(ctx);
+        put(ctx, "cruc_exit(");
+        if (s->e) {
+                gen(v, s->e);
+        } else {
+                put(ctx, "0");
+        }
+        put(ctx, ");\n");
+
+        return NULL;
+}
+
+static void *
+visit_stmt_extern_proc(visitor *v, stmt_extern_proc *s)
+{
+        NOOP(v, s);
+        return NULL;
+}
+
+static void *
+visit_stmt_if(visitor *v, stmt_if *s)
+{
+        cgen_context *ctx = (cgen_context *)v->context;
+
+        indent(ctx);
+        put(ctx, "if (");
+        for (;;) {
+                gen(v, s->e);
+                put(ctx, ")");
+                body(v, s->then);
+
+                if (!s->else_) {
+                        break;
+                }
+                if (s->else_->kind == STMT_KIND_IF) {
+                        s = (stmt_if *)s->else_;
+                        put(ctx, " else if (");
+                        continue;
+                }
+                put(ctx, " else");
+                body(v, s->else_);
+                break;
+        }
+        put(ctx, "\n");
+
+        return NULL;
+}
+
+static void *
+visit_stmt_while(visitor *v, stmt_while *s)
+{
+        cgen_context *ctx = (cgen_context *)v->context;
+
+        indent(ctx);
+        put(ctx, "while (");
+        gen(v, s->e);
+        put(ctx, ")");
+        body(v, s->body);
+        put(ctx, "\n");
+
+        return NULL;
+}
+
+static void *
+visit_stmt_for(visitor *v, stmt_for *s)
+{
+        cgen_context *ctx = (cgen_context *)v->context;
+
+        indent(ctx);
+        put(ctx, "for (");
+        switch (s->init->kind) {
+        case STMT_KIND_LET:   let_decl(v, (stmt_let *)s->init);   break;
+        case STMT_KIND_EXPR:  gen(v, ((stmt_expr *)s->init)->e); break;
+        case STMT_KIND_EMPTY: break;
+        default: forge_err_wargs("the C backend cannot begin a `for` with a statement of kind `%d`", (int)s->init->kind);
+        }
+        put(ctx, "; ");
+        if (s->e) gen(v, s->e);
+        put(ctx, "; ");
+        if (s->after) gen(v, s->after);
+        put(ctx, ")");
+        body(v, s->body);
+        put(ctx, "\n");
+
+        return NULL;
+}
+
+static void *
+visit_stmt_break(visitor *v, stmt_break *s)
+{
+        NOOP(s);
+        cgen_context *ctx = (cgen_context *)v->context;
+        indent(ctx);
+        put(ctx, "break;\n");
+        return NULL;
+}
+
+static void *
+visit_stmt_continue(visitor *v, stmt_continue *s)
+{
+        NOOP(s);
+        cgen_context *ctx = (cgen_context *)v->context;
+        indent(ctx);
+        put(ctx, "continue;\n");
+        return NULL;
+}
+
+static void *
+visit_stmt_struct(visitor *v, stmt_struct *s)
+{
+        NOOP(v, s);
+        return NULL;
+}
+
+static void *
+visit_stmt_module(visitor *v, stmt_module *s)
+{
+        NOOP(v, s);
+        return NULL;
+}
+
+static void *
+visit_stmt_import(visitor *v, stmt_import *s)
+{
+        NOOP(v, s);
+        return NULL;
+}
+
+// The local that semantic analysis turned `{name}` into
+// `[rbp-<offset>]` for.
+static const sym *
+local_at(cgen_context *ctx, int offset)
+{
+        for (size_t i = ctx->locals.len; i-- > 0;) {
+                if (ctx->locals.data[i]->stack_offset == offset) {
+                        return ctx->locals.data[i];
+                }
+        }
+        return NULL;
+}
+
+// Extended asm in Intel syntax (cc gets -masm=intel), with
+// each local it names as an operand that it may change.
+static void *
+visit_stmt_embed(visitor *v, stmt_embed *s)
+{
+        cgen_context *ctx = (cgen_context *)v->context;
+        sym_array used = dyn_array_empty(sym_array);
+
+        indent(ctx);
+        put(ctx, "__asm__ volatile(\n");
+        ++ctx->depth;
+
+        for (size_t i = 0; i < s->lns.len; ++i) {
+                const char *ln = s->lns.data[i]->lx;
+                size_t n = strcspn(ln, "\n");
+
+                indent(ctx);
+                put(ctx, "\"");
+                for (size_t j = 0; j < n; ++j) {
+                        int offset = 0, len = 0;
+                        const sym *local = NULL;
+
+                        if (sscanf(ln + j, "[rbp-%d]%n", &offset, &len) == 1 && len > 0
+                            && (local = local_at(ctx, offset))) {
+                                size_t k = 0;
+                                while (k < used.len && used.data[k] != local) ++k;
+                                if (k == used.len) dyn_array_append(used, (sym *)local);
+
+                                put(ctx, "%[");
+                                put_free(ctx, cname(ctx, local->id));
+                                put(ctx, "]");
+                                j += len - 1;
+                                continue;
+                        }
+
+                        switch (ln[j]) {
+                        case '%':  put(ctx, "%%");   break;
+                        case '"':  put(ctx, "\\\""); break;
+                        case '\\': put(ctx, "\\\\"); break;
+                        default:   forge_str_append(ctx->out, ln[j]);
+                        }
+                }
+                put(ctx, "\\n\\t\"\n");
+        }
+
+        indent(ctx);
+        put(ctx, ":");
+        for (size_t i = 0; i < used.len; ++i) {
+                char *name = cname(ctx, used.data[i]->id);
+                put(ctx, i ? ", [" : " [");
+                put(ctx, name);
+                put(ctx, "] \"+m\"(*(char (*)[])&");
+                put(ctx, name);
+                put(ctx, ")");
+                free(name);
+        }
+        put(ctx, "\n");
+        indent(ctx);
+        put(ctx, ":\n");
+        indent(ctx);
+        put(ctx, ": " EMBED_CLOBBERS ");\n");
+        --ctx->depth;
+
+        dyn_array_free(used);
+        return NULL;
+}
+
+static void *
+visit_stmt_empty(visitor *v, stmt_empty *s)
+{
+        NOOP(v, s);
+        return NULL;
+}
+
+static visitor *
+cgen_visitor_alloc(cgen_context *ctx)
+{
+        return visitor_alloc(
+                (void *)ctx,
+                visit_expr_binary,
+                visit_expr_identifier,
+                visit_expr_integer_literal,
+                visit_expr_string_literal,
+                visit_expr_proccall,
+                visit_expr_mut,
+                visit_expr_brace_init,
+                visit_expr_namespace,
+                visit_expr_arrayinit,
+                visit_expr_index,
+                visit_expr_un,
+                visit_expr_character_literal,
+                visit_expr_cast,
+                visit_expr_bool_literal,
+                visit_expr_null,
+
+                visit_stmt_let,
+                visit_stmt_expr,
+                visit_stmt_block,
+                visit_stmt_proc,
+                visit_stmt_return,
+                visit_stmt_exit,
+                visit_stmt_extern_proc,
+                visit_stmt_if,
+                visit_stmt_while,
+                visit_stmt_for,
+                visit_stmt_break,
+                visit_stmt_continue,
+                visit_stmt_struct,
+                visit_stmt_module,
+                visit_stmt_import,
+                visit_stmt_embed,
+                visit_stmt_empty
+        );
+}
+
+// A prototype, once per name.
+static void
+prototype(cgen_context          *ctx,
+          const char            *name,
+          const parameter_array *params,
+          int                    variadic,
+          type                  *rettype,
+          int                    local)
+{
+        if (smap_has(&ctx->globals, name)) return;
+        smap_insert(&ctx->globals, name, (void *)name);
+
+        if (local) put(ctx, "static ");
+        put_free(ctx, signature(ctx, name, params, variadic, rettype, 0));
+        put(ctx, ";\n");
+}
+
+static void
+declare_struct(cgen_context *ctx, stmt_struct *s)
+{
+        cgen_struct st = {
+                .members = &s->members,
+                .name    = forge_cstr_builder(ctx->tbl->modname, "_", s->id->lx, NULL),
+        };
+        dyn_array_append(ctx->structs, st);
+        smap_insert(&ctx->globals, st.name, st.name);
+
+        put(ctx, "typedef struct {\n");
+        for (size_t i = 0; i < s->members.len; ++i) {
+                char *name = member_name(s->members.data[i].id->lx);
+                put(ctx, "        ");
+                put_free(ctx, declare(ctx, s->members.data[i].type, name));
+                put(ctx, ";\n");
+                free(name);
+        }
+        put(ctx, "} ");
+        put(ctx, st.name);
+        put(ctx, ";\n");
+}
+
+// What asm.c declares extern for an import.
+static void
+declare_imports(cgen_context *ctx, stmt_import *s)
+{
+        for (size_t i = 0; i < s->resolved_tbls.len; ++i) {
+                symtbl *import_tbl = s->resolved_tbls.data[i];
+
+                // Defined in this source.
+                if (smap_has(&ctx->unit, import_tbl->src_filepath)) {
+                        continue;
+                }
+
+                for (size_t j = 0; j < import_tbl->export_syms.len; ++j) {
+                        const sym *sym = import_tbl->export_syms.data[j];
+                        if (sym->ty->kind != TYPE_KIND_PROC) continue;
+
+                        const type_proc *ty = (const type_proc *)sym->ty;
+                        char *name = ty->extern_
+                                ? strdup(sym->id)
+                                : reach_symbol(s->resolved_modnames.data[i], sym->id);
+                        if (reach_is_live(name)) {
+                                prototype(ctx, name, ty->params, ty->variadic, ty->rettype, 0);
+                        }
+                        free(name);
+                }
+        }
+}
+
+// Everything at file scope that the procedures of `m` may
+// refer to, before any of them.
+static void
+declare_module(cgen_context *ctx, module *m)
+{
+        program *p = m->program;
+
+        ctx->tbl = m->tbl;
+
+        for (size_t i = 0; i < p->stmts.len; ++i) {
+                stmt *s = p->stmts.data[i];
+                switch (s->kind) {
+                case STMT_KIND_STRUCT:
+                        declare_struct(ctx, (stmt_struct *)s);
+                        break;
+                case STMT_KIND_IMPORT:
+                        declare_imports(ctx, (stmt_import *)s);
+                        break;
+                case STMT_KIND_EXTERN_PROC: {
+                        stmt_extern_proc *ep = (stmt_extern_proc *)s;
+                        if (reach_is_live(ep->id->lx)) {
+                                prototype(ctx, ep->id->lx, &ep->params, ep->variadic, ep->type, 0);
+                        }
+                } break;
+                case STMT_KIND_PROC: {
+                        stmt_proc *sp = (stmt_proc *)s;
+                        char *symbol = reach_symbol(m->tbl->modname, sp->id->lx);
+                        if (reach_is_live(symbol)) {
+                                prototype(ctx, symbol, &sp->params, sp->variadic, sp->type, !sp->export);
+                        }
+                        free(symbol);
+                } break;
+                default: break;
+                }
+        }
+}
+
+char *
+cgen_source(module_array mods)
+{
+        cgen_context ctx;
+        memset(&ctx, 0, sizeof(ctx));
+
+        ctx.decls   = forge_str_create();
+        ctx.defs    = forge_str_create();
+        ctx.globals = smap_create(NULL);
+        ctx.unit    = smap_create(NULL);
+        ctx.structs = dyn_array_empty(cgen_struct_array);
+        ctx.locals  = dyn_array_empty(sym_array);
+
+        for (size_t i = 0; i < mods.len; ++i) {
+                smap_insert(&ctx.unit, mods.data[i]->tbl->src_filepath, mods.data[i]);
+        }
+
+        ctx.out = &ctx.decls;
+        for (size_t i = 0; i < mods.len; ++i) {
+                declare_module(&ctx, mods.data[i]);
+        }
+
+        visitor *v = cgen_visitor_alloc(&ctx);
+
+        ctx.out = &ctx.defs;
+        for (size_t i = 0; i < mods.len; ++i) {
+                program *p = mods.data[i]->program;
+                ctx.tbl = mods.data[i]->tbl;
+                for (size_t j = 0; j < p->stmts.len; ++j) {
+                        stmt *s = p->stmts.data[j];
+                        s->accept(s, v);
+                }
+        }
+
+        forge_str src = forge_str_create();
+        for (size_t i = 0; i < mods.len; ++i) {
+                forge_str_concat(&src, "// ");
+                forge_str_concat(&src, mods.data[i]->src_filepath);
+                forge_str_concat(&src, ", generated by cruc --emit=c\n");
+        }
+        forge_str_concat(&src, g_prelude);
+        if (ctx.decls.data) {
+                forge_str_concat(&src, "\n");
+                forge_str_concat(&src, ctx.decls.data);
+        }
+        if (ctx.defs.data) {
+                forge_str_concat(&src, ctx.defs.data);
+        }
+
+        for (size_t i = 0; i < ctx.structs.len; ++i) {
+                free(ctx.structs.data[i].name);
+        }
+        dyn_array_free(ctx.structs);
+        dyn_array_free(ctx.locals);
+        smap_free(&ctx.globals);
+        smap_free(&ctx.unit);
+        forge_str_destroy(&ctx.decls);
+        forge_str_destroy(&ctx.defs);
+        free(v);
+
+        return src.data;
+}
@@ -0,0 +1,329 @@
+#include "ir.h"
+#include "mem.h"
+
+#include <forge/array.h>
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Whether what `in` computes may go if nothing reads it.
+// Stores, calls, embeds and division, which traps on 0, are
+// there for what they do.
+static int
+pure(const ir_insn *in)
+{
+        switch (in->op) {
+        case IR_CONST: case IR_SYM: case IR_STR: case IR_SLOTADDR: case IR_PARAM:
+        case IR_LDSLOT: case IR_LOAD: case IR_ADD: case IR_SUB: case IR_MUL:
+        case IR_NEG: case IR_NOT: case IR_EQ: case IR_NE: case IR_LT: case IR_GT:
+        case IR_LE: case IR_GE: case IR_EXT: case IR_MOV: case IR_PHI:
+                return 1;
+        default:
+                return 0;
+        }
+}
+
+static void
+free_insn(ir_insn *in)
+{
+        free(in->args);
+        free(in->preds);
+}
+
+// Removes the edge from `from` to `to`, and what the phis of
+// `to` have for it.
+static void
+remove_edge(ir_proc *p, int from, int to)
+{
+        ir_block *b = &p->blocks.data[to];
+        size_t k = 0;
+
+        while (k < b->preds.len && b->preds.data[k] != from) ++k;
+        assert(k < b->preds.len);
+        memmove(&b->preds.data[k], &b->preds.data[k + 1], (b->preds.len - k - 1) * sizeof(int));
+        --b->preds.len;
+
+        for (size_t j = 0; j < b->insns.len && b->insns.data[j].op == IR_PHI; ++j) {
+                ir_insn *phi = &b->insns.data[j];
+                for (int i = 0; i < phi->nargs; ++i) {
+                        if (phi->preds[i] == from) {
+                                memmove(&phi->args[i], &phi->args[i + 1], (phi->nargs - i - 1) * sizeof(int));
+                                memmove(&phi->preds[i], &phi->preds[i + 1], (phi->nargs - i - 1) * sizeof(int));
+                                --phi->nargs;
+                                break;
+                        }
+                }
+        }
+}
+
+// The instruction that defines every virtual register, or NULL.
+static const ir_insn **
+find_defs(const ir_proc *p)
+{
+        const ir_insn **defs = (const ir_insn **)alloc((p->nvregs + 1) * sizeof(ir_insn *));
+        memset(defs, 0, (p->nvregs + 1) * sizeof(ir_insn *));
+
+        for (size_t i = 0; i < p->blocks.len; ++i) {
+                const ir_block *b = &p->blocks.data[i];
+                for (size_t j = 0; j < b->insns.len; ++j) {
+                        if (b->insns.data[j].dst >= 0) {
+                                defs[b->insns.data[j].dst] = &b->insns.data[j];
+                        }
+                }
+        }
+        return defs;
+}
+
+// A branch on a constant only goes one way.
+static void
+fold_branches(ir_proc *p)
+{
+        const ir_insn **defs = find_defs(p);
+
+        for (size_t i = 0; i < p->blocks.len; ++i) {
+                ir_block *b = &p->blocks.data[i];
+                ir_insn *t = &b->insns.data[b->insns.len - 1];
+                if (t->op != IR_BR || !defs[t->a] || defs[t->a]->op != IR_CONST) {
+                        continue;
+                }
+
+                uint64_t mask = t->sz >= 8 ? ~(uint64_t)0 : ((uint64_t)1 << (8 * t->sz)) - 1;
+                int k = ((uint64_t)defs[t->a]->imm & mask) ? 0 : 1;
+
+                remove_edge(p, (int)i, b->succ[1 - k]);
+                b->succ[0] = b->succ[k];
+                b->succ[1] = -1;
+                t->op = IR_JMP;
+                t->sz = 0;
+                t->a = -1;
+        }
+
+        free(defs);
+}
+
+// What the entry does not reach: code after a return, exit,
+// break, continue or call that does not return, and the other
+// side of a branch that was folded.
+static void
+remove_unreachable(ir_proc *p)
+{
+        size_t n = p->blocks.len;
+        int *map = (int *)alloc(n * sizeof(int));
+        int *stack = (int *)alloc(n * sizeof(int));
+        int top = 0, m = 0;
+
+        memset(map, 0, n * sizeof(int));
+        map[0] = 1;
+        stack[top++] = 0;
+        while (top) {
+                const ir_block *b = &p->blocks.data[stack[--top]];
+                for (int k = 0; k < 2; ++k) {
+                        if (b->succ[k] >= 0 && !map[b->succ[k]]) {
+                                map[b->succ[k]] = 1;
+                                stack[top++] = b->succ[k];
+                        }
+                }
+        }
+
+        for (size_t i = 0; i < n; ++i) {
+                const ir_block *b = &p->blocks.data[i];
+                if (map[i]) continue;
+                for (int k = 0; k < 2; ++k) {
+                        if (b->succ[k] >= 0 && map[b->succ[k]]) {
+                                remove_edge(p, (int)i, b->succ[k]);
+                        }
+                }
+        }
+
+        for (size_t i = 0; i < n; ++i) {
+                ir_block *b = &p->blocks.data[i];
+                if (map[i]) {
+                        map[i] = m;
+                        p->blocks.data[m++] = *b;
+                        continue;
+                }
+                for (size_t j = 0; j < b->insns.len; ++j) {
+                        free_insn(&b->insns.data[j]);
+                }
+                dyn_array_free(b->insns);
+                dyn_array_free(b->preds);
+                map[i] = -1;
+        }
+        p->blocks.len = m;
+
+        for (size_t i = 0; i < p->blocks.len; ++i) {
+                ir_block *b = &p->blocks.data[i];
+                for (int k = 0; k < 2; ++k) {
+                        if (b->succ[k] >= 0) b->succ[k] = map[b->succ[k]];
+                }
+                for (size_t j = 0; j < b->preds.len; ++j) {
+                        b->preds.data[j] = map[b->preds.data[j]];
+                }
+                for (size_t j = 0; j < b->insns.len && b->insns.data[j].op == IR_PHI; ++j) {
+                        ir_insn *phi = &b->insns.data[j];
+                        for (int a = 0; a < phi->nargs; ++a) {
+                                phi->preds[a] = map[phi->preds[a]];
+                        }
+                }
+        }
+
+        free(map);
+        free(stack);
+}
+
+// Removes the instructions of `p` that `dead` says are, and
+// returns how many there were.
+static int
+sweep(ir_proc *p, int (*dead)(const ir_insn *in, const void *arg), const void *arg)
+{
+        int n = 0;
+
+        for (size_t i = 0; i < p->blocks.len; ++i) {
+                ir_block *b = &p->blocks.data[i];
+                size_t k = 0;
+                for (size_t j = 0; j < b->insns.len; ++j) {
+                        ir_insn *in = &b->insns.data[j];
+                        if (dead(in, arg)) {
+                                free_insn(in);
+                                ++n;
+                        } else {
+                                b->insns.data[k++] = *in;
+                        }
+                }
+                b->insns.len = k;
+        }
+        return n;
+}
+
+static int
+overlaps(int off1, int sz1, int off2, int sz2)
+{
+        return off1 - sz1 < off2 && off2 - sz2 < off1;
+}
+
+// The bytes of the frame that something may read: those that
+// are loaded, and those of which the address is taken.
+typedef struct {
+        int offset;
+        int sz;
+} region;
+
+DYN_ARRAY_TYPE(region, region_array);
+
+static int
+dead_store(const ir_insn *in, const void *arg)
+{
+        const region_array *read = (const region_array *)arg;
+
+        if (in->op != IR_STSLOT) {
+                return 0;
+        }
+        for (size_t i = 0; i < read->len; ++i) {
+                if (overlaps(read->data[i].offset, read->data[i].sz, (int)in->imm, in->sz)) {
+                        return 0;
+                }
+        }
+        return 1;
+}
+
+// Stores to slots that are never read. Embeds may read any.
+static int
+remove_dead_stores(ir_proc *p)
+{
+        region_array read = dyn_array_empty(region_array);
+
+        for (size_t i = 0; i < p->blocks.len; ++i) {
+                const ir_block *b = &p->blocks.data[i];
+                for (size_t j = 0; j < b->insns.len; ++j) {
+                        const ir_insn *in = &b->insns.data[j];
+                        region r = {(int)in->imm, in->op == IR_LDSLOT ? in->sz : (int)in->imm2};
+                        if (in->op == IR_EMBED) {
+                                dyn_array_free(read);
+                                return 0;
+                        }
+                        if (in->op == IR_LDSLOT || in->op == IR_SLOTADDR) {
+                                dyn_array_append(read, r);
+                        }
+                }
+        }
+
+        int n = sweep(p, dead_store, &read);
+        dyn_array_free(read);
+        return n;
+}
+
+static void
+mark(char *live, int *work, int *nwork, int v)
+{
+        if (v >= 0 && !live[v]) {
+                live[v] = 1;
+                work[(*nwork)++] = v;
+        }
+}
+
+static void
+mark_uses(char *live, int *work, int *nwork, const ir_insn *in)
+{
+        for (int i = 0; i < ir_nuses(in); ++i) {
+                mark(live, work, nwork, ir_use(in, i));
+        }
+        if (in->op == IR_PHI) {
+                for (int i = 0; i < in->nargs; ++i) {
+                        mark(live, work, nwork, in->args[i]);
+                }
+        }
+}
+
+static int
+dead_value(const ir_insn *in, const void *arg)
+{
+        const char *live = (const char *)arg;
+        return pure(in) && !live[in->dst];
+}
+
+// Values that nothing with an effect of its own depends on.
+static int
+remove_dead_values(ir_proc *p)
+{
+        const ir_insn **defs = find_defs(p);
+        char *live = (char *)alloc(p->nvregs + 1);
+        int *work = (int *)alloc((p->nvregs + 1) * sizeof(int));
+        int nwork = 0;
+
+        memset(live, 0, p->nvregs + 1);
+        for (size_t i = 0; i < p->blocks.len; ++i) {
+                const ir_block *b = &p->blocks.data[i];
+                for (size_t j = 0; j < b->insns.len; ++j) {
+                        if (!pure(&b->insns.data[j])) {
+                                mark_uses(live, work, &nwork, &b->insns.data[j]);
+                        }
+                }
+        }
+        while (nwork) {
+                const ir_insn *in = defs[work[--nwork]];
+                if (in) mark_uses(live, work, &nwork, in);
+        }
+
+        int n = sweep(p, dead_value, live);
+
+        free(defs);
+        free(live);
+        free(work);
+        return n;
+}
+
+void
+ir_dce(ir_proc *p)
+{
+        fold_branches(p);
+        remove_unreachable(p);
+
+        // A value may only have been dead stores, and a store
+        // only of slots that dead values loaded.
+        int n;
+        do {
+                n = remove_dead_stores(p);
+                n += remove_dead_values(p);
+        } while (n);
+}
@@ -0,0 +1,48 @@
+#include "depfile.h"
+#include "modcache.h"
+
+#include <forge/array.h>
+
+#include <stdio.h>
+
+// Spaces need a backslash and dollars need doubling for
+// make to read a path back as written.
+static void
+put_path(FILE *f, const char *path)
+{
+        for (const char *p = path; *p; ++p) {
+                if (*p == ' ' || *p == '#') {
+                        fputc('\\', f);
+                } else if (*p == '$') {
+                        fputc('$', f);
+                }
+                fputc(*p, f);
+        }
+}
+
+void
+depfile_write(FILE *f, const char *target, const str_array *objs, module_array mods, int phony)
+{
+        put_path(f, target);
+        for (size_t i = 0; objs && i < objs->len; ++i) {
+                fputc(' ', f);
+                put_path(f, objs->data[i]);
+        }
+        fputc(':', f);
+
+        for (size_t i = 0; i < mods.len; ++i) {
+                fputs(" \\\n  ", f);
+                put_path(f, mods.data[i]->src_filepath);
+        }
+        fputc('\n', f);
+
+        if (!phony) return;
+
+        // `mods` has the entry file last, which (like with
+        // gcc) does not get a phony target.
+        for (size_t i = 0; i + 1 < mods.len; ++i) {
+                fputc('\n', f);
+                put_path(f, mods.data[i]->src_filepath);
+                fputs(":\n", f);
+        }
+}
@@ -287,8 +287,6 @@ stmt_while_alloc(expr *e, stmt *body)
         s->base.accept   = accept_stmt_while;
         s->e             = e;
         s->body          = body;
-        s->asm_begin_lbl = NULL;
-        s->asm_end_lbl   = NULL;
         return s;
 }
 
@@ -305,8 +303,6 @@ stmt_for_alloc(stmt *init,
         s->e             = e;
         s->after         = after;
         s->body          = body;
-        s->asm_begin_lbl = NULL;
-        s->asm_end_lbl   = NULL;
         return s;
 }
 
@@ -359,7 +355,11 @@ stmt_import_alloc(str_array filepaths)
         s->base.kind         = STMT_KIND_IMPORT;
         s->base.accept       = accept_stmt_import;
         s->filepaths         = filepaths;
+        s->wildcard          = 0;
         s->resolved_modnames = dyn_array_empty(str_array);
+        s->resolved_tbls.data = NULL;
+        s->resolved_tbls.len  = 0;
+        s->resolved_tbls.cap  = 0;
         return s;
 }
 
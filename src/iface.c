@@ -0,0 +1,433 @@
+#include "iface.h"
+#include "modcache.h"
+#include "sem.h"
+#include "types.h"
+#include "lexer.h"
+#include "mem.h"
+#include "utils.h"
+#include "ds/smap.h"
+
+#include <forge/array.h>
+#include <forge/io.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define IFACE_MAGIC "CRI2"
+#define IFACE_NULL_TYPE 0xff
+
+typedef struct {
+        unsigned char *data;
+        size_t len, cap;
+} buf;
+
+typedef struct {
+        const unsigned char *data;
+        size_t len, i;
+        int bad;
+        const char *src_filepath;
+} reader;
+
+/*** Writing ***/
+
+static void
+put(buf *b, const void *data, size_t n)
+{
+        if (b->len + n > b->cap) {
+                b->cap = (b->len + n) * 2;
+                b->data = (unsigned char *)realloc(b->data, b->cap);
+        }
+        memcpy(b->data + b->len, data, n);
+        b->len += n;
+}
+
+static void put_u8(buf *b, uint8_t x)   { put(b, &x, sizeof(x)); }
+static void put_u32(buf *b, uint32_t x) { put(b, &x, sizeof(x)); }
+static void put_i32(buf *b, int32_t x)  { put(b, &x, sizeof(x)); }
+static void put_u64(buf *b, uint64_t x) { put(b, &x, sizeof(x)); }
+
+static void
+put_str(buf *b, const char *s)
+{
+        uint32_t n = (uint32_t)strlen(s);
+        put_u32(b, n);
+        put(b, s, n);
+}
+
+static void
+put_type(buf *b, const type *t)
+{
+        if (!t) {
+                put_u8(b, IFACE_NULL_TYPE);
+                return;
+        }
+
+        put_u8(b, (uint8_t)t->kind);
+        put_i32(b, t->sz);
+
+        switch (t->kind) {
+        case TYPE_KIND_PTR: {
+                put_type(b, ((type_ptr *)t)->to);
+        } break;
+        case TYPE_KIND_PROC: {
+                const type_proc *proc = (const type_proc *)t;
+                put_str(b, proc->id);
+                put_type(b, proc->rettype);
+                put_u32(b, (uint32_t)proc->params->len);
+                for (size_t i = 0; i < proc->params->len; ++i) {
+                        put_str(b, proc->params->data[i].id->lx);
+                        put_type(b, proc->params->data[i].type);
+                }
+                put_u8(b, (uint8_t)proc->variadic);
+                put_u8(b, (uint8_t)proc->export);
+                put_u8(b, (uint8_t)proc->extern_);
+        } break;
+        case TYPE_KIND_PROCPTR: {
+                const type_procptr *procptr = (const type_procptr *)t;
+                put_u32(b, (uint32_t)procptr->param_types.len);
+                for (size_t i = 0; i < procptr->param_types.len; ++i) {
+                        put_type(b, procptr->param_types.data[i]);
+                }
+                put_type(b, procptr->rettype);
+                put_u8(b, (uint8_t)procptr->variadic);
+        } break;
+        case TYPE_KIND_LIST: {
+                put_type(b, ((type_list *)t)->elemty);
+                put_i32(b, ((type_list *)t)->len);
+        } break;
+        case TYPE_KIND_STRUCT: {
+                const parameter_array *members = ((type_struct *)t)->members;
+                put_u32(b, (uint32_t)members->len);
+                for (size_t i = 0; i < members->len; ++i) {
+                        put_str(b, members->data[i].id->lx);
+                        put_type(b, members->data[i].type);
+                }
+        } break;
+        default: break;
+        }
+}
+
+// Everything that an importer can observe.
+static void
+put_exports(buf *b, const symtbl *tbl)
+{
+        put_str(b, tbl->modname);
+        put_u32(b, (uint32_t)tbl->export_syms.len);
+        for (size_t i = 0; i < tbl->export_syms.len; ++i) {
+                const sym *sym = tbl->export_syms.data[i];
+                put_u8(b, (uint8_t)sym->extern_);
+                put_str(b, sym->id);
+                put_type(b, sym->ty);
+        }
+}
+
+uint64_t
+iface_hash(const symtbl *tbl)
+{
+        buf b = {0};
+        put_exports(&b, tbl);
+        uint64_t hash = hash_bytes(b.data, b.len);
+        free(b.data);
+        return hash;
+}
+
+void
+iface_write(const module *m, const char *path)
+{
+        buf b = {0};
+
+        put(&b, IFACE_MAGIC, 4);
+        put_u64(&b, m->hash);
+        put_u64(&b, m->iface_hash);
+        put_u32(&b, (uint32_t)m->deps.len);
+        for (size_t i = 0; i < m->deps.len; ++i) {
+                put_str(&b, m->specs.data[i]);
+                put_str(&b, m->deps.data[i]->path);
+                put_u64(&b, m->dep_ifaces.data[i]);
+        }
+        put_u32(&b, (uint32_t)m->tbl->externs.len);
+        for (size_t i = 0; i < m->tbl->externs.len; ++i) {
+                put_str(&b, m->tbl->externs.data[i]);
+        }
+        put_exports(&b, m->tbl);
+
+        // Write then rename so that a reader never sees half of it.
+        char *tmp = (char *)alloc(strlen(path) + 5);
+        sprintf(tmp, "%s.tmp", path);
+
+        FILE *f = fopen(tmp, "wb");
+        if (!f) {
+                perror("fopen");
+                exit(1);
+        }
+        fwrite(b.data, 1, b.len, f);
+        fclose(f);
+
+        if (rename(tmp, path) != 0) {
+                perror("rename");
+                exit(1);
+        }
+
+        free(tmp);
+        free(b.data);
+}
+
+/*** Reading ***/
+
+static const void *
+get(reader *r, size_t n)
+{
+        if (r->bad || r->i + n > r->len) {
+                r->bad = 1;
+                return NULL;
+        }
+        const void *p = r->data + r->i;
+        r->i += n;
+        return p;
+}
+
+#define GET_SCALAR(name, ty)                                    \
+        static ty                                               \
+        name(reader *r)                                         \
+        {                                                       \
+                ty x = 0;                                       \
+                const void *p = get(r, sizeof(ty));             \
+                if (p) memcpy(&x, p, sizeof(ty));               \
+                return x;                                       \
+        }
+
+GET_SCALAR(get_u8, uint8_t)
+GET_SCALAR(get_u32, uint32_t)
+GET_SCALAR(get_i32, int32_t)
+GET_SCALAR(get_u64, uint64_t)
+
+static char *
+get_str(reader *r)
+{
+        uint32_t n = get_u32(r);
+        const char *p = (const char *)get(r, n);
+        if (!p) return strdup("");
+        return strndup(p, n);
+}
+
+static type *get_type(reader *r);
+
+static parameter
+get_parameter(reader *r)
+{
+        char *id = get_str(r);
+        parameter param = {0};
+        param.id = token_alloc(id, strlen(id), TOKEN_TYPE_IDENTIFIER, 0, 0, r->src_filepath);
+        param.type = get_type(r);
+        free(id);
+        return param;
+}
+
+static type *
+get_type(reader *r)
+{
+        uint8_t kind = get_u8(r);
+        if (r->bad || kind == IFACE_NULL_TYPE) return NULL;
+        if (kind >= TYPE_KIND_UNKNOWN) {
+                r->bad = 1;
+                return NULL;
+        }
+
+        int sz = get_i32(r);
+        type *t = NULL;
+
+        switch ((type_kind)kind) {
+        case TYPE_KIND_PTR: {
+                t = (type *)type_ptr_alloc(get_type(r));
+        } break;
+        case TYPE_KIND_PROC: {
+                char *id = get_str(r);
+                type *rettype = get_type(r);
+                parameter_array *params = (parameter_array *)alloc(sizeof(parameter_array));
+                *params = dyn_array_empty(parameter_array);
+                uint32_t n = get_u32(r);
+                for (uint32_t i = 0; i < n && !r->bad; ++i) {
+                        dyn_array_append(*params, get_parameter(r));
+                }
+                int variadic = get_u8(r);
+                int export = get_u8(r);
+                int extern_ = get_u8(r);
+                t = (type *)type_proc_alloc(id, rettype, params, variadic, export, extern_);
+        } break;
+        case TYPE_KIND_PROCPTR: {
+                type_array param_types = dyn_array_empty(type_array);
+                uint32_t n = get_u32(r);
+                for (uint32_t i = 0; i < n && !r->bad; ++i) {
+                        dyn_array_append(param_types, get_type(r));
+                }
+                type *rettype = get_type(r);
+                t = (type *)type_procptr_alloc(param_types, rettype, get_u8(r));
+        } break;
+        case TYPE_KIND_LIST: {
+                type *elemty = get_type(r);
+                int len = get_i32(r);
+                if (!elemty) {
+                        r->bad = 1;
+                        return NULL;
+                }
+                t = (type *)type_list_alloc(elemty, len);
+        } break;
+        case TYPE_KIND_STRUCT: {
+                parameter_array *members = (parameter_array *)alloc(sizeof(parameter_array));
+                *members = dyn_array_empty(parameter_array);
+                uint32_t n = get_u32(r);
+                for (uint32_t i = 0; i < n && !r->bad; ++i) {
+                        dyn_array_append(*members, get_parameter(r));
+                }
+                t = (type *)type_struct_alloc(members, sz);
+        } break;
+        default: {
+                t = (type *)alloc(sizeof(type));
+        } break;
+        }
+
+        if (r->bad) return NULL;
+
+        t->kind = (type_kind)kind;
+        t->sz = sz;
+
+        return t;
+}
+
+// A table that looks like the result of sem_analysis()
+// to importers, but only knows about the exports.
+static symtbl *
+get_exports(reader *r, const char *src_filepath)
+{
+        symtbl *tbl         = (symtbl *)alloc(sizeof(symtbl));
+        tbl->src_filepath   = src_filepath;
+        tbl->modname        = get_str(r);
+        tbl->scope          = dyn_array_empty(smap_array);
+        tbl->program        = NULL;
+        tbl->proc.type      = NULL;
+        tbl->proc.inproc    = 0;
+        tbl->proc.rsp       = 0;
+        tbl->errs           = dyn_array_empty(str_array);
+        tbl->stack_offset   = 0;
+        tbl->loop           = NULL;
+        tbl->imports.data   = NULL;
+        tbl->imports.len    = 0;
+        tbl->imports.cap    = 0;
+        tbl->lazy_imports   = dyn_array_empty(lazy_import_array);
+        tbl->context_switch = 0;
+        tbl->export_syms    = dyn_array_empty(sym_array);
+        tbl->externs        = dyn_array_empty(str_array);
+        tbl->expty          = NULL;
+
+        dyn_array_append(tbl->scope, smap_create(NULL));
+
+        uint32_t n = get_u32(r);
+        for (uint32_t i = 0; i < n && !r->bad; ++i) {
+                sym *s          = (sym *)alloc(sizeof(sym));
+                s->extern_      = get_u8(r);
+                s->id           = get_str(r);
+                s->ty           = get_type(r);
+                s->stack_offset = 0;
+                s->modname      = tbl->modname;
+
+                if (r->bad || !s->ty) break;
+
+                smap_insert(&tbl->scope.data[0], s->id, s);
+                dyn_array_append(tbl->export_syms, s);
+        }
+
+        return tbl;
+}
+
+static int
+get_header(reader *r, iface *ifc)
+{
+        const char *magic = (const char *)get(r, 4);
+        if (!magic || memcmp(magic, IFACE_MAGIC, 4)) return 0;
+
+        ifc->src_hash   = get_u64(r);
+        ifc->hash       = get_u64(r);
+        ifc->dep_specs  = dyn_array_empty(str_array);
+        ifc->dep_paths  = dyn_array_empty(str_array);
+        ifc->dep_hashes = dyn_array_empty(u64_array);
+        ifc->externs    = dyn_array_empty(str_array);
+
+        uint32_t n = get_u32(r);
+        for (uint32_t i = 0; i < n && !r->bad; ++i) {
+                dyn_array_append(ifc->dep_specs, get_str(r));
+                dyn_array_append(ifc->dep_paths, get_str(r));
+                dyn_array_append(ifc->dep_hashes, get_u64(r));
+        }
+
+        n = get_u32(r);
+        for (uint32_t i = 0; i < n && !r->bad; ++i) {
+                dyn_array_append(ifc->externs, get_str(r));
+        }
+
+        return !r->bad;
+}
+
+static unsigned char *
+slurp(const char *path, size_t *n)
+{
+        FILE *f = fopen(path, "rb");
+        if (!f) return NULL;
+
+        buf b = {0};
+        unsigned char chunk[4096];
+        size_t got;
+        while ((got = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+                put(&b, chunk, got);
+        }
+        fclose(f);
+
+        *n = b.len;
+        return b.data;
+}
+
+iface *
+iface_read(const char *path, const char *src_filepath)
+{
+        size_t n = 0;
+        unsigned char *data = slurp(path, &n);
+        if (!data) return NULL;
+
+        reader r = { .data = data, .len = n, .i = 0, .bad = 0, .src_filepath = src_filepath };
+        iface *ifc = (iface *)alloc(sizeof(iface));
+
+        if (!get_header(&r, ifc)) goto bad;
+        ifc->tbl = get_exports(&r, src_filepath);
+        if (r.bad || iface_hash(ifc->tbl) != ifc->hash) goto bad;
+        ifc->tbl->externs = ifc->externs;
+
+        free(data);
+        return ifc;
+
+ bad:
+        free(data);
+        return NULL;
+}
+
+int
+iface_current(const module *m, const char *path)
+{
+        size_t n = 0;
+        unsigned char *data = slurp(path, &n);
+        if (!data) return 0;
+
+        reader r = { .data = data, .len = n, .i = 0, .bad = 0, .src_filepath = NULL };
+        iface ifc = {0};
+        int ok = get_header(&r, &ifc)
+                && ifc.src_hash == m->hash
+                && ifc.hash == m->iface_hash
+                && ifc.dep_paths.len == m->deps.len;
+
+        for (size_t i = 0; ok && i < m->deps.len; ++i) {
+                ok = !strcmp(ifc.dep_paths.data[i], m->deps.data[i]->path)
+                        && ifc.dep_hashes.data[i] == m->dep_ifaces.data[i];
+        }
+
+        free(data);
+        return ok;
+}
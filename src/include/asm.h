@@ -3,9 +3,31 @@
 
 #include "parser.h"
 #include "sem.h"
+#include "modcache.h"
 
 #include <forge/array.h>
 
-str_array asm_gen(program *p, symtbl *tbl);
+#include <sys/types.h>
+
+typedef struct asm_job asm_job;
+
+// Generates and assembles the module `m` (but not what it
+// imports), returning the path of its object file.
+char *asm_gen(module *m);
+
+// asm_gen() in steps, so that nasm can run while the next
+// module is generated: asm_assemble_start() returns the pid of
+// the assembler, or 0 if the object came from the cache or
+// was assembled in-process. Pass its exit status to
+// asm_assemble_finish(), which frees `j` and returns the
+// object, or NULL if assembling failed.
+asm_job *asm_codegen(module *m);
+
+// asm_codegen() for all of the modules `mods` of a program
+// (entry last) at once, into one object named after the entry.
+// Modules from libcrstd.a are left to it.
+asm_job *asm_codegen_program(module_array mods);
+pid_t asm_assemble_start(asm_job *j);
+char *asm_assemble_finish(asm_job *j, int status);
 
 #endif // ASM_H_INCLUDED
@@ -0,0 +1,16 @@
+#ifndef CGEN_H_INCLUDED
+#define CGEN_H_INCLUDED
+
+#include "modcache.h"
+
+// Lowers analyzed modules to C11 for --emit=c, which cc then
+// compiles in place of what asm.c generates. Procedures get
+// the symbols asm.c gives them, so that the objects of either
+// link together and with libcrstd.a.
+
+// The source of one object: the modules `mods`, each of which
+// has a program (one module unless --whole-program). What they
+// import from elsewhere is declared. To be freed.
+char *cgen_source(module_array mods);
+
+#endif // CGEN_H_INCLUDED
@@ -0,0 +1,16 @@
+#ifndef DEPFILE_H_INCLUDED
+#define DEPFILE_H_INCLUDED
+
+#include "modcache.h"
+
+#include <forge/array.h>
+
+#include <stdio.h>
+
+// Writes a make rule saying that `target` (and, if given,
+// the objects in `objs`) depend on the sources of `mods`.
+// With `phony`, every source also gets an empty rule so that
+// make does not fail once one of them is removed.
+void depfile_write(FILE *f, const char *target, const str_array *objs, module_array mods, int phony);
+
+#endif // DEPFILE_H_INCLUDED
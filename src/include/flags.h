@@ -5,8 +5,38 @@ typedef enum {
         FLAG_TYPE_ASM     = 1 << 0,
         FLAG_TYPE_NOSTD   = 1 << 1,
         FLAG_TYPE_VERBOSE = 1 << 2,
+        FLAG_TYPE_SERVER  = 1 << 3,
+        FLAG_TYPE_CLIENT  = 1 << 4,
+        FLAG_TYPE_MD      = 1 << 5,
+        FLAG_TYPE_MP      = 1 << 6,
+        FLAG_TYPE_MO      = 1 << 7,
+        FLAG_TYPE_CACHE_STATS = 1 << 8,
+        FLAG_TYPE_TRACE_SCHEDULE = 1 << 9,
+        FLAG_TYPE_STATIC  = 1 << 10,
+        FLAG_TYPE_NOLIBC  = 1 << 11,
+        FLAG_TYPE_WHOLE_PROGRAM = 1 << 12,
+        FLAG_TYPE_RUN     = 1 << 13,
+        FLAG_TYPE_INTERP  = 1 << 14,
+        FLAG_TYPE_DUMP_IR = 1 << 15,
 } flag_type;
 
+typedef enum {
+        ASSEMBLER_INTEGRATED = 0,
+        ASSEMBLER_NASM,
+        ASSEMBLER_GAS,
+} assembler_type;
+
+// What code generation writes for the assembler or compiler.
+typedef enum {
+        EMIT_ASM = 0,
+        EMIT_C,
+} emit_type;
+
+typedef enum {
+        LINKER_LD = 0,
+        LINKER_INTEGRATED,
+} linker_type;
+
 #define FLAG_1HY_HELP 'h'
 #define FLAG_2HY_HELP "help"
 
@@ -14,10 +44,21 @@ typedef enum {
 #define FLAG_2HY_OUTPUT "output"
 
 #define FLAG_2HY_ASM "asm"
+#define FLAG_2HY_ASSEMBLER "assembler"
+#define FLAG_2HY_LINKER "linker"
+#define FLAG_2HY_EMIT "emit"
+#define FLAG_2HY_RUN "run"
+#define FLAG_2HY_INTERP "interp"
+#define FLAG_2HY_DUMPIR "dump-ir"
+#define FLAG_2HY_NOPEEPHOLE "no-peephole"
+#define FLAG_2HY_STATIC "static"
+#define FLAG_2HY_NOLIBC "nolibc"
 
 #define FLAG_1HY_SEARCHPATH 'I'
 
 #define FLAG_2HY_NOSTD "nostd"
+#define FLAG_2HY_STDDIR "std-dir"
+#define FLAG_2HY_BUILDSTD "build-std"
 
 #define FLAG_1HY_LIBPATH 'L'
 #define FLAG_1HY_LIB 'l'
@@ -27,4 +68,26 @@ typedef enum {
 #define FLAG_1HY_VERBOSE 'v'
 #define FLAG_2HY_VERBOSE "verbose"
 
+#define FLAG_1HY_JOBS 'j'
+#define FLAG_2HY_JOBS "jobs"
+#define FLAG_2HY_TRACESCHEDULE "trace-schedule"
+
+#define FLAG_2HY_SERVER "server"
+#define FLAG_2HY_CLIENT "client"
+#define FLAG_2HY_SOCKET "socket"
+
+#define FLAG_2HY_BUILDDIR "build-dir"
+#define FLAG_2HY_WHOLEPROGRAM "whole-program"
+
+#define FLAG_2HY_CACHEDIR "cache-dir"
+#define FLAG_2HY_CACHESTATS "cache-stats"
+#define FLAG_2HY_CACHESIZE "cache-size"
+
+// Make dependency files, these are spelled like gcc's.
+#define FLAG_1HY_MD "MD"
+#define FLAG_1HY_MF "MF"
+#define FLAG_1HY_MT "MT"
+#define FLAG_1HY_MP "MP"
+#define FLAG_1HY_MO "MO"
+
 #endif // FLAGS_H_INCLUDED
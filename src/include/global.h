@@ -7,11 +7,25 @@
 
 extern struct {
         uint32_t flags;
-        char *filepath;
-        char *outname;
+        str_array filepaths;
+        str_array outnames;
         str_array search_paths;
         str_array lib_search_paths;
         str_array link_libs;
+        char *socket_path;
+        char *build_dir;
+        char *depfile;
+        char *dep_target;
+        char *cache_dir;
+        uint64_t cache_size; // in bytes, see objcache_trim()
+        char *std_dir;
+        char *build_std;
+        int jobs;
+        int assembler;
+        int linker;
+        int emit;
+        uint32_t peephole; // rules of the peephole optimiser in use
+        str_array run_args;
 } g_config;
 
 #endif // GLOBAL_H_INCLUDED
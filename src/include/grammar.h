@@ -10,6 +10,7 @@
 // Resolve circular dependencies.
 typedef struct sym sym;
 typedef struct sym_array sym_array;
+typedef struct symtbl symtbl;
 typedef struct visitor visitor;
 
 typedef enum {
@@ -236,10 +237,6 @@ typedef struct {
         stmt base;
         expr *e;
         stmt *body;
-
-        // Gets resolved during assembly generation
-        char *asm_begin_lbl;
-        char *asm_end_lbl;
 } stmt_while;
 
 typedef struct {
@@ -248,10 +245,6 @@ typedef struct {
         expr *e;
         expr *after;
         stmt *body;
-
-        // Gets resolved during assembly generation
-        char *asm_begin_lbl;
-        char *asm_end_lbl;
 } stmt_for;
 
 typedef struct {
@@ -282,8 +275,13 @@ typedef struct {
 typedef struct {
         stmt base;
         str_array filepaths;
+        int wildcard;                // `import foo.*;`, see sem.h
 
         str_array resolved_modnames; // resolved in semantic analysis
+        struct {
+                symtbl **data;
+                size_t len, cap;
+        } resolved_tbls;             // parallel to `resolved_modnames`
 } stmt_import;
 
 typedef struct {
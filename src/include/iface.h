@@ -0,0 +1,52 @@
+#ifndef IFACE_H_INCLUDED
+#define IFACE_H_INCLUDED
+
+#include "sem.h"
+#include "modcache.h"
+
+#include <forge/array.h>
+
+#include <stdint.h>
+
+// A module interface (`.cri`) is what importers need to know
+// about a module: its name and the signatures of its exports.
+// Next to it, the file records what the module was built from
+// so that it (and its object file) can be reused as long as
+// neither its source nor the interfaces it imports change.
+//
+// Layout, integers in host byte order:
+//   "CRI2"
+//   u64 source hash
+//   u64 interface hash (of everything after the externs)
+//   u32 #deps, then per dependency:
+//       str import as written, str realpath, u64 interface hash
+//   u32 #externs, then str per extern procedure the code uses
+//   str module name
+//   u32 #exports, then per export:
+//       u8 extern, str id, type
+// where str is (u32 len, bytes) and type is (u8 kind, i32 size)
+// followed by whatever the kind needs to describe its layout.
+
+typedef struct {
+        uint64_t src_hash;
+        uint64_t hash;
+        str_array dep_specs;
+        str_array dep_paths;
+        u64_array dep_hashes;
+        str_array externs;
+        symtbl *tbl; // exports, and the externs
+} iface;
+
+// The interface hash of an analyzed module.
+uint64_t iface_hash(const symtbl *tbl);
+
+// NULL if the file does not exist or is not an interface.
+iface *iface_read(const char *path, const char *src_filepath);
+
+void iface_write(const module *m, const char *path);
+
+// Whether the interface at `path` was written for exactly
+// this source and these imports.
+int iface_current(const module *m, const char *path);
+
+#endif // IFACE_H_INCLUDED
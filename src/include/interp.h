@@ -0,0 +1,19 @@
+#ifndef INTERP_H_INCLUDED
+#define INTERP_H_INCLUDED
+
+#include "modcache.h"
+
+// Runs analyzed programs without generating code for them
+// (--interp). Procedures are compiled to a bytecode for a
+// stack machine whose frames are laid out as semantic analysis
+// says, in memory of its own, so that addresses taken of
+// locals are real and embeds run natively against them.
+// Externs are called with dlsym(3).
+
+// Runs the program whose closure is `mods`, entry last, every
+// one of them with its program. `argv` is what main() gets.
+// Returns what main() does, or does not return when the
+// program exits.
+int interp_run(module_array mods, int argc, char **argv);
+
+#endif // INTERP_H_INCLUDED
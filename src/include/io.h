@@ -3,6 +3,25 @@
 
 #include "loc.h"
 
+#include <sys/types.h>
+
+char *find_file_from_searchpaths(const char *fp);
+void searchpaths_err(const char *fp, const loc *loc);
 char *read_file_from_searchpaths(char **fp, const loc *loc);
 
+// A directory only this process writes to, created on first
+// use and removed along with its contents on exit, once the
+// processes it started are done.
+const char *private_tmpdir(void);
+
+// Runs argv[0] (found through $PATH) without a shell and
+// returns its exit status, or -1 if it could not be run.
+int spawn(char *const argv[]);
+
+// spawn() in two steps. spawn_start() returns the pid, or -1.
+// spawn_wait() of 0 is 0, so that a step that had nothing to
+// run can be waited on all the same.
+pid_t spawn_start(char *const argv[]);
+int spawn_wait(pid_t pid);
+
 #endif // IO_H_INCLUDED
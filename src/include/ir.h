@@ -0,0 +1,135 @@
+#ifndef IR_H_INCLUDED
+#define IR_H_INCLUDED
+
+#include "grammar.h"
+
+#include <forge/array.h>
+
+#include <stdint.h>
+#include <stdio.h>
+
+// The mid-level IR that code generation goes through: the
+// procedures of the AST lowered to basic blocks of
+// instructions on virtual registers in SSA form. The locals
+// stay in the stack slots semantic analysis gave them, with
+// explicit loads and stores, since embeds and `&` refer to
+// them there.
+//
+// A value is 64 bits of which the low `sz` bytes are its own.
+
+typedef enum {
+        IR_CONST = 0, // imm
+        IR_SYM,       // the address of the symbol `sym`
+        IR_STR,       // the address of the string literal `sym`
+        IR_SLOTADDR,  // rbp-imm, of what takes imm2 bytes up from there
+        IR_PARAM,     // the argument imm, first in the entry
+        IR_LDSLOT,    // sz bytes at rbp-imm
+        IR_STSLOT,    // a into sz bytes at rbp-imm
+        IR_LOAD,      // sz bytes at a
+        IR_STORE,     // b into sz bytes at a
+        IR_ADD,
+        IR_SUB,
+        IR_MUL,
+        IR_DIV,
+        IR_MOD,
+        IR_NEG,
+        IR_NOT,
+        IR_EQ,        // the comparisons of asz bytes give 0 or 1
+        IR_NE,
+        IR_LT,
+        IR_GT,
+        IR_LE,
+        IR_GE,
+        IR_EXT,       // a of asz bytes, extended to sz
+        IR_MOV,
+        IR_PHI,       // args, from the blocks preds
+        IR_CALL,      // `sym`, or a if there is none, with args
+        IR_ZERO,      // imm2 bytes from rbp-imm up
+        IR_EMBED,
+
+        // Terminators, one last in every block.
+        IR_JMP,       // to succ[0]
+        IR_BR,        // to succ[0] if a is not 0, else succ[1]
+        IR_RET,       // a, or nothing if it is -1
+        IR_EXIT,      // the process, with status a
+        IR_UNREACHABLE, // after a call that does not return
+
+        IR_OP_COUNT,
+} ir_op;
+
+enum {
+        IR_UNSIGNED = 1 << 0, // DIV, MOD, comparisons, EXT
+        IR_VARIADIC = 1 << 1, // CALL
+};
+
+typedef struct {
+        uint8_t op;       // ir_op
+        uint8_t sz;       // of the value, or of what is loaded or stored
+        uint8_t asz;      // of the operands: comparisons, EXT
+        uint8_t flags;
+        int dst;          // the virtual register defined, or -1
+        int a, b;         // operands, or -1
+        int64_t imm, imm2;
+        const char *sym;
+        const stmt_embed *embed;
+        int nargs;        // CALL, PHI
+        int *args;
+        int *preds;       // PHI
+        loc loc;
+} ir_insn;
+
+DYN_ARRAY_TYPE(ir_insn, ir_insn_array);
+
+typedef struct {
+        ir_insn_array insns; // the terminator last
+        int succ[2];         // -1 for none
+        int_array preds;
+} ir_block;
+
+DYN_ARRAY_TYPE(ir_block, ir_block_array);
+
+typedef struct {
+        const stmt_proc *s;
+        const char *modname;
+        char *symbol;         // its label
+        int nvregs;
+        ir_block_array blocks; // the entry first
+        str_array strs;        // symbols that are not in the AST
+} ir_proc;
+
+// The IR of `s` from module `modname`, to be freed with
+// ir_free(). Code that follows a return, exit, break or
+// continue ends up in blocks without predecessors.
+ir_proc *ir_lower(const stmt_proc *s, const char *modname);
+
+// Keeps the locals that nothing takes the address of in
+// virtual registers instead of their slots: those of which
+// there is no `&` or embed reference, nor any access of
+// another size.
+void ir_promote(ir_proc *p);
+
+// Removes the blocks that the entry does not reach, after
+// branches on constants are made jumps, and then stores to
+// slots that nothing reads and the values that only dead
+// instructions use.
+void ir_dce(ir_proc *p);
+
+// Replaces every phi with copies in its predecessors, after
+// which a virtual register may be defined more than once.
+void ir_destruct_ssa(ir_proc *p);
+
+// --dump-ir
+void ir_dump(const ir_proc *p, FILE *out);
+
+void ir_free(ir_proc *p);
+
+// Whether `op` ends a block.
+int ir_is_terminator(int op);
+
+// The ith virtual register that `in` reads, for i below
+// ir_nuses(in), or -1 for an operand it does not have. The
+// arguments of phis are not among them.
+int ir_nuses(const ir_insn *in);
+int ir_use(const ir_insn *in, int i);
+
+#endif // IR_H_INCLUDED
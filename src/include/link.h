@@ -0,0 +1,32 @@
+#ifndef LINK_H_INCLUDED
+#define LINK_H_INCLUDED
+
+#include <forge/array.h>
+
+// A linker for what cruc itself produces: its objects and the
+// members of libcrstd.a, calling into libc. The executable is
+// not position independent, and only has an interpreter and
+// libc.so.6 as a dependency if it calls into libc.
+
+// Links the objects and archives in `inputs`, in that order
+// (archive members are pulled in as ld does), into `out`,
+// and against libc if `libc`. Returns 0, -1 after printing
+// what is wrong, or 1 if the input needs more than this
+// linker does, with the reason in *why, to be freed.
+int link_exe(const char *out, str_array inputs, int libc, char **why);
+
+// A program linked into the memory of this process.
+typedef struct link_image link_image;
+
+// Links as link_exe() does, but into executable memory, with
+// what the inputs leave undefined looked up with dlsym(3) in
+// libc and whatever else is loaded. Returns the same, with
+// *img set on success.
+int link_jit(str_array inputs, int libc, link_image **img, char **why);
+
+// Enters `img` at _start, on a stack like the one the kernel
+// sets up, or calls its main(argc, argv, envp) and exits with
+// what that returns.
+_Noreturn void link_jit_run(link_image *img, int argc, char **argv);
+
+#endif // LINK_H_INCLUDED
@@ -0,0 +1,79 @@
+#ifndef MODCACHE_H_INCLUDED
+#define MODCACHE_H_INCLUDED
+
+#include "parser.h"
+#include "sem.h"
+#include "loc.h"
+#include "ds/smap.h"
+
+#include <forge/array.h>
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+typedef struct module module;
+
+DYN_ARRAY_TYPE(module *, module_array);
+DYN_ARRAY_TYPE(uint64_t, u64_array);
+
+// A parsed and analyzed source file. Modules are cached
+// by their real path and reused for as long as neither
+// the file nor the interfaces it imports have changed.
+//
+// With a build directory, a module whose interface file is
+// current is not parsed at all, `program` is NULL and `tbl`
+// only holds its exports. The same goes for modules of the
+// prebuilt standard library, whose code is in libcrstd.a.
+struct module {
+        char *path;             // realpath(3), the cache key
+        char *src_filepath;     // the path it was found at
+        char *src;              // NULL if loaded from its interface
+        uint64_t hash;          // content hash of the source
+        struct timespec mtime;
+        off_t size;
+
+        program *program;
+        symtbl *tbl;
+        uint64_t iface_hash;
+
+        str_array specs;        // imports as they were written...
+        module_array deps;      // ...what they resolved to...
+        u64_array dep_ifaces;   // ...and their interface hashes at the time.
+
+        char *outbase;          // see modcache_outbase()
+        unsigned outbase_gen;
+
+        unsigned gen;           // generation last validated in
+        int prebuilt;           // from the prebuilt standard library
+};
+
+// Starts a new compilation. Cached modules are
+// revalidated against the disk once per generation.
+void modcache_begin(void);
+
+// Finds `fp` through the search paths and returns the
+// analyzed module, loading it only if needed.
+module *modcache_load(const char *fp, const loc *loc);
+
+// The name a source file declares with `module <name> where`,
+// found without parsing it. NULL if it cannot be told.
+char *modcache_modname(const char *fp);
+
+// All modules loaded from disk (as opposed to reused)
+// since the last modcache_begin(), dependencies first.
+module_array modcache_misses(void);
+
+// Where the files generated for `m` go, without extension.
+const char *modcache_outbase(module *m);
+
+// `m` and everything it imports, dependencies first.
+module_array modcache_closure(module *m);
+
+// Loads `path` into the cache only if its content still
+// hashes to `hash`. Every import it pulls in must match
+// `expect` as well. Returns 0 if anything was out of date,
+// in which case the cache is left as it was.
+int modcache_warm(const char *path, uint64_t hash, const smap *expect);
+
+#endif // MODCACHE_H_INCLUDED
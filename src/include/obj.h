@@ -0,0 +1,70 @@
+#ifndef OBJ_H_INCLUDED
+#define OBJ_H_INCLUDED
+
+#include "ds/smap.h"
+
+#include <forge/array.h>
+
+#include <stdint.h>
+
+// An object file in memory: sections of bytes, the symbols
+// defined in or used by them, and relocations. Written out
+// as an ELF64 relocatable object.
+
+DYN_ARRAY_TYPE(uint8_t, u8_array);
+
+typedef struct {
+        uint64_t offset;
+        int symbol;      // index into obj.symbols
+        uint32_t type;   // R_X86_64_*
+        int64_t addend;
+} obj_reloc;
+
+DYN_ARRAY_TYPE(obj_reloc, obj_reloc_array);
+
+typedef struct {
+        char *name;
+        uint32_t type;   // SHT_*
+        uint64_t flags;  // SHF_*
+        uint64_t align;
+        u8_array data;   // empty for SHT_NOBITS
+        uint64_t size;
+        obj_reloc_array relocs;
+} obj_section;
+
+DYN_ARRAY_TYPE(obj_section, obj_section_array);
+
+typedef struct {
+        char *name;
+        int section;     // -1 if it is defined elsewhere
+        uint64_t value;
+        int global;
+} obj_symbol;
+
+DYN_ARRAY_TYPE(obj_symbol, obj_symbol_array);
+
+typedef struct {
+        obj_section_array sections;
+        obj_symbol_array symbols;
+        smap symbol_index; // name -> index + 1
+} obj;
+
+obj *obj_create(void);
+void obj_free(obj *o);
+
+// The index of the section `name`, added with the usual type
+// and flags for its name if it is not there yet.
+int obj_section_get(obj *o, const char *name);
+
+// The index of the symbol `name`, added as undefined if it
+// is not there yet.
+int obj_symbol_get(obj *o, const char *name);
+
+void obj_emit(obj *o, int section, const void *p, size_t n);
+
+// Writes `o` to `path`. Only symbols that are defined or
+// referenced by a relocation are written. Returns 0, or -1
+// with errno set.
+int obj_write_elf(const obj *o, const char *path);
+
+#endif // OBJ_H_INCLUDED
@@ -0,0 +1,40 @@
+#ifndef OBJCACHE_H_INCLUDED
+#define OBJCACHE_H_INCLUDED
+
+#include "utils.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+// A ccache-style store of object files, keyed by a SHA-256 of
+// everything that went into making them, cruc and the tool that
+// made them included. Objects live in
+// <cache dir>/<first two hex digits>/<key>.o, next to a <key>.sum
+// with the SHA-256 of the object that every hit is checked
+// against. Once a build has added to it, the cache is trimmed to
+// --cache-size by removing the objects used least recently.
+
+// Adds to a key what identifies this cruc, and `tool`, which
+// turns its output into objects.
+void objcache_toolchain(sha256_ctx *c, const char *tool);
+
+// The cached object for `key`, or NULL on a miss.
+char *objcache_get(const char *key);
+
+// Stores the object at `path` under `key` and returns where
+// it now lives. With `keep`, `path` is copied instead of moved.
+char *objcache_put(const char *key, const char *path, int keep);
+
+// Copies a file, used to hand out cached objects.
+int objcache_copy(const char *from, const char *to);
+
+// Whether `path` is one of the cached objects.
+int objcache_owns(const char *path);
+
+// Removes the objects used least recently while the cache is
+// larger than --cache-size. Does nothing if nothing was added.
+void objcache_trim(void);
+
+void objcache_stats(FILE *f);
+
+#endif // OBJCACHE_H_INCLUDED
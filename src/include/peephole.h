@@ -0,0 +1,40 @@
+#ifndef PEEPHOLE_H_INCLUDED
+#define PEEPHOLE_H_INCLUDED
+
+#include "x64.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Rewrites of a few instructions at a time in the code of a
+// procedure, where what they leave in registers and flags is
+// known to be dead after them. Every rule can be turned off,
+// see --no-peephole.
+
+typedef enum {
+        PEEPHOLE_MOV_SELF     = 1 << 0,  // mov r, r
+        PEEPHOLE_STORE_LOAD   = 1 << 1,  // mov [m], r; mov s, [m]: the load is of r
+        PEEPHOLE_COPY         = 1 << 2,  // mov a, x; mov b, a: mov b, x
+        PEEPHOLE_EXT_IMM      = 1 << 3,  // mov a, imm; movsx b, a: mov b, imm
+        PEEPHOLE_IMM          = 1 << 4,  // mov a, imm; add b, a: add b, imm
+        PEEPHOLE_CMP_ZERO     = 1 << 5,  // mov a, [m]; test a, a: cmp [m], 0
+        PEEPHOLE_SETCC_BRANCH = 1 << 6,  // setcc r; movzx r, r; test r, r; je: jncc
+        PEEPHOLE_IDENTITY     = 1 << 7,  // imul r, 1 and add r, 0
+        PEEPHOLE_PUSH_POP     = 1 << 8,  // push a; pop b: mov b, a
+        PEEPHOLE_DEAD         = 1 << 9,  // what writes nothing live
+        PEEPHOLE_ZERO         = 1 << 10, // mov r, 0: xor r, r
+        PEEPHOLE_ALL          = (1 << 11) - 1,
+} peephole_rule;
+
+// The rule called `name`, or 0 if there is none.
+uint32_t peephole_find(const char *name);
+
+// Applies the rules in `rules` to the items of `code` from
+// `from` on, which are those of one procedure, until none
+// applies any more.
+void peephole_run(x64_item_array *code, size_t from, uint32_t rules);
+
+// What the rules did since the last report, for -v.
+void peephole_report(const char *modname);
+
+#endif // PEEPHOLE_H_INCLUDED
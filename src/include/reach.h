@@ -0,0 +1,24 @@
+#ifndef REACH_H_INCLUDED
+#define REACH_H_INCLUDED
+
+#include "modcache.h"
+
+#include <stddef.h>
+
+// Finds the procedures that can run in a set of programs, so
+// that code generation can leave out the rest. The roots are
+// _start/main and the exports of each entry module. A proc is
+// reached by naming it, be it in a call or by taking its
+// address, or by a word in an embed that spells its symbol.
+//
+// `mods[i]` is the closure of the ith program, entry last.
+void reach_compute(const module_array *mods, size_t n);
+
+// The assembly symbol of `id` defined in module `modname`.
+char *reach_symbol(const char *modname, const char *id);
+
+// Whether the symbol `sym` is used. Everything is until
+// reach_compute() was called.
+int reach_is_live(const char *sym);
+
+#endif // REACH_H_INCLUDED
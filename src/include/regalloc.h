@@ -0,0 +1,28 @@
+#ifndef REGALLOC_H_INCLUDED
+#define REGALLOC_H_INCLUDED
+
+#include "ir.h"
+
+#include <stdint.h>
+
+// Linear-scan register allocation of the virtual registers of
+// an IR procedure (after ir_destruct_ssa()) to the registers
+// of x64 that the code generator does not keep for itself.
+// rax, rcx, rdx and r11 stay scratch. A value that is live
+// across a call only goes in a callee-saved register, one that
+// is live across an embed in none, and those that do not get
+// one are spilled to slots of their own in the frame.
+
+typedef struct {
+        int8_t *reg;      // x64_reg of every virtual register, X64_NOREG if spilled
+        int *slot;        // the spill slot of every one that is, else -1
+        int nslots;
+        int nsaved;       // callee-saved registers used
+        int8_t saved[8];  // which, in order
+} regalloc;
+
+regalloc *regalloc_run(const ir_proc *p);
+
+void regalloc_free(regalloc *ra);
+
+#endif // REGALLOC_H_INCLUDED
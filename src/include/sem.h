@@ -18,6 +18,17 @@ typedef struct sym {
 
 DYN_ARRAY_TYPE(sym *, sym_array);
 
+// A module found by a wildcard import. Only its name is read
+// up front, the rest is loaded when the name is first used
+// as a namespace.
+typedef struct {
+        char *modname;
+        char *filepath;
+        stmt_import *stmt;
+} lazy_import;
+
+DYN_ARRAY_TYPE(lazy_import, lazy_import_array);
+
 typedef struct symtbl {
         const char *src_filepath;
         char *modname;
@@ -40,10 +51,12 @@ typedef struct symtbl {
                 struct symtbl **data;
                 size_t len, cap;
         } imports;
+        lazy_import_array lazy_imports;
 
         int context_switch;
 
         sym_array export_syms;
+        str_array externs; // extern procedures the code refers to, see run_plan()
 
         type *expty; // The expected type to convert integer literals to.
 } symtbl;
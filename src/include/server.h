@@ -0,0 +1,22 @@
+#ifndef SERVER_H_INCLUDED
+#define SERVER_H_INCLUDED
+
+// Runs one compilation for the command line `argv`,
+// returning the exit status.
+typedef int (*server_compile_fn)(int argc, char **argv);
+
+const char *server_default_socket(void);
+
+// Listens on `sockpath` forever, for clients of the same user.
+// Every connection is served by a forked process, so clients
+// do not wait for each other, and an error (which exits) cannot
+// take the server down. The analyzed modules a compilation
+// loaded are loaded in this process too, for those after it.
+void server_run(const char *sockpath, server_compile_fn compile);
+
+// Forwards `argv` to a running server and relays its output.
+// Returns the exit status of the compilation, or -1 if no
+// server could be reached.
+int client_run(const char *sockpath, int argc, char **argv);
+
+#endif // SERVER_H_INCLUDED
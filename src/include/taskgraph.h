@@ -0,0 +1,66 @@
+#ifndef TASKGRAPH_H_INCLUDED
+#define TASKGRAPH_H_INCLUDED
+
+#include <forge/array.h>
+
+#include <stdio.h>
+#include <sys/types.h>
+
+// A graph of build tasks. CPU tasks run in this process, one
+// at a time (the front end keeps global state). Process tasks
+// start a child and finish when it exits, up to `jobs` of them
+// at once, so they overlap with the CPU tasks and each other.
+// Tasks may add more tasks while they run.
+
+typedef struct task task;
+
+DYN_ARRAY_TYPE(task *, task_array);
+
+typedef enum {
+        TASK_CPU,
+        TASK_PROC,
+} task_kind;
+
+// CPU: run() does the work, nonzero is failure.
+// PROC: run() starts the child and returns its pid, or 0 if
+//       there turned out to be nothing to run. finish() gets
+//       its exit status, nonzero is failure.
+typedef struct {
+        task_kind kind;
+        long (*run)(task *t);
+        int (*finish)(task *t, int status);
+} task_ops;
+
+struct task {
+        char *name;
+        const task_ops *ops;
+        void *data;
+
+        task_array deps;
+        task_array rdeps;
+        size_t waiting;  // deps not done yet
+
+        int state;
+        pid_t pid;
+        double ready;    // when the last dep finished
+        double start;
+        double end;
+};
+
+task *sched_add(const char *name, const task_ops *ops, void *data);
+
+// `t` does not start before `dep` is done.
+void sched_depend(task *t, task *dep);
+
+// Runs everything, returning nonzero if a task failed. Once a
+// task fails, nothing new is started.
+int sched_run(int jobs);
+
+// Every task with its timing, then the chain of tasks that
+// determined how long the whole thing took.
+void sched_trace(FILE *f);
+
+// Forgets all tasks.
+void sched_reset(void);
+
+#endif // TASKGRAPH_H_INCLUDED
@@ -1,6 +1,26 @@
 #ifndef UTILS_H_INCLUDED
 #define UTILS_H_INCLUDED
 
+#include <stddef.h>
+#include <stdint.h>
+
 char *int_to_cstr(int i);
+uint64_t hash_bytes(const void *data, size_t n);
+uint64_t hash_cstr(const char *s);
+
+// SHA-256, where a 64-bit hash is too weak: the keys of the
+// object cache, which many builds share.
+typedef struct {
+        uint32_t h[8];
+        uint64_t n;
+        unsigned char buf[64];
+} sha256_ctx;
+
+void sha256_init(sha256_ctx *c);
+void sha256_update(sha256_ctx *c, const void *data, size_t n);
+void sha256_cstr(sha256_ctx *c, const char *s);
+
+// Writes the digest as 64 hex digits and a 0.
+void sha256_hex(sha256_ctx *c, char out[65]);
 
 #endif // UTILS_H_INCLUDED
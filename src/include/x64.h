@@ -0,0 +1,185 @@
+#ifndef X64_H_INCLUDED
+#define X64_H_INCLUDED
+
+#include "obj.h"
+
+#include <forge/array.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The part of x86-64 that the code generator and std's embeds
+// use, written in Intel syntax the way nasm reads it.
+
+// Numbered as they are encoded.
+typedef enum {
+        X64_NOREG = -1,
+        X64_RAX = 0,
+        X64_RCX,
+        X64_RDX,
+        X64_RBX,
+        X64_RSP,
+        X64_RBP,
+        X64_RSI,
+        X64_RDI,
+        X64_R8,
+        X64_R9,
+        X64_R10,
+        X64_R11,
+        X64_R12,
+        X64_R13,
+        X64_R14,
+        X64_R15,
+} x64_reg;
+
+typedef enum {
+        X64_OPND_NONE = 0,
+        X64_OPND_REG,
+        X64_OPND_IMM,
+        X64_OPND_MEM,
+        X64_OPND_SYM,
+} x64_opnd_kind;
+
+typedef struct {
+        uint8_t kind;    // x64_opnd_kind
+        uint8_t sz;      // 1, 2, 4 or 8; 0 if it is up to the other operand
+        int8_t reg;      // x64_reg: REG, and the base of MEM
+        int8_t index;    // x64_reg: MEM
+        uint8_t scale;   // MEM
+        int64_t imm;     // IMM, the displacement of MEM, the addend of SYM
+        const char *sym; // SYM
+} x64_opnd;
+
+// In the order of their encoding.
+typedef enum {
+        X64_CC_O = 0,
+        X64_CC_NO,
+        X64_CC_B,
+        X64_CC_AE,
+        X64_CC_E,
+        X64_CC_NE,
+        X64_CC_BE,
+        X64_CC_A,
+        X64_CC_S,
+        X64_CC_NS,
+        X64_CC_P,
+        X64_CC_NP,
+        X64_CC_L,
+        X64_CC_GE,
+        X64_CC_LE,
+        X64_CC_G,
+} x64_cc;
+
+typedef enum {
+        // ALU ops in the order of their /digit.
+        X64_ADD = 0,
+        X64_OR,
+        X64_ADC,
+        X64_SBB,
+        X64_AND,
+        X64_SUB,
+        X64_XOR,
+        X64_CMP,
+
+        X64_MOV,
+        X64_MOVZX,
+        X64_MOVSX,
+        X64_LEA,
+        X64_TEST,
+        X64_IMUL,
+        X64_MUL,
+        X64_IDIV,
+        X64_DIV,
+        X64_NEG,
+        X64_NOT,
+        X64_SHL,
+        X64_SHR,
+        X64_SAR,
+        X64_PUSH,
+        X64_POP,
+        X64_CALL,
+        X64_JMP,
+        X64_JCC,
+        X64_SETCC,
+        X64_RET,
+        X64_LEAVE,
+        X64_SYSCALL,
+        X64_CLD,
+        X64_REP_STOSB,
+        X64_REP_STOSD,
+        X64_REP_STOSQ,
+        X64_CQO,
+        X64_CDQ,
+        X64_NOP,
+} x64_op;
+
+typedef struct {
+        uint8_t op;      // x64_op
+        uint8_t cc;      // x64_cc: JCC, SETCC
+        uint8_t n;       // number of operands
+        uint8_t nargs;   // CALL: how many of rdi, rsi, rdx, rcx, r8 and r9 it passes
+        x64_opnd o[3];
+} x64_insn;
+
+// What the code generator produces: instructions, labels and
+// lines of nasm that are passed through (directives, data,
+// embeds).
+typedef enum {
+        X64_ITEM_INSN = 0,
+        X64_ITEM_LABEL,
+        X64_ITEM_TEXT,
+} x64_item_kind;
+
+typedef struct {
+        x64_item_kind kind;
+        const char *s;   // LABEL: the name, TEXT: the line
+        x64_insn in;     // INSN
+} x64_item;
+
+DYN_ARRAY_TYPE(x64_item, x64_item_array);
+
+// Where an encoded instruction refers to a symbol.
+typedef struct {
+        int at;          // offset of the field in the instruction
+        uint32_t type;   // R_X86_64_*
+        const char *sym;
+        int64_t addend;
+} x64_fixup;
+
+#define X64_MAX_INSN 16
+
+// Parses the instruction in `s`, which is modified: symbol
+// operands point into it. Returns 0, or -1 if it is not
+// an instruction this assembler knows.
+int x64_parse(char *s, x64_insn *in);
+
+// Writes `in` the way x64_parse() reads it, returning the
+// length as snprintf() does.
+int x64_format(const x64_insn *in, char *buf, size_t n);
+
+// x64_format() for GNU as after `.intel_syntax noprefix`.
+int x64_format_gas(const x64_insn *in, char *buf, size_t n);
+
+// Encodes `in` into `buf`, returning its length, or -1 if the
+// operands do not go together. A symbol operand sets *fix,
+// otherwise fix->sym is NULL. Branches to symbols are encoded
+// with a 32-bit displacement.
+int x64_encode(const x64_insn *in, uint8_t *buf, x64_fixup *fix);
+
+// Assembling into `o` piece by piece. Every call returns 0,
+// or -1 for what this assembler cannot do (which nasm may
+// still be able to), after which x64_asm_end() gives the
+// reason in *err, to be freed. Lines and records are
+// counted alike for the line numbers in it.
+typedef struct x64_asm x64_asm;
+
+x64_asm *x64_asm_begin(obj *o);
+int x64_asm_line(x64_asm *a, const char *line);
+int x64_asm_insn(x64_asm *a, const x64_insn *in);
+int x64_asm_label(x64_asm *a, const char *name);
+int x64_asm_end(x64_asm *a, char **err);
+
+// All of the nasm source `src` at once.
+int x64_assemble(const char *src, obj *o, char **err);
+
+#endif // X64_H_INCLUDED
@@ -0,0 +1,1369 @@
+#include "interp.h"
+#include "visitor.h"
+#include "types.h"
+#include "lexer.h"
+#include "kwds.h"
+#include "loc.h"
+#include "reach.h"
+#include "x64.h"
+#include "ds/smap.h"
+
+#include <forge/err.h>
+#include <forge/utils.h>
+#include <forge/cstr.h>
+#include <forge/array.h>
+
+#include <assert.h>
+#include <dlfcn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+extern char **environ;
+
+// Values are 64 bits on the stack of the machine, extended
+// from the width of their type as its signedness says.
+enum {
+        W_64 = 0,
+        W_I8,
+        W_U8,
+        W_I16,
+        W_U16,
+        W_I32,
+        W_U32,
+};
+
+// The arithmetic of ADD..MOD, and of MUT and LMUT by `k`.
+enum {
+        K_ADD = 0,
+        K_SUB,
+        K_MUL,
+        K_DIV,
+        K_MOD,
+};
+
+// [a, b] is the stack with b on top.
+typedef enum {
+        OP_IMM = 0, // push a
+        OP_CONST,   // push consts[a]
+        OP_LADDR,   // push rbp-a
+        OP_LLOAD,   // push [rbp-a]
+        OP_LSTORE,  // [v] -> [v], with [rbp-a] = v
+        OP_LMUT,    // [v] -> [x], with x = [rbp-a] = [rbp-a] k v
+        OP_LOAD,    // [p] -> [*p]
+        OP_STORE,   // [p, v] -> [v], with *p = v
+        OP_MUT,     // [p, v] -> [x], with x = *p = *p k v
+        OP_ZERO,    // [n] -> [], with n bytes from rbp-a zeroed
+        OP_POP,
+        OP_ADD,
+        OP_SUB,
+        OP_MUL,
+        OP_DIV,
+        OP_MOD,
+        OP_SCALE,   // [n] -> [n*a]
+        OP_INDEX,   // [p, i] -> [p + i*a]
+        OP_EQ,
+        OP_NE,
+        OP_LT,
+        OP_GT,
+        OP_LE,
+        OP_GE,
+        OP_NEG,
+        OP_NOT,
+        OP_LNOT,
+        OP_NORM,    // [v] -> [v at width w]
+        OP_JMP,     // to a
+        OP_JZ,      // [v] -> [], to a if v is 0
+        OP_JNZ,     // [v] -> [], to a if it is not
+        OP_CALL,    // [args..] -> [r], procs[a]
+        OP_CALLPTR, // [args.., f] -> [r], with a arguments
+        OP_CALLC,   // [args.., f] -> [r], f native
+        OP_RET,     // [r] -> returned
+        OP_EXIT,    // [status]
+        OP_EMBED,   // the thunk at a
+        OP_COUNT,
+} opcode;
+
+typedef struct {
+        uint8_t op;     // opcode
+        uint8_t w;      // the width of what is loaded, stored or computed
+        uint8_t k;      // MUT, LMUT
+        int32_t a;
+} insn;
+
+DYN_ARRAY_TYPE(insn, insn_array);
+
+// At most as many as there are argument registers.
+#define INTERP_MAX_PARAMS 6
+
+typedef struct {
+        int offset;
+        int w;
+} iparam;
+
+typedef struct {
+        char *symbol;   // what asm.c calls it
+        stmt_proc *s;
+        insn_array code;
+        int frame;      // bytes below rbp, a multiple of 16
+        int nparams;
+        iparam params[INTERP_MAX_PARAMS];
+} iproc;
+
+DYN_ARRAY_TYPE(iproc *, iproc_array);
+
+typedef struct {
+        const void *s;    // the while or for
+        int begin;        // where `continue` goes
+        int_array breaks; // jumps to the end
+} iloop;
+
+DYN_ARRAY_TYPE(iloop, iloop_array);
+
+typedef struct {
+        iproc_array procs;
+        smap index;         // symbol -> index in procs, plus one
+        u64_array consts;
+        str_array strs;     // of string literals, for as long as they run
+        u8_array thunks;    // the native code of every embed
+        iproc *cur;
+        iloop_array loops;  // innermost last
+} interp_context;
+
+// What a procedure pointer to an interpreted procedure holds:
+// its index, out of the way of any address.
+#define INTERP_PROC_TAG ((int64_t)1 << 62)
+
+// Sizes of the machine.
+#define INTERP_STACK  (8 << 20) // bytes of frames
+#define INTERP_VALUES (1 << 20) // of the value stack
+#define INTERP_FRAMES (1 << 18) // calls deep
+#define INTERP_SLACK  4096      // values one procedure may hold
+
+static int
+width(const type *t)
+{
+        if (!t) return W_64;
+        int u = type_is_unsigned(t) || t->kind == TYPE_KIND_BOOL;
+        switch (t->sz) {
+        case 1:  return u ? W_U8  : W_I8;
+        case 2:  return u ? W_U16 : W_I16;
+        case 4:  return u ? W_U32 : W_I32;
+        default: return W_64;
+        }
+}
+
+static inline int64_t
+norm(int64_t v, int w)
+{
+        switch (w) {
+        case W_I8:  return (int8_t)v;
+        case W_U8:  return (uint8_t)v;
+        case W_I16: return (int16_t)v;
+        case W_U16: return (uint16_t)v;
+        case W_I32: return (int32_t)v;
+        case W_U32: return (uint32_t)v;
+        default:    return v;
+        }
+}
+
+static inline int64_t
+load(const uint8_t *p, int w)
+{
+        switch (w) {
+        case W_I8:  { int8_t   x; memcpy(&x, p, 1); return x; }
+        case W_U8:  { uint8_t  x; memcpy(&x, p, 1); return x; }
+        case W_I16: { int16_t  x; memcpy(&x, p, 2); return x; }
+        case W_U16: { uint16_t x; memcpy(&x, p, 2); return x; }
+        case W_I32: { int32_t  x; memcpy(&x, p, 4); return x; }
+        case W_U32: { uint32_t x; memcpy(&x, p, 4); return x; }
+        default:    { int64_t  x; memcpy(&x, p, 8); return x; }
+        }
+}
+
+static inline void
+store(uint8_t *p, int64_t v, int w)
+{
+        switch (w) {
+        case W_I8:
+        case W_U8:  { uint8_t  x = (uint8_t)v;  memcpy(p, &x, 1); } break;
+        case W_I16:
+        case W_U16: { uint16_t x = (uint16_t)v; memcpy(p, &x, 2); } break;
+        case W_I32:
+        case W_U32: { uint32_t x = (uint32_t)v; memcpy(p, &x, 4); } break;
+        default:    memcpy(p, &v, 8);
+        }
+}
+
+static _Noreturn void
+fault(const iproc *p, const char *what)
+{
+        fflush(NULL);
+        fprintf(stderr, "%s%s in `%s`\n", loc_err(p->s->base.loc), what, p->s->id->lx);
+        _exit(1);
+}
+
+// Wraps as the machine does, and divides as idiv does but
+// for the fault.
+static inline int64_t
+arith(const iproc *p, int k, int64_t a, int64_t b, int w)
+{
+        uint64_t x = (uint64_t)a, y = (uint64_t)b;
+        switch (k) {
+        case K_ADD: return norm((int64_t)(x + y), w);
+        case K_SUB: return norm((int64_t)(x - y), w);
+        case K_MUL: return norm((int64_t)(x * y), w);
+        default:    break;
+        }
+        if (b == 0) fault(p, "division by zero");
+        if (b == -1) return norm(k == K_DIV ? (int64_t)(0 - x) : 0, w);
+        return norm(k == K_DIV ? a / b : a % b, w);
+}
+
+// Every argument goes in a register of its own, which is all
+// of the SysV calling convention that crucible uses. Calling
+// through a variadic type zeroes al, as variadic callees need.
+static int64_t
+call_native(int64_t f, const int64_t *a)
+{
+        int64_t (*fn)(int64_t, ...) = (int64_t (*)(int64_t, ...))(uintptr_t)f;
+        return fn(a[0], a[1], a[2], a[3], a[4], a[5]);
+}
+
+///////////////////////////////////////////
+// COMPILATION
+///////////////////////////////////////////
+
+static int
+emit(interp_context *ctx, opcode op, int w, int64_t a)
+{
+        insn in = {(uint8_t)op, (uint8_t)w, 0, (int32_t)a};
+        assert(a == in.a);
+        dyn_array_append(ctx->cur->code, in);
+        return (int)ctx->cur->code.len - 1;
+}
+
+static void
+emit_mut(interp_context *ctx, opcode op, int w, int k, int64_t a)
+{
+        emit(ctx, op, w, a);
+        ctx->cur->code.data[ctx->cur->code.len - 1].k = (uint8_t)k;
+}
+
+static int
+here(interp_context *ctx)
+{
+        return (int)ctx->cur->code.len;
+}
+
+// Points the jump at `at` here.
+static void
+patch(interp_context *ctx, int at)
+{
+        ctx->cur->code.data[at].a = here(ctx);
+}
+
+static void
+emit_imm(interp_context *ctx, int64_t x)
+{
+        if (x == (int32_t)x) {
+                emit(ctx, OP_IMM, W_64, x);
+                return;
+        }
+        dyn_array_append(ctx->consts, (uint64_t)x);
+        emit(ctx, OP_CONST, W_64, (int64_t)ctx->consts.len - 1);
+}
+
+static void
+gen(visitor *v, expr *e)
+{
+        e->accept(e, v);
+}
+
+static int
+proc_index(interp_context *ctx, const char *symbol)
+{
+        uintptr_t i = (uintptr_t)smap_get(&ctx->index, symbol);
+        assert(i);
+        return (int)i - 1;
+}
+
+static int64_t
+resolve_extern(const char *id, loc loc)
+{
+        void *f = dlsym(RTLD_DEFAULT, id);
+        if (!f) {
+                forge_err_wargs("%sundefined reference to `%s`", loc_err(loc), id);
+        }
+        return (int64_t)(uintptr_t)f;
+}
+
+// The procedure that `e` names directly, if it does.
+static const expr_identifier *
+callee_of(const expr *e)
+{
+        while (e->kind == EXPR_KIND_NAMESPACE) {
+                e = ((const expr_namespace *)e)->e;
+        }
+        if (e->kind != EXPR_KIND_IDENTIFIER) return NULL;
+        const expr_identifier *id = (const expr_identifier *)e;
+        return id->resolved && id->resolved->ty->kind == TYPE_KIND_PROC ? id : NULL;
+}
+
+static int
+arith_kind(token_type ty)
+{
+        switch (ty) {
+        case TOKEN_TYPE_PLUS:
+        case TOKEN_TYPE_PLUS_EQUALS:          return K_ADD;
+        case TOKEN_TYPE_MINUS:
+        case TOKEN_TYPE_MINUS_EQUALS:         return K_SUB;
+        case TOKEN_TYPE_ASTERISK:
+        case TOKEN_TYPE_ASTERISK_EQUALS:      return K_MUL;
+        case TOKEN_TYPE_FORWARDSLASH:
+        case TOKEN_TYPE_FORWARDSLASH_EQUALS:  return K_DIV;
+        case TOKEN_TYPE_PERCENT:
+        case TOKEN_TYPE_PERCENT_EQUALS:       return K_MOD;
+        default:                              return -1;
+        }
+}
+
+static void *
+visit_expr_binary(visitor *v, expr_bin *e)
+{
+        interp_context *ctx = (interp_context *)v->context;
+        token_type op = e->op->ty;
+
+        if (op == TOKEN_TYPE_DOUBLE_AMPERSAND || op == TOKEN_TYPE_DOUBLE_PIPE) {
+                opcode j = op == TOKEN_TYPE_DOUBLE_AMPERSAND ? OP_JZ : OP_JNZ;
+                gen(v, e->lhs);
+                int j1 = emit(ctx, j, W_64, 0);
+                gen(v, e->rhs);
+                int j2 = emit(ctx, j, W_64, 0);
+                emit(ctx, OP_IMM, W_64, j == OP_JZ);
+                int done = emit(ctx, OP_JMP, W_64, 0);
+                patch(ctx, j1);
+                patch(ctx, j2);
+                emit(ctx, OP_IMM, W_64, j != OP_JZ);
+                patch(ctx, done);
+                return NULL;
+        }
+
+        opcode cmp = OP_COUNT;
+        switch (op) {
+        case TOKEN_TYPE_DOUBLE_EQUALS:      cmp = OP_EQ; break;
+        case TOKEN_TYPE_BANG_EQUALS:        cmp = OP_NE; break;
+        case TOKEN_TYPE_LESSTHAN:           cmp = OP_LT; break;
+        case TOKEN_TYPE_GREATERTHAN:        cmp = OP_GT; break;
+        case TOKEN_TYPE_LESSTHAN_EQUALS:    cmp = OP_LE; break;
+        case TOKEN_TYPE_GREATERTHAN_EQUALS: cmp = OP_GE; break;
+        default: break;
+        }
+        if (cmp != OP_COUNT) {
+                gen(v, e->lhs);
+                gen(v, e->rhs);
+                emit(ctx, cmp, W_64, 0);
+                return NULL;
+        }
+
+        int k = arith_kind(op);
+        if (k < 0) {
+                forge_err_wargs("%sthe interpreter has no binary operator `%s`", loc_err(e->op->loc), e->op->lx);
+        }
+
+        // Pointer arithmetic: the pointer first, then the
+        // integer, scaled, as the native code does it.
+        if (e->lhs->type->kind == TYPE_KIND_PTR || e->rhs->type->kind == TYPE_KIND_PTR) {
+                expr *ptr = e->lhs->type->kind == TYPE_KIND_PTR ? e->lhs : e->rhs;
+                expr *n   = e->lhs->type->kind == TYPE_KIND_PTR ? e->rhs : e->lhs;
+                gen(v, ptr);
+                gen(v, n);
+                emit(ctx, OP_SCALE, W_64, ((type_ptr *)ptr->type)->to->sz);
+                emit(ctx, (opcode)(OP_ADD + k), W_64, 0);
+                return NULL;
+        }
+
+        gen(v, e->lhs);
+        gen(v, e->rhs);
+        emit(ctx, (opcode)(OP_ADD + k), width(e->lhs->type), 0);
+
+        return NULL;
+}
+
+static void *
+visit_expr_identifier(visitor *v, expr_identifier *e)
+{
+        interp_context *ctx = (interp_context *)v->context;
+        const sym *s = e->resolved;
+
+        assert(s);
+
+        if (s->extern_) {
+                emit_imm(ctx, resolve_extern(e->id->lx, ((expr *)e)->loc));
+        } else if (((expr *)e)->type->kind == TYPE_KIND_PROC) {
+                char *symbol = reach_symbol(s->modname, e->id->lx);
+                emit_imm(ctx, INTERP_PROC_TAG | proc_index(ctx, symbol));
+                free(symbol);
+        } else {
+                emit(ctx, OP_LLOAD, width(s->ty), s->stack_offset);
+        }
+
+        return NULL;
+}
+
+static void *
+visit_expr_integer_literal(visitor *v, expr_integer_literal *e)
+{
+        interp_context *ctx = (interp_context *)v->context;
+        emit_imm(ctx, strtoll(e->i->lx, NULL, 10));
+        return NULL;
+}
+
+static void *
+visit_expr_string_literal(visitor *v, expr_string_literal *e)
+{
+        interp_context *ctx = (interp_context *)v->context;
+        char *s = strdup(e->s->lx);
+        dyn_array_append(ctx->strs, s);
+        emit_imm(ctx, (int64_t)(uintptr_t)s);
+        return NULL;
+}
+
+static void *
+visit_expr_proccall(visitor *v, expr_proccall *e)
+{
+        interp_context *ctx = (interp_context *)v->context;
+        type *rettype = NULL;
+
+        if (e->args.len > INTERP_MAX_PARAMS) {
+                forge_err_wargs("%sthe interpreter passes at most %d arguments",
+                                loc_err(((expr *)e)->loc), INTERP_MAX_PARAMS);
+        }
+
+        if (e->lhs->type->kind == TYPE_KIND_PROC) {
+                rettype = ((type_proc *)e->lhs->type)->rettype;
+        } else {
+                rettype = ((type_procptr *)e->lhs->type)->rettype;
+        }
+
+        for (size_t i = 0; i < e->args.len; ++i) {
+                gen(v, e->args.data[i]);
+        }
+
+        int w = width(rettype);
+        const expr_identifier *id = callee_of(e->lhs);
+
+        if (id && !id->resolved->extern_) {
+                char *symbol = reach_symbol(id->resolved->modname, id->id->lx);
+                emit(ctx, OP_CALL, w, proc_index(ctx, symbol));
+                free(symbol);
+        } else {
+                gen(v, e->lhs);
+                emit(ctx, id ? OP_CALLC : OP_CALLPTR, w, e->args.len);
+        }
+
+        return NULL;
+}
+
+static void *
+visit_expr_mut(visitor *v, expr_mut *e)
+{
+        interp_context *ctx = (interp_context *)v->context;
+        int k = arith_kind(e->op->ty);
+
+        if (e->op->ty != TOKEN_TYPE_EQUALS && k < 0) {
+                forge_err_wargs("%sthe interpreter has no operator `%s`", loc_err(e->op->loc), e->op->lx);
+        }
+
+        switch (e->lhs->kind) {
+        case EXPR_KIND_IDENTIFIER: {
+                const sym *s = ((expr_identifier *)e->lhs)->resolved;
+                assert(s);
+
+                gen(v, e->rhs);
+                if (k < 0) {
+                        emit(ctx, OP_LSTORE, width(s->ty), s->stack_offset);
+                        break;
+                }
+                if (s->ty->kind == TYPE_KIND_PTR) {
+                        emit(ctx, OP_SCALE, W_64, ((type_ptr *)s->ty)->to->sz);
+                }
+                emit_mut(ctx, OP_LMUT, width(s->ty), k, s->stack_offset);
+        } break;
+        case EXPR_KIND_INDEX: {
+                expr_index *idx = (expr_index *)e->lhs;
+                type *elemty = ((type_list *)idx->lhs->type)->elemty;
+
+                gen(v, idx->lhs);
+                gen(v, idx->idx);
+                emit(ctx, OP_INDEX, W_64, elemty->sz);
+                gen(v, e->rhs);
+                if (k < 0) {
+                        emit(ctx, OP_STORE, width(elemty), 0);
+                } else {
+                        emit_mut(ctx, OP_MUT, width(elemty), k, 0);
+                }
+        } break;
+        case EXPR_KIND_UNARY: {
+                expr_un *un = (expr_un *)e->lhs;
+                if (un->op->ty != TOKEN_TYPE_ASTERISK || un->rhs->type->kind != TYPE_KIND_PTR) {
+                        forge_err_wargs("%sthe interpreter cannot assign to `%s`", loc_err(un->op->loc), un->op->lx);
+                }
+                type *to = ((type_ptr *)un->rhs->type)->to;
+
+                gen(v, un->rhs);
+                gen(v, e->rhs);
+                if (k < 0) {
+                        emit(ctx, OP_STORE, width(to), 0);
+                } else {
+                        emit_mut(ctx, OP_MUT, width(to), k, 0);
+                }
+        } break;
+        default:
+                forge_err_wargs("%sthe interpreter cannot assign to an expression of kind `%d`",
+                                loc_err(e->lhs->loc), (int)e->lhs->kind);
+        }
+
+        return NULL;
+}
+
+static void *
+visit_expr_brace_init(visitor *v, expr_brace_init *e)
+{
+        interp_context *ctx = (interp_context *)v->context;
+
+        for (size_t i = 0; i < e->resolved_syms->len; ++i) {
+                const sym *s = e->resolved_syms->data[i];
+                gen(v, e->exprs.data[i]);
+                emit(ctx, OP_LSTORE, width(s->ty), s->stack_offset);
+                emit(ctx, OP_POP, W_64, 0);
+        }
+        emit(ctx, OP_IMM, W_64, 0);
+
+        return NULL;
+}
+
+static void *
+visit_expr_namespace(visitor *v, expr_namespace *e)
+{
+        gen(v, e->e);
+        return NULL;
+}
+
+// The expressions come last element first, each stored below
+// the one before it.
+static void *
+visit_expr_arrayinit(visitor *v, expr_arrayinit *e)
+{
+        interp_context *ctx = (interp_context *)v->context;
+        type_list *ty = (type_list *)((expr *)e)->type;
+        int szsum = ty->elemty->sz * ty->len;
+
+        if (e->zeroed) {
+                emit(ctx, OP_IMM, W_64, szsum);
+                emit(ctx, OP_ZERO, W_64, e->stack_offset_base + szsum);
+        }
+
+        int offset = 0;
+        for (size_t i = 0; i < e->exprs.len; ++i) {
+                expr *x = e->exprs.data[i];
+                offset += x->type->sz;
+                gen(v, x);
+                emit(ctx, OP_LSTORE, width(x->type), e->stack_offset_base + offset);
+                emit(ctx, OP_POP, W_64, 0);
+        }
+
+        emit(ctx, OP_LADDR, W_64, e->stack_offset_base + szsum);
+
+        return NULL;
+}
+
+static void *
+visit_expr_index(visitor *v, expr_index *e)
+{
+        interp_context *ctx = (interp_context *)v->context;
+        type *elemty = ((type_list *)e->lhs->type)->elemty;
+
+        gen(v, e->lhs);
+        gen(v, e->idx);
+        emit(ctx, OP_INDEX, W_64, elemty->sz);
+        emit(ctx, OP_LOAD, width(elemty), 0);
+
+        return NULL;
+}
+
+static void *
+visit_expr_un(visitor *v, expr_un *e)
+{
+        interp_context *ctx = (interp_context *)v->context;
+
+        switch (e->op->ty) {
+        case TOKEN_TYPE_AMPERSAND:
+                if (e->rhs->kind == EXPR_KIND_IDENTIFIER) {
+                        const sym *s = ((expr_identifier *)e->rhs)->resolved;
+                        assert(s);
+                        emit(ctx, OP_LADDR, W_64, s->stack_offset);
+                } else if (e->rhs->kind == EXPR_KIND_INDEX) {
+                        expr_index *idx = (expr_index *)e->rhs;
+                        gen(v, idx->lhs);
+                        gen(v, idx->idx);
+                        emit(ctx, OP_INDEX, W_64, ((type_list *)idx->lhs->type)->elemty->sz);
+                } else {
+                        forge_err_wargs("%sthe interpreter cannot take the address of an expression of kind `%d`",
+                                        loc_err(e->op->loc), (int)e->rhs->kind);
+                }
+                break;
+        case TOKEN_TYPE_ASTERISK:
+                gen(v, e->rhs);
+                emit(ctx, OP_LOAD, width(((type_ptr *)e->rhs->type)->to), 0);
+                break;
+        case TOKEN_TYPE_MINUS:
+                gen(v, e->rhs);
+                emit(ctx, OP_NEG, width(e->rhs->type), 0);
+                break;
+        case TOKEN_TYPE_BANG:
+                gen(v, e->rhs);
+                emit(ctx, OP_LNOT, W_64, 0);
+                break;
+        case TOKEN_TYPE_TILDE:
+                gen(v, e->rhs);
+                emit(ctx, OP_NOT, width(e->rhs->type), 0);
+                break;
+        default:
+                forge_err_wargs("%sthe interpreter has no unary operator `%s`", loc_err(e->op->loc), e->op->lx);
+        }
+
+        return NULL;
+}
+
+static void *
+visit_expr_character_literal(visitor                *v,
+                             expr_character_literal *e)
+{
+        interp_context *ctx = (interp_context *)v->context;
+        emit(ctx, OP_IMM, W_64, e->c->lx[0]);
+        return NULL;
+}
+
+// The value is already extended as the type it is cast from
+// says, which leaves cutting it to the new width.
+static void *
+visit_expr_cast(visitor *v, expr_cast *e)
+{
+        interp_context *ctx = (interp_context *)v->context;
+        gen(v, e->rhs);
+        emit(ctx, OP_NORM, width(((expr *)e)->type), 0);
+        return NULL;
+}
+
+static void *
+visit_expr_bool_literal(visitor *v, expr_bool_literal *e)
+{
+        interp_context *ctx = (interp_context *)v->context;
+        emit(ctx, OP_IMM, W_64, strcmp(e->b->lx, KWD_TRUE) == 0);
+        return NULL;
+}
+
+static void *
+visit_expr_null(visitor *v, expr_null *e)
+{
+        NOOP(e);
+        interp_context *ctx = (interp_context *)v->context;
+        emit(ctx, OP_IMM, W_64, 0);
+        return NULL;
+}
+
+static void *
+visit_stmt_let(visitor *v, stmt_let *s)
+{
+        interp_context *ctx = (interp_context *)v->context;
+
+        gen(v, s->e);
+        if (s->resolved->ty->kind != TYPE_KIND_STRUCT) {
+                emit(ctx, OP_LSTORE, width(s->e->type), s->resolved->stack_offset);
+        }
+        emit(ctx, OP_POP, W_64, 0);
+
+        return NULL;
+}
+
+static void *
+visit_stmt_expr(visitor *v, stmt_expr *s)
+{
+        interp_context *ctx = (interp_context *)v->context;
+        gen(v, s->e);
+        emit(ctx, OP_POP, W_64, 0);
+        return NULL;
+}
+
+static void *
+visit_stmt_block(visitor *v, stmt_block *s)
+{
+        for (size_t i = 0; i < s->stmts.len; ++i) {
+                stmt *stmt = s->stmts.data[i];
+                stmt->accept(stmt, v);
+        }
+        return NULL;
+}
+
+// Procedures are compiled one by one by interp_run().
+static void *
+visit_stmt_proc(visitor *v, stmt_proc *s)
+{
+        NOOP(v, s);
+        return NULL;
+}
+
+static void *
+visit_stmt_return(visitor *v, stmt_return *s)
+{
+        interp_context *ctx = (interp_context *)v->context;
+
+        if (s->e) {
+                gen(v, s->e);
+        } else {
+                emit(ctx, OP_IMM, W_64, 0);
+        }
+        emit(ctx, OP_RET, width(ctx->cur->s->type), 0);
+
+        return NULL;
+}
+
+static void *
+visit_stmt_exit(visitor *v, stmt_exit *s)
+{
+        interp_context *ctx = (interp_context *)v->context;
+
+        if (s->e) {
+                gen(v, s->e);
+        } else {
+                emit(ctx, OP_IMM, W_64, 0);
+        }
+        emit(ctx, OP_EXIT, W_64, 0);
+
+        return NULL;
+}
+
+static void *
+visit_stmt_extern_proc(visitor *v, stmt_extern_proc *s)
+{
+        NOOP(v, s);
+        return NULL;
+}
+
+static void *
+visit_stmt_if(visitor *v, stmt_if *s)
+{
+        interp_context *ctx = (interp_context *)v->context;
+
+        gen(v, s->e);
+        int jelse = emit(ctx, OP_JZ, W_64, 0);
+        s->then->accept(s->then, v);
+
+        if (s->else_) {
+                int jdone = emit(ctx, OP_JMP, W_64, 0);
+                patch(ctx, jelse);
+                s->else_->accept(s->else_, v);
+                patch(ctx, jdone);
+        } else {
+                patch(ctx, jelse);
+        }
+
+        return NULL;
+}
+
+static void
+loop_begin(interp_context *ctx, const void *s, int begin)
+{
+        iloop l = {s, begin, dyn_array_empty(int_array)};
+        dyn_array_append(ctx->loops, l);
+}
+
+// Closes the innermost loop here.
+static void
+loop_end(interp_context *ctx)
+{
+        iloop *l = &ctx->loops.data[ctx->loops.len - 1];
+        for (size_t i = 0; i < l->breaks.len; ++i) {
+                patch(ctx, l->breaks.data[i]);
+        }
+        dyn_array_free(l->breaks);
+        --ctx->loops.len;
+}
+
+static iloop *
+loop_of(interp_context *ctx, const void *s)
+{
+        for (size_t i = ctx->loops.len; i-- > 0;) {
+                if (ctx->loops.data[i].s == s) return &ctx->loops.data[i];
+        }
+        assert(0 && "break or continue outside of its loop");
+        return NULL;
+}
+
+static void *
+visit_stmt_while(visitor *v, stmt_while *s)
+{
+        interp_context *ctx = (interp_context *)v->context;
+        int begin = here(ctx);
+
+        gen(v, s->e);
+        int jend = emit(ctx, OP_JZ, W_64, 0);
+
+        loop_begin(ctx, s, begin);
+        s->body->accept(s->body, v);
+        emit(ctx, OP_JMP, W_64, begin);
+        patch(ctx, jend);
+        loop_end(ctx);
+
+        return NULL;
+}
+
+// `continue` goes back to the condition, not to `after`, as
+// it does in the native code.
+static void *
+visit_stmt_for(visitor *v, stmt_for *s)
+{
+        interp_context *ctx = (interp_context *)v->context;
+
+        s->init->accept(s->init, v);
+        int begin = here(ctx);
+
+        int jend = -1;
+        if (s->e) {
+                gen(v, s->e);
+                jend = emit(ctx, OP_JZ, W_64, 0);
+        }
+
+        loop_begin(ctx, s, begin);
+        s->body->accept(s->body, v);
+        if (s->after) {
+                gen(v, s->after);
+                emit(ctx, OP_POP, W_64, 0);
+        }
+        emit(ctx, OP_JMP, W_64, begin);
+        if (jend >= 0) {
+                patch(ctx, jend);
+        }
+        loop_end(ctx);
+
+        return NULL;
+}
+
+static void *
+visit_stmt_break(visitor *v, stmt_break *s)
+{
+        interp_context *ctx = (interp_context *)v->context;
+        iloop *l = loop_of(ctx, s->resolved_parent);
+        int j = emit(ctx, OP_JMP, W_64, 0);
+        dyn_array_append(l->breaks, j);
+        return NULL;
+}
+
+static void *
+visit_stmt_continue(visitor *v, stmt_continue *s)
+{
+        interp_context *ctx = (interp_context *)v->context;
+        emit(ctx, OP_JMP, W_64, loop_of(ctx, s->resolved_parent)->begin);
+        return NULL;
+}
+
+static void *
+visit_stmt_struct(visitor *v, stmt_struct *s)
+{
+        NOOP(v, s);
+        return NULL;
+}
+
+static void *
+visit_stmt_module(visitor *v, stmt_module *s)
+{
+        NOOP(v, s);
+        return NULL;
+}
+
+static void *
+visit_stmt_import(visitor *v, stmt_import *s)
+{
+        NOOP(v, s);
+        return NULL;
+}
+
+// An embed becomes a function of the frame it runs in, which
+// saves what the lines may clobber that the interpreter needs
+// and points rbp at the frame, so that `[rbp-N]` is the local.
+static void *
+visit_stmt_embed(visitor *v, stmt_embed *s)
+{
+        interp_context *ctx = (interp_context *)v->context;
+
+        // push rbp, rbx, r12-r15; sub rsp, 8; mov rbp, rdi
+        static const uint8_t enter[] = {
+                0x55, 0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57,
+                0x48, 0x83, 0xec, 0x08, 0x48, 0x89, 0xfd,
+        };
+        // add rsp, 8; pop r15-r12, rbx, rbp; ret
+        static const uint8_t leave[] = {
+                0x48, 0x83, 0xc4, 0x08, 0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d,
+                0x41, 0x5c, 0x5b, 0x5d, 0xc3,
+        };
+
+        int at = (int)ctx->thunks.len;
+        for (size_t i = 0; i < sizeof(enter); ++i) {
+                dyn_array_append(ctx->thunks, enter[i]);
+        }
+
+        for (size_t i = 0; i < s->lns.len; ++i) {
+                const char *lx = s->lns.data[i]->lx;
+                char *ln = strndup(lx, strcspn(lx, "\n"));
+                x64_insn in;
+                x64_fixup fix;
+                uint8_t buf[X64_MAX_INSN];
+                int n = -1;
+
+                if (!*ln) {
+                        free(ln);
+                        continue;
+                }
+                if (x64_parse(ln, &in) == 0) {
+                        n = x64_encode(&in, buf, &fix);
+                }
+                if (n < 0 || fix.sym) {
+                        forge_err_wargs("%sthe interpreter cannot run `%s` in an embed",
+                                        loc_err(s->lns.data[i]->loc), lx);
+                }
+                for (int j = 0; j < n; ++j) {
+                        dyn_array_append(ctx->thunks, buf[j]);
+                }
+                free(ln);
+        }
+
+        for (size_t i = 0; i < sizeof(leave); ++i) {
+                dyn_array_append(ctx->thunks, leave[i]);
+        }
+
+        emit(ctx, OP_EMBED, W_64, at);
+
+        return NULL;
+}
+
+static void *
+visit_stmt_empty(visitor *v, stmt_empty *s)
+{
+        NOOP(v, s);
+        return NULL;
+}
+
+static visitor *
+interp_visitor_alloc(interp_context *ctx)
+{
+        return visitor_alloc(
+                (void *)ctx,
+                visit_expr_binary,
+                visit_expr_identifier,
+                visit_expr_integer_literal,
+                visit_expr_string_literal,
+                visit_expr_proccall,
+                visit_expr_mut,
+                visit_expr_brace_init,
+                visit_expr_namespace,
+                visit_expr_arrayinit,
+                visit_expr_index,
+                visit_expr_un,
+                visit_expr_character_literal,
+                visit_expr_cast,
+                visit_expr_bool_literal,
+                visit_expr_null,
+
+                visit_stmt_let,
+                visit_stmt_expr,
+                visit_stmt_block,
+                visit_stmt_proc,
+                visit_stmt_return,
+                visit_stmt_exit,
+                visit_stmt_extern_proc,
+                visit_stmt_if,
+                visit_stmt_while,
+                visit_stmt_for,
+                visit_stmt_break,
+                visit_stmt_continue,
+                visit_stmt_struct,
+                visit_stmt_module,
+                visit_stmt_import,
+                visit_stmt_embed,
+                visit_stmt_empty
+        );
+}
+
+static void
+compile_proc(visitor *v, iproc *p)
+{
+        interp_context *ctx = (interp_context *)v->context;
+        stmt_proc *s = p->s;
+
+        if (s->params.len > INTERP_MAX_PARAMS) {
+                forge_err_wargs("%sthe interpreter takes at most %d parameters",
+                                loc_err(s->base.loc), INTERP_MAX_PARAMS);
+        }
+
+        p->frame = (s->rsp + 15) & ~15;
+        p->nparams = (int)s->params.len;
+        for (size_t i = 0; i < s->params.len; ++i) {
+                const sym *param = s->params.data[i].resolved;
+                assert(param);
+                p->params[i].offset = param->stack_offset;
+                p->params[i].w = width(param->ty);
+        }
+
+        ctx->cur = p;
+        s->blk->accept(s->blk, v);
+
+        // Falling off the end.
+        emit(ctx, OP_IMM, W_64, 0);
+        emit(ctx, OP_RET, W_64, 0);
+}
+
+///////////////////////////////////////////
+// EXECUTION
+///////////////////////////////////////////
+
+typedef struct {
+        const iproc *p;
+        const insn *ip;  // of the call
+        uint8_t *rbp;
+        uint8_t *rsp;
+        int64_t *sp;     // of the values, with the arguments gone
+} iframe;
+
+static int64_t
+execute(const interp_context *ctx, const uint8_t *thunks, const iproc *entry, const int64_t *args)
+{
+        static void *const ops[OP_COUNT] = {
+                [OP_IMM]     = &&op_imm,
+                [OP_CONST]   = &&op_const,
+                [OP_LADDR]   = &&op_laddr,
+                [OP_LLOAD]   = &&op_lload,
+                [OP_LSTORE]  = &&op_lstore,
+                [OP_LMUT]    = &&op_lmut,
+                [OP_LOAD]    = &&op_load,
+                [OP_STORE]   = &&op_store,
+                [OP_MUT]     = &&op_mut,
+                [OP_ZERO]    = &&op_zero,
+                [OP_POP]     = &&op_pop,
+                [OP_ADD]     = &&op_add,
+                [OP_SUB]     = &&op_sub,
+                [OP_MUL]     = &&op_mul,
+                [OP_DIV]     = &&op_div,
+                [OP_MOD]     = &&op_mod,
+                [OP_SCALE]   = &&op_scale,
+                [OP_INDEX]   = &&op_index,
+                [OP_EQ]      = &&op_eq,
+                [OP_NE]      = &&op_ne,
+                [OP_LT]      = &&op_lt,
+                [OP_GT]      = &&op_gt,
+                [OP_LE]      = &&op_le,
+                [OP_GE]      = &&op_ge,
+                [OP_NEG]     = &&op_neg,
+                [OP_NOT]     = &&op_not,
+                [OP_LNOT]    = &&op_lnot,
+                [OP_NORM]    = &&op_norm,
+                [OP_JMP]     = &&op_jmp,
+                [OP_JZ]      = &&op_jz,
+                [OP_JNZ]     = &&op_jnz,
+                [OP_CALL]    = &&op_call,
+                [OP_CALLPTR] = &&op_callptr,
+                [OP_CALLC]   = &&op_callc,
+                [OP_RET]     = &&op_ret,
+                [OP_EXIT]    = &&op_exit,
+                [OP_EMBED]   = &&op_embed,
+        };
+
+        uint8_t *stack   = (uint8_t *)malloc(INTERP_STACK);
+        int64_t *values  = (int64_t *)malloc(sizeof(int64_t) * INTERP_VALUES);
+        iframe  *frames  = (iframe *)malloc(sizeof(iframe) * INTERP_FRAMES);
+        iframe  *fp      = frames;
+        int64_t *sp      = values;       // the top, values[0] is never used
+        uint8_t *rbp     = stack + INTERP_STACK;
+        uint8_t *rsp     = rbp;
+        const iproc *p   = entry;
+        const insn *code = NULL;
+        const insn *ip   = NULL;
+        int64_t  result  = 0;
+
+        if (!stack || !values || !frames) {
+                forge_err("the interpreter could not allocate its stacks");
+        }
+
+        for (int i = 0; i < entry->nparams; ++i) {
+                *++sp = args[i];
+        }
+
+#define NEXT()    do { ++ip; goto *ops[ip->op]; } while (0)
+#define JUMP(to)  do { ip = code + (to); goto *ops[ip->op]; } while (0)
+#define BINARY(x) do { int64_t b = *sp--; *sp = (x); NEXT(); } while (0)
+
+        // Calls come here with `p` the callee and its arguments
+        // on top.
+enter:
+        if (fp == frames + INTERP_FRAMES - 1
+            || sp > values + INTERP_VALUES - INTERP_SLACK
+            || rsp - 16 - p->frame < stack) {
+                fault(p, "stack overflow");
+        }
+        sp -= p->nparams;
+        ++fp;
+        fp->ip  = ip;
+        fp->rbp = rbp;
+        fp->rsp = rsp;
+        fp->sp  = sp;
+        fp->p   = p;
+
+        // Where a return address and the caller's rbp would go.
+        rbp = rsp - 16;
+        rsp = rbp - p->frame;
+        for (int i = 0; i < p->nparams; ++i) {
+                store(rbp - p->params[i].offset, sp[i + 1], p->params[i].w);
+        }
+        code = p->code.data;
+        ip = code;
+        goto *ops[ip->op];
+
+op_imm:
+        *++sp = ip->a;
+        NEXT();
+op_const:
+        *++sp = (int64_t)ctx->consts.data[ip->a];
+        NEXT();
+op_laddr:
+        *++sp = (int64_t)(uintptr_t)(rbp - ip->a);
+        NEXT();
+op_lload:
+        *++sp = load(rbp - ip->a, ip->w);
+        NEXT();
+op_lstore:
+        *sp = norm(*sp, ip->w);
+        store(rbp - ip->a, *sp, ip->w);
+        NEXT();
+op_lmut:
+        *sp = arith(p, ip->k, load(rbp - ip->a, ip->w), *sp, ip->w);
+        store(rbp - ip->a, *sp, ip->w);
+        NEXT();
+op_load:
+        *sp = load((const uint8_t *)(uintptr_t)*sp, ip->w);
+        NEXT();
+op_store: {
+        uint8_t *to = (uint8_t *)(uintptr_t)sp[-1];
+        sp[-1] = norm(sp[0], ip->w);
+        store(to, sp[-1], ip->w);
+        --sp;
+        NEXT();
+}
+op_mut: {
+        uint8_t *to = (uint8_t *)(uintptr_t)sp[-1];
+        sp[-1] = arith(p, ip->k, load(to, ip->w), sp[0], ip->w);
+        store(to, sp[-1], ip->w);
+        --sp;
+        NEXT();
+}
+op_zero:
+        memset(rbp - ip->a, 0, (size_t)*sp--);
+        NEXT();
+op_pop:
+        --sp;
+        NEXT();
+op_add:
+        BINARY(arith(p, K_ADD, *sp, b, ip->w));
+op_sub:
+        BINARY(arith(p, K_SUB, *sp, b, ip->w));
+op_mul:
+        BINARY(arith(p, K_MUL, *sp, b, ip->w));
+op_div:
+        BINARY(arith(p, K_DIV, *sp, b, ip->w));
+op_mod:
+        BINARY(arith(p, K_MOD, *sp, b, ip->w));
+op_scale:
+        *sp = (int64_t)((uint64_t)*sp * (uint64_t)ip->a);
+        NEXT();
+op_index:
+        BINARY((int64_t)((uint64_t)*sp + (uint64_t)b * (uint64_t)ip->a));
+op_eq:
+        BINARY(*sp == b);
+op_ne:
+        BINARY(*sp != b);
+op_lt:
+        BINARY(*sp < b);
+op_gt:
+        BINARY(*sp > b);
+op_le:
+        BINARY(*sp <= b);
+op_ge:
+        BINARY(*sp >= b);
+op_neg:
+        *sp = norm((int64_t)(0 - (uint64_t)*sp), ip->w);
+        NEXT();
+op_not:
+        *sp = norm(~*sp, ip->w);
+        NEXT();
+op_lnot:
+        *sp = *sp == 0;
+        NEXT();
+op_norm:
+        *sp = norm(*sp, ip->w);
+        NEXT();
+op_jmp:
+        JUMP(ip->a);
+op_jz:
+        if (*sp-- == 0) JUMP(ip->a);
+        NEXT();
+op_jnz:
+        if (*sp-- != 0) JUMP(ip->a);
+        NEXT();
+op_call:
+        p = ctx->procs.data[ip->a];
+        goto enter;
+op_callptr: {
+        int64_t f = *sp;
+        if (f & INTERP_PROC_TAG) {
+                --sp;
+                p = ctx->procs.data[f & ~INTERP_PROC_TAG];
+                goto enter;
+        }
+}
+        // fallthrough
+op_callc: {
+        int64_t a[INTERP_MAX_PARAMS] = {0};
+        int64_t f = *sp--;
+        sp -= ip->a;
+        memcpy(a, sp + 1, sizeof(int64_t) * ip->a);
+        *++sp = norm(call_native(f, a), ip->w);
+        NEXT();
+}
+op_ret:
+        result = norm(*sp, ip->w);
+        ip  = fp->ip;
+        rbp = fp->rbp;
+        rsp = fp->rsp;
+        sp  = fp->sp;
+        if (--fp == frames) {
+                goto done;
+        }
+        p = fp->p;
+        code = p->code.data;
+        // The call had the width of the value.
+        *++sp = norm(result, ip->w);
+        NEXT();
+op_exit:
+        fflush(NULL);
+        _exit((int)*sp);
+op_embed:
+        ((void (*)(uint8_t *))(uintptr_t)(thunks + ip->a))(rbp);
+        NEXT();
+
+#undef NEXT
+#undef JUMP
+#undef BINARY
+
+done:
+        free(stack);
+        free(values);
+        free(frames);
+        return result;
+}
+
+// The native code of the embeds, where it may run.
+static uint8_t *
+map_thunks(const u8_array *code)
+{
+        if (!code->len) return NULL;
+
+        uint8_t *m = (uint8_t *)mmap(NULL, code->len, PROT_READ | PROT_WRITE,
+                                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (m == MAP_FAILED) {
+                forge_err("the interpreter could not map its embeds");
+        }
+        memcpy(m, code->data, code->len);
+        if (mprotect(m, code->len, PROT_READ | PROT_EXEC) != 0) {
+                forge_err("the interpreter could not map its embeds");
+        }
+        return m;
+}
+
+int
+interp_run(module_array mods, int argc, char **argv)
+{
+        interp_context ctx;
+        memset(&ctx, 0, sizeof(ctx));
+
+        ctx.procs  = dyn_array_empty(iproc_array);
+        ctx.index  = smap_create(NULL);
+        ctx.consts = dyn_array_empty(u64_array);
+        ctx.strs   = dyn_array_empty(str_array);
+        ctx.thunks = dyn_array_empty(u8_array);
+        ctx.loops  = dyn_array_empty(iloop_array);
+
+        // Every procedure is known before any is compiled, for
+        // the calls ahead of what they call.
+        for (size_t i = 0; i < mods.len; ++i) {
+                module *m = mods.data[i];
+                if (!m->program) {
+                        forge_err_wargs("`%s` has to be interpreted from source", m->src_filepath);
+                }
+                for (size_t j = 0; j < m->program->stmts.len; ++j) {
+                        stmt *s = m->program->stmts.data[j];
+                        if (s->kind != STMT_KIND_PROC) continue;
+
+                        iproc *p = (iproc *)calloc(1, sizeof(iproc));
+                        p->s = (stmt_proc *)s;
+                        p->symbol = reach_symbol(m->tbl->modname, p->s->id->lx);
+                        p->code = dyn_array_empty(insn_array);
+                        dyn_array_append(ctx.procs, p);
+                        smap_insert(&ctx.index, p->symbol, (void *)(uintptr_t)ctx.procs.len);
+                }
+        }
+
+        visitor *v = interp_visitor_alloc(&ctx);
+        for (size_t i = 0; i < ctx.procs.len; ++i) {
+                compile_proc(v, ctx.procs.data[i]);
+        }
+        free(v);
+
+        const iproc *entry = NULL;
+        if (smap_has(&ctx.index, "_start")) {
+                entry = ctx.procs.data[proc_index(&ctx, "_start")];
+        } else if (smap_has(&ctx.index, "main")) {
+                entry = ctx.procs.data[proc_index(&ctx, "main")];
+        } else {
+                forge_err_wargs("`%s` has neither _start nor main to run",
+                                mods.data[mods.len - 1]->src_filepath);
+        }
+
+        int64_t args[INTERP_MAX_PARAMS] = {
+                argc, (int64_t)(uintptr_t)argv, (int64_t)(uintptr_t)environ,
+        };
+
+        uint8_t *thunks = map_thunks(&ctx.thunks);
+        int64_t r = execute(&ctx, thunks, entry, args);
+
+        if (thunks) {
+                munmap(thunks, ctx.thunks.len);
+        }
+        for (size_t i = 0; i < ctx.procs.len; ++i) {
+                free(ctx.procs.data[i]->symbol);
+                dyn_array_free(ctx.procs.data[i]->code);
+                free(ctx.procs.data[i]);
+        }
+        for (size_t i = 0; i < ctx.strs.len; ++i) {
+                free(ctx.strs.data[i]);
+        }
+        dyn_array_free(ctx.procs);
+        dyn_array_free(ctx.consts);
+        dyn_array_free(ctx.strs);
+        dyn_array_free(ctx.thunks);
+        dyn_array_free(ctx.loops);
+        smap_free(&ctx.index);
+
+        return (int)r;
+}
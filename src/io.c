@@ -1,39 +1,159 @@
 #include "io.h"
 #include "loc.h"
 #include "global.h"
+#include "flags.h"
 
 #include <forge/array.h>
 #include <forge/io.h>
 #include <forge/cstr.h>
+#include <forge/err.h>
 
+#include <dirent.h>
+#include <errno.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 char *
-read_file_from_searchpaths(char **fp, const loc *loc)
+find_file_from_searchpaths(const char *fp)
 {
-        char *s = forge_io_read_file_to_cstr(*fp);
-        if (s) return s;
+        if (access(fp, R_OK) == 0) return strdup(fp);
 
         for (size_t i = 0; i < g_config.search_paths.len; ++i) {
-                char *path = forge_cstr_builder(g_config.search_paths.data[i], "/", *fp, NULL);
-                s = forge_io_read_file_to_cstr(path);
-                if (s) {
-                        *fp = path;
-                        break;
-                }
+                char *path = forge_cstr_builder(g_config.search_paths.data[i], "/", fp, NULL);
+                if (access(path, R_OK) == 0) return path;
                 free(path);
         }
 
+        return NULL;
+}
+
+void
+searchpaths_err(const char *fp, const loc *loc)
+{
+        fprintf(stderr, "%scould not find file `%s`\n", (loc ? loc_err(*loc) : ""), fp);
+        for (size_t i = 0; i < g_config.search_paths.len; ++i) {
+                if (i == 0)
+                        fprintf(stderr, "out of the following paths:\n");
+                fprintf(stderr, "    %s\n", g_config.search_paths.data[i]);
+        }
+        if ((g_config.flags & FLAG_TYPE_INTERP) && !strncmp(fp, "std/", 4)) {
+                fprintf(stderr, "--%s runs std from source, which is installed with libcrstd.a;\n"
+                                "pass --%s or -I with the directory that has std/ in it\n",
+                        FLAG_2HY_INTERP, FLAG_2HY_STDDIR);
+        }
+        exit(1);
+}
+
+char *
+read_file_from_searchpaths(char **fp, const loc *loc)
+{
+        char *path = find_file_from_searchpaths(*fp);
+        char *s = path ? forge_io_read_file_to_cstr(path) : NULL;
+
         if (!s) {
-                fprintf(stderr, "%scould not find file `%s`\n", (loc ? loc_err(*loc) : ""), *fp);
-                for (size_t i = 0; i < g_config.search_paths.len; ++i) {
-                        if (i == 0)
-                                fprintf(stderr, "out of the following paths:\n");
-                        fprintf(stderr, "    %s\n", g_config.search_paths.data[i]);
-                }
-                exit(1);
+                searchpaths_err(*fp, loc);
         }
 
+        *fp = path;
         return s;
 }
+
+extern char **environ;
+
+static char  *g_tmpdir       = NULL;
+static pid_t  g_tmpdir_owner = 0;
+
+static void
+remove_tmpdir(void)
+{
+        // Forked children inherit the handler, not the directory.
+        if (!g_tmpdir || getpid() != g_tmpdir_owner) return;
+
+        // An error can end the build while assemblers still write
+        // to the directory.
+        while (waitpid(-1, NULL, 0) > 0 || errno == EINTR)
+                ;
+
+        DIR *dir = opendir(g_tmpdir);
+        if (dir) {
+                struct dirent *e;
+                while ((e = readdir(dir))) {
+                        if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) continue;
+                        char *path = forge_cstr_builder(g_tmpdir, "/", e->d_name, NULL);
+                        unlink(path);
+                        free(path);
+                }
+                closedir(dir);
+        }
+        rmdir(g_tmpdir);
+}
+
+const char *
+private_tmpdir(void)
+{
+        if (g_tmpdir && g_tmpdir_owner == getpid()) return g_tmpdir;
+
+        const char *base = getenv("TMPDIR");
+        if (!base || !*base) base = "/tmp";
+
+        char *dir = forge_cstr_builder(base, "/cruc-XXXXXX", NULL);
+        if (!mkdtemp(dir)) {
+                forge_err_wargs("could not create a temporary directory in `%s`: %s", base, strerror(errno));
+        }
+
+        if (!g_tmpdir_owner) {
+                atexit(remove_tmpdir);
+        }
+        g_tmpdir       = dir;
+        g_tmpdir_owner = getpid();
+
+        return g_tmpdir;
+}
+
+pid_t
+spawn_start(char *const argv[])
+{
+        if (g_config.flags & FLAG_TYPE_VERBOSE) {
+                printf("[cmd]");
+                for (size_t i = 0; argv[i]; ++i) {
+                        printf(" %s", argv[i]);
+                }
+                printf("\n");
+        }
+
+        fflush(stdout);
+        fflush(stderr);
+
+        pid_t pid;
+        int err = posix_spawnp(&pid, argv[0], NULL, NULL, argv, environ);
+        if (err) {
+                fprintf(stderr, "could not run `%s`: %s\n", argv[0], strerror(err));
+                return -1;
+        }
+
+        return pid;
+}
+
+int
+spawn_wait(pid_t pid)
+{
+        if (pid == 0) return 0;
+        if (pid < 0) return -1;
+
+        int status = 0;
+        while (waitpid(pid, &status, 0) < 0) {
+                if (errno != EINTR) return -1;
+        }
+
+        return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+int
+spawn(char *const argv[])
+{
+        return spawn_wait(spawn_start(argv));
+}
@@ -0,0 +1,1198 @@
+#include "ir.h"
+#include "visitor.h"
+#include "sem.h"
+#include "types.h"
+#include "lexer.h"
+#include "kwds.h"
+#include "loc.h"
+#include "reach.h"
+#include "mem.h"
+
+#include <forge/err.h>
+#include <forge/utils.h>
+#include <forge/array.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+        const void *s;  // the while or for
+        int header;     // where `continue` goes
+        int exit;       // and `break`
+} ir_loop;
+
+DYN_ARRAY_TYPE(ir_loop, ir_loop_array);
+
+typedef struct {
+        ir_proc *p;
+        int cur;             // see here()
+        int value;           // of the last expression, see val()
+        ir_loop_array loops; // innermost last
+} lower_context;
+
+static const char *g_op_names[IR_OP_COUNT] = {
+        [IR_CONST] = "const",   [IR_SYM] = "sym",         [IR_STR] = "str",
+        [IR_SLOTADDR] = "slotaddr", [IR_PARAM] = "param", [IR_LDSLOT] = "ldslot",
+        [IR_STSLOT] = "stslot", [IR_LOAD] = "load",       [IR_STORE] = "store",
+        [IR_ADD] = "add",       [IR_SUB] = "sub",         [IR_MUL] = "mul",
+        [IR_DIV] = "div",       [IR_MOD] = "mod",         [IR_NEG] = "neg",
+        [IR_NOT] = "not",       [IR_EQ] = "eq",           [IR_NE] = "ne",
+        [IR_LT] = "lt",         [IR_GT] = "gt",           [IR_LE] = "le",
+        [IR_GE] = "ge",         [IR_EXT] = "ext",         [IR_MOV] = "mov",
+        [IR_PHI] = "phi",       [IR_CALL] = "call",       [IR_ZERO] = "zero",
+        [IR_EMBED] = "embed",   [IR_JMP] = "jmp",         [IR_BR] = "br",
+        [IR_RET] = "ret",       [IR_EXIT] = "exit",       [IR_UNREACHABLE] = "unreachable",
+};
+
+int
+ir_is_terminator(int op)
+{
+        return op == IR_JMP || op == IR_BR || op == IR_RET || op == IR_EXIT || op == IR_UNREACHABLE;
+}
+
+int
+ir_nuses(const ir_insn *in)
+{
+        return 2 + (in->op == IR_CALL ? in->nargs : 0);
+}
+
+int
+ir_use(const ir_insn *in, int i)
+{
+        switch (i) {
+        case 0:  return in->a;
+        case 1:  return in->b;
+        default: return in->args[i - 2];
+        }
+}
+
+static int
+is_unsigned(const type *t)
+{
+        return type_is_unsigned(t) || t->kind == TYPE_KIND_BOOL;
+}
+
+static ir_insn
+mk(ir_op op, int sz, loc loc)
+{
+        ir_insn in;
+        memset(&in, 0, sizeof(in));
+        in.op  = (uint8_t)op;
+        in.sz  = (uint8_t)sz;
+        in.dst = -1;
+        in.a   = -1;
+        in.b   = -1;
+        in.loc = loc;
+        return in;
+}
+
+static int
+new_block(lower_context *ctx)
+{
+        ir_block b;
+        memset(&b, 0, sizeof(b));
+        b.insns   = dyn_array_empty(ir_insn_array);
+        b.succ[0] = -1;
+        b.succ[1] = -1;
+        b.preds   = dyn_array_empty(int_array);
+        dyn_array_append(ctx->p->blocks, b);
+        return (int)ctx->p->blocks.len - 1;
+}
+
+// The block being appended to. What follows a terminator goes
+// into a block of its own, which nothing may reach.
+static int
+here(lower_context *ctx)
+{
+        if (ctx->cur < 0) ctx->cur = new_block(ctx);
+        return ctx->cur;
+}
+
+static void
+append(lower_context *ctx, ir_insn in)
+{
+        dyn_array_append(ctx->p->blocks.data[here(ctx)].insns, in);
+}
+
+// Appends `in` as the definition of a new virtual register.
+static int
+def(lower_context *ctx, ir_insn in)
+{
+        in.dst = ctx->p->nvregs++;
+        append(ctx, in);
+        return in.dst;
+}
+
+static void
+edge(lower_context *ctx, int from, int to)
+{
+        ir_block *b = &ctx->p->blocks.data[from];
+        b->succ[b->succ[0] < 0 ? 0 : 1] = to;
+        dyn_array_append(ctx->p->blocks.data[to].preds, from);
+}
+
+// Ends the current block with `in`.
+static void
+terminate(lower_context *ctx, ir_insn in, int to0, int to1)
+{
+        int from = here(ctx);
+        append(ctx, in);
+        if (to0 >= 0) edge(ctx, from, to0);
+        if (to1 >= 0) edge(ctx, from, to1);
+        ctx->cur = -1;
+}
+
+// Nothing jumps from where nothing reaches.
+static void
+jump(lower_context *ctx, int to, loc loc)
+{
+        if (ctx->cur >= 0) {
+                terminate(ctx, mk(IR_JMP, 0, loc), to, -1);
+        }
+}
+
+static void
+branch(lower_context *ctx, int cond, int sz, int t, int f, loc loc)
+{
+        ir_insn in = mk(IR_BR, sz, loc);
+        in.a = cond;
+        terminate(ctx, in, t, f);
+}
+
+// Continues in `b`, which the current block falls through to.
+static void
+enter(lower_context *ctx, int b, loc loc)
+{
+        jump(ctx, b, loc);
+        ctx->cur = b;
+}
+
+static int
+konst(lower_context *ctx, int64_t x, int sz, loc loc)
+{
+        ir_insn in = mk(IR_CONST, sz, loc);
+        in.imm = x;
+        return def(ctx, in);
+}
+
+static int
+unop(lower_context *ctx, ir_op op, int sz, int a, loc loc)
+{
+        ir_insn in = mk(op, sz, loc);
+        in.a = a;
+        return def(ctx, in);
+}
+
+static int
+binop(lower_context *ctx, ir_op op, int sz, int flags, int a, int b, loc loc)
+{
+        ir_insn in = mk(op, sz, loc);
+        in.flags = (uint8_t)flags;
+        in.a = a;
+        in.b = b;
+        return def(ctx, in);
+}
+
+static int
+cmp(lower_context *ctx, ir_op op, int asz, int flags, int a, int b, loc loc)
+{
+        ir_insn in = mk(op, 1, loc);
+        in.asz = (uint8_t)asz;
+        in.flags = (uint8_t)flags;
+        in.a = a;
+        in.b = b;
+        return def(ctx, in);
+}
+
+// `v` of type `t` as `sz` bytes, extended as `t` says.
+static int
+widen(lower_context *ctx, int v, const type *t, int sz, loc loc)
+{
+        if (t->sz >= sz) return v;
+
+        ir_insn in = mk(IR_EXT, sz, loc);
+        in.asz = (uint8_t)t->sz;
+        in.flags = is_unsigned(t) ? IR_UNSIGNED : 0;
+        in.a = v;
+        return def(ctx, in);
+}
+
+static int
+ldslot(lower_context *ctx, int offset, int sz, loc loc)
+{
+        ir_insn in = mk(IR_LDSLOT, sz, loc);
+        in.imm = offset;
+        return def(ctx, in);
+}
+
+static void
+stslot(lower_context *ctx, int offset, int sz, int v, loc loc)
+{
+        ir_insn in = mk(IR_STSLOT, sz, loc);
+        in.imm = offset;
+        in.a = v;
+        append(ctx, in);
+}
+
+static int
+load(lower_context *ctx, int addr, int sz, loc loc)
+{
+        ir_insn in = mk(IR_LOAD, sz, loc);
+        in.a = addr;
+        return def(ctx, in);
+}
+
+static void
+store(lower_context *ctx, int addr, int sz, int v, loc loc)
+{
+        ir_insn in = mk(IR_STORE, sz, loc);
+        in.a = addr;
+        in.b = v;
+        append(ctx, in);
+}
+
+static const char *
+keep(lower_context *ctx, char *s)
+{
+        dyn_array_append(ctx->p->strs, s);
+        return s;
+}
+
+static int
+val(visitor *v, expr *e)
+{
+        lower_context *ctx = (lower_context *)v->context;
+        ctx->value = -1;
+        e->accept(e, v);
+        assert(ctx->value >= 0);
+        return ctx->value;
+}
+
+static void *
+result(lower_context *ctx, int value)
+{
+        ctx->value = value;
+        return NULL;
+}
+
+// A value of `sz` bytes that lives in a register.
+static void
+check_size(int sz, loc loc)
+{
+        if (sz != 1 && sz != 2 && sz != 4 && sz != 8) {
+                forge_err_wargs("%sa value of %d bytes does not fit in a register", loc_err(loc), sz);
+        }
+}
+
+// The procedure that `e` names directly, if it does.
+static const expr_identifier *
+callee_of(const expr *e)
+{
+        while (e->kind == EXPR_KIND_NAMESPACE) {
+                e = ((const expr_namespace *)e)->e;
+        }
+        if (e->kind != EXPR_KIND_IDENTIFIER) return NULL;
+        const expr_identifier *id = (const expr_identifier *)e;
+        return id->resolved && id->resolved->ty->kind == TYPE_KIND_PROC ? id : NULL;
+}
+
+static ir_op
+arith_op(token_type ty)
+{
+        switch (ty) {
+        case TOKEN_TYPE_PLUS:
+        case TOKEN_TYPE_PLUS_EQUALS:          return IR_ADD;
+        case TOKEN_TYPE_MINUS:
+        case TOKEN_TYPE_MINUS_EQUALS:         return IR_SUB;
+        case TOKEN_TYPE_ASTERISK:
+        case TOKEN_TYPE_ASTERISK_EQUALS:      return IR_MUL;
+        case TOKEN_TYPE_FORWARDSLASH:
+        case TOKEN_TYPE_FORWARDSLASH_EQUALS:  return IR_DIV;
+        case TOKEN_TYPE_PERCENT:
+        case TOKEN_TYPE_PERCENT_EQUALS:       return IR_MOD;
+        default:                              return IR_OP_COUNT;
+        }
+}
+
+// `n` of type `t` in elements of `elemsz` bytes, as the 8
+// bytes to add to a pointer.
+static int
+scale(lower_context *ctx, int n, const type *t, int elemsz, loc loc)
+{
+        n = widen(ctx, n, t, 8, loc);
+        if (elemsz == 1) return n;
+        return binop(ctx, IR_MUL, 8, 0, n, konst(ctx, elemsz, 8, loc), loc);
+}
+
+// The address of the element `e` refers to.
+static int
+index_addr(visitor *v, expr_index *e)
+{
+        lower_context *ctx = (lower_context *)v->context;
+        loc loc = ((expr *)e)->loc;
+        int elemsz = ((type_list *)e->lhs->type)->elemty->sz;
+
+        int base = val(v, e->lhs);
+        int i = scale(ctx, val(v, e->idx), e->idx->type, elemsz, loc);
+        return binop(ctx, IR_ADD, 8, 0, base, i, loc);
+}
+
+// `&&` and `||` as a branch around the right-hand side, which
+// only runs if the left one did not decide.
+static int
+logical(visitor *v, expr_bin *e)
+{
+        lower_context *ctx = (lower_context *)v->context;
+        loc loc = ((expr *)e)->loc;
+        int is_and = e->op->ty == TOKEN_TYPE_DOUBLE_AMPERSAND;
+
+        int lhs = val(v, e->lhs);
+        int decided = konst(ctx, !is_and, 1, loc);
+        int from_lhs = ctx->cur;
+        int rhs_b = new_block(ctx);
+        int done = new_block(ctx);
+
+        if (is_and) {
+                branch(ctx, lhs, e->lhs->type->sz, rhs_b, done, loc);
+        } else {
+                branch(ctx, lhs, e->lhs->type->sz, done, rhs_b, loc);
+        }
+
+        ctx->cur = rhs_b;
+        int rhs = val(v, e->rhs);
+        int zero = konst(ctx, 0, e->rhs->type->sz, loc);
+        int r = cmp(ctx, IR_NE, e->rhs->type->sz, 0, rhs, zero, loc);
+        int from_rhs = ctx->cur;
+        enter(ctx, done, loc);
+
+        ir_insn phi = mk(IR_PHI, 1, loc);
+        phi.nargs = 2;
+        phi.args = (int *)alloc(2 * sizeof(int));
+        phi.preds = (int *)alloc(2 * sizeof(int));
+        phi.args[0] = decided;
+        phi.preds[0] = from_lhs;
+        phi.args[1] = r;
+        phi.preds[1] = from_rhs;
+        return def(ctx, phi);
+}
+
+static void *
+visit_expr_binary(visitor *v, expr_bin *e)
+{
+        lower_context *ctx = (lower_context *)v->context;
+        token_type op = e->op->ty;
+        loc loc = ((expr *)e)->loc;
+
+        if (op == TOKEN_TYPE_DOUBLE_AMPERSAND || op == TOKEN_TYPE_DOUBLE_PIPE) {
+                return result(ctx, logical(v, e));
+        }
+
+        ir_op c = IR_OP_COUNT;
+        switch (op) {
+        case TOKEN_TYPE_DOUBLE_EQUALS:      c = IR_EQ; break;
+        case TOKEN_TYPE_BANG_EQUALS:        c = IR_NE; break;
+        case TOKEN_TYPE_LESSTHAN:           c = IR_LT; break;
+        case TOKEN_TYPE_GREATERTHAN:        c = IR_GT; break;
+        case TOKEN_TYPE_LESSTHAN_EQUALS:    c = IR_LE; break;
+        case TOKEN_TYPE_GREATERTHAN_EQUALS: c = IR_GE; break;
+        default: break;
+        }
+        if (c != IR_OP_COUNT) {
+                int sz = e->lhs->type->sz > e->rhs->type->sz ? e->lhs->type->sz : e->rhs->type->sz;
+                int a = widen(ctx, val(v, e->lhs), e->lhs->type, sz, loc);
+                int b = widen(ctx, val(v, e->rhs), e->rhs->type, sz, loc);
+                return result(ctx, cmp(ctx, c, sz, is_unsigned(e->lhs->type) ? IR_UNSIGNED : 0, a, b, loc));
+        }
+
+        ir_op k = arith_op(op);
+        if (k == IR_OP_COUNT) {
+                forge_err_wargs("%sunsupported binary operator `%s`", loc_err(e->op->loc), e->op->lx);
+        }
+
+        // Pointer arithmetic: the pointer first, then the
+        // integer, scaled.
+        if (e->lhs->type->kind == TYPE_KIND_PTR || e->rhs->type->kind == TYPE_KIND_PTR) {
+                expr *ptr = e->lhs->type->kind == TYPE_KIND_PTR ? e->lhs : e->rhs;
+                expr *n   = e->lhs->type->kind == TYPE_KIND_PTR ? e->rhs : e->lhs;
+                int p = val(v, ptr);
+                int x = scale(ctx, val(v, n), n->type, ((type_ptr *)ptr->type)->to->sz, loc);
+                return result(ctx, binop(ctx, k, 8, 0, p, x, loc));
+        }
+
+        int sz = e->lhs->type->sz;
+        check_size(sz, loc);
+        int a = val(v, e->lhs);
+        int b = widen(ctx, val(v, e->rhs), e->rhs->type, sz, loc);
+        return result(ctx, binop(ctx, k, sz, is_unsigned(e->lhs->type) ? IR_UNSIGNED : 0, a, b, loc));
+}
+
+static void *
+visit_expr_identifier(visitor *v, expr_identifier *e)
+{
+        lower_context *ctx = (lower_context *)v->context;
+        const sym *s = e->resolved;
+        loc loc = ((expr *)e)->loc;
+
+        assert(s);
+
+        if (s->extern_ || ((expr *)e)->type->kind == TYPE_KIND_PROC) {
+                ir_insn in = mk(IR_SYM, 8, loc);
+                in.sym = s->extern_ ? e->id->lx : keep(ctx, reach_symbol(s->modname, e->id->lx));
+                return result(ctx, def(ctx, in));
+        }
+
+        check_size(s->ty->sz, loc);
+        return result(ctx, ldslot(ctx, s->stack_offset, s->ty->sz, loc));
+}
+
+static void *
+visit_expr_integer_literal(visitor *v, expr_integer_literal *e)
+{
+        lower_context *ctx = (lower_context *)v->context;
+        expr *x = (expr *)e;
+        return result(ctx, konst(ctx, strtoll(e->i->lx, NULL, 10), x->type->sz, x->loc));
+}
+
+static void *
+visit_expr_string_literal(visitor *v, expr_string_literal *e)
+{
+        lower_context *ctx = (lower_context *)v->context;
+        ir_insn in = mk(IR_STR, 8, ((expr *)e)->loc);
+        in.sym = e->s->lx;
+        return result(ctx, def(ctx, in));
+}
+
+static void *
+visit_expr_proccall(visitor *v, expr_proccall *e)
+{
+        lower_context *ctx = (lower_context *)v->context;
+        loc loc = ((expr *)e)->loc;
+        int variadic = 0;
+        type *rettype = NULL;
+
+        if (e->args.len > 6) {
+                forge_err_wargs("%sonly 6 procedure arguments are supported", loc_err(loc));
+        }
+
+        assert(e->lhs->type->kind == TYPE_KIND_PROC || e->lhs->type->kind == TYPE_KIND_PROCPTR);
+        if (e->lhs->type->kind == TYPE_KIND_PROC) {
+                variadic = ((type_proc *)e->lhs->type)->variadic;
+                rettype = ((type_proc *)e->lhs->type)->rettype;
+        } else {
+                variadic = ((type_procptr *)e->lhs->type)->variadic;
+                rettype = ((type_procptr *)e->lhs->type)->rettype;
+        }
+
+        int sz = rettype->kind == TYPE_KIND_VOID || rettype->kind == TYPE_KIND_NORETURN ? 8 : rettype->sz;
+        ir_insn in = mk(IR_CALL, sz, loc);
+        in.flags = variadic ? IR_VARIADIC : 0;
+        in.nargs = (int)e->args.len;
+        in.args = (int *)alloc((e->args.len + 1) * sizeof(int));
+
+        for (size_t i = 0; i < e->args.len; ++i) {
+                in.args[i] = val(v, e->args.data[i]);
+        }
+
+        // Externs are called through their address, as the
+        // linker may put them anywhere.
+        const expr_identifier *id = callee_of(e->lhs);
+        if (id && !id->resolved->extern_) {
+                in.sym = keep(ctx, reach_symbol(id->resolved->modname, id->id->lx));
+        } else {
+                in.a = val(v, e->lhs);
+        }
+
+        int call = def(ctx, in);
+        if (rettype->kind == TYPE_KIND_NORETURN) {
+                terminate(ctx, mk(IR_UNREACHABLE, 0, loc), -1, -1);
+        }
+        return result(ctx, call);
+}
+
+// The compound assignment `op` of `x` and `rhs` of type `t`.
+static int
+combine(visitor *v, expr_mut *e, const type *t, int x, int rhs)
+{
+        lower_context *ctx = (lower_context *)v->context;
+        loc loc = ((expr *)e)->loc;
+        ir_op k = arith_op(e->op->ty);
+
+        if (k == IR_OP_COUNT) {
+                forge_err_wargs("%sunsupported operator `%s`", loc_err(e->op->loc), e->op->lx);
+        }
+        if (t->kind == TYPE_KIND_PTR) {
+                rhs = scale(ctx, rhs, e->rhs->type, ((type_ptr *)t)->to->sz, loc);
+                return binop(ctx, k, 8, 0, x, rhs, loc);
+        }
+        rhs = widen(ctx, rhs, e->rhs->type, t->sz, loc);
+        return binop(ctx, k, t->sz, is_unsigned(t) ? IR_UNSIGNED : 0, x, rhs, loc);
+}
+
+static void *
+visit_expr_mut(visitor *v, expr_mut *e)
+{
+        lower_context *ctx = (lower_context *)v->context;
+        loc loc = ((expr *)e)->loc;
+        int assign = e->op->ty == TOKEN_TYPE_EQUALS;
+
+        switch (e->lhs->kind) {
+        case EXPR_KIND_IDENTIFIER: {
+                const sym *s = ((expr_identifier *)e->lhs)->resolved;
+                assert(s);
+                check_size(s->ty->sz, loc);
+
+                int rhs = val(v, e->rhs);
+                int x = assign
+                        ? widen(ctx, rhs, e->rhs->type, s->ty->sz, loc)
+                        : combine(v, e, s->ty, ldslot(ctx, s->stack_offset, s->ty->sz, loc), rhs);
+                stslot(ctx, s->stack_offset, s->ty->sz, x, loc);
+                return result(ctx, x);
+        }
+        case EXPR_KIND_INDEX:
+        case EXPR_KIND_UNARY: {
+                const type *t = NULL;
+                int addr = -1;
+
+                if (e->lhs->kind == EXPR_KIND_INDEX) {
+                        expr_index *idx = (expr_index *)e->lhs;
+                        t = ((type_list *)idx->lhs->type)->elemty;
+                        addr = index_addr(v, idx);
+                } else {
+                        expr_un *un = (expr_un *)e->lhs;
+                        if (un->op->ty != TOKEN_TYPE_ASTERISK || un->rhs->type->kind != TYPE_KIND_PTR) {
+                                forge_err_wargs("%scannot assign to `%s`", loc_err(un->op->loc), un->op->lx);
+                        }
+                        t = ((type_ptr *)un->rhs->type)->to;
+                        addr = val(v, un->rhs);
+                }
+                check_size(t->sz, loc);
+
+                int rhs = val(v, e->rhs);
+                int x = assign
+                        ? widen(ctx, rhs, e->rhs->type, t->sz, loc)
+                        : combine(v, e, t, load(ctx, addr, t->sz, loc), rhs);
+                store(ctx, addr, t->sz, x, loc);
+                return result(ctx, x);
+        }
+        default:
+                forge_err_wargs("%scannot assign to an expression of kind `%d`", loc_err(e->lhs->loc), (int)e->lhs->kind);
+        }
+
+        return NULL; // unreachable
+}
+
+static void *
+visit_expr_brace_init(visitor *v, expr_brace_init *e)
+{
+        lower_context *ctx = (lower_context *)v->context;
+        loc loc = ((expr *)e)->loc;
+
+        for (size_t i = 0; i < e->resolved_syms->len; ++i) {
+                const sym *s = e->resolved_syms->data[i];
+                check_size(s->ty->sz, loc);
+                int x = widen(ctx, val(v, e->exprs.data[i]), e->exprs.data[i]->type, s->ty->sz, loc);
+                stslot(ctx, s->stack_offset, s->ty->sz, x, loc);
+        }
+
+        return result(ctx, konst(ctx, 0, 8, loc));
+}
+
+static void *
+visit_expr_namespace(visitor *v, expr_namespace *e)
+{
+        return e->e->accept(e->e, v);
+}
+
+// The expressions come last element first, each stored below
+// the one before it. The value is the address of the first.
+static void *
+visit_expr_arrayinit(visitor *v, expr_arrayinit *e)
+{
+        lower_context *ctx = (lower_context *)v->context;
+        loc loc = ((expr *)e)->loc;
+        type_list *ty = (type_list *)((expr *)e)->type;
+        int szsum = ty->elemty->sz * ty->len;
+
+        if (e->zeroed) {
+                ir_insn in = mk(IR_ZERO, 0, loc);
+                in.imm = e->stack_offset_base + szsum;
+                in.imm2 = szsum;
+                append(ctx, in);
+        }
+
+        int offset = 0;
+        for (size_t i = 0; i < e->exprs.len; ++i) {
+                expr *x = e->exprs.data[i];
+                offset += x->type->sz;
+                check_size(x->type->sz, x->loc);
+                stslot(ctx, e->stack_offset_base + offset, x->type->sz, val(v, x), loc);
+        }
+
+        ir_insn in = mk(IR_SLOTADDR, 8, loc);
+        in.imm = e->stack_offset_base + szsum;
+        in.imm2 = szsum;
+        return result(ctx, def(ctx, in));
+}
+
+static void *
+visit_expr_index(visitor *v, expr_index *e)
+{
+        lower_context *ctx = (lower_context *)v->context;
+        type *elemty = ((type_list *)e->lhs->type)->elemty;
+        loc loc = ((expr *)e)->loc;
+
+        check_size(elemty->sz, loc);
+        return result(ctx, load(ctx, index_addr(v, e), elemty->sz, loc));
+}
+
+static void *
+visit_expr_un(visitor *v, expr_un *e)
+{
+        lower_context *ctx = (lower_context *)v->context;
+        loc loc = ((expr *)e)->loc;
+        int sz = e->rhs->type->sz;
+
+        switch (e->op->ty) {
+        case TOKEN_TYPE_AMPERSAND:
+                if (e->rhs->kind == EXPR_KIND_IDENTIFIER) {
+                        const sym *s = ((expr_identifier *)e->rhs)->resolved;
+                        assert(s);
+                        ir_insn in = mk(IR_SLOTADDR, 8, loc);
+                        in.imm = s->stack_offset;
+                        in.imm2 = s->ty->sz;
+                        return result(ctx, def(ctx, in));
+                }
+                if (e->rhs->kind == EXPR_KIND_INDEX) {
+                        return result(ctx, index_addr(v, (expr_index *)e->rhs));
+                }
+                forge_err_wargs("%scannot take the address of an expression of kind `%d`",
+                                loc_err(e->op->loc), (int)e->rhs->kind);
+                break;
+        case TOKEN_TYPE_ASTERISK: {
+                int to = ((type_ptr *)e->rhs->type)->to->sz;
+                check_size(to, loc);
+                return result(ctx, load(ctx, val(v, e->rhs), to, loc));
+        }
+        case TOKEN_TYPE_MINUS:
+                return result(ctx, unop(ctx, IR_NEG, sz, val(v, e->rhs), loc));
+        case TOKEN_TYPE_TILDE:
+                return result(ctx, unop(ctx, IR_NOT, sz, val(v, e->rhs), loc));
+        case TOKEN_TYPE_BANG: {
+                int x = val(v, e->rhs);
+                return result(ctx, cmp(ctx, IR_EQ, sz, 0, x, konst(ctx, 0, sz, loc), loc));
+        }
+        default:
+                forge_err_wargs("%sunsupported unary operator `%s`", loc_err(e->op->loc), e->op->lx);
+        }
+
+        return NULL; // unreachable
+}
+
+static void *
+visit_expr_character_literal(visitor                *v,
+                             expr_character_literal *e)
+{
+        lower_context *ctx = (lower_context *)v->context;
+        expr *x = (expr *)e;
+        return result(ctx, konst(ctx, e->c->lx[0], x->type->sz, x->loc));
+}
+
+// Narrowing keeps the low bytes, which is what the value
+// already is.
+static void *
+visit_expr_cast(visitor *v, expr_cast *e)
+{
+        lower_context *ctx = (lower_context *)v->context;
+        expr *x = (expr *)e;
+        check_size(x->type->sz, x->loc);
+        return result(ctx, widen(ctx, val(v, e->rhs), e->rhs->type, x->type->sz, x->loc));
+}
+
+static void *
+visit_expr_bool_literal(visitor *v, expr_bool_literal *e)
+{
+        lower_context *ctx = (lower_context *)v->context;
+        return result(ctx, konst(ctx, strcmp(e->b->lx, KWD_TRUE) == 0, 1, ((expr *)e)->loc));
+}
+
+static void *
+visit_expr_null(visitor *v, expr_null *e)
+{
+        lower_context *ctx = (lower_context *)v->context;
+        return result(ctx, konst(ctx, 0, 8, ((expr *)e)->loc));
+}
+
+static void *
+visit_stmt_let(visitor *v, stmt_let *s)
+{
+        lower_context *ctx = (lower_context *)v->context;
+
+        int x = val(v, s->e);
+        if (s->resolved->ty->kind != TYPE_KIND_STRUCT) {
+                check_size(s->e->type->sz, s->base.loc);
+                stslot(ctx, s->resolved->stack_offset, s->e->type->sz, x, s->base.loc);
+        }
+
+        return NULL;
+}
+
+static void *
+visit_stmt_expr(visitor *v, stmt_expr *s)
+{
+        (void)val(v, s->e);
+        return NULL;
+}
+
+static void *
+visit_stmt_block(visitor *v, stmt_block *s)
+{
+        for (size_t i = 0; i < s->stmts.len; ++i) {
+                stmt *stmt = s->stmts.data[i];
+                stmt->accept(stmt, v);
+        }
+        return NULL;
+}
+
+// Nested ones are not lowered.
+static void *
+visit_stmt_proc(visitor *v, stmt_proc *s)
+{
+        NOOP(v, s);
+        return NULL;
+}
+
+static void *
+visit_stmt_return(visitor *v, stmt_return *s)
+{
+        lower_context *ctx = (lower_context *)v->context;
+        ir_insn in = mk(IR_RET, s->e ? s->e->type->sz : 8, s->base.loc);
+
+        if (s->e) {
+                in.a = val(v, s->e);
+        }
+        terminate(ctx, in, -1, -1);
+
+        return NULL;
+}
+
+static void *
+visit_stmt_exit(visitor *v, stmt_exit *s)
+{
+        lower_context *ctx = (lower_context *)v->context;
+        ir_insn in = mk(IR_EXIT, 8, s->base.loc);
+
+        in.a = s->e ? val(v, s->e) : konst(ctx, 0, 8, s->base.loc);
+        terminate(ctx, in, -1, -1);
+
+        return NULL;
+}
+
+static void *
+visit_stmt_extern_proc(visitor *v, stmt_extern_proc *s)
+{
+        NOOP(v, s);
+        return NULL;
+}
+
+static void *
+visit_stmt_if(visitor *v, stmt_if *s)
+{
+        lower_context *ctx = (lower_context *)v->context;
+        loc loc = s->base.loc;
+
+        int c = val(v, s->e);
+        int then = new_block(ctx);
+        int else_ = s->else_ ? new_block(ctx) : -1;
+        int done = new_block(ctx);
+
+        branch(ctx, c, s->e->type->sz, then, s->else_ ? else_ : done, loc);
+
+        ctx->cur = then;
+        s->then->accept(s->then, v);
+        jump(ctx, done, loc);
+
+        if (s->else_) {
+                ctx->cur = else_;
+                s->else_->accept(s->else_, v);
+                jump(ctx, done, loc);
+        }
+
+        ctx->cur = done;
+
+        return NULL;
+}
+
+static void
+loop_begin(lower_context *ctx, const void *s, int header, int exit)
+{
+        ir_loop l = {s, header, exit};
+        dyn_array_append(ctx->loops, l);
+}
+
+static const ir_loop *
+loop_of(lower_context *ctx, const void *s)
+{
+        for (size_t i = ctx->loops.len; i-- > 0;) {
+                if (ctx->loops.data[i].s == s) return &ctx->loops.data[i];
+        }
+        assert(0 && "break or continue outside of its loop");
+        return NULL;
+}
+
+static void *
+visit_stmt_while(visitor *v, stmt_while *s)
+{
+        lower_context *ctx = (lower_context *)v->context;
+        loc loc = s->base.loc;
+        int header = new_block(ctx);
+
+        enter(ctx, header, loc);
+        int c = val(v, s->e);
+        int body = new_block(ctx);
+        int exit = new_block(ctx);
+        branch(ctx, c, s->e->type->sz, body, exit, loc);
+
+        loop_begin(ctx, s, header, exit);
+        ctx->cur = body;
+        s->body->accept(s->body, v);
+        jump(ctx, header, loc);
+        --ctx->loops.len;
+
+        ctx->cur = exit;
+
+        return NULL;
+}
+
+// `continue` goes back to the condition, not to `after`.
+static void *
+visit_stmt_for(visitor *v, stmt_for *s)
+{
+        lower_context *ctx = (lower_context *)v->context;
+        loc loc = s->base.loc;
+
+        s->init->accept(s->init, v);
+
+        int header = new_block(ctx);
+        enter(ctx, header, loc);
+
+        int body = new_block(ctx);
+        int exit = new_block(ctx);
+        if (s->e) {
+                int c = val(v, s->e);
+                branch(ctx, c, s->e->type->sz, body, exit, loc);
+        } else {
+                jump(ctx, body, loc);
+        }
+
+        loop_begin(ctx, s, header, exit);
+        ctx->cur = body;
+        s->body->accept(s->body, v);
+        if (s->after) {
+                (void)val(v, s->after);
+        }
+        jump(ctx, header, loc);
+        --ctx->loops.len;
+
+        ctx->cur = exit;
+
+        return NULL;
+}
+
+static void *
+visit_stmt_break(visitor *v, stmt_break *s)
+{
+        lower_context *ctx = (lower_context *)v->context;
+        jump(ctx, loop_of(ctx, s->resolved_parent)->exit, s->base.loc);
+        return NULL;
+}
+
+static void *
+visit_stmt_continue(visitor *v, stmt_continue *s)
+{
+        lower_context *ctx = (lower_context *)v->context;
+        jump(ctx, loop_of(ctx, s->resolved_parent)->header, s->base.loc);
+        return NULL;
+}
+
+static void *
+visit_stmt_struct(visitor *v, stmt_struct *s)
+{
+        NOOP(v, s);
+        return NULL;
+}
+
+static void *
+visit_stmt_module(visitor *v, stmt_module *s)
+{
+        NOOP(v, s);
+        return NULL;
+}
+
+static void *
+visit_stmt_import(visitor *v, stmt_import *s)
+{
+        NOOP(v, s);
+        return NULL;
+}
+
+static void *
+visit_stmt_embed(visitor *v, stmt_embed *s)
+{
+        lower_context *ctx = (lower_context *)v->context;
+        ir_insn in = mk(IR_EMBED, 0, s->base.loc);
+        in.embed = s;
+        append(ctx, in);
+        return NULL;
+}
+
+static void *
+visit_stmt_empty(visitor *v, stmt_empty *s)
+{
+        NOOP(v, s);
+        return NULL;
+}
+
+static visitor *
+ir_visitor_alloc(lower_context *ctx)
+{
+        return visitor_alloc(
+                (void *)ctx,
+                visit_expr_binary,
+                visit_expr_identifier,
+                visit_expr_integer_literal,
+                visit_expr_string_literal,
+                visit_expr_proccall,
+                visit_expr_mut,
+                visit_expr_brace_init,
+                visit_expr_namespace,
+                visit_expr_arrayinit,
+                visit_expr_index,
+                visit_expr_un,
+                visit_expr_character_literal,
+                visit_expr_cast,
+                visit_expr_bool_literal,
+                visit_expr_null,
+
+                visit_stmt_let,
+                visit_stmt_expr,
+                visit_stmt_block,
+                visit_stmt_proc,
+                visit_stmt_return,
+                visit_stmt_exit,
+                visit_stmt_extern_proc,
+                visit_stmt_if,
+                visit_stmt_while,
+                visit_stmt_for,
+                visit_stmt_break,
+                visit_stmt_continue,
+                visit_stmt_struct,
+                visit_stmt_module,
+                visit_stmt_import,
+                visit_stmt_embed,
+                visit_stmt_empty
+        );
+}
+
+ir_proc *
+ir_lower(const stmt_proc *s, const char *modname)
+{
+        ir_proc *p = (ir_proc *)alloc(sizeof(ir_proc));
+        memset(p, 0, sizeof(ir_proc));
+        p->s       = s;
+        p->modname = modname;
+        p->symbol  = reach_symbol(modname, s->id->lx);
+        p->blocks  = dyn_array_empty(ir_block_array);
+        p->strs    = dyn_array_empty(str_array);
+
+        lower_context ctx = {0};
+        ctx.p     = p;
+        ctx.loops = dyn_array_empty(ir_loop_array);
+        ctx.cur   = new_block(&ctx);
+
+        visitor *v = ir_visitor_alloc(&ctx);
+
+        for (size_t i = 0; i < s->params.len; ++i) {
+                const sym *param = s->params.data[i].resolved;
+                assert(param);
+                check_size(param->ty->sz, s->base.loc);
+                ir_insn in = mk(IR_PARAM, param->ty->sz, s->base.loc);
+                in.imm = (int64_t)i;
+                stslot(&ctx, param->stack_offset, param->ty->sz, def(&ctx, in), s->base.loc);
+        }
+
+        s->blk->accept(s->blk, v);
+
+        // Falling off the end, and the ends of what follows a
+        // return and nothing reaches.
+        for (size_t i = 0; i < p->blocks.len; ++i) {
+                ir_insn_array *insns = &p->blocks.data[i].insns;
+                if (!insns->len || !ir_is_terminator(insns->data[insns->len - 1].op)) {
+                        ctx.cur = (int)i;
+                        append(&ctx, mk(IR_RET, 8, s->base.loc));
+                }
+        }
+
+        dyn_array_free(ctx.loops);
+        free(v);
+
+        return p;
+}
+
+// Each phi gets a register of its own that its predecessors
+// copy into, so that phis of the same block, and values that
+// are still live, are never overwritten on the way.
+void
+ir_destruct_ssa(ir_proc *p)
+{
+        for (size_t i = 0; i < p->blocks.len; ++i) {
+                ir_block *b = &p->blocks.data[i];
+
+                for (size_t j = 0; j < b->insns.len && b->insns.data[j].op == IR_PHI; ++j) {
+                        ir_insn *phi = &b->insns.data[j];
+                        int t = p->nvregs++;
+
+                        for (int k = 0; k < phi->nargs; ++k) {
+                                ir_block *pred = &p->blocks.data[phi->preds[k]];
+                                ir_insn mov = mk(IR_MOV, phi->sz, phi->loc);
+                                mov.dst = t;
+                                mov.a = phi->args[k];
+
+                                // Before the terminator.
+                                dyn_array_append(pred->insns, mov);
+                                ir_insn term = pred->insns.data[pred->insns.len - 2];
+                                pred->insns.data[pred->insns.len - 2] = mov;
+                                pred->insns.data[pred->insns.len - 1] = term;
+                        }
+
+                        // `b` may have been a predecessor of its own.
+                        phi = &b->insns.data[j];
+                        free(phi->args);
+                        free(phi->preds);
+                        phi->op = IR_MOV;
+                        phi->a = t;
+                        phi->nargs = 0;
+                        phi->args = NULL;
+                        phi->preds = NULL;
+                }
+        }
+}
+
+static void
+dump_insn(const ir_insn *in, FILE *out)
+{
+        fprintf(out, "        ");
+        if (in->dst >= 0) fprintf(out, "%%%d = ", in->dst);
+        fprintf(out, "%s", g_op_names[in->op]);
+        if (in->sz) fprintf(out, ".%d", in->sz);
+        if (in->flags & IR_UNSIGNED) fprintf(out, "u");
+
+        switch (in->op) {
+        case IR_CONST:
+        case IR_PARAM:
+                fprintf(out, " %lld", (long long)in->imm);
+                break;
+        case IR_SYM:
+                fprintf(out, " %s", in->sym);
+                break;
+        case IR_STR: {
+                fprintf(out, " \"");
+                for (const char *c = in->sym; *c; ++c) {
+                        if (*c == '\n')      fprintf(out, "\\n");
+                        else if (*c == '\t') fprintf(out, "\\t");
+                        else                 fputc(*c, out);
+                }
+                fprintf(out, "\"");
+        } break;
+        case IR_SLOTADDR:
+        case IR_LDSLOT:
+                fprintf(out, " [rbp-%lld]", (long long)in->imm);
+                break;
+        case IR_STSLOT:
+                fprintf(out, " [rbp-%lld], %%%d", (long long)in->imm, in->a);
+                break;
+        case IR_ZERO:
+                fprintf(out, " [rbp-%lld], %lld", (long long)in->imm, (long long)in->imm2);
+                break;
+        case IR_EQ: case IR_NE: case IR_LT: case IR_GT: case IR_LE: case IR_GE:
+        case IR_EXT:
+                fprintf(out, " %%%d", in->a);
+                if (in->b >= 0) fprintf(out, ", %%%d", in->b);
+                fprintf(out, " (%d)", in->asz);
+                break;
+        case IR_PHI:
+                for (int i = 0; i < in->nargs; ++i) {
+                        fprintf(out, "%s [%%%d, b%d]", i ? "," : "", in->args[i], in->preds[i]);
+                }
+                break;
+        case IR_CALL:
+                if (in->sym) fprintf(out, " %s", in->sym);
+                else         fprintf(out, " %%%d", in->a);
+                fprintf(out, "(");
+                for (int i = 0; i < in->nargs; ++i) {
+                        fprintf(out, "%s%%%d", i ? ", " : "", in->args[i]);
+                }
+                fprintf(out, ")%s", (in->flags & IR_VARIADIC) ? " variadic" : "");
+                break;
+        case IR_EMBED:
+                fprintf(out, " %zu lines", in->embed->lns.len);
+                break;
+        default:
+                if (in->a >= 0) fprintf(out, " %%%d", in->a);
+                if (in->b >= 0) fprintf(out, ", %%%d", in->b);
+                break;
+        }
+}
+
+void
+ir_dump(const ir_proc *p, FILE *out)
+{
+        fprintf(out, "proc %s\n", p->symbol);
+
+        for (size_t i = 0; i < p->blocks.len; ++i) {
+                const ir_block *b = &p->blocks.data[i];
+
+                fprintf(out, "b%zu:", i);
+                if (b->preds.len) {
+                        fprintf(out, "  ; preds");
+                        for (size_t j = 0; j < b->preds.len; ++j) {
+                                fprintf(out, " b%d", b->preds.data[j]);
+                        }
+                }
+                fprintf(out, "\n");
+
+                for (size_t j = 0; j < b->insns.len; ++j) {
+                        const ir_insn *in = &b->insns.data[j];
+                        dump_insn(in, out);
+                        if (in->op == IR_JMP) {
+                                fprintf(out, " b%d", b->succ[0]);
+                        } else if (in->op == IR_BR) {
+                                fprintf(out, ", b%d, b%d", b->succ[0], b->succ[1]);
+                        }
+                        fprintf(out, "\n");
+                }
+        }
+        fprintf(out, "\n");
+}
+
+void
+ir_free(ir_proc *p)
+{
+        for (size_t i = 0; i < p->blocks.len; ++i) {
+                ir_block *b = &p->blocks.data[i];
+                for (size_t j = 0; j < b->insns.len; ++j) {
+                        free(b->insns.data[j].args);
+                        free(b->insns.data[j].preds);
+                }
+                dyn_array_free(b->insns);
+                dyn_array_free(b->preds);
+        }
+        for (size_t i = 0; i < p->strs.len; ++i) {
+                free(p->strs.data[i]);
+        }
+        dyn_array_free(p->blocks);
+        dyn_array_free(p->strs);
+        free(p->symbol);
+        free(p);
+}
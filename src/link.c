@@ -0,0 +1,1091 @@
+// RTLD_DEFAULT, MAP_32BIT
+#define _GNU_SOURCE
+
+#include "link.h"
+#include "obj.h"
+#include "ds/smap.h"
+#include "mem.h"
+
+#include <forge/array.h>
+#include <forge/cstr.h>
+
+#include <ar.h>
+#include <dlfcn.h>
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Where ld puts a non-PIE executable.
+#define LINK_BASE 0x400000
+#define LINK_PAGE 0x1000
+
+// What the kernel gives a program by default.
+#define LINK_STACK (8 << 20)
+
+#define LINK_INTERP "/lib64/ld-linux-x86-64.so.2"
+#define LINK_LIBC   "libc.so.6"
+
+static const char *g_libc_dirs[] = {
+        "/lib/x86_64-linux-gnu",
+        "/usr/lib/x86_64-linux-gnu",
+        "/lib64",
+        "/usr/lib64",
+        "/lib",
+        "/usr/lib",
+};
+
+// An object, on its own or out of an archive.
+typedef struct {
+        char *name;             // the file, or archive(member)
+        uint8_t *p;
+        size_t n;
+        const Elf64_Shdr *sh;
+        size_t nsh;
+        const char *shstrs;
+        const Elf64_Sym *syms;
+        size_t nsyms;
+        const char *strs;
+        uint64_t *addr;         // of each section, 0 if it is not in the output
+        int loaded;
+} input;
+
+DYN_ARRAY_TYPE(input *, input_array);
+
+// Where a global symbol is defined, or which libc function
+// it is.
+typedef struct {
+        input *in;
+        size_t sym;
+        size_t import;          // index into imports + 1, 0 if defined
+} global;
+
+DYN_ARRAY_TYPE(global *, global_array);
+
+typedef struct {
+        input_array inputs;
+        smap globals;           // name -> global
+        global_array owned;
+        smap refs;              // names that are used -> the first input using it
+        str_array undefs;       // the same, in the order they were found
+        str_array imports;      // what is left for libc
+        int libc;
+        int jit;                // into memory, see link_jit()
+        uint64_t base;          // where the image goes
+        char *why;
+} linker;
+
+// The sections of the output, in the order they are laid out.
+enum {
+        OUT_TEXT,
+        OUT_RODATA,
+        OUT_DATA,
+        OUT_BSS,
+};
+
+static int
+unsupported(linker *l, const char *fmt, ...)
+{
+        char buf[512];
+        va_list ap;
+        va_start(ap, fmt);
+        vsnprintf(buf, sizeof(buf), fmt, ap);
+        va_end(ap);
+
+        l->why = strdup(buf);
+        return 1;
+}
+
+static uint8_t *
+read_file(const char *path, size_t *n)
+{
+        FILE *f = fopen(path, "rb");
+        if (!f) return NULL;
+
+        u8_array buf = dyn_array_empty(u8_array);
+        uint8_t chunk[1 << 16];
+        size_t got;
+        while ((got = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+                for (size_t i = 0; i < got; ++i) {
+                        dyn_array_append(buf, chunk[i]);
+                }
+        }
+        fclose(f);
+
+        *n = buf.len;
+        return buf.data;
+}
+
+static uint64_t
+align_up(uint64_t x, uint64_t a)
+{
+        return a > 1 ? (x + a - 1) / a * a : x;
+}
+
+static int
+out_section(const Elf64_Shdr *sh)
+{
+        if (sh->sh_flags & SHF_EXECINSTR) return OUT_TEXT;
+        if (!(sh->sh_flags & SHF_WRITE))  return OUT_RODATA;
+        return sh->sh_type == SHT_NOBITS ? OUT_BSS : OUT_DATA;
+}
+
+static const char *
+sym_name(const input *in, size_t i)
+{
+        return in->strs + in->syms[i].st_name;
+}
+
+static int
+parse_object(linker *l, input *in)
+{
+        const Elf64_Ehdr *eh = (const Elf64_Ehdr *)in->p;
+
+        if (in->n < sizeof(*eh) || memcmp(eh->e_ident, ELFMAG, SELFMAG)
+            || eh->e_ident[EI_CLASS] != ELFCLASS64 || eh->e_machine != EM_X86_64
+            || eh->e_type != ET_REL || eh->e_shentsize != sizeof(Elf64_Shdr)
+            || eh->e_shoff + (uint64_t)eh->e_shnum * sizeof(Elf64_Shdr) > in->n
+            || eh->e_shstrndx >= eh->e_shnum) {
+                return unsupported(l, "`%s` is not an x86-64 relocatable object", in->name);
+        }
+
+        in->sh     = (const Elf64_Shdr *)(in->p + eh->e_shoff);
+        in->nsh    = eh->e_shnum;
+        in->shstrs = (const char *)in->p + in->sh[eh->e_shstrndx].sh_offset;
+        in->addr   = (uint64_t *)alloc(sizeof(uint64_t) * in->nsh);
+        memset(in->addr, 0, sizeof(uint64_t) * in->nsh);
+
+        for (size_t i = 0; i < in->nsh; ++i) {
+                const Elf64_Shdr *sh = &in->sh[i];
+                const char *name = in->shstrs + sh->sh_name;
+
+                if (sh->sh_type != SHT_NOBITS && sh->sh_offset + sh->sh_size > in->n) {
+                        return unsupported(l, "`%s` is truncated", in->name);
+                }
+                if (sh->sh_type == SHT_SYMTAB) {
+                        in->syms  = (const Elf64_Sym *)(in->p + sh->sh_offset);
+                        in->nsyms = sh->sh_size / sizeof(Elf64_Sym);
+                        in->strs  = (const char *)in->p + in->sh[sh->sh_link].sh_offset;
+                } else if (sh->sh_type == SHT_GROUP) {
+                        return unsupported(l, "section group `%s` in `%s`", name, in->name);
+                } else if (sh->sh_flags & SHF_ALLOC) {
+                        if ((sh->sh_type != SHT_PROGBITS && sh->sh_type != SHT_NOBITS)
+                            || (sh->sh_flags & SHF_TLS)) {
+                                return unsupported(l, "section `%s` in `%s`", name, in->name);
+                        }
+                }
+        }
+
+        return 0;
+}
+
+static input *
+add_input(linker *l, const char *name, uint8_t *p, size_t n)
+{
+        input *in = (input *)alloc(sizeof(input));
+        memset(in, 0, sizeof(input));
+        in->name = strdup(name);
+        in->p    = p;
+        in->n    = n;
+        dyn_array_append(l->inputs, in);
+        return in;
+}
+
+// Every member becomes an input that is not loaded yet. They
+// are copied out so that their headers are aligned.
+static int
+read_archive(linker *l, const char *path, const uint8_t *p, size_t n)
+{
+        const char *longnames = NULL;
+        size_t nlongnames = 0;
+
+        for (size_t at = SARMAG; at + sizeof(struct ar_hdr) <= n; ) {
+                const struct ar_hdr *h = (const struct ar_hdr *)(p + at);
+                char field[sizeof(h->ar_size) + 1];
+                memcpy(field, h->ar_size, sizeof(h->ar_size));
+                field[sizeof(h->ar_size)] = 0;
+
+                size_t size = strtoul(field, NULL, 10);
+                const uint8_t *data = p + at + sizeof(*h);
+                if (memcmp(h->ar_fmag, ARFMAG, 2) || data + size > p + n) {
+                        return unsupported(l, "`%s` is not an archive ld would read", path);
+                }
+                at += sizeof(*h) + size + (size & 1);
+
+                // The symbol index is rebuilt from the members.
+                if (!memcmp(h->ar_name, "/ ", 2) || !memcmp(h->ar_name, "/SYM64/", 7)) {
+                        continue;
+                }
+                if (!memcmp(h->ar_name, "// ", 3)) {
+                        longnames  = (const char *)data;
+                        nlongnames = size;
+                        continue;
+                }
+
+                const char *s = h->ar_name;
+                size_t max = sizeof(h->ar_name);
+                if (h->ar_name[0] == '/') {
+                        size_t off = strtoul(h->ar_name + 1, NULL, 10);
+                        if (!longnames || off >= nlongnames) {
+                                return unsupported(l, "`%s` is not an archive ld would read", path);
+                        }
+                        s   = longnames + off;
+                        max = nlongnames - off;
+                }
+                size_t len = 0;
+                while (len < max && s[len] != '/' && s[len] != '\n') ++len;
+
+                char *name = (char *)alloc(strlen(path) + len + 3);
+                sprintf(name, "%s(%.*s)", path, (int)len, s);
+
+                uint8_t *copy = (uint8_t *)alloc(size ? size : 1);
+                memcpy(copy, data, size);
+                add_input(l, name, copy, size);
+                free(name);
+
+                int r = parse_object(l, l->inputs.data[l->inputs.len - 1]);
+                if (r) return r;
+        }
+
+        return 0;
+}
+
+static global *
+add_global(linker *l, const char *name, input *in, size_t sym, size_t import)
+{
+        global *g = (global *)alloc(sizeof(global));
+        g->in     = in;
+        g->sym    = sym;
+        g->import = import;
+        smap_insert(&l->globals, name, g);
+        dyn_array_append(l->owned, g);
+        return g;
+}
+
+static int
+load(linker *l, input *in)
+{
+        in->loaded = 1;
+
+        for (size_t i = 1; i < in->nsyms; ++i) {
+                const Elf64_Sym *s = &in->syms[i];
+                const char *name = sym_name(in, i);
+
+                if (ELF64_ST_BIND(s->st_info) == STB_LOCAL) continue;
+
+                if (s->st_shndx == SHN_UNDEF) {
+                        if (!smap_has(&l->refs, name)) {
+                                smap_insert(&l->refs, name, in);
+                                dyn_array_append(l->undefs, (char *)name);
+                        }
+                        continue;
+                }
+                if (s->st_shndx == SHN_COMMON) {
+                        return unsupported(l, "common symbol `%s` in `%s`", name, in->name);
+                }
+
+                global *g = (global *)smap_get(&l->globals, name);
+                if (g) {
+                        fprintf(stderr, "`%s` is defined in both `%s` and `%s`\n", name, g->in->name, in->name);
+                        return -1;
+                }
+
+                add_global(l, name, in, i, 0);
+        }
+
+        return 0;
+}
+
+// Whether a member that is not loaded yet defines something
+// that is used and not defined.
+static int
+needed(linker *l, const input *in)
+{
+        for (size_t i = 1; i < in->nsyms; ++i) {
+                const Elf64_Sym *s = &in->syms[i];
+                const char *name = sym_name(in, i);
+                if (ELF64_ST_BIND(s->st_info) == STB_LOCAL || s->st_shndx == SHN_UNDEF) continue;
+                if (smap_has(&l->refs, name) && !smap_has(&l->globals, name)) return 1;
+        }
+        return 0;
+}
+
+// The functions libc.so.6 exports, name -> symbol type + 1.
+static int
+read_libc(linker *l, smap *funcs)
+{
+        uint8_t *p = NULL;
+        size_t n = 0;
+
+        for (size_t i = 0; i < sizeof(g_libc_dirs) / sizeof(*g_libc_dirs) && !p; ++i) {
+                char *path = forge_cstr_builder(g_libc_dirs[i], "/", LINK_LIBC, NULL);
+                p = read_file(path, &n);
+                free(path);
+        }
+        if (!p) {
+                return unsupported(l, "could not find %s", LINK_LIBC);
+        }
+
+        const Elf64_Ehdr *eh = (const Elf64_Ehdr *)p;
+        if (n < sizeof(*eh) || memcmp(eh->e_ident, ELFMAG, SELFMAG)
+            || eh->e_ident[EI_CLASS] != ELFCLASS64 || eh->e_machine != EM_X86_64
+            || eh->e_shoff + (uint64_t)eh->e_shnum * sizeof(Elf64_Shdr) > n) {
+                free(p);
+                return unsupported(l, "%s is not an x86-64 library", LINK_LIBC);
+        }
+
+        const Elf64_Shdr *sh = (const Elf64_Shdr *)(p + eh->e_shoff);
+        for (size_t i = 0; i < eh->e_shnum; ++i) {
+                if (sh[i].sh_type != SHT_DYNSYM) continue;
+
+                const Elf64_Sym *syms = (const Elf64_Sym *)(p + sh[i].sh_offset);
+                const char *strs = (const char *)p + sh[sh[i].sh_link].sh_offset;
+                for (size_t j = 1; j < sh[i].sh_size / sizeof(Elf64_Sym); ++j) {
+                        if (syms[j].st_shndx == SHN_UNDEF) continue;
+                        int type = ELF64_ST_TYPE(syms[j].st_info);
+                        smap_insert(funcs, strs + syms[j].st_name, (void *)(uintptr_t)(type + 1));
+                }
+        }
+
+        free(p);
+        return 0;
+}
+
+// What is not defined by the inputs has to be a libc function,
+// or in memory, anything this process can dlsym(3).
+static int
+resolve_imports(linker *l)
+{
+        smap libc = smap_create(NULL);
+        int loaded = 0;
+
+        for (size_t i = 0; i < l->undefs.len; ++i) {
+                const char *name = l->undefs.data[i];
+                if (smap_has(&l->globals, name)) continue;
+
+                if (!l->libc) {
+                        const input *in = (const input *)smap_get(&l->refs, name);
+                        fprintf(stderr, "%s: undefined reference to `%s`, and libc is not linked\n", in->name, name);
+                        return -1;
+                }
+
+                if (l->jit) {
+                        if (!dlsym(RTLD_DEFAULT, name)) {
+                                const input *in = (const input *)smap_get(&l->refs, name);
+                                fprintf(stderr, "%s: undefined reference to `%s`\n", in->name, name);
+                                return -1;
+                        }
+                        dyn_array_append(l->imports, (char *)name);
+                        add_global(l, name, NULL, 0, l->imports.len);
+                        continue;
+                }
+
+                if (!loaded) {
+                        int r = read_libc(l, &libc);
+                        if (r) {
+                                smap_free(&libc);
+                                return r;
+                        }
+                        loaded = 1;
+                }
+
+                uintptr_t type = (uintptr_t)smap_get(&libc, name);
+                if (!type) {
+                        const input *in = (const input *)smap_get(&l->refs, name);
+                        fprintf(stderr, "%s: undefined reference to `%s`\n", in->name, name);
+                        smap_free(&libc);
+                        return -1;
+                }
+                if (type - 1 != STT_FUNC && type - 1 != STT_GNU_IFUNC) {
+                        smap_free(&libc);
+                        return unsupported(l, "`%s` is not a function in %s", name, LINK_LIBC);
+                }
+
+                dyn_array_append(l->imports, (char *)name);
+                add_global(l, name, NULL, 0, l->imports.len);
+        }
+
+        smap_free(&libc);
+        return 0;
+}
+
+// The output, laid out as one read-only executable segment
+// (headers, the dynamic symbols, code, then constants) and
+// one writable segment (the dynamic section and GOT, data,
+// then bss). A call to a libc function goes through an
+// eight-byte stub that jumps through its GOT entry, which the
+// dynamic loader fills in at startup; the stub is also what
+// the function's address is taken to be.
+typedef struct {
+        int dynamic;
+        size_t nphdr;
+
+        uint64_t interp, hash, dynsym, dynstr, rela, stubs;
+        uint64_t rx_end;
+
+        uint64_t rw, dyn, got;
+        uint64_t rw_filesz, rw_memsz;
+
+        u8_array strs;
+        uint32_t *names;
+        size_t ndyn;
+} layout;
+
+static uint64_t
+place(linker *l, int kind, uint64_t at)
+{
+        for (size_t i = 0; i < l->inputs.len; ++i) {
+                input *in = l->inputs.data[i];
+                if (!in->loaded) continue;
+
+                for (size_t k = 0; k < in->nsh; ++k) {
+                        const Elf64_Shdr *sh = &in->sh[k];
+                        if (!(sh->sh_flags & SHF_ALLOC) || out_section(sh) != kind) continue;
+
+                        at = align_up(at, sh->sh_addralign);
+                        in->addr[k] = l->base + at;
+                        at += sh->sh_size;
+                }
+        }
+        return at;
+}
+
+static uint32_t
+add_str(u8_array *tab, const char *s)
+{
+        uint32_t at = (uint32_t)tab->len;
+        for (size_t i = 0; s[i]; ++i) {
+                dyn_array_append(*tab, (uint8_t)s[i]);
+        }
+        dyn_array_append(*tab, 0);
+        return at;
+}
+
+static void
+lay_out(linker *l, layout *lo)
+{
+        size_t nimp = l->imports.len;
+
+        lo->dynamic = nimp > 0 && !l->jit;
+        lo->nphdr   = lo->dynamic ? 4 : 2;
+
+        lo->strs  = dyn_array_empty(u8_array);
+        lo->names = (uint32_t *)alloc(sizeof(uint32_t) * (nimp + 1));
+        add_str(&lo->strs, "");
+        if (lo->dynamic) {
+                lo->names[nimp] = add_str(&lo->strs, LINK_LIBC);
+                for (size_t i = 0; i < nimp; ++i) {
+                        lo->names[i] = add_str(&lo->strs, l->imports.data[i]);
+                }
+        }
+
+        // In memory, there are neither headers nor a dynamic loader.
+        uint64_t at = l->jit ? 0 : sizeof(Elf64_Ehdr) + (lo->nphdr + 1) * sizeof(Elf64_Phdr);
+        if (lo->dynamic) {
+                lo->interp = at;
+                at += sizeof(LINK_INTERP);
+                lo->hash   = at = align_up(at, 8);
+                at += sizeof(uint32_t) * (2 + 1 + nimp + 1);
+                lo->dynsym = at = align_up(at, 8);
+                at += sizeof(Elf64_Sym) * (nimp + 1);
+                lo->dynstr = at;
+                at += lo->strs.len;
+                lo->rela   = at = align_up(at, 8);
+                at += sizeof(Elf64_Rela) * nimp;
+        }
+
+        at = place(l, OUT_TEXT, at);
+        lo->stubs = at = align_up(at, 8);
+        at += 8 * nimp;
+        at = place(l, OUT_RODATA, at);
+        lo->rx_end = at;
+
+        lo->rw = at = align_up(at, LINK_PAGE);
+        if (lo->dynamic) {
+                lo->ndyn = 13;
+                lo->dyn  = at;
+                at += sizeof(Elf64_Dyn) * lo->ndyn;
+        }
+        lo->got = at;
+        at += 8 * nimp;
+        at = place(l, OUT_DATA, at);
+        lo->rw_filesz = at - lo->rw;
+        at = place(l, OUT_BSS, at);
+        lo->rw_memsz = at - lo->rw;
+
+        // Counted as the last, optional, program header.
+        if (lo->rw_memsz) ++lo->nphdr;
+}
+
+static int
+sym_address(linker *l, const layout *lo, const input *in, size_t i, uint64_t *addr)
+{
+        const Elf64_Sym *s = &in->syms[i];
+
+        if (s->st_shndx == SHN_UNDEF) {
+                const global *g = (const global *)smap_get(&l->globals, sym_name(in, i));
+                if (g->import) {
+                        *addr = l->base + lo->stubs + 8 * (g->import - 1);
+                        return 0;
+                }
+                in = g->in;
+                s  = &in->syms[g->sym];
+        }
+
+        if (s->st_shndx == SHN_ABS) {
+                *addr = s->st_value;
+                return 0;
+        }
+        if (s->st_shndx >= in->nsh || !in->addr[s->st_shndx]) {
+                return unsupported(l, "`%s` in `%s` is not in an allocated section", sym_name(in, s - in->syms), in->name);
+        }
+
+        *addr = in->addr[s->st_shndx] + s->st_value;
+        return 0;
+}
+
+static int
+relocate(linker *l, const layout *lo, uint8_t *img)
+{
+        for (size_t i = 0; i < l->inputs.len; ++i) {
+                input *in = l->inputs.data[i];
+                if (!in->loaded) continue;
+
+                for (size_t k = 0; k < in->nsh; ++k) {
+                        const Elf64_Shdr *sh = &in->sh[k];
+                        if (sh->sh_type == SHT_REL) {
+                                return unsupported(l, "REL relocations in `%s`", in->name);
+                        }
+                        // Those for debug information go with it.
+                        if (sh->sh_type != SHT_RELA || sh->sh_info >= in->nsh || !in->addr[sh->sh_info]) continue;
+
+                        const Elf64_Rela *r = (const Elf64_Rela *)(in->p + sh->sh_offset);
+                        size_t n = sh->sh_size / sizeof(Elf64_Rela);
+                        for (size_t j = 0; j < n; ++j) {
+                                uint32_t type = ELF64_R_TYPE(r[j].r_info);
+                                size_t si = ELF64_R_SYM(r[j].r_info);
+                                if (type == R_X86_64_NONE) continue;
+
+                                uint64_t S = 0;
+                                int e = sym_address(l, lo, in, si, &S);
+                                if (e) return e;
+
+                                uint64_t P = in->addr[sh->sh_info] + r[j].r_offset;
+                                uint8_t *at = img + (P - l->base);
+                                int64_t v = (int64_t)(S + r[j].r_addend);
+                                int fits = 1;
+
+                                switch (type) {
+                                case R_X86_64_64:
+                                        memcpy(at, &v, 8);
+                                        break;
+                                case R_X86_64_PC64:
+                                        v -= (int64_t)P;
+                                        memcpy(at, &v, 8);
+                                        break;
+                                case R_X86_64_32:
+                                        fits = v == (int64_t)(uint32_t)v;
+                                        memcpy(at, &v, 4);
+                                        break;
+                                case R_X86_64_32S:
+                                        fits = v == (int64_t)(int32_t)v;
+                                        memcpy(at, &v, 4);
+                                        break;
+                                case R_X86_64_PC32:
+                                case R_X86_64_PLT32:
+                                        v -= (int64_t)P;
+                                        fits = v == (int64_t)(int32_t)v;
+                                        memcpy(at, &v, 4);
+                                        break;
+                                default:
+                                        return unsupported(l, "relocation type %u in `%s`", type, in->name);
+                                }
+
+                                if (!fits) {
+                                        fprintf(stderr, "%s: relocation against `%s` does not fit\n",
+                                                in->name, sym_name(in, si));
+                                        return -1;
+                                }
+                        }
+                }
+        }
+
+        return 0;
+}
+
+static void
+copy_sections(linker *l, uint8_t *img)
+{
+        for (size_t i = 0; i < l->inputs.len; ++i) {
+                input *in = l->inputs.data[i];
+                if (!in->loaded) continue;
+
+                for (size_t k = 0; k < in->nsh; ++k) {
+                        const Elf64_Shdr *sh = &in->sh[k];
+                        if (!in->addr[k] || sh->sh_type == SHT_NOBITS) continue;
+                        memcpy(img + (in->addr[k] - l->base), in->p + sh->sh_offset, sh->sh_size);
+                }
+        }
+}
+
+static void
+write_stubs(linker *l, const layout *lo, uint8_t *img)
+{
+        for (size_t i = 0; i < l->imports.len; ++i) {
+                // jmp [rip + got]
+                uint8_t *stub = img + lo->stubs + 8 * i;
+                int32_t disp = (int32_t)((lo->got + 8 * i) - (lo->stubs + 8 * i + 6));
+                stub[0] = 0xff;
+                stub[1] = 0x25;
+                memcpy(stub + 2, &disp, 4);
+                stub[6] = 0xcc;
+                stub[7] = 0xcc;
+        }
+}
+
+static void
+write_dynamic(linker *l, const layout *lo, uint8_t *img)
+{
+        size_t nimp = l->imports.len;
+
+        memcpy(img + lo->interp, LINK_INTERP, sizeof(LINK_INTERP));
+
+        // One bucket, every symbol chained to the one before.
+        uint32_t *hash = (uint32_t *)(img + lo->hash);
+        hash[0] = 1;
+        hash[1] = (uint32_t)nimp + 1;
+        hash[2] = (uint32_t)nimp;
+        hash[3] = 0;
+        for (size_t i = 1; i <= nimp; ++i) {
+                hash[3 + i] = (uint32_t)i - 1;
+        }
+
+        Elf64_Sym *syms = (Elf64_Sym *)(img + lo->dynsym);
+        Elf64_Rela *rela = (Elf64_Rela *)(img + lo->rela);
+        for (size_t i = 0; i < nimp; ++i) {
+                syms[i + 1].st_name = lo->names[i];
+                syms[i + 1].st_info = ELF64_ST_INFO(STB_GLOBAL, STT_FUNC);
+
+                rela[i].r_offset = LINK_BASE + lo->got + 8 * i;
+                rela[i].r_info   = ELF64_R_INFO(i + 1, R_X86_64_GLOB_DAT);
+                rela[i].r_addend = 0;
+        }
+        write_stubs(l, lo, img);
+
+        memcpy(img + lo->dynstr, lo->strs.data, lo->strs.len);
+
+        Elf64_Dyn dyn[] = {
+                {DT_NEEDED,   {lo->names[nimp]}},
+                {DT_HASH,     {LINK_BASE + lo->hash}},
+                {DT_STRTAB,   {LINK_BASE + lo->dynstr}},
+                {DT_SYMTAB,   {LINK_BASE + lo->dynsym}},
+                {DT_STRSZ,    {lo->strs.len}},
+                {DT_SYMENT,   {sizeof(Elf64_Sym)}},
+                {DT_RELA,     {LINK_BASE + lo->rela}},
+                {DT_RELASZ,   {sizeof(Elf64_Rela) * nimp}},
+                {DT_RELAENT,  {sizeof(Elf64_Rela)}},
+                {DT_FLAGS,    {DF_BIND_NOW}},
+                {DT_FLAGS_1,  {DF_1_NOW}},
+                {DT_DEBUG,    {0}},
+                {DT_NULL,     {0}},
+        };
+        memcpy(img + lo->dyn, dyn, sizeof(dyn));
+}
+
+static void
+write_headers(const layout *lo, uint64_t entry, uint8_t *img)
+{
+        Elf64_Ehdr eh = {0};
+        memcpy(eh.e_ident, ELFMAG, SELFMAG);
+        eh.e_ident[EI_CLASS]   = ELFCLASS64;
+        eh.e_ident[EI_DATA]    = ELFDATA2LSB;
+        eh.e_ident[EI_VERSION] = EV_CURRENT;
+        eh.e_ident[EI_OSABI]   = ELFOSABI_SYSV;
+        eh.e_type      = ET_EXEC;
+        eh.e_machine   = EM_X86_64;
+        eh.e_version   = EV_CURRENT;
+        eh.e_entry     = entry;
+        eh.e_phoff     = sizeof(Elf64_Ehdr);
+        eh.e_ehsize    = sizeof(Elf64_Ehdr);
+        eh.e_phentsize = sizeof(Elf64_Phdr);
+        eh.e_phnum     = (Elf64_Half)lo->nphdr;
+        eh.e_shentsize = sizeof(Elf64_Shdr);
+        memcpy(img, &eh, sizeof(eh));
+
+        Elf64_Phdr ph[6];
+        size_t n = 0;
+        memset(ph, 0, sizeof(ph));
+
+        if (lo->dynamic) {
+                ph[n].p_type   = PT_INTERP;
+                ph[n].p_flags  = PF_R;
+                ph[n].p_offset = lo->interp;
+                ph[n].p_vaddr  = ph[n].p_paddr = LINK_BASE + lo->interp;
+                ph[n].p_filesz = ph[n].p_memsz = sizeof(LINK_INTERP);
+                ph[n].p_align  = 1;
+                ++n;
+        }
+
+        ph[n].p_type   = PT_LOAD;
+        ph[n].p_flags  = PF_R | PF_X;
+        ph[n].p_vaddr  = ph[n].p_paddr = LINK_BASE;
+        ph[n].p_filesz = ph[n].p_memsz = lo->rx_end;
+        ph[n].p_align  = LINK_PAGE;
+        ++n;
+
+        if (lo->rw_memsz) {
+                ph[n].p_type   = PT_LOAD;
+                ph[n].p_flags  = PF_R | PF_W;
+                ph[n].p_offset = lo->rw;
+                ph[n].p_vaddr  = ph[n].p_paddr = LINK_BASE + lo->rw;
+                ph[n].p_filesz = lo->rw_filesz;
+                ph[n].p_memsz  = lo->rw_memsz;
+                ph[n].p_align  = LINK_PAGE;
+                ++n;
+        }
+
+        if (lo->dynamic) {
+                ph[n].p_type   = PT_DYNAMIC;
+                ph[n].p_flags  = PF_R | PF_W;
+                ph[n].p_offset = lo->dyn;
+                ph[n].p_vaddr  = ph[n].p_paddr = LINK_BASE + lo->dyn;
+                ph[n].p_filesz = ph[n].p_memsz = sizeof(Elf64_Dyn) * lo->ndyn;
+                ph[n].p_align  = 8;
+                ++n;
+        }
+
+        ph[n].p_type  = PT_GNU_STACK;
+        ph[n].p_flags = PF_R | PF_W;
+        ph[n].p_align = 16;
+        ++n;
+
+        memcpy(img + sizeof(eh), ph, sizeof(Elf64_Phdr) * n);
+}
+
+static int
+write_exe(const char *out, const uint8_t *img, size_t n)
+{
+        // Replaced rather than overwritten, the old one may be running.
+        unlink(out);
+
+        int fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0777);
+        if (fd < 0) return -1;
+
+        for (size_t at = 0; at < n; ) {
+                ssize_t w = write(fd, img + at, n - at);
+                if (w < 0) {
+                        if (errno == EINTR) continue;
+                        close(fd);
+                        return -1;
+                }
+                at += (size_t)w;
+        }
+
+        return close(fd);
+}
+
+// Reads `inputs`, loads what is needed of the archives and
+// resolves the rest.
+static int
+load_inputs(linker *l, str_array inputs)
+{
+        for (size_t i = 0; i < inputs.len; ++i) {
+                const char *path = inputs.data[i];
+                size_t n = 0;
+                uint8_t *p = read_file(path, &n);
+                if (!p) {
+                        fprintf(stderr, "could not read `%s`: %s\n", path, strerror(errno));
+                        return -1;
+                }
+
+                int r = 0;
+                if (n >= SARMAG && !memcmp(p, ARMAG, SARMAG)) {
+                        r = read_archive(l, path, p, n);
+                        free(p);
+                } else {
+                        input *in = add_input(l, path, p, n);
+                        r = parse_object(l, in);
+                        if (!r) r = load(l, in);
+                }
+                if (r) return r;
+        }
+
+        // Archive members, for as long as one of them defines
+        // something that is still missing.
+        for (int changed = 1; changed; ) {
+                changed = 0;
+                for (size_t i = 0; i < l->inputs.len; ++i) {
+                        input *in = l->inputs.data[i];
+                        if (in->loaded || !needed(l, in)) continue;
+
+                        int r = load(l, in);
+                        if (r) return r;
+                        changed = 1;
+                }
+        }
+
+        return resolve_imports(l);
+}
+
+// The address of a global symbol that is defined, or 0.
+static uint64_t
+global_address(linker *l, const layout *lo, const char *name)
+{
+        uint64_t addr = 0;
+        const global *g = (const global *)smap_get(&l->globals, name);
+        if (g && !g->import && sym_address(l, lo, g->in, g->sym, &addr) == 0) {
+                return addr;
+        }
+        return 0;
+}
+
+static int
+link_all(linker *l, const char *out, str_array inputs)
+{
+        int r = load_inputs(l, inputs);
+        if (r) return r;
+
+        layout lo;
+        memset(&lo, 0, sizeof(lo));
+        lay_out(l, &lo);
+
+        size_t n = lo.rw_filesz ? lo.rw + lo.rw_filesz : lo.rx_end;
+        uint8_t *img = (uint8_t *)alloc(n);
+        memset(img, 0, n);
+
+        copy_sections(l, img);
+        r = relocate(l, &lo, img);
+
+        if (!r) {
+                if (lo.dynamic) write_dynamic(l, &lo, img);
+
+                // As ld, the start of the code if there is no _start.
+                uint64_t entry = global_address(l, &lo, "_start");
+                if (!entry) {
+                        entry = l->base + lo.rx_end;
+                        for (size_t i = 0; i < l->inputs.len; ++i) {
+                                input *in = l->inputs.data[i];
+                                for (size_t k = 0; in->loaded && k < in->nsh; ++k) {
+                                        if (in->addr[k] && out_section(&in->sh[k]) == OUT_TEXT && in->addr[k] < entry) {
+                                                entry = in->addr[k];
+                                        }
+                                }
+                        }
+                }
+                write_headers(&lo, entry, img);
+
+                if (write_exe(out, img, n) != 0) {
+                        fprintf(stderr, "could not write `%s`: %s\n", out, strerror(errno));
+                        r = -1;
+                }
+        }
+
+        free(img);
+        free(lo.names);
+        dyn_array_free(lo.strs);
+
+        return r;
+}
+
+struct link_image {
+        uint8_t *mem;
+        size_t size;
+        uint64_t entry;
+        int main;       // entered as main() rather than _start
+};
+
+// The image is mapped in the low 2 GiB, like the executables
+// at LINK_BASE, so that the code may use 32-bit addresses.
+static int
+jit_all(linker *l, str_array inputs, link_image **img)
+{
+        int r = load_inputs(l, inputs);
+        if (r) return r;
+
+        layout lo;
+        memset(&lo, 0, sizeof(lo));
+        lay_out(l, &lo);
+
+        size_t size = align_up(lo.rw + lo.rw_memsz, LINK_PAGE);
+        uint8_t *mem = (uint8_t *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+        if (mem == MAP_FAILED) {
+                fprintf(stderr, "could not map the program: %s\n", strerror(errno));
+                r = -1;
+                goto out;
+        }
+        l->base = (uint64_t)(uintptr_t)mem;
+
+        // Again, now that the base is known.
+        free(lo.names);
+        dyn_array_free(lo.strs);
+        memset(&lo, 0, sizeof(lo));
+        lay_out(l, &lo);
+
+        copy_sections(l, mem);
+        r = relocate(l, &lo, mem);
+        if (r) {
+                munmap(mem, size);
+                goto out;
+        }
+
+        write_stubs(l, &lo, mem);
+        for (size_t i = 0; i < l->imports.len; ++i) {
+                void *f = dlsym(RTLD_DEFAULT, l->imports.data[i]);
+                memcpy(mem + lo.got + 8 * i, &f, 8);
+        }
+
+        link_image *im = (link_image *)alloc(sizeof(link_image));
+        im->mem   = mem;
+        im->size  = size;
+        im->entry = global_address(l, &lo, "_start");
+        im->main  = 0;
+        if (!im->entry) {
+                im->entry = global_address(l, &lo, "main");
+                im->main  = 1;
+        }
+        if (!im->entry) {
+                fprintf(stderr, "there is neither a `_start` nor a `main` to run\n");
+                munmap(mem, size);
+                free(im);
+                r = -1;
+                goto out;
+        }
+
+        if ((lo.rw && mprotect(mem, lo.rw, PROT_READ | PROT_EXEC) != 0)) {
+                fprintf(stderr, "could not make the program executable: %s\n", strerror(errno));
+                munmap(mem, size);
+                free(im);
+                r = -1;
+                goto out;
+        }
+
+        *img = im;
+
+out:
+        free(lo.names);
+        dyn_array_free(lo.strs);
+        return r;
+}
+
+static linker
+linker_create(int libc, int jit)
+{
+        linker l = {
+                .inputs  = dyn_array_empty(input_array),
+                .globals = smap_create(NULL),
+                .owned   = dyn_array_empty(global_array),
+                .refs    = smap_create(NULL),
+                .undefs  = dyn_array_empty(str_array),
+                .imports = dyn_array_empty(str_array),
+                .libc    = libc,
+                .jit     = jit,
+                .base    = jit ? 0 : LINK_BASE,
+                .why     = NULL,
+        };
+        return l;
+}
+
+static void
+linker_free(linker *l)
+{
+        for (size_t i = 0; i < l->inputs.len; ++i) {
+                input *in = l->inputs.data[i];
+                free(in->name);
+                free(in->p);
+                free(in->addr);
+                free(in);
+        }
+        dyn_array_free(l->inputs);
+        for (size_t i = 0; i < l->owned.len; ++i) {
+                free(l->owned.data[i]);
+        }
+        dyn_array_free(l->owned);
+        smap_free(&l->globals);
+        smap_free(&l->refs);
+        dyn_array_free(l->undefs);
+        dyn_array_free(l->imports);
+}
+
+int
+link_exe(const char *out, str_array inputs, int libc, char **why)
+{
+        linker l = linker_create(libc, 0);
+
+        int r = link_all(&l, out, inputs);
+
+        *why = l.why;
+        linker_free(&l);
+
+        return r;
+}
+
+int
+link_jit(str_array inputs, int libc, link_image **img, char **why)
+{
+        linker l = linker_create(libc, 1);
+
+        *img = NULL;
+        int r = jit_all(&l, inputs, img);
+
+        *why = l.why;
+        linker_free(&l);
+
+        return r;
+}
+
+void
+link_jit_run(link_image *img, int argc, char **argv)
+{
+        extern char **environ;
+
+        // What this process has written so far comes first.
+        fflush(NULL);
+
+        if (img->main) {
+                int (*main_)(int, char **, char **) = (int (*)(int, char **, char **))(uintptr_t)img->entry;
+                exit(main_(argc, argv, environ));
+        }
+
+        // _start gets a stack of its own, laid out as the kernel
+        // does: argc, argv, NULL, envp, NULL, and an empty auxv.
+        size_t nenv = 0;
+        while (environ[nenv]) ++nenv;
+
+        size_t stack_sz = LINK_STACK;
+        uint8_t *stack = (uint8_t *)mmap(NULL, stack_sz, PROT_READ | PROT_WRITE,
+                                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+        if (stack == MAP_FAILED) {
+                fprintf(stderr, "could not map a stack for the program: %s\n", strerror(errno));
+                exit(1);
+        }
+
+        size_t n = 1 + (size_t)argc + 1 + nenv + 1 + 2;
+        uint64_t *sp = (uint64_t *)((uintptr_t)(stack + stack_sz - n * 8) & ~(uintptr_t)15);
+        size_t at = 0;
+
+        sp[at++] = (uint64_t)argc;
+        for (int i = 0; i < argc; ++i) sp[at++] = (uint64_t)(uintptr_t)argv[i];
+        sp[at++] = 0;
+        for (size_t i = 0; i < nenv; ++i) sp[at++] = (uint64_t)(uintptr_t)environ[i];
+        sp[at++] = 0;
+        sp[at++] = AT_NULL;
+        sp[at++] = 0;
+
+        // rdx is what the dynamic loader would leave for atexit.
+        __asm__ volatile(
+                "movq %0, %%rsp\n\t"
+                "xorl %%ebp, %%ebp\n\t"
+                "xorl %%edx, %%edx\n\t"
+                "jmp *%1"
+                :
+                : "S"(sp), "a"(img->entry)
+                : "memory");
+        __builtin_unreachable();
+}
@@ -4,125 +4,304 @@
 #include "sem.h"
 #include "asm.h"
 #include "visitor.h"
+#include "modcache.h"
+#include "server.h"
+#include "iface.h"
+#include "depfile.h"
+#include "objcache.h"
+#include "reach.h"
+#include "taskgraph.h"
+#include "mem.h"
+#include "io.h"
+#include "link.h"
+#include "interp.h"
+#include "peephole.h"
 
 #include <forge/arg.h>
 #include <forge/err.h>
 #include <forge/io.h>
 #include <forge/utils.h>
 #include <forge/chooser.h>
-#include <forge/str.h>
 #include <forge/cstr.h>
-#include <forge/cmd.h>
 #include <forge/array.h>
 
 #include <assert.h>
+#include <dlfcn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Where `make install` puts libcrstd.a, see Makefile.am.
+#ifndef CRUC_STD_DIR
+#define CRUC_STD_DIR "/usr/local/lib/cruc"
+#endif
+
+// The default bound that objcache_trim() cuts the cache back to.
+#define CRUC_CACHE_SIZE ((uint64_t)1 << 30)
 
 struct {
         uint32_t flags;
-        char *filepath;
-        char *outname;
+        str_array filepaths;
+        str_array outnames;
         str_array search_paths;
         str_array lib_search_paths;
         str_array link_libs;
+        char *socket_path;
+        char *build_dir;
+        char *depfile;
+        char *dep_target;
+        char *cache_dir;
+        uint64_t cache_size;
+        char *std_dir;
+        char *build_std;
+        int jobs;
+        int assembler;
+        int linker;
+        int emit;
+        uint32_t peephole;
+        str_array run_args;
 } g_config = {
         .flags = 0x0000,
-        .filepath = NULL,
-        .outname = NULL,
+        .filepaths = dyn_array_empty(str_array),
+        .outnames = dyn_array_empty(str_array),
         .search_paths = dyn_array_empty(str_array),
         .lib_search_paths = dyn_array_empty(str_array),
         .link_libs = dyn_array_empty(str_array),
+        .socket_path = NULL,
+        .build_dir = NULL,
+        .depfile = NULL,
+        .dep_target = NULL,
+        .cache_dir = NULL,
+        .cache_size = CRUC_CACHE_SIZE,
+        .std_dir = NULL,
+        .build_std = NULL,
+        .jobs = 0,
+        .assembler = ASSEMBLER_INTEGRATED,
+        .linker = LINKER_LD,
+        .emit = EMIT_ASM,
+        .peephole = PEEPHOLE_ALL,
+        .run_args = dyn_array_empty(str_array),
 };
 
 void
 usage(void)
 {
-        printf("Usage: cruc [options..] <filepath>\n");
+        printf("Usage: cruc [options..] <filepath..>\n");
         printf("Options:\n");
         printf("    --%s, -%c    view this help information\n", FLAG_2HY_HELP, FLAG_1HY_HELP);
-        printf("    --%s, -%c    set the output filename\n", FLAG_2HY_OUTPUT, FLAG_1HY_OUTPUT);
+        printf("    --%s, -%c    set the output filename (the nth -%c names the nth file)\n", FLAG_2HY_OUTPUT, FLAG_1HY_OUTPUT, FLAG_1HY_OUTPUT);
         printf("    --%s, -%c <dir>   add directory to library search path\n", FLAG_2HY_LIBPATH, FLAG_1HY_LIBPATH);
         printf("    --%s, -%c <name>  link with library lib<name>.so or .a\n", FLAG_2HY_LIB, FLAG_1HY_LIB);
+        printf("    --%s <name> assemble with `integrated` (default), `nasm` or `gas`\n", FLAG_2HY_ASSEMBLER);
+        printf("    --%s <name>    link with `ld` (default) or `integrated`\n", FLAG_2HY_LINKER);
+        printf("    --%s <lang>      generate `asm` (default), or `c` to be compiled by cc\n", FLAG_2HY_EMIT);
+        printf("    --%s        print the IR of every procedure as it is generated\n", FLAG_2HY_DUMPIR);
+        printf("    --%s[=<rule,..>] turn the peephole optimiser off, or only the given rules (see -%c)\n", FLAG_2HY_NOPEEPHOLE, FLAG_1HY_VERBOSE);
+        printf("    --%s <file> [args..] compile <file> into memory and run it with [args..]\n", FLAG_2HY_RUN);
+        printf("    --%s <file> [args..] interpret <file> with [args..], without generating code\n", FLAG_2HY_INTERP);
+        printf("    --%s         do not link libc, extern bindings cannot be used\n", FLAG_2HY_NOLIBC);
+        printf("    --%s         link statically, without an interpreter (needs --%s)\n", FLAG_2HY_STATIC, FLAG_2HY_NOLIBC);
+        printf("    --%s          compile std from source instead of using libcrstd.a\n", FLAG_2HY_NOSTD);
+        printf("    --%s <dir>   use the prebuilt standard library in <dir> (default: %s)\n", FLAG_2HY_STDDIR, CRUC_STD_DIR);
+        printf("    --%s <dir> compile the given std modules into <dir>/libcrstd.a\n", FLAG_2HY_BUILDSTD);
+        printf("    --%s <dir> keep objects and module interfaces in <dir> and only rebuild what changed\n", FLAG_2HY_BUILDDIR);
+        printf("    --%s  generate each program with all of its modules as one object\n", FLAG_2HY_WHOLEPROGRAM);
+        printf("    --%s <dir> cache assembled objects in <dir> (or $CRUC_CACHE_DIR)\n", FLAG_2HY_CACHEDIR);
+        printf("    --%s <n>    keep the object cache under <n> bytes, or with a k, M or G suffix (default: 1G)\n", FLAG_2HY_CACHESIZE);
+        printf("    --%s     report object cache hits and misses\n", FLAG_2HY_CACHESTATS);
+        printf("    -%s               write a make depfile to <output>.d\n", FLAG_1HY_MD);
+        printf("    -%s <file>        write the depfile to <file>\n", FLAG_1HY_MF);
+        printf("    -%s <target>      name the target of the depfile rule\n", FLAG_1HY_MT);
+        printf("    -%s               add a phony target for every imported file\n", FLAG_1HY_MP);
+        printf("    -%s               list the object files as targets too (needs --%s)\n", FLAG_1HY_MO, FLAG_2HY_BUILDDIR);
+        printf("    --%s, -%c <n>     run up to <n> assemblers and linkers at once (default: one per CPU)\n", FLAG_2HY_JOBS, FLAG_1HY_JOBS);
+        printf("    --%s   print when each build step ran and the critical path\n", FLAG_2HY_TRACESCHEDULE);
+        printf("    --%s          run a compile server that keeps analyzed modules in memory\n", FLAG_2HY_SERVER);
+        printf("    --%s          forward this compilation to a running server\n", FLAG_2HY_CLIENT);
+        printf("    --%s <path>   socket for --%s/--%s (or $CRUC_SOCKET, default: %s)\n", FLAG_2HY_SOCKET, FLAG_2HY_SERVER, FLAG_2HY_CLIENT, server_default_socket());
         exit(0);
 }
 
+static int
+parse_jobs(const char *s)
+{
+        char *end = NULL;
+        long n = strtol(s, &end, 10);
+        if (!*s || *end || n < 1 || n > 4096) {
+                forge_err_wargs("invalid number of jobs `%s`", s);
+        }
+        return (int)n;
+}
+
+static uint64_t
+parse_size(const char *s)
+{
+        char *end = NULL;
+        unsigned long long n = strtoull(s, &end, 10);
+        int shift = 0;
+        switch (*end) {
+        case 'k': case 'K': shift = 10; ++end; break;
+        case 'm': case 'M': shift = 20; ++end; break;
+        case 'g': case 'G': shift = 30; ++end; break;
+        }
+        if (!*s || *end || n == 0 || n > (UINT64_MAX >> shift)) {
+                forge_err_wargs("invalid size `%s`", s);
+        }
+        return (uint64_t)n << shift;
+}
+
+static int
+parse_assembler(const char *s)
+{
+        if (!strcmp(s, "integrated")) return ASSEMBLER_INTEGRATED;
+        if (!strcmp(s, "nasm"))       return ASSEMBLER_NASM;
+        if (!strcmp(s, "gas"))        return ASSEMBLER_GAS;
+        forge_err_wargs("unknown assembler `%s`", s);
+        return ASSEMBLER_INTEGRATED;
+}
+
+static int
+parse_emit(const char *s)
+{
+        if (!strcmp(s, "asm")) return EMIT_ASM;
+        if (!strcmp(s, "c"))   return EMIT_C;
+        forge_err_wargs("unknown output language `%s`", s);
+        return EMIT_ASM;
+}
+
+// --no-peephole=copy,dead
 static void
-link(str_array obj_filepaths)
+parse_no_peephole(const char *s)
 {
-        int (*_cmd)(const char *) = (g_config.flags & FLAG_TYPE_VERBOSE) == 0
-                ? cmd_s
-                : cmd;
+        char *names = strdup(s);
+        for (char *name = strtok(names, ","); name; name = strtok(NULL, ",")) {
+                uint32_t rule = peephole_find(name);
+                if (!rule) {
+                        forge_err_wargs("unknown peephole rule `%s`", name);
+                }
+                g_config.peephole &= ~rule;
+        }
+        free(names);
+}
 
-        forge_str ld = forge_str_from("ld -dynamic-linker /lib64/ld-linux-x86-64.so.2 -lc ");
-        // append -L paths
-        FOREACH(path, g_config.lib_search_paths.data, g_config.lib_search_paths.len, {
-                forge_str_concat(&ld, "-L");
-                forge_str_concat(&ld, path);
-                forge_str_concat(&ld, " ");
-        });
+static int
+parse_linker(const char *s)
+{
+        if (!strcmp(s, "ld"))         return LINKER_LD;
+        if (!strcmp(s, "integrated")) return LINKER_INTEGRATED;
+        forge_err_wargs("unknown linker `%s`", s);
+        return LINKER_LD;
+}
+
+// ld's arguments, each allocated, ending in NULL.
+static str_array
+ld_argv(const char *outname, str_array inputs)
+{
+        int is_static = g_config.flags & FLAG_TYPE_STATIC;
+
+        str_array argv = dyn_array_empty(str_array);
+        dyn_array_append(argv, strdup("ld"));
+        if (is_static) {
+                dyn_array_append(argv, strdup("-static"));
+        } else {
+                // Without anything to link dynamically, ld leaves
+                // out the interpreter all the same.
+                dyn_array_append(argv, strdup("-dynamic-linker"));
+                dyn_array_append(argv, strdup("/lib64/ld-linux-x86-64.so.2"));
+        }
+        if (!(g_config.flags & FLAG_TYPE_NOLIBC)) {
+                dyn_array_append(argv, strdup("-lc"));
+        }
         FOREACH(path, g_config.lib_search_paths.data, g_config.lib_search_paths.len, {
-                forge_str_concat(&ld, "-rpath=");
-                forge_str_concat(&ld, path);
-                forge_str_concat(&ld, " ");
+                dyn_array_append(argv, forge_cstr_builder("-L", path, NULL));
         });
-        // append -l libs
+        if (!is_static) {
+                FOREACH(path, g_config.lib_search_paths.data, g_config.lib_search_paths.len, {
+                        dyn_array_append(argv, forge_cstr_builder("-rpath=", path, NULL));
+                });
+        }
         FOREACH(lib, g_config.link_libs.data, g_config.link_libs.len, {
-                forge_str_concat(&ld, "-l");
-                forge_str_concat(&ld, lib);
-                forge_str_concat(&ld, " ");
+                dyn_array_append(argv, forge_cstr_builder("-l", lib, NULL));
+        });
+        dyn_array_append(argv, strdup("-o"));
+        dyn_array_append(argv, strdup(outname));
+        FOREACH(in, inputs.data, inputs.len, {
+                dyn_array_append(argv, strdup(in));
         });
-        forge_str_concat(&ld, "-o ");
-        forge_str_concat(&ld, g_config.outname);
+        dyn_array_append(argv, NULL);
 
-        str_array found = dyn_array_empty(str_array);
+        return argv;
+}
 
-        for (size_t i = 0; i < obj_filepaths.len; ++i) {
-                int ok = 1;
-                for (size_t j = 0; j < found.len; ++j) {
-                        if (!strcmp(obj_filepaths.data[i], found.data[j])) {
-                                ok = 0;
-                                break;
-                        }
-                }
-                if (ok) {
-                        dyn_array_append(found, obj_filepaths.data[i]);
-                }
+static void
+free_argv(str_array argv)
+{
+        for (size_t i = 0; i < argv.len; ++i) {
+                free(argv.data[i]);
         }
+        dyn_array_free(argv);
+}
 
-        FOREACH(obj, found.data, found.len, {
-                forge_str_concat(&ld, " ");
-                forge_str_concat(&ld, obj);
-        });
-
-        _cmd(ld.data);
-
-        FOREACH(obj, found.data, found.len, {
-                _cmd(forge_cstr_builder("rm ", obj, NULL));
+static void
+remove_objects(str_array objs)
+{
+        FOREACH(obj, objs.data, objs.len, {
+                if (!objcache_owns(obj)) {
+                        unlink(obj);
+                }
         });
-
-        forge_str_destroy(&ld);
 }
 
+
 static void
 handle_args(int argc, char **argv)
 {
-        forge_arg *arg = forge_arg_alloc(argc, argv, 1);
+        // What follows `--run <file>` or `--interp <file>` is for
+        // the program, which gets the file as its argv[0].
+        int n = argc;
+        for (int i = 1; i < argc; ++i) {
+                if (!strcmp(argv[i], "--" FLAG_2HY_RUN) || !strcmp(argv[i], "--" FLAG_2HY_INTERP)) {
+                        n = i + 2 < argc ? i + 2 : argc;
+                        for (int j = i + 1; j < argc; ++j) {
+                                dyn_array_append(g_config.run_args, strdup(argv[j]));
+                        }
+                        break;
+                }
+        }
+
+        forge_arg *arg = forge_arg_alloc(n, argv, 1);
         forge_arg *it = arg;
 
         while (it) {
                 if (!it->h) {
-                        if (g_config.filepath) { forge_err("only 1 file is supported right now"); }
-                        g_config.filepath = strdup(it->s);
+                        dyn_array_append(g_config.filepaths, strdup(it->s));
                 } else if (it->h == 1) {
-                        if (it->s[0] == FLAG_1HY_HELP) {
+                        if (!strcmp(it->s, FLAG_1HY_MD)) {
+                                g_config.flags |= FLAG_TYPE_MD;
+                        } else if (!strcmp(it->s, FLAG_1HY_MP)) {
+                                g_config.flags |= FLAG_TYPE_MP;
+                        } else if (!strcmp(it->s, FLAG_1HY_MO)) {
+                                g_config.flags |= FLAG_TYPE_MO;
+                        } else if (!strcmp(it->s, FLAG_1HY_MF)) {
+                                if (!it->n) { forge_err_wargs("option -%s requires an argument", FLAG_1HY_MF); }
+                                it = it->n;
+                                g_config.flags |= FLAG_TYPE_MD;
+                                g_config.depfile = strdup(it->s);
+                        } else if (!strcmp(it->s, FLAG_1HY_MT)) {
+                                if (!it->n) { forge_err_wargs("option -%s requires an argument", FLAG_1HY_MT); }
+                                it = it->n;
+                                g_config.dep_target = strdup(it->s);
+                        } else if (it->s[0] == FLAG_1HY_HELP) {
                                 usage();
                         } else if (it->s[0] == FLAG_1HY_OUTPUT) {
                                 if (!it->n) { forge_err_wargs("option -%c requires an argument", FLAG_1HY_OUTPUT); }
                                 it = it->n;
-                                g_config.outname = strdup(it->s);
+                                dyn_array_append(g_config.outnames, strdup(it->s));
                         } else if (it->s[0] == FLAG_1HY_SEARCHPATH) {
                                 if (!it->n) { forge_err_wargs("option -%c requires an argument", FLAG_1HY_SEARCHPATH); }
                                 it = it->n;
@@ -135,6 +314,15 @@ handle_args(int argc, char **argv)
                                 if (!it->n) { forge_err_wargs("option -%c requires an argument", FLAG_1HY_LIB); }
                                 it = it->n;
                                 dyn_array_append(g_config.link_libs, strdup(it->s));
+                        } else if (it->s[0] == FLAG_1HY_JOBS) {
+                                // Both -j4 and -j 4.
+                                if (it->s[1]) {
+                                        g_config.jobs = parse_jobs(it->s + 1);
+                                } else {
+                                        if (!it->n) { forge_err_wargs("option -%c requires an argument", FLAG_1HY_JOBS); }
+                                        it = it->n;
+                                        g_config.jobs = parse_jobs(it->s);
+                                }
                         } else if (it->s[0] == FLAG_1HY_VERBOSE) {
                                 g_config.flags |= FLAG_TYPE_VERBOSE;
                         } else {
@@ -146,11 +334,57 @@ handle_args(int argc, char **argv)
                         } else if (!strcmp(it->s, FLAG_2HY_OUTPUT)) {
                                 if (!it->n) { forge_err_wargs("option --%s requires an argument", FLAG_2HY_OUTPUT); }
                                 it = it->n;
-                                g_config.outname = strdup(it->s);
+                                dyn_array_append(g_config.outnames, strdup(it->s));
                         } else if (!strcmp(it->s, FLAG_2HY_ASM)) {
                                 g_config.flags |= FLAG_TYPE_ASM;
+                        } else if (!strcmp(it->s, FLAG_2HY_DUMPIR)) {
+                                g_config.flags |= FLAG_TYPE_DUMP_IR;
+                        } else if (!strcmp(it->s, FLAG_2HY_NOPEEPHOLE)) {
+                                g_config.peephole = 0;
+                        } else if (!strncmp(it->s, FLAG_2HY_NOPEEPHOLE "=", strlen(FLAG_2HY_NOPEEPHOLE) + 1)) {
+                                parse_no_peephole(it->s + strlen(FLAG_2HY_NOPEEPHOLE) + 1);
+                        } else if (!strcmp(it->s, FLAG_2HY_ASSEMBLER)) {
+                                if (!it->n) { forge_err_wargs("option --%s requires an argument", FLAG_2HY_ASSEMBLER); }
+                                it = it->n;
+                                g_config.assembler = parse_assembler(it->s);
+                        } else if (!strncmp(it->s, FLAG_2HY_ASSEMBLER "=", strlen(FLAG_2HY_ASSEMBLER) + 1)) {
+                                g_config.assembler = parse_assembler(it->s + strlen(FLAG_2HY_ASSEMBLER) + 1);
+                        } else if (!strcmp(it->s, FLAG_2HY_LINKER)) {
+                                if (!it->n) { forge_err_wargs("option --%s requires an argument", FLAG_2HY_LINKER); }
+                                it = it->n;
+                                g_config.linker = parse_linker(it->s);
+                        } else if (!strncmp(it->s, FLAG_2HY_LINKER "=", strlen(FLAG_2HY_LINKER) + 1)) {
+                                g_config.linker = parse_linker(it->s + strlen(FLAG_2HY_LINKER) + 1);
+                        } else if (!strcmp(it->s, FLAG_2HY_EMIT)) {
+                                if (!it->n) { forge_err_wargs("option --%s requires an argument", FLAG_2HY_EMIT); }
+                                it = it->n;
+                                g_config.emit = parse_emit(it->s);
+                        } else if (!strncmp(it->s, FLAG_2HY_EMIT "=", strlen(FLAG_2HY_EMIT) + 1)) {
+                                g_config.emit = parse_emit(it->s + strlen(FLAG_2HY_EMIT) + 1);
+                        } else if (!strcmp(it->s, FLAG_2HY_RUN)) {
+                                if (!it->n) { forge_err_wargs("option --%s requires an argument", FLAG_2HY_RUN); }
+                                it = it->n;
+                                g_config.flags |= FLAG_TYPE_RUN;
+                                dyn_array_append(g_config.filepaths, strdup(it->s));
+                        } else if (!strcmp(it->s, FLAG_2HY_INTERP)) {
+                                if (!it->n) { forge_err_wargs("option --%s requires an argument", FLAG_2HY_INTERP); }
+                                it = it->n;
+                                g_config.flags |= FLAG_TYPE_INTERP;
+                                dyn_array_append(g_config.filepaths, strdup(it->s));
+                        } else if (!strcmp(it->s, FLAG_2HY_STATIC)) {
+                                g_config.flags |= FLAG_TYPE_STATIC;
+                        } else if (!strcmp(it->s, FLAG_2HY_NOLIBC)) {
+                                g_config.flags |= FLAG_TYPE_NOLIBC;
                         } else if (!strcmp(it->s, FLAG_2HY_NOSTD)) {
                                 g_config.flags |= FLAG_TYPE_NOSTD;
+                        } else if (!strcmp(it->s, FLAG_2HY_STDDIR)) {
+                                if (!it->n) { forge_err_wargs("option --%s requires an argument", FLAG_2HY_STDDIR); }
+                                it = it->n;
+                                g_config.std_dir = strdup(it->s);
+                        } else if (!strcmp(it->s, FLAG_2HY_BUILDSTD)) {
+                                if (!it->n) { forge_err_wargs("option --%s requires an argument", FLAG_2HY_BUILDSTD); }
+                                it = it->n;
+                                g_config.build_std = strdup(it->s);
                         } else if (!strcmp(it->s, FLAG_2HY_LIBPATH)) {
                                 if (!it->n) { forge_err_wargs("option --%s requires an argument", FLAG_2HY_LIBPATH); }
                                 it = it->n;
@@ -159,8 +393,38 @@ handle_args(int argc, char **argv)
                                 if (!it->n) { forge_err_wargs("option --%s requires an argument", FLAG_2HY_LIB); }
                                 it = it->n;
                                 dyn_array_append(g_config.link_libs, strdup(it->s));
+                        } else if (!strcmp(it->s, FLAG_2HY_JOBS)) {
+                                if (!it->n) { forge_err_wargs("option --%s requires an argument", FLAG_2HY_JOBS); }
+                                it = it->n;
+                                g_config.jobs = parse_jobs(it->s);
+                        } else if (!strcmp(it->s, FLAG_2HY_TRACESCHEDULE)) {
+                                g_config.flags |= FLAG_TYPE_TRACE_SCHEDULE;
                         } else if (!strcmp(it->s, FLAG_2HY_VERBOSE)) {
                                 g_config.flags |= FLAG_TYPE_VERBOSE;
+                        } else if (!strcmp(it->s, FLAG_2HY_SERVER)) {
+                                g_config.flags |= FLAG_TYPE_SERVER;
+                        } else if (!strcmp(it->s, FLAG_2HY_CLIENT)) {
+                                g_config.flags |= FLAG_TYPE_CLIENT;
+                        } else if (!strcmp(it->s, FLAG_2HY_SOCKET)) {
+                                if (!it->n) { forge_err_wargs("option --%s requires an argument", FLAG_2HY_SOCKET); }
+                                it = it->n;
+                                g_config.socket_path = strdup(it->s);
+                        } else if (!strcmp(it->s, FLAG_2HY_BUILDDIR)) {
+                                if (!it->n) { forge_err_wargs("option --%s requires an argument", FLAG_2HY_BUILDDIR); }
+                                it = it->n;
+                                g_config.build_dir = strdup(it->s);
+                        } else if (!strcmp(it->s, FLAG_2HY_WHOLEPROGRAM)) {
+                                g_config.flags |= FLAG_TYPE_WHOLE_PROGRAM;
+                        } else if (!strcmp(it->s, FLAG_2HY_CACHEDIR)) {
+                                if (!it->n) { forge_err_wargs("option --%s requires an argument", FLAG_2HY_CACHEDIR); }
+                                it = it->n;
+                                g_config.cache_dir = strdup(it->s);
+                        } else if (!strcmp(it->s, FLAG_2HY_CACHESIZE)) {
+                                if (!it->n) { forge_err_wargs("option --%s requires an argument", FLAG_2HY_CACHESIZE); }
+                                it = it->n;
+                                g_config.cache_size = parse_size(it->s);
+                        } else if (!strcmp(it->s, FLAG_2HY_CACHESTATS)) {
+                                g_config.flags |= FLAG_TYPE_CACHE_STATS;
                         }
                         else {
                                 forge_err_wargs("unknown option `%s`", it->s);
@@ -173,28 +437,815 @@ handle_args(int argc, char **argv)
         forge_arg_free(arg);
 }
 
-int
-main(int argc, char **argv)
+static void
+reset_config(void)
 {
-        handle_args(argc, argv);
+        g_config.flags            = 0x0000;
+        g_config.filepaths        = dyn_array_empty(str_array);
+        g_config.outnames         = dyn_array_empty(str_array);
+        g_config.search_paths     = dyn_array_empty(str_array);
+        g_config.lib_search_paths = dyn_array_empty(str_array);
+        g_config.link_libs        = dyn_array_empty(str_array);
+        g_config.socket_path      = NULL;
+        g_config.build_dir        = NULL;
+        g_config.depfile          = NULL;
+        g_config.dep_target       = NULL;
+        g_config.cache_dir        = NULL;
+        g_config.cache_size       = CRUC_CACHE_SIZE;
+        g_config.std_dir          = NULL;
+        g_config.build_std        = NULL;
+        g_config.jobs             = 0;
+        g_config.assembler        = ASSEMBLER_INTEGRATED;
+        g_config.linker           = LINKER_LD;
+        g_config.emit             = EMIT_ASM;
+        g_config.peephole         = PEEPHOLE_ALL;
+        g_config.run_args         = dyn_array_empty(str_array);
+}
 
-        if (!g_config.filepath) {
-                usage();
+// Without -o, a single program is written to a.out and
+// every program of a batch is named after its file.
+static void
+resolve_outnames(void)
+{
+        str_array *fps  = &g_config.filepaths;
+        str_array *outs = &g_config.outnames;
+
+        if (outs->len > fps->len) {
+                forge_err_wargs("got %zu output names for %zu input files", outs->len, fps->len);
+        }
+
+        if (fps->len == 1 && outs->len == 0) {
+                dyn_array_append(*outs, "a.out");
+                return;
+        }
+
+        for (size_t i = outs->len; i < fps->len; ++i) {
+                char *out = strdup(forge_io_basename(fps->data[i]));
+                char *ext = strrchr(out, '.');
+                if (ext && !strcmp(ext, ".cr")) *ext = 0;
+                dyn_array_append(*outs, out);
+        }
+
+        for (size_t i = 0; i < outs->len; ++i) {
+                for (size_t j = i+1; j < outs->len; ++j) {
+                        if (!strcmp(outs->data[i], outs->data[j])) {
+                                forge_err_wargs("both `%s` and `%s` would be written to `%s`, use -%c to name them",
+                                                fps->data[i], fps->data[j], outs->data[i], FLAG_1HY_OUTPUT);
+                        }
+                }
+        }
+}
+
+/*** Build tasks ***/
+
+// A module that goes into one or more programs, or with
+// --whole-program, all of the modules of one.
+typedef struct {
+        module *m;
+        module_array *closure; // --whole-program: what is in it, m last
+        asm_job *job;
+        char *obj;      // known up front, or once assembled
+        task *assemble; // NULL if there is nothing to wait for
+} unit;
+
+DYN_ARRAY_TYPE(unit *, unit_array);
+
+// The state of a compilation, shared by its tasks.
+static struct {
+        module_array *mods;  // the closure of each program, entry last
+        smap units;          // module path -> unit
+        unit_array order;    // units in the order they were found
+        unit **programs;     // --whole-program: the unit of each program
+        link_image *image;   // --run: the program, once linked
+} g_build;
+
+static long
+run_load(task *t)
+{
+        size_t i = (size_t)(uintptr_t)t->data;
+        module *m = modcache_load(g_config.filepaths.data[i], NULL);
+        g_build.mods[i] = modcache_closure(m);
+        return 0;
+}
+
+static long
+run_codegen(task *t)
+{
+        unit *u = (unit *)t->data;
+        u->job = u->closure
+                ? asm_codegen_program(*u->closure)
+                : asm_codegen(u->m);
+        return 0;
+}
+
+static long
+run_assemble(task *t)
+{
+        unit *u = (unit *)t->data;
+        return asm_assemble_start(u->job);
+}
+
+static int
+finish_assemble(task *t, int status)
+{
+        unit *u = (unit *)t->data;
+        u->obj = asm_assemble_finish(u->job, status);
+        u->job = NULL;
+        if (!u->obj) return 1;
+
+        if (g_config.build_dir) {
+                char *cri = forge_cstr_builder(modcache_outbase(u->m), ".cri", NULL);
+                iface_write(u->m, cri);
+                free(cri);
+        }
+        return 0;
+}
+
+// Each object of the ith program once, in the order found.
+static str_array
+program_objects(size_t i)
+{
+        str_array objs = dyn_array_empty(str_array);
+
+        if (g_build.programs) {
+                unit *u = g_build.programs[i];
+                if (u && u->obj) dyn_array_append(objs, u->obj);
+                return objs;
+        }
+
+        smap seen = smap_create(NULL);
+        for (size_t j = 0; j < g_build.mods[i].len; ++j) {
+                unit *u = (unit *)smap_get(&g_build.units, g_build.mods[i].data[j]->path);
+                if (u && u->obj && !smap_has(&seen, u->obj)) {
+                        smap_insert(&seen, u->obj, u);
+                        dyn_array_append(objs, u->obj);
+                }
+        }
+        smap_free(&seen);
+        return objs;
+}
+
+// Returns 0 once linked, -1 if that failed and 1 to leave it
+// to ld.
+static int
+link_integrated(const char *outname, str_array inputs)
+{
+        char *why = NULL;
+        int r = 1;
+
+        if (g_config.link_libs.len) {
+                why = strdup("libraries given with -l need ld");
+        } else {
+                r = link_exe(outname, inputs, !(g_config.flags & FLAG_TYPE_NOLIBC), &why);
+        }
+        if (r == 1 && (g_config.flags & FLAG_TYPE_VERBOSE)) {
+                printf("%s: %s, using ld\n", outname, why);
+        }
+
+        free(why);
+        return r;
+}
+
+static long
+run_link(task *t)
+{
+        size_t i = (size_t)(uintptr_t)t->data;
+        const char *outname = g_config.outnames.data[i];
+        str_array inputs = program_objects(i);
+
+        // After the objects, so that only the members they need
+        // are linked.
+        char *crstd = NULL;
+        if (g_config.std_dir) {
+                crstd = forge_cstr_builder(g_config.std_dir, "/libcrstd.a", NULL);
+                dyn_array_append(inputs, crstd);
+        }
+
+        long r = 1;
+        if (g_config.linker == LINKER_INTEGRATED) {
+                r = link_integrated(outname, inputs);
+        }
+        if (r == 1) {
+                str_array argv = ld_argv(outname, inputs);
+                r = spawn_start(argv.data);
+                free_argv(argv);
+        }
+
+        dyn_array_free(inputs);
+        free(crstd);
+        return r;
+}
+
+// Loads what -l names for dlsym(3) to find, from the
+// directories given with -L before anywhere else.
+static int
+open_libs(void)
+{
+        FOREACH(lib, g_config.link_libs.data, g_config.link_libs.len, {
+                void *h = NULL;
+                FOREACH(dir, g_config.lib_search_paths.data, g_config.lib_search_paths.len, {
+                        char *path = forge_cstr_builder(dir, "/lib", lib, ".so", NULL);
+                        if (!h) h = dlopen(path, RTLD_NOW | RTLD_GLOBAL);
+                        free(path);
+                });
+                if (!h) {
+                        char *name = forge_cstr_builder("lib", lib, ".so", NULL);
+                        h = dlopen(name, RTLD_NOW | RTLD_GLOBAL);
+                        free(name);
+                }
+                if (!h) {
+                        fprintf(stderr, "could not load library `%s`: %s\n", lib, dlerror());
+                        return 1;
+                }
+        });
+        return 0;
+}
+
+// --run: links the program into memory, to be entered once
+// the build is cleaned up.
+static long
+run_jit(task *t)
+{
+        NOOP(t);
+
+        str_array inputs = program_objects(0);
+        char *crstd = NULL;
+        if (g_config.std_dir) {
+                crstd = forge_cstr_builder(g_config.std_dir, "/libcrstd.a", NULL);
+                dyn_array_append(inputs, crstd);
+        }
+
+        int r = open_libs();
+        if (!r) {
+                char *why = NULL;
+                r = link_jit(inputs, !(g_config.flags & FLAG_TYPE_NOLIBC), &g_build.image, &why);
+                if (r == 1) {
+                        fprintf(stderr, "`%s` cannot be run in memory: %s\n", g_config.filepaths.data[0], why);
+                }
+                free(why);
         }
-        if (!g_config.outname) {
-                g_config.outname = "a.out";
+
+        dyn_array_free(inputs);
+        free(crstd);
+        return r != 0;
+}
+
+static int
+finish_link(task *t, int status)
+{
+        NOOP(t);
+        return status != 0;
+}
+
+static const task_ops g_load_ops     = {TASK_CPU,  run_load,     NULL};
+static const task_ops g_codegen_ops  = {TASK_CPU,  run_codegen,  NULL};
+static const task_ops g_assemble_ops = {TASK_PROC, run_assemble, finish_assemble};
+static const task_ops g_link_ops     = {TASK_PROC, run_link,     finish_link};
+static const task_ops g_jit_ops      = {TASK_CPU,  run_jit,      NULL};
+
+// Decides what `m` needs: nothing if it is in libcrstd.a or its
+// object in the build directory is current, code generation
+// and assembly otherwise.
+static unit *
+plan_unit(module *m)
+{
+        unit *u = (unit *)smap_get(&g_build.units, m->path);
+        if (u) return u;
+
+        u = (unit *)alloc(sizeof(unit));
+        u->m        = m;
+        u->closure  = NULL;
+        u->job      = NULL;
+        u->obj      = NULL;
+        u->assemble = NULL;
+
+        smap_insert(&g_build.units, m->path, u);
+        dyn_array_append(g_build.order, u);
+
+        if (m->prebuilt) {
+                return u;
+        }
+
+        if (g_config.build_dir) {
+                const char *base = modcache_outbase(m);
+                char *cri = forge_cstr_builder(base, ".cri", NULL);
+                char *obj = forge_cstr_builder(base, ".o", NULL);
+
+                // Modules without a program were loaded from their
+                // interface, which means that they are up to date.
+                int current = !m->program || (iface_current(m, cri) && access(obj, R_OK) == 0);
+                free(cri);
+
+                if (current) {
+                        u->obj = obj;
+                        return u;
+                }
+                free(obj);
+        }
+
+        char *name = forge_cstr_builder("codegen ", m->src_filepath, NULL);
+        task *codegen = sched_add(name, &g_codegen_ops, u);
+        free(name);
+
+        name = forge_cstr_builder("assemble ", m->src_filepath, NULL);
+        u->assemble = sched_add(name, &g_assemble_ops, u);
+        free(name);
+
+        sched_depend(u->assemble, codegen);
+
+        return u;
+}
+
+// With --whole-program, the ith program is a unit of its own.
+static unit *
+plan_program(size_t i)
+{
+        module_array *mods = &g_build.mods[i];
+
+        unit *u = (unit *)alloc(sizeof(unit));
+        u->m        = mods->data[mods->len - 1];
+        u->closure  = mods;
+        u->job      = NULL;
+        u->obj      = NULL;
+        u->assemble = NULL;
+
+        dyn_array_append(g_build.order, u);
+        g_build.programs[i] = u;
+
+        char *name = forge_cstr_builder("codegen ", g_config.filepaths.data[i], NULL);
+        task *codegen = sched_add(name, &g_codegen_ops, u);
+        free(name);
+
+        name = forge_cstr_builder("assemble ", g_config.filepaths.data[i], NULL);
+        u->assemble = sched_add(name, &g_assemble_ops, u);
+        free(name);
+
+        sched_depend(u->assemble, codegen);
+
+        return u;
+}
+
+// What sem_analysis() reports about externs under --nolibc,
+// for every build: modules reused from the server's cache or
+// loaded from their interface were not analyzed this time.
+static void
+check_nolibc(const module_array *mods, size_t n)
+{
+        if (!(g_config.flags & FLAG_TYPE_NOLIBC) || g_config.link_libs.len) return;
+
+        for (size_t i = 0; i < n; ++i) {
+                for (size_t j = 0; j < mods[i].len; ++j) {
+                        const module *m = mods[i].data[j];
+                        if (m->tbl->externs.len) {
+                                forge_err_wargs("%s: extern procedure `%s` cannot be used with --%s",
+                                                m->src_filepath, m->tbl->externs.data[0], FLAG_2HY_NOLIBC);
+                        }
+                }
         }
+}
+
+// Runs once every program is loaded, adding the rest of the
+// graph: shared modules are generated once no matter how many
+// programs import them, and each program links as soon as
+// its own objects are there.
+static long
+run_plan(task *t)
+{
+        NOOP(t);
+
+        size_t n = g_config.filepaths.len;
 
-        char *src = forge_io_read_file_to_cstr(g_config.filepath);
-        if (!src) {
-                forge_err_wargs("could not read filepath `%s`", g_config.filepath);
+        check_nolibc(g_build.mods, n);
+
+        // Objects in a build directory outlive this set of
+        // programs, so they have to keep everything.
+        if (!g_config.build_dir) {
+                reach_compute(g_build.mods, n);
         }
 
-        lexer    l      = lexer_create(src, g_config.filepath);
-        program  *p     = parser_create_program(&l);
-        symtbl  *tbl    = sem_analysis(p);
+        for (size_t i = 0; i < n; ++i) {
+                task *link = NULL;
+                if (g_config.flags & FLAG_TYPE_RUN) {
+                        char *name = forge_cstr_builder("load ", g_config.filepaths.data[i], " into memory", NULL);
+                        link = sched_add(name, &g_jit_ops, (void *)(uintptr_t)i);
+                        free(name);
+                } else {
+                        char *name = forge_cstr_builder("link ", g_config.outnames.data[i], NULL);
+                        link = sched_add(name, &g_link_ops, (void *)(uintptr_t)i);
+                        free(name);
+                }
 
-        link(asm_gen(p, tbl));
+                if (g_build.programs) {
+                        sched_depend(link, plan_program(i)->assemble);
+                        continue;
+                }
+
+                for (size_t j = 0; j < g_build.mods[i].len; ++j) {
+                        unit *u = plan_unit(g_build.mods[i].data[j]);
+                        if (u->assemble) sched_depend(link, u->assemble);
+                }
+        }
 
         return 0;
 }
+
+static const task_ops g_plan_ops = {TASK_CPU, run_plan, NULL};
+
+static int
+default_jobs(void)
+{
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        return n < 1 ? 1 : (int)n;
+}
+
+// One rule per program, either all in the -MF file or
+// each in <output>.d.
+static void
+write_depfiles(module_array *mods, str_array *obj_filepaths)
+{
+        FILE *f = NULL;
+
+        if (g_config.depfile && !(f = fopen(g_config.depfile, "w"))) {
+                forge_err_wargs("could not write depfile `%s`: %s", g_config.depfile, strerror(errno));
+        }
+
+        for (size_t i = 0; i < g_config.outnames.len; ++i) {
+                const char *out = g_config.outnames.data[i];
+                const char *target = g_config.dep_target ? g_config.dep_target : out;
+                const str_array *objs = (g_config.flags & FLAG_TYPE_MO) ? &obj_filepaths[i] : NULL;
+
+                if (!g_config.depfile) {
+                        char *path = forge_cstr_builder(out, ".d", NULL);
+                        if (!(f = fopen(path, "w"))) {
+                                forge_err_wargs("could not write depfile `%s`: %s", path, strerror(errno));
+                        }
+                        free(path);
+                } else if (i > 0) {
+                        fputc('\n', f);
+                }
+
+                depfile_write(f, target, objs, mods[i], g_config.flags & FLAG_TYPE_MP);
+
+                if (!g_config.depfile) {
+                        fclose(f);
+                }
+        }
+
+        if (g_config.depfile) {
+                fclose(f);
+        }
+}
+
+// The prebuilt standard library is used when there is one,
+// unless asked not to. Naming a directory that has none is
+// an error, not having one in the default location is not.
+static void
+resolve_std_dir(void)
+{
+        if ((g_config.flags & FLAG_TYPE_NOSTD) || g_config.build_std) {
+                g_config.std_dir = NULL;
+                return;
+        }
+
+        int explicit = g_config.std_dir != NULL;
+        if (!explicit) {
+                g_config.std_dir = (char *)CRUC_STD_DIR;
+        }
+
+        char *lib = forge_cstr_builder(g_config.std_dir, "/libcrstd.a", NULL);
+        if (access(lib, R_OK) != 0) {
+                if (explicit) {
+                        forge_err_wargs("could not find `%s`, build it with --%s", lib, FLAG_2HY_BUILDSTD);
+                }
+                g_config.std_dir = NULL;
+        }
+        free(lib);
+}
+
+static void
+mkdirs(const char *path)
+{
+        char *p = strdup(path);
+        for (char *s = strchr(p+1, '/'); s; s = strchr(s+1, '/')) {
+                *s = 0;
+                if (mkdir(p, 0755) != 0 && errno != EEXIST) break;
+                *s = '/';
+        }
+        if (mkdir(p, 0755) != 0 && errno != EEXIST) {
+                forge_err_wargs("could not create directory `%s`: %s", p, strerror(errno));
+        }
+        free(p);
+}
+
+// Compiles the std modules given on the command line (as
+// they would be imported, e.g. std/io.cr) into libcrstd.a,
+// with their interfaces next to it in the same layout.
+static int
+build_std(void)
+{
+        const char *dir = g_config.build_std;
+
+        // Everything is compiled from source here.
+        g_config.build_dir = NULL;
+
+        modcache_begin();
+
+        smap inputs = smap_create(NULL);
+        module_array mods = dyn_array_empty(module_array);
+
+        for (size_t i = 0; i < g_config.filepaths.len; ++i) {
+                const char *fp = g_config.filepaths.data[i];
+                if (strncmp(fp, "std/", 4)) {
+                        forge_err_wargs("`%s` is not a standard library module (expected std/...)", fp);
+                }
+
+                module *m = modcache_load(fp, NULL);
+                smap_insert(&inputs, m->path, m);
+                dyn_array_append(mods, m);
+
+                char *cri = forge_cstr_builder(dir, "/", fp, "i", NULL);
+                char *slash = strrchr(cri, '/');
+                *slash = 0;
+                mkdirs(cri);
+                *slash = '/';
+                iface_write(m, cri);
+                free(cri);
+
+                // And the source, for --interp.
+                char *src = forge_cstr_builder(dir, "/", fp, NULL);
+                FILE *f = fopen(src, "w");
+                if (!f || fputs(m->src, f) < 0 || fclose(f) != 0) {
+                        forge_err_wargs("could not write `%s`: %s", src, strerror(errno));
+                }
+                free(src);
+        }
+
+        char *lib = forge_cstr_builder(dir, "/libcrstd.a", NULL);
+        str_array objs = dyn_array_empty(str_array);
+        str_array ar = dyn_array_empty(str_array);
+        dyn_array_append(ar, "ar");
+        dyn_array_append(ar, "rcs");
+        dyn_array_append(ar, lib);
+
+        for (size_t i = 0; i < mods.len; ++i) {
+                for (size_t j = 0; j < mods.data[i]->deps.len; ++j) {
+                        module *dep = mods.data[i]->deps.data[j];
+                        if (!smap_has(&inputs, dep->path)) {
+                                forge_err_wargs("`%s` imports `%s`, which is not part of the library",
+                                                mods.data[i]->src_filepath, dep->src_filepath);
+                        }
+                }
+
+                char *obj = asm_gen(mods.data[i]);
+                dyn_array_append(objs, obj);
+                dyn_array_append(ar, obj);
+        }
+        dyn_array_append(ar, NULL);
+
+        // ar only ever adds to an existing archive.
+        unlink(lib);
+
+        int failed = spawn(ar.data) != 0;
+
+        remove_objects(objs);
+
+        free(lib);
+        dyn_array_free(ar);
+        dyn_array_free(objs);
+        dyn_array_free(mods);
+        smap_free(&inputs);
+
+        return failed ? 1 : 0;
+}
+
+// --interp: every module of the program is analyzed from
+// source, std too, and run without any code being generated.
+static int
+interpret(void)
+{
+        // The prebuilt library comes with its sources, which
+        // are used unless -I finds others first.
+        if (g_config.std_dir) {
+                dyn_array_append(g_config.search_paths, strdup(g_config.std_dir));
+        }
+        g_config.std_dir = NULL;
+        g_config.build_dir = NULL;
+
+        modcache_begin();
+
+        module *m = modcache_load(g_config.filepaths.data[0], NULL);
+        module_array mods = modcache_closure(m);
+
+        if (open_libs() != 0) {
+                dyn_array_free(mods);
+                return 1;
+        }
+
+        int status = interp_run(mods, (int)g_config.run_args.len, g_config.run_args.data);
+        dyn_array_free(mods);
+        return status;
+}
+
+static int
+compile(void)
+{
+        if (g_config.filepaths.len == 0) {
+                usage();
+        }
+
+        // cruc only ever links libc dynamically.
+        if ((g_config.flags & FLAG_TYPE_STATIC) && !(g_config.flags & FLAG_TYPE_NOLIBC)) {
+                forge_err_wargs("--%s needs --%s", FLAG_2HY_STATIC, FLAG_2HY_NOLIBC);
+        }
+
+        if ((g_config.flags & FLAG_TYPE_RUN) && g_config.filepaths.len != 1) {
+                forge_err_wargs("--%s runs a single program", FLAG_2HY_RUN);
+        }
+
+        if ((g_config.flags & FLAG_TYPE_INTERP) && g_config.filepaths.len != 1) {
+                forge_err_wargs("--%s runs a single program", FLAG_2HY_INTERP);
+        }
+
+        resolve_std_dir();
+
+        if (g_config.build_std) {
+                return build_std();
+        }
+
+        if (g_config.flags & FLAG_TYPE_INTERP) {
+                return interpret();
+        }
+
+        resolve_outnames();
+
+        if (!g_config.cache_dir && getenv("CRUC_CACHE_DIR") && *getenv("CRUC_CACHE_DIR")) {
+                g_config.cache_dir = getenv("CRUC_CACHE_DIR");
+        }
+
+        // Objects in a build directory are per module.
+        if ((g_config.flags & FLAG_TYPE_WHOLE_PROGRAM) && g_config.build_dir) {
+                forge_err_wargs("--%s cannot be used with --%s", FLAG_2HY_WHOLEPROGRAM, FLAG_2HY_BUILDDIR);
+        }
+
+        if (g_config.dep_target && g_config.filepaths.len > 1) {
+                forge_err_wargs("-%s can only be used with a single input file", FLAG_1HY_MT);
+        }
+
+        // Objects anywhere else are gone, or may be, by the time
+        // make reads the rule.
+        if ((g_config.flags & FLAG_TYPE_MO) && !g_config.build_dir) {
+                forge_err_wargs("-%s needs --%s", FLAG_1HY_MO, FLAG_2HY_BUILDDIR);
+        }
+
+        modcache_begin();
+
+        if (g_config.build_dir && mkdir(g_config.build_dir, 0755) != 0 && errno != EEXIST) {
+                forge_err_wargs("could not create build directory `%s`: %s", g_config.build_dir, strerror(errno));
+        }
+
+        size_t n = g_config.filepaths.len;
+
+        module_array *mods = (module_array *)alloc(sizeof(module_array) * n);
+        g_build.mods  = mods;
+        g_build.units = smap_create(NULL);
+        g_build.order = dyn_array_empty(unit_array);
+        g_build.programs = NULL;
+        g_build.image = NULL;
+
+        if (g_config.flags & FLAG_TYPE_WHOLE_PROGRAM) {
+                g_build.programs = (unit **)alloc(sizeof(unit *) * n);
+                memset(g_build.programs, 0, sizeof(unit *) * n);
+        }
+
+        for (size_t i = 0; i < n; ++i) {
+                mods[i] = dyn_array_empty(module_array);
+        }
+
+        sched_reset();
+
+        task *plan = sched_add("plan", &g_plan_ops, NULL);
+        for (size_t i = 0; i < n; ++i) {
+                char *name = forge_cstr_builder("load ", g_config.filepaths.data[i], NULL);
+                sched_depend(plan, sched_add(name, &g_load_ops, (void *)(uintptr_t)i));
+                free(name);
+        }
+
+        int failed = sched_run(g_config.jobs ? g_config.jobs : default_jobs());
+
+        if (g_config.flags & FLAG_TYPE_TRACE_SCHEDULE) {
+                sched_trace(stderr);
+        }
+
+        str_array *obj_filepaths = (str_array *)alloc(sizeof(str_array) * n);
+        for (size_t i = 0; i < n; ++i) {
+                obj_filepaths[i] = program_objects(i);
+        }
+
+        // Objects in the build directory are kept for next time.
+        if (!g_config.build_dir) {
+                str_array objs = dyn_array_empty(str_array);
+                for (size_t i = 0; i < g_build.order.len; ++i) {
+                        if (g_build.order.data[i]->obj) dyn_array_append(objs, g_build.order.data[i]->obj);
+                }
+                remove_objects(objs);
+                dyn_array_free(objs);
+        }
+
+        if (!failed && (g_config.flags & FLAG_TYPE_MD)) {
+                write_depfiles(mods, obj_filepaths);
+        }
+
+        objcache_trim();
+        if (g_config.flags & FLAG_TYPE_CACHE_STATS) {
+                objcache_stats(stderr);
+        }
+
+        for (size_t i = 0; i < n; ++i) {
+                dyn_array_free(mods[i]);
+                dyn_array_free(obj_filepaths[i]);
+        }
+        for (size_t i = 0; i < g_build.order.len; ++i) {
+                free(g_build.order.data[i]);
+        }
+        dyn_array_free(g_build.order);
+        smap_free(&g_build.units);
+        free(g_build.programs);
+        g_build.programs = NULL;
+        free(mods);
+        free(obj_filepaths);
+
+        if (!failed && g_build.image) {
+                link_jit_run(g_build.image, (int)g_config.run_args.len, g_config.run_args.data);
+        }
+
+        return failed ? 1 : 0;
+}
+
+// Called by the server for every forwarded command line.
+static int
+compile_request(int argc, char **argv)
+{
+        reset_config();
+        handle_args(argc, argv);
+        if (g_config.flags & (FLAG_TYPE_SERVER | FLAG_TYPE_CLIENT)) {
+                forge_err_wargs("--%s and --%s cannot be forwarded to a server", FLAG_2HY_SERVER, FLAG_2HY_CLIENT);
+        }
+        if (g_config.flags & FLAG_TYPE_RUN) {
+                forge_err_wargs("--%s cannot be forwarded to a server", FLAG_2HY_RUN);
+        }
+        if (g_config.flags & FLAG_TYPE_INTERP) {
+                forge_err_wargs("--%s cannot be forwarded to a server", FLAG_2HY_INTERP);
+        }
+        return compile();
+}
+
+// Runs the compilation on a server if there is one, keeping
+// everything but the client options. Returns -1 if there is not.
+static int
+forward(int argc, char **argv)
+{
+        char **fwd = (char **)alloc(sizeof(char *) * (argc+1));
+        int n = 0;
+
+        for (int i = 0; i < argc; ++i) {
+                if (i > 0 && !strcmp(argv[i], "--"FLAG_2HY_CLIENT)) {
+                        continue;
+                }
+                if (i > 0 && !strcmp(argv[i], "--"FLAG_2HY_SOCKET)) {
+                        ++i;
+                        continue;
+                }
+                fwd[n++] = argv[i];
+        }
+
+        int status = client_run(g_config.socket_path, n, fwd);
+        free(fwd);
+        return status;
+}
+
+int
+main(int argc, char **argv)
+{
+        handle_args(argc, argv);
+
+        if (!g_config.socket_path) {
+                g_config.socket_path = (char *)server_default_socket();
+        }
+
+        if (g_config.flags & FLAG_TYPE_SERVER) {
+                server_run(g_config.socket_path, compile_request);
+        }
+
+        // A program to run has to end up in this process.
+        if ((g_config.flags & FLAG_TYPE_CLIENT) && !(g_config.flags & (FLAG_TYPE_RUN | FLAG_TYPE_INTERP))) {
+                int status = forward(argc, argv);
+                if (status >= 0) {
+                        return status;
+                }
+                if (g_config.flags & FLAG_TYPE_VERBOSE) {
+                        fprintf(stderr, "no server at `%s`, compiling locally\n", g_config.socket_path);
+                }
+        }
+
+        return compile();
+}
@@ -0,0 +1,506 @@
+#include "modcache.h"
+#include "iface.h"
+#include "lexer.h"
+#include "parser.h"
+#include "sem.h"
+#include "io.h"
+#include "mem.h"
+#include "utils.h"
+#include "global.h"
+#include "flags.h"
+#include "ds/smap.h"
+
+#include <forge/array.h>
+#include <forge/cstr.h>
+#include <forge/err.h>
+#include <forge/io.h>
+#include <forge/str.h>
+
+#include <assert.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static smap         g_modules  = {0};
+static smap         g_stems    = {0};
+static unsigned     g_gen      = 1;
+static module_array g_loading  = dyn_array_empty(module_array);
+static module_array g_misses   = dyn_array_empty(module_array);
+
+// Set while warming the cache on behalf of a finished
+// compilation, see modcache_warm().
+static const smap  *g_expect   = NULL;
+static jmp_buf      g_warm_jmp;
+
+static module *get(const char *found, char *path, const loc *loc);
+static module *load_prebuilt(const char *fp, const loc *loc);
+
+static int
+same_mtime(struct timespec a, struct timespec b)
+{
+        return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+static char *
+resolve(const char *fp, char **found)
+{
+        *found = find_file_from_searchpaths(fp);
+        if (!*found) return NULL;
+        char *path = realpath(*found, NULL);
+        if (!path) {
+                free(*found);
+                *found = NULL;
+        }
+        return path;
+}
+
+static char *
+read_src(const char *fp, struct stat *st)
+{
+        char *src = forge_io_read_file_to_cstr(fp);
+        if (src && stat(fp, st) != 0) {
+                free(src);
+                return NULL;
+        }
+        return src;
+}
+
+static int
+unchanged(module *m)
+{
+        struct stat st;
+        if (stat(m->path, &st) != 0) return 0;
+
+        if (!same_mtime(st.st_mtim, m->mtime) || st.st_size != m->size) {
+                // Touched, but maybe not changed.
+                char *src = forge_io_read_file_to_cstr(m->path);
+                if (!src) return 0;
+                uint64_t hash = hash_cstr(src);
+                free(src);
+                if (hash != m->hash) return 0;
+                m->mtime = st.st_mtim;
+                m->size = st.st_size;
+        }
+
+        return 1;
+}
+
+// Checks that every import still resolves to the same file,
+// and that the interface behind it is the one we were built
+// against. Reloads those dependencies as needed.
+static int
+deps_unchanged(str_array specs, str_array paths, u64_array hashes, module_array *deps)
+{
+        for (size_t i = 0; i < specs.len; ++i) {
+                module *dep = load_prebuilt(specs.data[i], NULL);
+                if (dep) {
+                        if (strcmp(dep->path, paths.data[i])) return 0;
+                        if (dep->iface_hash != hashes.data[i]) return 0;
+                        if (deps) dyn_array_append(*deps, dep);
+                        continue;
+                }
+
+                char *found = NULL;
+                char *path = resolve(specs.data[i], &found);
+
+                if (!path || strcmp(path, paths.data[i])) {
+                        free(path);
+                        free(found);
+                        return 0;
+                }
+
+                dep = get(found, path, NULL);
+                free(found);
+
+                if (dep->iface_hash != hashes.data[i]) return 0;
+                if (deps) dyn_array_append(*deps, dep);
+        }
+
+        return 1;
+}
+
+static module *
+module_alloc(const char *found, char *path, uint64_t hash, struct stat *st)
+{
+        module *m       = (module *)alloc(sizeof(module));
+        m->path         = path;
+        m->src_filepath = strdup(found);
+        m->src          = NULL;
+        m->hash         = hash;
+        m->mtime        = st->st_mtim;
+        m->size         = st->st_size;
+        m->program      = NULL;
+        m->tbl          = NULL;
+        m->iface_hash   = 0;
+        m->specs        = dyn_array_empty(str_array);
+        m->deps         = dyn_array_empty(module_array);
+        m->dep_ifaces   = dyn_array_empty(u64_array);
+        m->outbase      = NULL;
+        m->outbase_gen  = 0;
+        m->gen          = g_gen;
+        m->prebuilt     = 0;
+        return m;
+}
+
+static void
+insert(module *m)
+{
+        // Note: the old module (if any) is leaked on purpose,
+        //       importers that were analyzed against it keep
+        //       pointing into it.
+        smap_insert(&g_modules, m->path, m);
+        dyn_array_append(g_misses, m);
+}
+
+// Tries to get away with only reading the interface that
+// was written the last time this module was built.
+static module *
+load_iface(const char *found, char *path, uint64_t hash, struct stat *st)
+{
+        module *m = module_alloc(found, path, hash, st);
+        const char *base = modcache_outbase(m);
+        char *cri = forge_cstr_builder(base, ".cri", NULL);
+        char *obj = forge_cstr_builder(base, ".o", NULL);
+
+        iface *ifc = iface_read(cri, m->src_filepath);
+        int ok = ifc && ifc->src_hash == hash && access(obj, R_OK) == 0;
+
+        free(cri);
+        free(obj);
+
+        if (!ok || !deps_unchanged(ifc->dep_specs, ifc->dep_paths, ifc->dep_hashes, &m->deps)) {
+                return NULL;
+        }
+
+        m->tbl        = ifc->tbl;
+        m->iface_hash = ifc->hash;
+        m->specs      = ifc->dep_specs;
+        m->dep_ifaces = ifc->dep_hashes;
+
+        insert(m);
+
+        return m;
+}
+
+// Imports of `std` come from the interfaces next to libcrstd.a
+// (see --build-std) when there is one. The sources are not
+// looked at, the library is rebuilt as a whole or not at all.
+static module *
+load_prebuilt(const char *fp, const loc *loc)
+{
+        if (!g_config.std_dir || strncmp(fp, "std/", 4)) return NULL;
+
+        // std/io.cr -> <std dir>/std/io.cri
+        char *cri = forge_cstr_builder(g_config.std_dir, "/", fp, "i", NULL);
+        struct stat st;
+        if (stat(cri, &st) != 0) {
+                free(cri);
+                return NULL;
+        }
+
+        module *m = (module *)smap_get(&g_modules, cri);
+        if (m && (m->gen == g_gen || (same_mtime(st.st_mtim, m->mtime) && st.st_size == m->size))) {
+                m->gen = g_gen;
+                free(cri);
+                return m;
+        }
+
+        iface *ifc = iface_read(cri, fp);
+        if (!ifc) {
+                forge_err_wargs("%s`%s` is not a module interface", (loc ? loc_err(*loc) : ""), cri);
+        }
+
+        m             = module_alloc(cri, cri, ifc->src_hash, &st);
+        m->tbl        = ifc->tbl;
+        m->iface_hash = ifc->hash;
+        m->specs      = ifc->dep_specs;
+        m->dep_ifaces = ifc->dep_hashes;
+        m->prebuilt   = 1;
+
+        for (size_t i = 0; i < m->specs.len; ++i) {
+                module *dep = load_prebuilt(m->specs.data[i], loc);
+                if (!dep || dep->iface_hash != m->dep_ifaces.data[i]) {
+                        forge_err_wargs("%sthe standard library in `%s` is incomplete or out of date, rebuild it or use --%s",
+                                        (loc ? loc_err(*loc) : ""), g_config.std_dir, FLAG_2HY_NOSTD);
+                }
+                dyn_array_append(m->deps, dep);
+        }
+
+        // Not a miss, there is nothing for a server to warm.
+        smap_insert(&g_modules, m->path, m);
+
+        return m;
+}
+
+static module *
+load(const char *found, char *path, const loc *loc)
+{
+        for (size_t i = 0; i < g_loading.len; ++i) {
+                if (!strcmp(g_loading.data[i]->path, path)) {
+                        forge_err_wargs("%scircular import of `%s`", (loc ? loc_err(*loc) : ""), found);
+                }
+        }
+
+        struct stat st;
+        char *src = read_src(found, &st);
+        if (!src) {
+                if (g_expect) longjmp(g_warm_jmp, 1);
+                searchpaths_err(found, loc);
+        }
+
+        uint64_t hash = hash_cstr(src);
+
+        if (g_expect) {
+                uint64_t *want = (uint64_t *)smap_get(g_expect, path);
+                if (!want || *want != hash) longjmp(g_warm_jmp, 1);
+        }
+
+        if (g_config.build_dir) {
+                module *m = load_iface(found, path, hash, &st);
+                if (m) {
+                        free(src);
+                        return m;
+                }
+        }
+
+        module *m = module_alloc(found, path, hash, &st);
+        m->src = src;
+
+        dyn_array_append(g_loading, m);
+
+        lexer l       = lexer_create(m->src, m->src_filepath);
+        m->program    = parser_create_program(&l);
+        m->tbl        = sem_analysis(m->program);
+        m->iface_hash = iface_hash(m->tbl);
+
+        --g_loading.len;
+
+        insert(m);
+
+        return m;
+}
+
+static int
+has_object(module *m)
+{
+        char *obj = forge_cstr_builder(modcache_outbase(m), ".o", NULL);
+        int ok = access(obj, R_OK) == 0;
+        free(obj);
+        return ok;
+}
+
+static module *
+get(const char *found, char *path, const loc *loc)
+{
+        module *m = (module *)smap_get(&g_modules, path);
+
+        if (m && m->gen == g_gen) {
+                free(path);
+                return m;
+        }
+
+        // Only loaded from its interface, which is no good if
+        // we need to generate it after all.
+        if (m && !m->program && !(g_config.build_dir && has_object(m))) {
+                m = NULL;
+        }
+
+        if (m && unchanged(m)) {
+                module_array deps = dyn_array_empty(module_array);
+                str_array paths = dyn_array_empty(str_array);
+                for (size_t i = 0; i < m->deps.len; ++i) {
+                        dyn_array_append(paths, m->deps.data[i]->path);
+                }
+
+                int ok = deps_unchanged(m->specs, paths, m->dep_ifaces, &deps);
+                dyn_array_free(paths);
+
+                if (ok) {
+                        // Dependencies may have been reloaded with
+                        // the same interface, follow them.
+                        dyn_array_free(m->deps);
+                        m->deps = deps;
+                        m->gen = g_gen;
+                        free(path);
+                        return m;
+                }
+                dyn_array_free(deps);
+        }
+
+        return load(found, path, loc);
+}
+
+void
+modcache_begin(void)
+{
+        if (!g_modules.tbl.entries) {
+                g_modules = smap_create(NULL);
+        }
+        ++g_gen;
+        g_misses.len = 0;
+        g_loading.len = 0;
+}
+
+module *
+modcache_load(const char *fp, const loc *loc)
+{
+        if (!g_modules.tbl.entries) {
+                modcache_begin();
+        }
+
+        module *m = load_prebuilt(fp, loc);
+
+        if (!m) {
+                char *found = NULL;
+                char *path = resolve(fp, &found);
+                if (!path) {
+                        if (g_expect) longjmp(g_warm_jmp, 1);
+                        searchpaths_err(fp, loc);
+                }
+
+                m = get(found, path, loc);
+                free(found);
+        }
+
+        if (g_loading.len > 0) {
+                module *importer = g_loading.data[g_loading.len-1];
+                dyn_array_append(importer->specs, strdup(fp));
+                dyn_array_append(importer->deps, m);
+                dyn_array_append(importer->dep_ifaces, m->iface_hash);
+        }
+
+        return m;
+}
+
+// In a build directory, names need to be the same from one
+// run to the next. Otherwise they only need to be unique
+// within this process, which has a directory of its own.
+const char *
+modcache_outbase(module *m)
+{
+        if (m->outbase && m->outbase_gen == g_gen) return m->outbase;
+
+        const char *basename = forge_io_basename(m->src_filepath);
+
+        m->outbase_gen = g_gen;
+
+        if (g_config.build_dir) {
+                char hash[17];
+                snprintf(hash, sizeof(hash), "%016" PRIx64, hash_cstr(m->path));
+                m->outbase = forge_cstr_builder(g_config.build_dir, "/", basename, "-", hash, NULL);
+                return m->outbase;
+        }
+
+        if (!g_stems.tbl.entries) {
+                g_stems = smap_create(NULL);
+        }
+
+        char *stem = strdup(basename);
+        for (int i = 1; smap_has(&g_stems, stem) && strcmp(smap_get(&g_stems, stem), m->path); ++i) {
+                free(stem);
+                char *n = int_to_cstr(i);
+                stem = forge_cstr_builder(basename, "-", n, NULL);
+                free(n);
+        }
+        smap_insert(&g_stems, stem, m->path);
+
+        m->outbase = forge_cstr_builder(private_tmpdir(), "/", stem, NULL);
+        return m->outbase;
+}
+
+char *
+modcache_modname(const char *fp)
+{
+        char *found = find_file_from_searchpaths(fp);
+        FILE *f = found ? fopen(found, "r") : NULL;
+        free(found);
+        if (!f) return NULL;
+
+        // Skip blanks and `--` comments, then expect `module`
+        // followed by an identifier.
+        forge_str word = forge_str_create();
+        char *modname = NULL;
+        int nwords = 0;
+        int c;
+
+        while ((c = fgetc(f)) != EOF && nwords < 2) {
+                if (c == '-') {
+                        if ((c = fgetc(f)) != '-' || word.len > 0) break;
+                        while ((c = fgetc(f)) != EOF && c != '\n');
+                } else if (c == '_' || isalnum(c)) {
+                        forge_str_append(&word, (char)c);
+                        continue;
+                } else if (!isspace(c)) {
+                        break;
+                }
+
+                if (word.len == 0) continue;
+
+                if (nwords == 0 && strcmp(word.data, "module")) break;
+                if (nwords == 1) modname = strdup(word.data);
+                ++nwords;
+                forge_str_clear(&word);
+        }
+
+        fclose(f);
+        forge_str_destroy(&word);
+
+        return modname;
+}
+
+module_array
+modcache_misses(void)
+{
+        return g_misses;
+}
+
+static void
+closure(module *m, smap *seen, module_array *out)
+{
+        if (smap_has(seen, m->path)) return;
+        smap_insert(seen, m->path, m);
+
+        for (size_t i = 0; i < m->deps.len; ++i) {
+                closure(m->deps.data[i], seen, out);
+        }
+
+        dyn_array_append(*out, m);
+}
+
+module_array
+modcache_closure(module *m)
+{
+        module_array out = dyn_array_empty(module_array);
+        smap seen = smap_create(NULL);
+        closure(m, &seen, &out);
+        smap_free(&seen);
+        return out;
+}
+
+int
+modcache_warm(const char *path, uint64_t hash, const smap *expect)
+{
+        if (!g_modules.tbl.entries) {
+                modcache_begin();
+        }
+
+        module *m = (module *)smap_get(&g_modules, path);
+        if (m && m->gen == g_gen && m->hash == hash) return 1;
+
+        if (setjmp(g_warm_jmp)) {
+                g_expect = NULL;
+                g_loading.len = 0;
+                return 0;
+        }
+
+        g_expect = expect;
+        (void)modcache_load(path, NULL);
+        g_expect = NULL;
+
+        return 1;
+}
@@ -0,0 +1,337 @@
+#include "obj.h"
+#include "mem.h"
+
+#include <elf.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+obj *
+obj_create(void)
+{
+        obj *o = (obj *)alloc(sizeof(obj));
+        o->sections     = dyn_array_empty(obj_section_array);
+        o->symbols      = dyn_array_empty(obj_symbol_array);
+        o->symbol_index = smap_create(NULL);
+        return o;
+}
+
+void
+obj_free(obj *o)
+{
+        if (!o) return;
+
+        for (size_t i = 0; i < o->sections.len; ++i) {
+                free(o->sections.data[i].name);
+                dyn_array_free(o->sections.data[i].data);
+                dyn_array_free(o->sections.data[i].relocs);
+        }
+        for (size_t i = 0; i < o->symbols.len; ++i) {
+                free(o->symbols.data[i].name);
+        }
+        dyn_array_free(o->sections);
+        dyn_array_free(o->symbols);
+        smap_free(&o->symbol_index);
+        free(o);
+}
+
+int
+obj_section_get(obj *o, const char *name)
+{
+        for (size_t i = 0; i < o->sections.len; ++i) {
+                if (!strcmp(o->sections.data[i].name, name)) {
+                        return (int)i;
+                }
+        }
+
+        obj_section s = {
+                .name   = strdup(name),
+                .type   = SHT_PROGBITS,
+                .flags  = 0,
+                .align  = 1,
+                .data   = dyn_array_empty(u8_array),
+                .size   = 0,
+                .relocs = dyn_array_empty(obj_reloc_array),
+        };
+
+        // The flags nasm gives these names.
+        if (!strcmp(name, ".text")) {
+                s.flags = SHF_ALLOC | SHF_EXECINSTR;
+                s.align = 16;
+        } else if (!strcmp(name, ".data")) {
+                s.flags = SHF_ALLOC | SHF_WRITE;
+                s.align = 4;
+        } else if (!strcmp(name, ".rodata")) {
+                s.flags = SHF_ALLOC;
+                s.align = 4;
+        } else if (!strcmp(name, ".bss")) {
+                s.type  = SHT_NOBITS;
+                s.flags = SHF_ALLOC | SHF_WRITE;
+                s.align = 4;
+        }
+
+        dyn_array_append(o->sections, s);
+        return (int)o->sections.len - 1;
+}
+
+int
+obj_symbol_get(obj *o, const char *name)
+{
+        uintptr_t i = (uintptr_t)smap_get(&o->symbol_index, name);
+        if (i) return (int)i - 1;
+
+        obj_symbol s = {
+                .name    = strdup(name),
+                .section = -1,
+                .value   = 0,
+                .global  = 0,
+        };
+        dyn_array_append(o->symbols, s);
+        smap_insert(&o->symbol_index, name, (void *)(uintptr_t)o->symbols.len);
+
+        return (int)o->symbols.len - 1;
+}
+
+static void
+put_bytes(u8_array *a, const void *p, size_t n)
+{
+        const uint8_t *b = (const uint8_t *)p;
+        for (size_t i = 0; i < n; ++i) {
+                dyn_array_append(*a, b[i]);
+        }
+}
+
+void
+obj_emit(obj *o, int section, const void *p, size_t n)
+{
+        obj_section *s = &o->sections.data[section];
+        put_bytes(&s->data, p, n);
+        s->size += n;
+}
+
+static uint32_t
+add_str(u8_array *tab, const char *s)
+{
+        uint32_t at = (uint32_t)tab->len;
+        for (size_t i = 0; s[i]; ++i) {
+                dyn_array_append(*tab, (uint8_t)s[i]);
+        }
+        dyn_array_append(*tab, 0);
+        return at;
+}
+
+static void
+pad(FILE *f, uint64_t *at, uint64_t align)
+{
+        static const uint8_t zeros[16] = {0};
+        while (*at % align) {
+                size_t n = align - *at % align;
+                if (n > sizeof(zeros)) n = sizeof(zeros);
+                fwrite(zeros, 1, n, f);
+                *at += n;
+        }
+}
+
+// Layout: header, section contents, section headers. The
+// sections are the object's, then one .rela per section
+// with relocations, .symtab, .strtab and .shstrtab.
+int
+obj_write_elf(const obj *o, const char *path)
+{
+        size_t nsect = o->sections.len;
+
+        FILE *f = fopen(path, "wb");
+        if (!f) return -1;
+
+        // Which symbols go in, locals first as ELF wants.
+        int *used = (int *)alloc(sizeof(int) * (o->symbols.len + 1));
+        memset(used, 0, sizeof(int) * (o->symbols.len + 1));
+        for (size_t i = 0; i < o->symbols.len; ++i) {
+                used[i] = o->symbols.data[i].section >= 0;
+        }
+        for (size_t i = 0; i < nsect; ++i) {
+                const obj_reloc_array *r = &o->sections.data[i].relocs;
+                for (size_t j = 0; j < r->len; ++j) {
+                        used[r->data[j].symbol] = 1;
+                }
+        }
+
+        u8_array strtab = dyn_array_empty(u8_array);
+        u8_array symtab = dyn_array_empty(u8_array);
+        add_str(&strtab, "");
+
+        Elf64_Sym null_sym = {0};
+        put_bytes(&symtab, &null_sym, sizeof(null_sym));
+
+        // A section symbol for each section.
+        for (size_t i = 0; i < nsect; ++i) {
+                Elf64_Sym s = {0};
+                s.st_info  = ELF64_ST_INFO(STB_LOCAL, STT_SECTION);
+                s.st_shndx = (Elf64_Section)(i + 1);
+                put_bytes(&symtab, &s, sizeof(s));
+        }
+
+        uint32_t *elf_index = (uint32_t *)alloc(sizeof(uint32_t) * (o->symbols.len + 1));
+        uint32_t nsyms = (uint32_t)nsect + 1;
+        uint32_t first_global = 0;
+
+        for (int pass = 0; pass < 2; ++pass) {
+                if (pass == 1) first_global = nsyms;
+                for (size_t i = 0; i < o->symbols.len; ++i) {
+                        const obj_symbol *sym = &o->symbols.data[i];
+                        int global = sym->global || sym->section < 0;
+                        if (!used[i] || global != pass) continue;
+
+                        Elf64_Sym s = {0};
+                        s.st_name  = add_str(&strtab, sym->name);
+                        s.st_info  = ELF64_ST_INFO(global ? STB_GLOBAL : STB_LOCAL, STT_NOTYPE);
+                        s.st_shndx = sym->section < 0 ? SHN_UNDEF : (Elf64_Section)(sym->section + 1);
+                        s.st_value = sym->value;
+                        put_bytes(&symtab, &s, sizeof(s));
+                        elf_index[i] = nsyms++;
+                }
+        }
+
+        // Relocation sections.
+        u8_array *relas = (u8_array *)alloc(sizeof(u8_array) * (nsect + 1));
+        size_t nrela = 0;
+        for (size_t i = 0; i < nsect; ++i) {
+                relas[i] = dyn_array_empty(u8_array);
+                const obj_reloc_array *r = &o->sections.data[i].relocs;
+                if (r->len) ++nrela;
+                for (size_t j = 0; j < r->len; ++j) {
+                        Elf64_Rela rela = {
+                                .r_offset = r->data[j].offset,
+                                .r_info   = ELF64_R_INFO(elf_index[r->data[j].symbol], r->data[j].type),
+                                .r_addend = r->data[j].addend,
+                        };
+                        put_bytes(&relas[i], &rela, sizeof(rela));
+                }
+        }
+
+        // Section header names.
+        u8_array shstrtab = dyn_array_empty(u8_array);
+        add_str(&shstrtab, "");
+        uint32_t *names = (uint32_t *)alloc(sizeof(uint32_t) * (nsect + 1));
+        uint32_t *rela_names = (uint32_t *)alloc(sizeof(uint32_t) * (nsect + 1));
+        for (size_t i = 0; i < nsect; ++i) {
+                names[i] = add_str(&shstrtab, o->sections.data[i].name);
+                if (o->sections.data[i].relocs.len) {
+                        char buf[256];
+                        snprintf(buf, sizeof(buf), ".rela%s", o->sections.data[i].name);
+                        rela_names[i] = add_str(&shstrtab, buf);
+                }
+        }
+        uint32_t symtab_name   = add_str(&shstrtab, ".symtab");
+        uint32_t strtab_name   = add_str(&shstrtab, ".strtab");
+        uint32_t shstrtab_name = add_str(&shstrtab, ".shstrtab");
+
+        size_t nshdr       = 1 + nsect + nrela + 3;
+        size_t symtab_idx  = 1 + nsect + nrela;
+        size_t strtab_idx  = symtab_idx + 1;
+        size_t shstr_idx   = symtab_idx + 2;
+        Elf64_Shdr *shdrs  = (Elf64_Shdr *)alloc(sizeof(Elf64_Shdr) * nshdr);
+        memset(shdrs, 0, sizeof(Elf64_Shdr) * nshdr);
+
+        Elf64_Ehdr eh = {0};
+        memcpy(eh.e_ident, ELFMAG, SELFMAG);
+        eh.e_ident[EI_CLASS]   = ELFCLASS64;
+        eh.e_ident[EI_DATA]    = ELFDATA2LSB;
+        eh.e_ident[EI_VERSION] = EV_CURRENT;
+        eh.e_ident[EI_OSABI]   = ELFOSABI_SYSV;
+        eh.e_type      = ET_REL;
+        eh.e_machine   = EM_X86_64;
+        eh.e_version   = EV_CURRENT;
+        eh.e_ehsize    = sizeof(Elf64_Ehdr);
+        eh.e_shentsize = sizeof(Elf64_Shdr);
+        eh.e_shnum     = (Elf64_Half)nshdr;
+        eh.e_shstrndx  = (Elf64_Half)shstr_idx;
+        fwrite(&eh, sizeof(eh), 1, f); // e_shoff is patched below
+
+        uint64_t at = sizeof(eh);
+
+        for (size_t i = 0; i < nsect; ++i) {
+                const obj_section *s = &o->sections.data[i];
+                Elf64_Shdr *sh = &shdrs[1 + i];
+
+                pad(f, &at, s->align ? s->align : 1);
+                sh->sh_name      = names[i];
+                sh->sh_type      = s->type;
+                sh->sh_flags     = s->flags;
+                sh->sh_offset    = at;
+                sh->sh_size      = s->size;
+                sh->sh_addralign = s->align;
+
+                if (s->type != SHT_NOBITS) {
+                        fwrite(s->data.data, 1, s->data.len, f);
+                        at += s->data.len;
+                }
+        }
+
+        size_t k = 1 + nsect;
+        for (size_t i = 0; i < nsect; ++i) {
+                if (!o->sections.data[i].relocs.len) continue;
+
+                Elf64_Shdr *sh = &shdrs[k++];
+                pad(f, &at, 8);
+                sh->sh_name      = rela_names[i];
+                sh->sh_type      = SHT_RELA;
+                sh->sh_flags     = SHF_INFO_LINK;
+                sh->sh_offset    = at;
+                sh->sh_size      = relas[i].len;
+                sh->sh_link      = (Elf64_Word)symtab_idx;
+                sh->sh_info      = (Elf64_Word)(1 + i);
+                sh->sh_addralign = 8;
+                sh->sh_entsize   = sizeof(Elf64_Rela);
+                fwrite(relas[i].data, 1, relas[i].len, f);
+                at += relas[i].len;
+        }
+
+        pad(f, &at, 8);
+        shdrs[symtab_idx].sh_name      = symtab_name;
+        shdrs[symtab_idx].sh_type      = SHT_SYMTAB;
+        shdrs[symtab_idx].sh_offset    = at;
+        shdrs[symtab_idx].sh_size      = symtab.len;
+        shdrs[symtab_idx].sh_link      = (Elf64_Word)strtab_idx;
+        shdrs[symtab_idx].sh_info      = first_global;
+        shdrs[symtab_idx].sh_addralign = 8;
+        shdrs[symtab_idx].sh_entsize   = sizeof(Elf64_Sym);
+        fwrite(symtab.data, 1, symtab.len, f);
+        at += symtab.len;
+
+        shdrs[strtab_idx].sh_name      = strtab_name;
+        shdrs[strtab_idx].sh_type      = SHT_STRTAB;
+        shdrs[strtab_idx].sh_offset    = at;
+        shdrs[strtab_idx].sh_size      = strtab.len;
+        shdrs[strtab_idx].sh_addralign = 1;
+        fwrite(strtab.data, 1, strtab.len, f);
+        at += strtab.len;
+
+        shdrs[shstr_idx].sh_name      = shstrtab_name;
+        shdrs[shstr_idx].sh_type      = SHT_STRTAB;
+        shdrs[shstr_idx].sh_offset    = at;
+        shdrs[shstr_idx].sh_size      = shstrtab.len;
+        shdrs[shstr_idx].sh_addralign = 1;
+        fwrite(shstrtab.data, 1, shstrtab.len, f);
+        at += shstrtab.len;
+
+        pad(f, &at, 8);
+        eh.e_shoff = at;
+        fwrite(shdrs, sizeof(Elf64_Shdr), nshdr, f);
+
+        int ok = fseek(f, 0, SEEK_SET) == 0 && fwrite(&eh, sizeof(eh), 1, f) == 1;
+        ok = fclose(f) == 0 && ok;
+
+        free(used);
+        free(elf_index);
+        free(names);
+        free(rela_names);
+        free(shdrs);
+        for (size_t i = 0; i < nsect; ++i) dyn_array_free(relas[i]);
+        free(relas);
+        dyn_array_free(strtab);
+        dyn_array_free(symtab);
+        dyn_array_free(shstrtab);
+
+        return ok ? 0 : -1;
+}
@@ -0,0 +1,290 @@
+#include "objcache.h"
+#include "global.h"
+
+#include <forge/cstr.h>
+#include <forge/err.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
+static size_t g_hits    = 0;
+static size_t g_misses  = 0;
+static size_t g_evicted = 0;
+static int    g_added   = 0; // whether this process stored anything
+
+static char *
+entry_path(const char *key, const char *ext, int mkdirs)
+{
+        char sub[3] = { key[0], key[1], 0 };
+        char *dir = forge_cstr_builder(g_config.cache_dir, "/", sub, NULL);
+
+        if (mkdirs) {
+                if ((mkdir(g_config.cache_dir, 0755) != 0 && errno != EEXIST)
+                    || (mkdir(dir, 0755) != 0 && errno != EEXIST)) {
+                        forge_err_wargs("could not create cache directory `%s`: %s", dir, strerror(errno));
+                }
+        }
+
+        char *path = forge_cstr_builder(dir, "/", key, ext, NULL);
+        free(dir);
+        return path;
+}
+
+static int
+file_digest(const char *path, char out[65])
+{
+        FILE *f = fopen(path, "rb");
+        if (!f) return 0;
+
+        sha256_ctx c;
+        sha256_init(&c);
+
+        char buf[1 << 14];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+                sha256_update(&c, buf, n);
+        }
+
+        int ok = !ferror(f);
+        fclose(f);
+        sha256_hex(&c, out);
+        return ok;
+}
+
+// cruc itself, so that a fix to the code generator or the
+// integrated assembler does not keep handing out old objects.
+static const char *
+self_digest(void)
+{
+        static char digest[65] = {0};
+        if (!digest[0] && !file_digest("/proc/self/exe", digest)) {
+                forge_err_wargs("could not read `/proc/self/exe`: %s", strerror(errno));
+        }
+        return digest;
+}
+
+void
+objcache_toolchain(sha256_ctx *c, const char *tool)
+{
+        sha256_cstr(c, self_digest());
+        sha256_cstr(c, tool);
+
+        // Like ccache, the tool found in $PATH counts by its
+        // size and modification time.
+        const char *env = getenv("PATH");
+        char *paths = strdup(env ? env : "");
+        for (char *dir = strtok(paths, ":"); dir; dir = strtok(NULL, ":")) {
+                char *path = forge_cstr_builder(dir, "/", tool, NULL);
+                struct stat st;
+                int found = stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, X_OK) == 0;
+                if (found) {
+                        char id[96];
+                        snprintf(id, sizeof(id), "%lld %lld.%09ld", (long long)st.st_size,
+                                 (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+                        sha256_cstr(c, path);
+                        sha256_cstr(c, id);
+                }
+                free(path);
+                if (found) break;
+        }
+        free(paths);
+}
+
+char *
+objcache_get(const char *key)
+{
+        char *path = entry_path(key, ".o", 0);
+        char *sum  = entry_path(key, ".sum", 0);
+        char want[65] = {0}, got[65];
+
+        FILE *f = fopen(sum, "r");
+        if (f) {
+                if (fread(want, 1, 64, f) != 64) want[0] = 0;
+                fclose(f);
+        }
+
+        if (want[0] && file_digest(path, got) && !strcmp(want, got)) {
+                // For the trim, this is a use.
+                utime(path, NULL);
+                free(sum);
+                ++g_hits;
+                return path;
+        }
+
+        // A damaged entry is as good as none.
+        if (f) {
+                unlink(path);
+                unlink(sum);
+        }
+        ++g_misses;
+        free(path);
+        free(sum);
+        return NULL;
+}
+
+int
+objcache_copy(const char *from, const char *to)
+{
+        FILE *in = fopen(from, "rb");
+        if (!in) return 0;
+
+        FILE *out = fopen(to, "wb");
+        if (!out) {
+                fclose(in);
+                return 0;
+        }
+
+        char buf[1 << 14];
+        size_t n;
+        int ok = 1;
+        while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+                if (fwrite(buf, 1, n, out) != n) {
+                        ok = 0;
+                        break;
+                }
+        }
+
+        fclose(in);
+        if (fclose(out) != 0) ok = 0;
+        return ok;
+}
+
+// Writes `path` to `dst` through a temporary file, so that
+// nobody (another cruc included) sees half of it.
+static int
+publish(const char *path, const char *dst, int keep)
+{
+        char pid[32];
+        snprintf(pid, sizeof(pid), "%d", (int)getpid());
+        char *tmp = forge_cstr_builder(dst, ".tmp.", pid, NULL);
+
+        int ok = keep
+                ? objcache_copy(path, tmp)
+                : rename(path, tmp) == 0 || (errno == EXDEV && objcache_copy(path, tmp) && unlink(path) == 0);
+        ok = ok && rename(tmp, dst) == 0;
+
+        if (!ok) unlink(tmp);
+        free(tmp);
+        return ok;
+}
+
+char *
+objcache_put(const char *key, const char *path, int keep)
+{
+        char *dst = entry_path(key, ".o", 1);
+        char *sum = entry_path(key, ".sum", 0);
+        char digest[65];
+
+        // The sum goes first, an object without one would
+        // count as damaged.
+        char *sumtmp = forge_cstr_builder(sum, ".new", NULL);
+        FILE *f = NULL;
+        int ok = file_digest(path, digest) && (f = fopen(sumtmp, "w")) && fputs(digest, f) >= 0;
+        if (f && fclose(f) != 0) ok = 0;
+        ok = ok && publish(sumtmp, sum, 0) && publish(path, dst, keep);
+
+        if (!ok) {
+                forge_err_wargs("could not add `%s` to the object cache: %s", path, strerror(errno));
+        }
+
+        g_added = 1;
+        free(sumtmp);
+        free(sum);
+        return dst;
+}
+
+int
+objcache_owns(const char *path)
+{
+        size_t n = g_config.cache_dir ? strlen(g_config.cache_dir) : 0;
+        return n > 0 && !strncmp(path, g_config.cache_dir, n) && path[n] == '/';
+}
+
+typedef struct {
+        char    *path;
+        off_t    size;
+        time_t   used;
+} entry;
+
+static int
+by_use(const void *a, const void *b)
+{
+        const entry *x = (const entry *)a, *y = (const entry *)b;
+        return (x->used > y->used) - (x->used < y->used);
+}
+
+void
+objcache_trim(void)
+{
+        if (!g_added || !g_config.cache_dir) return;
+
+        entry *entries = NULL;
+        size_t n = 0, cap = 0;
+        uint64_t total = 0;
+
+        for (int i = 0; i < 256; ++i) {
+                char sub[3];
+                snprintf(sub, sizeof(sub), "%02x", i);
+                char *dir = forge_cstr_builder(g_config.cache_dir, "/", sub, NULL);
+                DIR *d = opendir(dir);
+                struct dirent *de;
+                while (d && (de = readdir(d))) {
+                        size_t len = strlen(de->d_name);
+                        if (len < 2 || strcmp(de->d_name + len - 2, ".o")) continue;
+
+                        char *path = forge_cstr_builder(dir, "/", de->d_name, NULL);
+                        struct stat st;
+                        if (stat(path, &st) != 0) {
+                                free(path);
+                                continue;
+                        }
+                        if (n == cap) {
+                                cap = cap ? 2*cap : 256;
+                                entries = (entry *)realloc(entries, cap * sizeof(entry));
+                        }
+                        entries[n++] = (entry){ path, st.st_size, st.st_mtime };
+                        total += (uint64_t)st.st_size;
+                }
+                if (d) closedir(d);
+                free(dir);
+        }
+
+        // Down to 90%, so that the next build does not trim
+        // again right away.
+        if (total > g_config.cache_size) {
+                qsort(entries, n, sizeof(entry), by_use);
+                for (size_t i = 0; i < n && total > g_config.cache_size / 10 * 9; ++i) {
+                        size_t len = strlen(entries[i].path) - 2;
+                        char *sum = (char *)malloc(len + 5);
+                        memcpy(sum, entries[i].path, len);
+                        strcpy(sum + len, ".sum");
+                        if (unlink(entries[i].path) == 0) {
+                                total -= (uint64_t)entries[i].size;
+                                ++g_evicted;
+                        }
+                        unlink(sum);
+                        free(sum);
+                }
+        }
+
+        for (size_t i = 0; i < n; ++i) {
+                free(entries[i].path);
+        }
+        free(entries);
+}
+
+void
+objcache_stats(FILE *f)
+{
+        fprintf(f, "object cache (%s): %zu hit%s, %zu miss%s, %zu evicted\n",
+                g_config.cache_dir ? g_config.cache_dir : "disabled",
+                g_hits, g_hits == 1 ? "" : "s",
+                g_misses, g_misses == 1 ? "" : "es",
+                g_evicted);
+}
@@ -787,6 +787,7 @@ parse_stmt_import(parser_context *ctx)
 
         token *basepath = expect_or(ctx, TOKEN_TYPE_IDENTIFIER, TOKEN_TYPE_STRING_LITERAL);
         str_array filepaths = dyn_array_empty(str_array);
+        int wildcard = 0;
 
         if (basepath->ty == TOKEN_TYPE_STRING_LITERAL) {
                 dyn_array_append(filepaths, strdup(basepath->lx));
@@ -832,6 +833,7 @@ parse_stmt_import(parser_context *ctx)
                                 }
                                 dyn_array_free(walked);
                                 (void)expect(ctx, TOKEN_TYPE_SEMICOLON);
+                                wildcard = 1;
                                 goto done;
                         } break;
                         default: forge_err_wargs("%sunexpected token `%s`", loc_err(basepath->loc), basepath->lx);
@@ -845,8 +847,11 @@ parse_stmt_import(parser_context *ctx)
                 }
         }
 
- done:
-        return stmt_import_alloc(filepaths);
+ done: {
+                stmt_import *s = stmt_import_alloc(filepaths);
+                s->wildcard = wildcard;
+                return s;
+        }
 }
 
 static stmt *
@@ -0,0 +1,801 @@
+#include "peephole.h"
+#include "mem.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BIT(r) (1u << (r))
+#define FLAGS  (1u << 16)
+#define ALL    (0xFFFFu | FLAGS)
+
+// The stack and the frame are never dead.
+#define PINNED (BIT(X64_RSP) | BIT(X64_RBP))
+
+#define CALLER_SAVED (BIT(X64_RAX) | BIT(X64_RCX) | BIT(X64_RDX) | BIT(X64_RSI) | BIT(X64_RDI) \
+                      | BIT(X64_R8) | BIT(X64_R9) | BIT(X64_R10) | BIT(X64_R11))
+#define CALLEE_SAVED (BIT(X64_RBX) | BIT(X64_R12) | BIT(X64_R13) | BIT(X64_R14) | BIT(X64_R15))
+
+static const x64_reg g_arg_regs[] = {X64_RDI, X64_RSI, X64_RDX, X64_RCX, X64_R8, X64_R9};
+
+// The items of a procedure, and which registers (and the
+// flags, as one) are live around each of them. Items that
+// rules drop during a pass are only unlinked, and removed
+// once it is over.
+typedef struct {
+        x64_item *it;
+        size_t n;
+        uint32_t *in;    // before every item
+        uint32_t *out;   // and after it
+        int *target;     // the label a jump goes to, -1 if it is not in the procedure
+        size_t *next;    // the item after each that is still there, n past the end
+        size_t *prev;    // and before it, SIZE_MAX before the start
+        char *dropped;
+} peephole_context;
+
+// The registers that `o` reads as a source or to address
+// memory.
+static uint32_t
+reads(const x64_opnd *o)
+{
+        uint32_t m = 0;
+        if (o->kind == X64_OPND_REG) {
+                return BIT(o->reg);
+        }
+        if (o->kind == X64_OPND_MEM) {
+                if (o->reg != X64_NOREG) m |= BIT(o->reg);
+                if (o->index != X64_NOREG) m |= BIT(o->index);
+        }
+        return m;
+}
+
+// Writing `o` adds to *def and returns what it reads: the
+// address of memory, or the register if fewer than 4 bytes
+// of it are written and the rest kept.
+static uint32_t
+writes(const x64_opnd *o, uint32_t *def)
+{
+        if (o->kind == X64_OPND_REG) {
+                *def |= BIT(o->reg);
+                return o->sz < 4 ? BIT(o->reg) : 0;
+        }
+        return reads(o);
+}
+
+static int
+is_reg(const x64_opnd *o, int reg, int sz)
+{
+        return o->kind == X64_OPND_REG && (reg == X64_NOREG || o->reg == reg) && (!sz || o->sz == sz);
+}
+
+static int
+same_opnd(const x64_opnd *a, const x64_opnd *b)
+{
+        return a->kind == b->kind && a->sz == b->sz && a->reg == b->reg && a->index == b->index
+                && a->scale == b->scale && a->imm == b->imm;
+}
+
+static x64_opnd
+reg_opnd(int reg, int sz)
+{
+        x64_opnd o = {X64_OPND_REG, (uint8_t)sz, (int8_t)reg, X64_NOREG, 1, 0, NULL};
+        return o;
+}
+
+static x64_opnd
+imm_opnd(int64_t imm)
+{
+        x64_opnd o = {X64_OPND_IMM, 0, X64_NOREG, X64_NOREG, 1, imm, NULL};
+        return o;
+}
+
+// What `in` reads in *use and writes in *def. What the code
+// generator does not emit reads everything.
+static void
+effects(const x64_insn *in, uint32_t *use, uint32_t *def)
+{
+        const x64_opnd *d = &in->o[0], *s = &in->o[1];
+        uint32_t u = 0, w = 0;
+
+        switch (in->op) {
+        case X64_ADC: case X64_SBB:
+                u = FLAGS;
+                // fallthrough
+        case X64_ADD: case X64_OR: case X64_AND: case X64_SUB: case X64_XOR:
+                u |= reads(d) | reads(s);
+                writes(d, &w);
+                w |= FLAGS;
+                // xor r, r is 0 whatever r was.
+                if (in->op == X64_XOR && is_reg(d, X64_NOREG, 0) && d->sz >= 4 && same_opnd(d, s)) {
+                        u &= ~BIT(d->reg);
+                }
+                break;
+        case X64_CMP: case X64_TEST:
+                u = reads(d) | reads(s);
+                w = FLAGS;
+                break;
+        case X64_MOV: case X64_MOVZX: case X64_MOVSX: case X64_LEA:
+                u = reads(s) | writes(d, &w);
+                break;
+        case X64_IMUL:
+                if (in->n == 1) {
+                        u = reads(d) | BIT(X64_RAX);
+                        w = BIT(X64_RAX) | BIT(X64_RDX) | FLAGS;
+                } else {
+                        u = reads(s) | writes(d, &w);
+                        if (in->n == 2) u |= reads(d);
+                        w |= FLAGS;
+                }
+                break;
+        case X64_MUL:
+                u = reads(d) | BIT(X64_RAX);
+                w = BIT(X64_RAX) | BIT(X64_RDX) | FLAGS;
+                break;
+        case X64_DIV: case X64_IDIV:
+                u = reads(d) | BIT(X64_RAX) | BIT(X64_RDX);
+                w = BIT(X64_RAX) | BIT(X64_RDX) | FLAGS;
+                break;
+        case X64_NEG: case X64_NOT:
+                u = reads(d) | writes(d, &w);
+                if (in->op == X64_NEG) w |= FLAGS;
+                break;
+        case X64_SHL: case X64_SHR: case X64_SAR:
+                // A count of 0 leaves the flags.
+                u = reads(d) | reads(s) | writes(d, &w) | FLAGS;
+                w |= FLAGS;
+                break;
+        case X64_PUSH:
+                u = reads(d) | BIT(X64_RSP);
+                w = BIT(X64_RSP);
+                break;
+        case X64_POP:
+                u = BIT(X64_RSP) | writes(d, &w);
+                w |= BIT(X64_RSP);
+                break;
+        case X64_CALL:
+                // al is the number of vector registers of a
+                // variadic callee.
+                u = reads(d) | BIT(X64_RAX) | BIT(X64_RSP);
+                for (int i = 0; i < in->nargs && i < 6; ++i) {
+                        u |= BIT(g_arg_regs[i]);
+                }
+                w = CALLER_SAVED | FLAGS;
+                break;
+        case X64_JMP:
+                u = reads(d);
+                break;
+        case X64_JCC:
+                u = FLAGS;
+                break;
+        case X64_SETCC:
+                u = FLAGS | writes(d, &w);
+                break;
+        case X64_RET:
+                u = BIT(X64_RAX) | CALLEE_SAVED;
+                break;
+        case X64_LEAVE:
+                u = BIT(X64_RBP);
+                w = BIT(X64_RSP) | BIT(X64_RBP);
+                break;
+        case X64_SYSCALL:
+                u = BIT(X64_RAX) | BIT(X64_RDI) | BIT(X64_RSI) | BIT(X64_RDX)
+                        | BIT(X64_R10) | BIT(X64_R8) | BIT(X64_R9);
+                w = BIT(X64_RAX) | BIT(X64_RCX) | BIT(X64_R11);
+                break;
+        case X64_REP_STOSB: case X64_REP_STOSD: case X64_REP_STOSQ:
+                u = BIT(X64_RDI) | BIT(X64_RCX) | BIT(X64_RAX);
+                w = BIT(X64_RDI) | BIT(X64_RCX);
+                break;
+        case X64_CQO: case X64_CDQ:
+                u = BIT(X64_RAX);
+                w = BIT(X64_RDX);
+                break;
+        case X64_CLD: case X64_NOP:
+                break;
+        default:
+                u = ALL;
+        }
+
+        *use = u;
+        *def = w;
+}
+
+// Whether `in` does nothing but write registers and flags,
+// reading no memory but the frame's.
+static int
+removable(const x64_insn *in)
+{
+        switch (in->op) {
+        case X64_ADD: case X64_OR: case X64_ADC: case X64_SBB: case X64_AND:
+        case X64_SUB: case X64_XOR: case X64_CMP: case X64_TEST:
+        case X64_MOV: case X64_MOVZX: case X64_MOVSX: case X64_LEA:
+        case X64_NEG: case X64_NOT: case X64_SHL: case X64_SHR: case X64_SAR:
+        case X64_SETCC: case X64_CQO: case X64_CDQ:
+                break;
+        case X64_IMUL:
+                if (in->n == 1) return 0;
+                break;
+        default:
+                return 0;
+        }
+
+        for (int i = 0; i < in->n; ++i) {
+                const x64_opnd *o = &in->o[i];
+                if (o->kind != X64_OPND_MEM || (in->op == X64_LEA && i == 1)) {
+                        continue;
+                }
+                if (i == 0 && in->op != X64_CMP && in->op != X64_TEST) {
+                        return 0;
+                }
+                if ((o->reg != X64_RBP && o->reg != X64_RSP) || o->index != X64_NOREG) {
+                        return 0;
+                }
+        }
+        return 1;
+}
+
+static x64_insn *
+insn(peephole_context *ctx, size_t i)
+{
+        if (i >= ctx->n || ctx->it[i].kind != X64_ITEM_INSN) {
+                return NULL;
+        }
+        return &ctx->it[i].in;
+}
+
+// The item `k` places after `i`, skipping those dropped.
+static size_t
+after(const peephole_context *ctx, size_t i, int k)
+{
+        while (k-- > 0 && i < ctx->n) {
+                i = ctx->next[i];
+        }
+        return i;
+}
+
+static int
+is_jump(const x64_insn *in)
+{
+        return in->op == X64_JMP || in->op == X64_JCC;
+}
+
+typedef struct {
+        const char *name;
+        int at;
+} label;
+
+static int
+by_name(const void *a, const void *b)
+{
+        return strcmp(((const label *)a)->name, ((const label *)b)->name);
+}
+
+static void
+find_targets(peephole_context *ctx)
+{
+        label *labels = (label *)alloc((ctx->n + 1) * sizeof(label));
+        size_t nlabels = 0;
+
+        for (size_t i = 0; i < ctx->n; ++i) {
+                if (ctx->it[i].kind == X64_ITEM_LABEL) {
+                        labels[nlabels++] = (label){ctx->it[i].s, (int)i};
+                }
+        }
+        qsort(labels, nlabels, sizeof(label), by_name);
+
+        for (size_t i = 0; i < ctx->n; ++i) {
+                const x64_insn *in = insn(ctx, i);
+                ctx->target[i] = -1;
+                if (!in || !is_jump(in) || in->o[0].kind != X64_OPND_SYM) {
+                        continue;
+                }
+                label key = {in->o[0].sym, 0};
+                const label *l = (const label *)bsearch(&key, labels, nlabels, sizeof(label), by_name);
+                if (l) ctx->target[i] = l->at;
+        }
+
+        free(labels);
+}
+
+// Backwards to a fixed point. What runs off the end, jumps
+// out of the procedure or is an embed takes everything to be
+// live.
+static void
+liveness(peephole_context *ctx)
+{
+        int changed = 1;
+
+        find_targets(ctx);
+        memset(ctx->in, 0, ctx->n * sizeof(uint32_t));
+        memset(ctx->out, 0, ctx->n * sizeof(uint32_t));
+
+        while (changed) {
+                changed = 0;
+                for (size_t i = ctx->n; i-- > 0;) {
+                        const x64_item *it = &ctx->it[i];
+                        uint32_t next = i + 1 < ctx->n ? ctx->in[i + 1] : ALL;
+                        uint32_t in, out = next;
+
+                        if (it->kind == X64_ITEM_TEXT) {
+                                in = ALL;
+                        } else if (it->kind == X64_ITEM_LABEL) {
+                                in = out;
+                        } else {
+                                uint32_t use, def;
+                                uint32_t there = ctx->target[i] >= 0 ? ctx->in[ctx->target[i]] : ALL;
+
+                                if (it->in.op == X64_RET)       out = 0;
+                                else if (it->in.op == X64_JMP)  out = there;
+                                else if (it->in.op == X64_JCC)  out |= there;
+
+                                effects(&it->in, &use, &def);
+                                in = (out & ~def) | use;
+                        }
+                        in |= PINNED;
+
+                        if (in != ctx->in[i] || out != ctx->out[i]) {
+                                ctx->in[i] = in;
+                                ctx->out[i] = out;
+                                changed = 1;
+                        }
+                }
+        }
+}
+
+static void
+drop(peephole_context *ctx, size_t i)
+{
+        size_t p = ctx->prev[i], q = ctx->next[i];
+        if (p < ctx->n) ctx->next[p] = q;
+        if (q < ctx->n) ctx->prev[q] = p;
+        ctx->dropped[i] = 1;
+}
+
+static int
+dead_after(const peephole_context *ctx, size_t i, uint32_t m)
+{
+        return !(ctx->out[i] & m);
+}
+
+// The low `sz` bytes of `v` as an immediate of that size, or
+// 0 if 8 of them do not fit.
+static int
+narrow_imm(int64_t v, int sz, int64_t *imm)
+{
+        switch (sz) {
+        case 1:  *imm = (int8_t)v;  return 1;
+        case 2:  *imm = (int16_t)v; return 1;
+        case 4:  *imm = (int32_t)v; return 1;
+        default: *imm = v;          return v == (int32_t)v;
+        }
+}
+
+static int
+mov_self(peephole_context *ctx, size_t i)
+{
+        x64_insn *a = insn(ctx, i);
+        if (!a || a->op != X64_MOV || !is_reg(&a->o[0], X64_NOREG, 0) || a->o[0].sz == 4
+            || !same_opnd(&a->o[0], &a->o[1])) {
+                return 0;
+        }
+        drop(ctx, i);
+        return 1;
+}
+
+static int
+store_load(peephole_context *ctx, size_t i)
+{
+        x64_insn *a = insn(ctx, i), *b = insn(ctx, after(ctx, i, 1));
+        if (!a || !b || a->op != X64_MOV || a->o[0].kind != X64_OPND_MEM || !a->o[0].sz
+            || !is_reg(&a->o[1], X64_NOREG, a->o[0].sz)) {
+                return 0;
+        }
+        if ((b->op != X64_MOV && b->op != X64_MOVZX && b->op != X64_MOVSX)
+            || !is_reg(&b->o[0], X64_NOREG, 0) || !same_opnd(&b->o[1], &a->o[0])) {
+                return 0;
+        }
+        b->o[1] = a->o[1];
+        return 1;
+}
+
+static int
+copy(peephole_context *ctx, size_t i)
+{
+        size_t j = after(ctx, i, 1);
+        x64_insn *a = insn(ctx, i), *b = insn(ctx, j);
+        if (!a || !b || a->op != X64_MOV || b->op != X64_MOV || !is_reg(&a->o[0], X64_NOREG, 8)) {
+                return 0;
+        }
+
+        const x64_opnd *x = &a->o[1];
+        int r = a->o[0].reg;
+        if (!is_reg(&b->o[1], r, 8) || !dead_after(ctx, j, BIT(r)) || is_reg(x, r, 0)) {
+                return 0;
+        }
+        if ((x->kind == X64_OPND_REG || x->kind == X64_OPND_MEM) && x->sz != 8) {
+                return 0;
+        }
+        if (b->o[0].kind == X64_OPND_MEM) {
+                if (b->o[0].sz != 8 || (reads(&b->o[0]) & BIT(r))) return 0;
+                if (x->kind != X64_OPND_REG && (x->kind != X64_OPND_IMM || x->imm != (int32_t)x->imm)) return 0;
+        } else if (!is_reg(&b->o[0], X64_NOREG, 8)) {
+                return 0;
+        }
+
+        b->o[1] = *x;
+        drop(ctx, i);
+        return 1;
+}
+
+static int
+ext_imm(peephole_context *ctx, size_t i)
+{
+        size_t j = after(ctx, i, 1);
+        x64_insn *a = insn(ctx, i), *b = insn(ctx, j);
+        if (!a || !b || a->op != X64_MOV || !is_reg(&a->o[0], X64_NOREG, 8) || a->o[1].kind != X64_OPND_IMM) {
+                return 0;
+        }
+        if ((b->op != X64_MOVZX && b->op != X64_MOVSX) || b->o[0].kind != X64_OPND_REG || b->o[0].sz < 4) {
+                return 0;
+        }
+
+        int r = a->o[0].reg, sz = b->o[1].sz;
+        if (!is_reg(&b->o[1], r, 0) || (b->o[0].reg != r && !dead_after(ctx, j, BIT(r)))) {
+                return 0;
+        }
+
+        int64_t v = a->o[1].imm;
+        if (b->op == X64_MOVZX) {
+                v = (int64_t)((uint64_t)v & ((1ull << (8 * sz)) - 1));
+        } else {
+                narrow_imm(v, sz, &v);
+        }
+        if (b->o[0].sz == 4) {
+                v = (uint32_t)v;
+        }
+
+        b->op = X64_MOV;
+        b->o[0].sz = 8;
+        b->o[1] = imm_opnd(v);
+        drop(ctx, i);
+        return 1;
+}
+
+static int
+imm(peephole_context *ctx, size_t i)
+{
+        size_t j = after(ctx, i, 1);
+        x64_insn *a = insn(ctx, i), *b = insn(ctx, j);
+        if (!a || !b || a->op != X64_MOV || !is_reg(&a->o[0], X64_NOREG, 8) || a->o[1].kind != X64_OPND_IMM) {
+                return 0;
+        }
+
+        int r = a->o[0].reg;
+        x64_opnd *d = &b->o[0], *s = &b->o[1];
+        if (b->n != 2 || !is_reg(s, r, 0) || (reads(d) & BIT(r)) || !dead_after(ctx, j, BIT(r))) {
+                return 0;
+        }
+        if (b->op == X64_IMUL) {
+                if (d->kind != X64_OPND_REG || d->sz == 1) return 0;
+        } else if (b->op != X64_MOV && b->op > X64_CMP) {
+                return 0;
+        }
+
+        int64_t v;
+        if (!narrow_imm(a->o[1].imm, s->sz, &v)) {
+                return 0;
+        }
+        if (!d->sz) {
+                d->sz = s->sz;
+        }
+
+        *s = imm_opnd(v);
+        drop(ctx, i);
+        return 1;
+}
+
+static int
+cmp_zero(peephole_context *ctx, size_t i)
+{
+        size_t j = after(ctx, i, 1);
+        x64_insn *a = insn(ctx, i), *b = insn(ctx, j);
+        if (!a || !b || a->op != X64_MOV || !is_reg(&a->o[0], X64_NOREG, 8)) {
+                return 0;
+        }
+
+        const x64_opnd *x = &a->o[1];
+        int r = a->o[0].reg, sz = b->o[0].sz;
+        if (!is_reg(x, X64_NOREG, 8) && (x->kind != X64_OPND_MEM || x->sz != 8)) {
+                return 0;
+        }
+        if (!is_reg(&b->o[0], r, 0)) {
+                return 0;
+        }
+        if (!(b->op == X64_TEST && same_opnd(&b->o[0], &b->o[1]))
+            && !(b->op == X64_CMP && b->o[1].kind == X64_OPND_IMM && b->o[1].imm == 0)) {
+                return 0;
+        }
+        if (!dead_after(ctx, j, BIT(r)) || is_reg(x, r, 0)) {
+                return 0;
+        }
+
+        if (x->kind == X64_OPND_REG) {
+                b->op = X64_TEST;
+                b->o[0] = b->o[1] = reg_opnd(x->reg, sz);
+        } else {
+                b->op = X64_CMP;
+                b->o[0] = *x;
+                b->o[0].sz = (uint8_t)sz;
+                b->o[1] = imm_opnd(0);
+        }
+        drop(ctx, i);
+        return 1;
+}
+
+// The flags that setcc read are still there for the branch,
+// which then needs neither the test nor, if nothing else reads
+// it, the value.
+static int
+setcc_branch(peephole_context *ctx, size_t i)
+{
+        size_t k = after(ctx, i, 2), l = after(ctx, k, 1);
+        x64_insn *a = insn(ctx, i), *b = insn(ctx, after(ctx, i, 1)), *c = insn(ctx, k), *d = insn(ctx, l);
+        if (!a || !b || !c || !d || a->op != X64_SETCC || b->op != X64_MOVZX || c->op != X64_TEST
+            || d->op != X64_JCC || (d->cc != X64_CC_E && d->cc != X64_CC_NE)) {
+                return 0;
+        }
+
+        int r = a->o[0].reg;
+        if (!is_reg(&a->o[0], X64_NOREG, 1) || !is_reg(&b->o[0], r, 4) || !same_opnd(&b->o[1], &a->o[0])
+            || !is_reg(&c->o[0], r, 0) || !same_opnd(&c->o[0], &c->o[1]) || !dead_after(ctx, l, FLAGS)) {
+                return 0;
+        }
+
+        // The encoding of a condition and its inverse differ
+        // in the lowest bit.
+        d->cc = d->cc == X64_CC_NE ? a->cc : a->cc ^ 1;
+        drop(ctx, k);
+        return 1;
+}
+
+static int
+identity(peephole_context *ctx, size_t i)
+{
+        x64_insn *a = insn(ctx, i);
+        if (!a || !is_reg(&a->o[0], X64_NOREG, 8) || !dead_after(ctx, i, FLAGS)) {
+                return 0;
+        }
+
+        if (a->n < 2 || a->o[a->n - 1].kind != X64_OPND_IMM) {
+                return 0;
+        }
+        int64_t k = a->o[a->n - 1].imm;
+
+        switch (a->op) {
+        case X64_IMUL:
+                if (k != 1) return 0;
+                if (a->n == 3 && !same_opnd(&a->o[0], &a->o[1])) {
+                        a->op = X64_MOV;
+                        a->n = 2;
+                        return 1;
+                }
+                break;
+        case X64_ADD: case X64_SUB: case X64_OR: case X64_XOR:
+        case X64_SHL: case X64_SHR: case X64_SAR:
+                if (k != 0) return 0;
+                break;
+        default:
+                return 0;
+        }
+
+        drop(ctx, i);
+        return 1;
+}
+
+static int
+push_pop(peephole_context *ctx, size_t i)
+{
+        size_t j = after(ctx, i, 1);
+        x64_insn *a = insn(ctx, i), *b = insn(ctx, j);
+        if (!a || !b || a->op != X64_PUSH || b->op != X64_POP
+            || !is_reg(&a->o[0], X64_NOREG, 8) || !is_reg(&b->o[0], X64_NOREG, 8)) {
+                return 0;
+        }
+
+        if (a->o[0].reg == b->o[0].reg) {
+                drop(ctx, j);
+                drop(ctx, i);
+        } else {
+                b->op = X64_MOV;
+                b->n = 2;
+                b->o[1] = a->o[0];
+                drop(ctx, i);
+        }
+        return 1;
+}
+
+static int
+dead(peephole_context *ctx, size_t i)
+{
+        x64_insn *a = insn(ctx, i);
+        uint32_t use, def;
+
+        if (!a || !removable(a)) {
+                return 0;
+        }
+        effects(a, &use, &def);
+        if (!dead_after(ctx, i, def)) {
+                return 0;
+        }
+        drop(ctx, i);
+        return 1;
+}
+
+static int
+zero(peephole_context *ctx, size_t i)
+{
+        x64_insn *a = insn(ctx, i);
+        if (!a || a->op != X64_MOV || a->o[0].kind != X64_OPND_REG || a->o[0].sz < 4
+            || a->o[1].kind != X64_OPND_IMM || a->o[1].imm != 0 || !dead_after(ctx, i, FLAGS)) {
+                return 0;
+        }
+        a->op = X64_XOR;
+        a->o[0].sz = 4;
+        a->o[1] = a->o[0];
+        return 1;
+}
+
+// Tried in this order at every instruction. `len` is how many
+// instructions a rule looks at.
+static const struct {
+        const char *name;
+        uint32_t rule;
+        int len;
+        int (*apply)(peephole_context *ctx, size_t i);
+} g_rules[] = {
+        {"mov-self",     PEEPHOLE_MOV_SELF,     1, mov_self},
+        {"store-load",   PEEPHOLE_STORE_LOAD,   2, store_load},
+        {"copy",         PEEPHOLE_COPY,         2, copy},
+        {"ext-imm",      PEEPHOLE_EXT_IMM,      2, ext_imm},
+        {"imm",          PEEPHOLE_IMM,          2, imm},
+        {"cmp-zero",     PEEPHOLE_CMP_ZERO,     2, cmp_zero},
+        {"setcc-branch", PEEPHOLE_SETCC_BRANCH, 4, setcc_branch},
+        {"identity",     PEEPHOLE_IDENTITY,     1, identity},
+        {"push-pop",     PEEPHOLE_PUSH_POP,     2, push_pop},
+        {"dead",         PEEPHOLE_DEAD,         1, dead},
+        {"zero",         PEEPHOLE_ZERO,         1, zero},
+};
+
+#define NRULES ((int)(sizeof(g_rules) / sizeof(g_rules[0])))
+
+// Since the last peephole_report().
+static int g_hits[NRULES];
+static int g_before, g_after;
+
+uint32_t
+peephole_find(const char *name)
+{
+        for (int r = 0; r < NRULES; ++r) {
+                if (!strcmp(g_rules[r].name, name)) {
+                        return g_rules[r].rule;
+                }
+        }
+        return 0;
+}
+
+static int
+count_insns(const peephole_context *ctx)
+{
+        int n = 0;
+        for (size_t i = 0; i < ctx->n; ++i) {
+                n += ctx->it[i].kind == X64_ITEM_INSN;
+        }
+        return n;
+}
+
+// Links the items in order and works out what is live, at the
+// start of a pass.
+static void
+begin_pass(peephole_context *ctx)
+{
+        for (size_t i = 0; i < ctx->n; ++i) {
+                ctx->next[i] = i + 1;
+                ctx->prev[i] = i ? i - 1 : SIZE_MAX;
+                ctx->dropped[i] = 0;
+        }
+        liveness(ctx);
+}
+
+// Removes what the pass dropped.
+static void
+end_pass(peephole_context *ctx)
+{
+        size_t k = 0;
+        for (size_t i = 0; i < ctx->n; ++i) {
+                if (!ctx->dropped[i]) ctx->it[k++] = ctx->it[i];
+        }
+        ctx->n = k;
+}
+
+// One pass over the procedure with `rules`, whether anything
+// changed. What is live is worked out once. A rewrite can only
+// make more live inside the instructions it looked at, so the
+// pass goes on after them and leaves anything those may allow
+// to the next.
+static int
+pass(peephole_context *ctx, uint32_t rules)
+{
+        int changed = 0;
+
+        begin_pass(ctx);
+        for (size_t i = 0; i < ctx->n;) {
+                size_t next = ctx->next[i];
+                for (int r = 0; r < NRULES; ++r) {
+                        if (!(rules & g_rules[r].rule)) continue;
+                        size_t end = after(ctx, i, g_rules[r].len);
+                        if (g_rules[r].apply(ctx, i)) {
+                                ++g_hits[r];
+                                changed = 1;
+                                next = end;
+                                break;
+                        }
+                }
+                i = next;
+        }
+        end_pass(ctx);
+
+        return changed;
+}
+
+// Passes over the procedure until one changes nothing. An xor
+// is no longer an immediate the other rules can fold, so zero
+// is left to a last pass.
+void
+peephole_run(x64_item_array *code, size_t from, uint32_t rules)
+{
+        peephole_context ctx;
+        size_t n = code->len - from + 1;
+
+        ctx.it = code->data + from;
+        ctx.n = code->len - from;
+        ctx.in = (uint32_t *)alloc(n * sizeof(uint32_t));
+        ctx.out = (uint32_t *)alloc(n * sizeof(uint32_t));
+        ctx.target = (int *)alloc(n * sizeof(int));
+        ctx.next = (size_t *)alloc(n * sizeof(size_t));
+        ctx.prev = (size_t *)alloc(n * sizeof(size_t));
+        ctx.dropped = (char *)alloc(n);
+
+        g_before += count_insns(&ctx);
+
+        while (pass(&ctx, rules & ~PEEPHOLE_ZERO));
+        if (rules & PEEPHOLE_ZERO) {
+                pass(&ctx, PEEPHOLE_ZERO);
+        }
+
+        g_after += count_insns(&ctx);
+        code->len = from + ctx.n;
+
+        free(ctx.in);
+        free(ctx.out);
+        free(ctx.target);
+        free(ctx.next);
+        free(ctx.prev);
+        free(ctx.dropped);
+}
+
+void
+peephole_report(const char *modname)
+{
+        if (!g_before) {
+                return;
+        }
+        printf("peephole: %s: %d of %d instructions removed", modname, g_before - g_after, g_before);
+        for (int r = 0; r < NRULES; ++r) {
+                if (g_hits[r]) {
+                        printf(", %s %d", g_rules[r].name, g_hits[r]);
+                }
+                g_hits[r] = 0;
+        }
+        printf("\n");
+        g_before = g_after = 0;
+}
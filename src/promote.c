@@ -0,0 +1,515 @@
+#include "ir.h"
+#include "mem.h"
+
+#include <forge/array.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+// The bytes of a local are (offset-sz, offset] below rbp, as
+// are those of anything else in the frame.
+typedef struct {
+        int offset;
+        int sz;
+        int ok;     // whether it can be promoted
+        int var;    // its number among those that are, else -1
+} slot;
+
+DYN_ARRAY_TYPE(slot, slot_array);
+
+typedef struct {
+        ir_proc *p;
+        slot_array slots;
+        int nvars;
+        int *last;     // per block and variable, what it holds at the end, or -1
+        int *in;       // and at the start, -1 until known, -2 while it is worked out
+        int *phis;     // the phi of every variable in every join, or -1
+        int *repl;     // what every virtual register is to be replaced with, or -1
+        int undef;     // for what is read before it is written, or -1
+} promote_context;
+
+static int
+overlaps(int off1, int sz1, int off2, int sz2)
+{
+        return off1 - sz1 < off2 && off2 - sz2 < off1;
+}
+
+static slot *
+find_slot(promote_context *ctx, int offset)
+{
+        for (size_t i = 0; i < ctx->slots.len; ++i) {
+                if (ctx->slots.data[i].offset == offset) {
+                        return &ctx->slots.data[i];
+                }
+        }
+        return NULL;
+}
+
+// Whatever overlaps the `sz` bytes at rbp-offset stays in memory.
+static void
+escape(promote_context *ctx, int offset, int sz)
+{
+        for (size_t i = 0; i < ctx->slots.len; ++i) {
+                slot *s = &ctx->slots.data[i];
+                if (overlaps(s->offset, s->sz, offset, sz)) {
+                        s->ok = 0;
+                }
+        }
+}
+
+// Embeds refer to locals as [rbp-N], which is what semantic
+// analysis turns `{x}` into.
+static void
+escape_embed(promote_context *ctx, const stmt_embed *e)
+{
+        for (size_t i = 0; i < e->lns.len; ++i) {
+                for (const char *s = e->lns.data[i]->lx; (s = strstr(s, "[rbp-")); ++s) {
+                        int offset = (int)strtol(s + 5, NULL, 10);
+                        escape(ctx, offset, 1);
+                }
+        }
+}
+
+static void
+find_slots(promote_context *ctx)
+{
+        ir_proc *p = ctx->p;
+
+        for (size_t i = 0; i < p->blocks.len; ++i) {
+                const ir_block *b = &p->blocks.data[i];
+                for (size_t j = 0; j < b->insns.len; ++j) {
+                        const ir_insn *in = &b->insns.data[j];
+                        if (in->op != IR_LDSLOT && in->op != IR_STSLOT) continue;
+
+                        slot *s = find_slot(ctx, (int)in->imm);
+                        if (!s) {
+                                slot n = {(int)in->imm, in->sz, 1, -1};
+                                dyn_array_append(ctx->slots, n);
+                        } else if (s->sz != in->sz) {
+                                s->ok = 0;
+                        }
+                }
+        }
+
+        // Of two slots that overlap, neither is one variable.
+        for (size_t i = 0; i < ctx->slots.len; ++i) {
+                for (size_t j = i + 1; j < ctx->slots.len; ++j) {
+                        slot *s = &ctx->slots.data[i], *t = &ctx->slots.data[j];
+                        if (overlaps(s->offset, s->sz, t->offset, t->sz)) {
+                                s->ok = t->ok = 0;
+                        }
+                }
+        }
+
+        for (size_t i = 0; i < p->blocks.len; ++i) {
+                const ir_block *b = &p->blocks.data[i];
+                for (size_t j = 0; j < b->insns.len; ++j) {
+                        const ir_insn *in = &b->insns.data[j];
+                        switch (in->op) {
+                        case IR_SLOTADDR:
+                        case IR_ZERO:
+                                escape(ctx, (int)in->imm, (int)in->imm2);
+                                break;
+                        case IR_EMBED:
+                                escape_embed(ctx, in->embed);
+                                break;
+                        default:
+                                break;
+                        }
+                }
+        }
+
+        for (size_t i = 0; i < ctx->slots.len; ++i) {
+                if (ctx->slots.data[i].ok) {
+                        ctx->slots.data[i].var = ctx->nvars++;
+                }
+        }
+}
+
+// The variable `in` reads or writes, or -1.
+static int
+var_of(promote_context *ctx, const ir_insn *in)
+{
+        if (in->op != IR_LDSLOT && in->op != IR_STSLOT) return -1;
+        return find_slot(ctx, (int)in->imm)->var;
+}
+
+static ir_insn
+insn(ir_op op, int sz, loc loc)
+{
+        ir_insn in;
+        memset(&in, 0, sizeof(in));
+        in.op  = (uint8_t)op;
+        in.sz  = (uint8_t)sz;
+        in.dst = -1;
+        in.a   = -1;
+        in.b   = -1;
+        in.loc = loc;
+        return in;
+}
+
+static int
+undef(promote_context *ctx)
+{
+        if (ctx->undef < 0) ctx->undef = ctx->p->nvregs++;
+        return ctx->undef;
+}
+
+static int
+find(promote_context *ctx, int v)
+{
+        while (v >= 0 && ctx->repl[v] >= 0) v = ctx->repl[v];
+        return v;
+}
+
+static int at_end(promote_context *ctx, int b, int var);
+
+// What `var` holds on entry to `b`: its phi in a join, what
+// the one predecessor leaves in it otherwise.
+static int
+at_start(promote_context *ctx, int b, int var)
+{
+        const ir_block *blk = &ctx->p->blocks.data[b];
+        int *in = &ctx->in[b * ctx->nvars + var];
+
+        if (*in >= 0) return *in;
+        if (*in == -2 || blk->preds.len == 0) {
+                // The entry, or blocks that nothing reaches.
+                return undef(ctx);
+        }
+        if (blk->preds.len > 1) {
+                *in = ctx->phis[b * ctx->nvars + var];
+                return *in;
+        }
+
+        *in = -2;
+        int x = at_end(ctx, blk->preds.data[0], var);
+        *in = x;
+        return x;
+}
+
+static int
+at_end(promote_context *ctx, int b, int var)
+{
+        int x = ctx->last[b * ctx->nvars + var];
+        return x >= 0 ? x : at_start(ctx, b, var);
+}
+
+// The bytes of `v` above its low `sz` ones are 0, as they are
+// when it is read back from its slot.
+static int
+zero_extended(const ir_insn *def, int sz)
+{
+        if (!def) return 0;
+        switch (def->op) {
+        case IR_EQ: case IR_NE: case IR_LT: case IR_GT: case IR_LE: case IR_GE:
+                return 1;
+        case IR_LDSLOT:
+        case IR_LOAD:
+                return def->sz <= sz;
+        case IR_CONST:
+                return def->imm >= 0 && def->imm < ((int64_t)1 << (8 * sz));
+        case IR_EXT:
+                return (def->flags & IR_UNSIGNED) && def->asz <= sz;
+        default:
+                return 0;
+        }
+}
+
+// Rewrites the blocks: the loads and stores of the variables
+// go, their phis come first, and what is stored to those below
+// 4 bytes is zero-extended as their slots would have it. Above
+// that the ops of their size see to it.
+static void
+rewrite(promote_context *ctx)
+{
+        ir_proc *p = ctx->p;
+
+        for (size_t i = 0; i < p->blocks.len; ++i) {
+                ir_block *b = &p->blocks.data[i];
+                ir_insn_array out = dyn_array_empty(ir_insn_array);
+
+                for (int var = 0; var < ctx->nvars; ++var) {
+                        int phi = ctx->phis[i * ctx->nvars + var];
+                        if (phi < 0) continue;
+
+                        ir_insn in = insn(IR_PHI, 8, p->s->base.loc);
+                        in.dst = phi;
+                        in.nargs = (int)b->preds.len;
+                        in.args = (int *)alloc(b->preds.len * sizeof(int));
+                        in.preds = (int *)alloc(b->preds.len * sizeof(int));
+                        for (size_t k = 0; k < b->preds.len; ++k) {
+                                in.args[k] = at_end(ctx, b->preds.data[k], var);
+                                in.preds[k] = b->preds.data[k];
+                        }
+                        dyn_array_append(out, in);
+                }
+
+                for (size_t j = 0; j < b->insns.len; ++j) {
+                        ir_insn in = b->insns.data[j];
+                        int var = var_of(ctx, &in);
+
+                        if (var < 0) {
+                                dyn_array_append(out, in);
+                                continue;
+                        }
+                        if (in.op == IR_STSLOT && in.dst >= 0) {
+                                ir_insn ext = insn(IR_EXT, 4, in.loc);
+                                ext.asz = in.sz;
+                                ext.flags = IR_UNSIGNED;
+                                ext.a = in.a;
+                                ext.dst = in.dst;
+                                dyn_array_append(out, ext);
+                        }
+                }
+
+                dyn_array_free(b->insns);
+                b->insns = out;
+        }
+}
+
+static void
+replace_operands(promote_context *ctx)
+{
+        ir_proc *p = ctx->p;
+
+        for (size_t i = 0; i < p->blocks.len; ++i) {
+                ir_block *b = &p->blocks.data[i];
+                for (size_t j = 0; j < b->insns.len; ++j) {
+                        ir_insn *in = &b->insns.data[j];
+                        in->a = find(ctx, in->a);
+                        in->b = find(ctx, in->b);
+                        for (int k = 0; k < in->nargs; ++k) {
+                                in->args[k] = find(ctx, in->args[k]);
+                        }
+                }
+        }
+}
+
+// A phi whose arguments are all one value, or itself, is that
+// value. Removing one can make others so.
+static void
+remove_trivial_phis(promote_context *ctx)
+{
+        ir_proc *p = ctx->p;
+        int changed = 1;
+
+        while (changed) {
+                changed = 0;
+                for (size_t i = 0; i < p->blocks.len; ++i) {
+                        ir_block *b = &p->blocks.data[i];
+                        for (size_t j = 0; j < b->insns.len && b->insns.data[j].op == IR_PHI; ++j) {
+                                ir_insn *in = &b->insns.data[j];
+                                int same = -1, trivial = 1;
+
+                                if (ctx->repl[in->dst] >= 0) continue;
+                                for (int k = 0; k < in->nargs; ++k) {
+                                        int x = find(ctx, in->args[k]);
+                                        if (x == in->dst || x == same) continue;
+                                        if (same >= 0) {
+                                                trivial = 0;
+                                                break;
+                                        }
+                                        same = x;
+                                }
+                                if (trivial) {
+                                        ctx->repl[in->dst] = same >= 0 ? same : undef(ctx);
+                                        changed = 1;
+                                }
+                        }
+                }
+        }
+
+        for (size_t i = 0; i < p->blocks.len; ++i) {
+                ir_block *b = &p->blocks.data[i];
+                size_t n = 0;
+                for (size_t j = 0; j < b->insns.len; ++j) {
+                        ir_insn *in = &b->insns.data[j];
+                        if (in->op == IR_PHI && ctx->repl[in->dst] >= 0) {
+                                free(in->args);
+                                free(in->preds);
+                                continue;
+                        }
+                        b->insns.data[n++] = *in;
+                }
+                b->insns.len = n;
+        }
+}
+
+// A phi that nothing but phis that are themselves dead uses is
+// dead, as is what every variable gets in every join it is not
+// read after.
+static void
+remove_dead_phis(promote_context *ctx)
+{
+        ir_proc *p = ctx->p;
+        char *used = (char *)alloc(p->nvregs);
+        int changed = 1;
+
+        memset(used, 0, p->nvregs);
+        for (size_t i = 0; i < p->blocks.len; ++i) {
+                const ir_block *b = &p->blocks.data[i];
+                for (size_t j = 0; j < b->insns.len; ++j) {
+                        const ir_insn *in = &b->insns.data[j];
+                        if (in->op == IR_PHI) continue;
+                        for (int k = 0; k < ir_nuses(in); ++k) {
+                                if (ir_use(in, k) >= 0) used[ir_use(in, k)] = 1;
+                        }
+                }
+        }
+
+        while (changed) {
+                changed = 0;
+                for (size_t i = 0; i < p->blocks.len; ++i) {
+                        const ir_block *b = &p->blocks.data[i];
+                        for (size_t j = 0; j < b->insns.len && b->insns.data[j].op == IR_PHI; ++j) {
+                                const ir_insn *in = &b->insns.data[j];
+                                if (!used[in->dst]) continue;
+                                for (int k = 0; k < in->nargs; ++k) {
+                                        if (!used[in->args[k]]) {
+                                                used[in->args[k]] = 1;
+                                                changed = 1;
+                                        }
+                                }
+                        }
+                }
+        }
+
+        for (size_t i = 0; i < p->blocks.len; ++i) {
+                ir_block *b = &p->blocks.data[i];
+                size_t n = 0;
+                for (size_t j = 0; j < b->insns.len; ++j) {
+                        ir_insn *in = &b->insns.data[j];
+                        if (in->op == IR_PHI && !used[in->dst]) {
+                                free(in->args);
+                                free(in->preds);
+                                continue;
+                        }
+                        b->insns.data[n++] = *in;
+                }
+                b->insns.len = n;
+        }
+
+        free(used);
+}
+
+// Defines `undef` after the parameters, if anything reads it.
+static void
+define_undef(promote_context *ctx)
+{
+        ir_insn_array *insns = &ctx->p->blocks.data[0].insns;
+        size_t at = 0;
+
+        if (ctx->undef < 0) return;
+
+        while (at < insns->len && insns->data[at].op == IR_PARAM) ++at;
+
+        ir_insn in = insn(IR_CONST, 8, ctx->p->s->base.loc);
+        in.dst = ctx->undef;
+        dyn_array_append(*insns, in);
+        memmove(&insns->data[at + 1], &insns->data[at], (insns->len - 1 - at) * sizeof(ir_insn));
+        insns->data[at] = in;
+}
+
+void
+ir_promote(ir_proc *p)
+{
+        promote_context ctx;
+        memset(&ctx, 0, sizeof(ctx));
+        ctx.p = p;
+        ctx.slots = dyn_array_empty(slot_array);
+        ctx.undef = -1;
+
+        find_slots(&ctx);
+
+        // Code cannot jump back to the start, or there would be
+        // no one place for what the variables start out as.
+        if (!ctx.nvars || p->blocks.data[0].preds.len) {
+                dyn_array_free(ctx.slots);
+                return;
+        }
+
+        const ir_insn **defs = (const ir_insn **)alloc(p->nvregs * sizeof(ir_insn *));
+        memset(defs, 0, p->nvregs * sizeof(ir_insn *));
+        for (size_t i = 0; i < p->blocks.len; ++i) {
+                const ir_block *b = &p->blocks.data[i];
+                for (size_t j = 0; j < b->insns.len; ++j) {
+                        if (b->insns.data[j].dst >= 0) defs[b->insns.data[j].dst] = &b->insns.data[j];
+                }
+        }
+
+        // The registers of the phis, and of what is stored
+        // zero-extended, which the store holds on to.
+        size_t n = p->blocks.len * ctx.nvars;
+        ctx.phis = (int *)alloc(n * sizeof(int));
+        for (size_t i = 0; i < p->blocks.len; ++i) {
+                ir_block *b = &p->blocks.data[i];
+                for (int var = 0; var < ctx.nvars; ++var) {
+                        ctx.phis[i * ctx.nvars + var] = b->preds.len > 1 ? p->nvregs++ : -1;
+                }
+                for (size_t j = 0; j < b->insns.len; ++j) {
+                        ir_insn *in = &b->insns.data[j];
+                        if (var_of(&ctx, in) >= 0 && in->op == IR_STSLOT
+                            && in->sz < 4 && !zero_extended(defs[in->a], in->sz)) {
+                                in->dst = p->nvregs++;
+                        }
+                }
+        }
+
+        // And `undef`.
+        ctx.repl = (int *)alloc((p->nvregs + 1) * sizeof(int));
+        memset(ctx.repl, -1, (p->nvregs + 1) * sizeof(int));
+        ctx.last = (int *)alloc(n * sizeof(int));
+        ctx.in = (int *)alloc(n * sizeof(int));
+        memset(ctx.last, -1, n * sizeof(int));
+        memset(ctx.in, -1, n * sizeof(int));
+
+        // Within a block, a load is what was last stored or
+        // loaded. What each block stores last is for at_end().
+        int *cur = (int *)alloc(ctx.nvars * sizeof(int));
+        for (size_t i = 0; i < p->blocks.len; ++i) {
+                const ir_block *b = &p->blocks.data[i];
+                memset(cur, -1, ctx.nvars * sizeof(int));
+
+                for (size_t j = 0; j < b->insns.len; ++j) {
+                        const ir_insn *in = &b->insns.data[j];
+                        int var = var_of(&ctx, in);
+                        if (var < 0) continue;
+
+                        if (in->op == IR_LDSLOT) {
+                                if (cur[var] >= 0) ctx.repl[in->dst] = cur[var];
+                                else cur[var] = in->dst;
+                        } else {
+                                cur[var] = in->dst >= 0 ? in->dst : in->a;
+                                ctx.last[i * ctx.nvars + var] = cur[var];
+                        }
+                }
+        }
+        free(cur);
+
+        // The loads before any store in their block.
+        for (size_t i = 0; i < p->blocks.len; ++i) {
+                const ir_block *b = &p->blocks.data[i];
+                for (size_t j = 0; j < b->insns.len; ++j) {
+                        const ir_insn *in = &b->insns.data[j];
+                        int var = var_of(&ctx, in);
+                        if (var >= 0 && in->op == IR_LDSLOT && ctx.repl[in->dst] < 0) {
+                                ctx.repl[in->dst] = at_start(&ctx, (int)i, var);
+                        }
+                }
+        }
+
+        rewrite(&ctx);
+        replace_operands(&ctx);
+        remove_trivial_phis(&ctx);
+        replace_operands(&ctx);
+        remove_dead_phis(&ctx);
+        define_undef(&ctx);
+
+        free(defs);
+        free(ctx.last);
+        free(ctx.in);
+        free(ctx.phis);
+        free(ctx.repl);
+        dyn_array_free(ctx.slots);
+}
@@ -0,0 +1,478 @@
+#include "reach.h"
+#include "visitor.h"
+#include "global.h"
+#include "flags.h"
+#include "mem.h"
+#include "ds/smap.h"
+
+#include <forge/array.h>
+#include <forge/cstr.h>
+#include <forge/utils.h>
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+        const symtbl *tbl;
+        str_array *refs; // of the proc being visited, if any
+} reach_context;
+
+// symbol -> str_array * of the symbols it refers to.
+static smap g_graph = {0};
+static smap g_live  = {0};
+static int  g_done  = 0;
+
+char *
+reach_symbol(const char *modname, const char *id)
+{
+        if (!strcmp(id, "_start") || !strcmp(id, "main")) {
+                return strdup(id);
+        }
+        return forge_cstr_builder(modname, "_", id, NULL);
+}
+
+int
+reach_is_live(const char *sym)
+{
+        return !g_done || smap_has(&g_live, sym);
+}
+
+static void
+ref(reach_context *ctx, char *sym)
+{
+        if (ctx->refs) {
+                dyn_array_append(*ctx->refs, sym);
+        } else {
+                free(sym);
+        }
+}
+
+static void
+accept_expr(expr *e, visitor *v)
+{
+        if (e) e->accept(e, v);
+}
+
+static void
+accept_stmt(stmt *s, visitor *v)
+{
+        if (s) s->accept(s, v);
+}
+
+static void *
+visit_expr_binary(visitor *v, expr_bin *e)
+{
+        accept_expr(e->lhs, v);
+        accept_expr(e->rhs, v);
+        return NULL;
+}
+
+// Calls, as well as procs whose address is taken, all come
+// through here.
+static void *
+visit_expr_identifier(visitor *v, expr_identifier *e)
+{
+        reach_context *ctx = (reach_context *)v->context;
+        const sym *s = e->resolved;
+
+        if (!s || !((expr *)e)->type) return NULL;
+
+        if (s->extern_) {
+                ref(ctx, strdup(e->id->lx));
+        } else if (((expr *)e)->type->kind == TYPE_KIND_PROC) {
+                ref(ctx, reach_symbol(s->modname, e->id->lx));
+        }
+
+        return NULL;
+}
+
+static void *
+visit_expr_integer_literal(visitor *v, expr_integer_literal *e)
+{
+        NOOP(v, e);
+        return NULL;
+}
+
+static void *
+visit_expr_string_literal(visitor *v, expr_string_literal *e)
+{
+        NOOP(v, e);
+        return NULL;
+}
+
+static void *
+visit_expr_proccall(visitor *v, expr_proccall *e)
+{
+        accept_expr(e->lhs, v);
+        for (size_t i = 0; i < e->args.len; ++i) {
+                accept_expr(e->args.data[i], v);
+        }
+        return NULL;
+}
+
+static void *
+visit_expr_mut(visitor *v, expr_mut *e)
+{
+        accept_expr(e->lhs, v);
+        accept_expr(e->rhs, v);
+        return NULL;
+}
+
+static void *
+visit_expr_brace_init(visitor *v, expr_brace_init *e)
+{
+        for (size_t i = 0; i < e->exprs.len; ++i) {
+                accept_expr(e->exprs.data[i], v);
+        }
+        return NULL;
+}
+
+static void *
+visit_expr_namespace(visitor *v, expr_namespace *e)
+{
+        accept_expr(e->e, v);
+        return NULL;
+}
+
+static void *
+visit_expr_arrayinit(visitor *v, expr_arrayinit *e)
+{
+        for (size_t i = 0; i < e->exprs.len; ++i) {
+                accept_expr(e->exprs.data[i], v);
+        }
+        return NULL;
+}
+
+static void *
+visit_expr_index(visitor *v, expr_index *e)
+{
+        accept_expr(e->lhs, v);
+        accept_expr(e->idx, v);
+        return NULL;
+}
+
+static void *
+visit_expr_un(visitor *v, expr_un *e)
+{
+        accept_expr(e->rhs, v);
+        return NULL;
+}
+
+static void *
+visit_expr_character_literal(visitor *v, expr_character_literal *e)
+{
+        NOOP(v, e);
+        return NULL;
+}
+
+static void *
+visit_expr_cast(visitor *v, expr_cast *e)
+{
+        accept_expr(e->rhs, v);
+        return NULL;
+}
+
+static void *
+visit_expr_bool_literal(visitor *v, expr_bool_literal *e)
+{
+        NOOP(v, e);
+        return NULL;
+}
+
+static void *
+visit_expr_null(visitor *v, expr_null *e)
+{
+        NOOP(v, e);
+        return NULL;
+}
+
+static void *
+visit_stmt_let(visitor *v, stmt_let *s)
+{
+        accept_expr(s->e, v);
+        return NULL;
+}
+
+static void *
+visit_stmt_expr(visitor *v, stmt_expr *s)
+{
+        accept_expr(s->e, v);
+        return NULL;
+}
+
+static void *
+visit_stmt_block(visitor *v, stmt_block *s)
+{
+        for (size_t i = 0; i < s->stmts.len; ++i) {
+                accept_stmt(s->stmts.data[i], v);
+        }
+        return NULL;
+}
+
+static void *
+visit_stmt_proc(visitor *v, stmt_proc *s)
+{
+        reach_context *ctx = (reach_context *)v->context;
+
+        // Every program of a batch has its own _start, their
+        // references all count.
+        char *sym = reach_symbol(ctx->tbl->modname, s->id->lx);
+        str_array *refs = (str_array *)smap_get(&g_graph, sym);
+        if (!refs) {
+                refs = (str_array *)alloc(sizeof(str_array));
+                *refs = dyn_array_empty(str_array);
+                smap_insert(&g_graph, sym, refs);
+        }
+        free(sym);
+
+        ctx->refs = refs;
+        accept_stmt(s->blk, v);
+        ctx->refs = NULL;
+
+        return NULL;
+}
+
+static void *
+visit_stmt_return(visitor *v, stmt_return *s)
+{
+        accept_expr(s->e, v);
+        return NULL;
+}
+
+static void *
+visit_stmt_exit(visitor *v, stmt_exit *s)
+{
+        accept_expr(s->e, v);
+        return NULL;
+}
+
+static void *
+visit_stmt_extern_proc(visitor *v, stmt_extern_proc *s)
+{
+        NOOP(v, s);
+        return NULL;
+}
+
+static void *
+visit_stmt_if(visitor *v, stmt_if *s)
+{
+        accept_expr(s->e, v);
+        accept_stmt(s->then, v);
+        accept_stmt(s->else_, v);
+        return NULL;
+}
+
+static void *
+visit_stmt_while(visitor *v, stmt_while *s)
+{
+        accept_expr(s->e, v);
+        accept_stmt(s->body, v);
+        return NULL;
+}
+
+static void *
+visit_stmt_for(visitor *v, stmt_for *s)
+{
+        accept_stmt(s->init, v);
+        accept_expr(s->e, v);
+        accept_expr(s->after, v);
+        accept_stmt(s->body, v);
+        return NULL;
+}
+
+static void *
+visit_stmt_break(visitor *v, stmt_break *s)
+{
+        NOOP(v, s);
+        return NULL;
+}
+
+static void *
+visit_stmt_continue(visitor *v, stmt_continue *s)
+{
+        NOOP(v, s);
+        return NULL;
+}
+
+static void *
+visit_stmt_struct(visitor *v, stmt_struct *s)
+{
+        NOOP(v, s);
+        return NULL;
+}
+
+static void *
+visit_stmt_module(visitor *v, stmt_module *s)
+{
+        NOOP(v, s);
+        return NULL;
+}
+
+static void *
+visit_stmt_import(visitor *v, stmt_import *s)
+{
+        NOOP(v, s);
+        return NULL;
+}
+
+// There is no telling what an embed refers to, so every word
+// in it counts, both as is and as a proc of this module.
+static void *
+visit_stmt_embed(visitor *v, stmt_embed *s)
+{
+        reach_context *ctx = (reach_context *)v->context;
+
+        for (size_t i = 0; i < s->lns.len; ++i) {
+                const char *ln = s->lns.data[i]->lx;
+                for (size_t j = 0; ln[j];) {
+                        if (!(isalpha((unsigned char)ln[j]) || ln[j] == '_')) {
+                                ++j;
+                                continue;
+                        }
+                        size_t k = j;
+                        while (isalnum((unsigned char)ln[k]) || ln[k] == '_') ++k;
+
+                        char *word = strndup(ln+j, k-j);
+                        ref(ctx, reach_symbol(ctx->tbl->modname, word));
+                        ref(ctx, word);
+                        j = k;
+                }
+        }
+
+        return NULL;
+}
+
+static void *
+visit_stmt_empty(visitor *v, stmt_empty *s)
+{
+        NOOP(v, s);
+        return NULL;
+}
+
+static visitor *
+reach_visitor_alloc(reach_context *ctx)
+{
+        return visitor_alloc(
+                (void *)ctx,
+                visit_expr_binary,
+                visit_expr_identifier,
+                visit_expr_integer_literal,
+                visit_expr_string_literal,
+                visit_expr_proccall,
+                visit_expr_mut,
+                visit_expr_brace_init,
+                visit_expr_namespace,
+                visit_expr_arrayinit,
+                visit_expr_index,
+                visit_expr_un,
+                visit_expr_character_literal,
+                visit_expr_cast,
+                visit_expr_bool_literal,
+                visit_expr_null,
+
+                visit_stmt_let,
+                visit_stmt_expr,
+                visit_stmt_block,
+                visit_stmt_proc,
+                visit_stmt_return,
+                visit_stmt_exit,
+                visit_stmt_extern_proc,
+                visit_stmt_if,
+                visit_stmt_while,
+                visit_stmt_for,
+                visit_stmt_break,
+                visit_stmt_continue,
+                visit_stmt_struct,
+                visit_stmt_module,
+                visit_stmt_import,
+                visit_stmt_embed,
+                visit_stmt_empty
+        );
+}
+
+static void
+add_module(module *m)
+{
+        // Interface-only modules have no bodies to look at, but
+        // their code is not generated here either.
+        if (!m->program) return;
+
+        reach_context ctx = {m->tbl, NULL};
+        visitor *v = reach_visitor_alloc(&ctx);
+
+        for (size_t i = 0; i < m->program->stmts.len; ++i) {
+                accept_stmt(m->program->stmts.data[i], v);
+        }
+
+        free(v);
+}
+
+// Returns 1 if `sym` is a proc that was not live yet.
+static int
+mark(const char *sym, str_array *work)
+{
+        if (smap_has(&g_live, sym)) return 0;
+        smap_insert(&g_live, sym, (void *)1);
+        dyn_array_append(*work, strdup(sym));
+        return smap_has(&g_graph, sym);
+}
+
+void
+reach_compute(const module_array *mods, size_t n)
+{
+        if (g_graph.tbl.entries) smap_free(&g_graph);
+        if (g_live.tbl.entries) smap_free(&g_live);
+        g_graph = smap_create(NULL);
+        g_live  = smap_create(NULL);
+
+        smap seen = smap_create(NULL);
+        str_array work = dyn_array_empty(str_array);
+
+        for (size_t i = 0; i < n; ++i) {
+                for (size_t j = 0; j < mods[i].len; ++j) {
+                        module *m = mods[i].data[j];
+                        if (smap_has(&seen, m->path)) continue;
+                        smap_insert(&seen, m->path, m);
+                        add_module(m);
+                }
+        }
+
+        size_t nprocs = smap_size(&g_graph);
+        size_t nlive  = 0;
+
+        for (size_t i = 0; i < n; ++i) {
+                module *entry = mods[i].data[mods[i].len-1];
+                if (!entry->program) continue;
+
+                program *p = entry->program;
+                for (size_t j = 0; j < p->stmts.len; ++j) {
+                        if (p->stmts.data[j]->kind != STMT_KIND_PROC) continue;
+                        stmt_proc *s = (stmt_proc *)p->stmts.data[j];
+                        if (!s->export && strcmp(s->id->lx, "_start") && strcmp(s->id->lx, "main")) continue;
+
+                        char *sym = reach_symbol(entry->tbl->modname, s->id->lx);
+                        nlive += mark(sym, &work);
+                        free(sym);
+                }
+        }
+
+        while (work.len > 0) {
+                char *sym = work.data[--work.len];
+                str_array *refs = (str_array *)smap_get(&g_graph, sym);
+                for (size_t i = 0; refs && i < refs->len; ++i) {
+                        nlive += mark(refs->data[i], &work);
+                }
+                free(sym);
+        }
+
+        if (g_config.flags & FLAG_TYPE_VERBOSE) {
+                printf("reachable: %zu of %zu procedures\n", nlive, nprocs);
+        }
+
+        dyn_array_free(work);
+        smap_free(&seen);
+
+        g_done = 1;
+}
@@ -0,0 +1,361 @@
+#include "regalloc.h"
+#include "x64.h"
+#include "mem.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define BIT(r) (1u << (r))
+
+// Handed out in this order, so that what does not need to
+// survive a call does not cost a callee-saved register.
+static const x64_reg g_regs[] = {
+        X64_RSI, X64_RDI, X64_R8, X64_R9, X64_R10,
+        X64_RBX, X64_R12, X64_R13, X64_R14, X64_R15,
+};
+
+#define NREGS ((int)(sizeof(g_regs) / sizeof(g_regs[0])))
+
+#define CALLER_SAVED (BIT(X64_RSI) | BIT(X64_RDI) | BIT(X64_R8) | BIT(X64_R9) | BIT(X64_R10))
+#define CALLEE_SAVED (BIT(X64_RBX) | BIT(X64_R12) | BIT(X64_R13) | BIT(X64_R14) | BIT(X64_R15))
+
+static const x64_reg g_arg_regs[] = {X64_RDI, X64_RSI, X64_RDX, X64_RCX, X64_R8, X64_R9};
+
+// Instruction k of the procedure, counting through the blocks
+// in order, reads its operands at 2k and writes its result at
+// 2k+1. An interval is from the first to the last position at
+// which its virtual register is live, holes and all.
+typedef struct {
+        int v;
+        int start, end;
+} interval;
+
+typedef struct {
+        const ir_proc *p;
+        regalloc *ra;
+        int nwords;        // of a set of virtual registers
+        uint64_t *in;      // live on entry to every block
+        uint64_t *out;     // and on exit
+        interval *iv;      // of every virtual register, start -1 if it has none
+        uint32_t *avoid;   // registers that must not hold it
+        int8_t *hint;      // the register it would best be in, or X64_NOREG
+} ra_context;
+
+static uint64_t *
+set_of(ra_context *ctx, uint64_t *sets, size_t i)
+{
+        return sets + i * ctx->nwords;
+}
+
+static int
+set_has(const uint64_t *s, int v)
+{
+        return (s[v / 64] >> (v % 64)) & 1;
+}
+
+static void
+set_add(uint64_t *s, int v)
+{
+        s[v / 64] |= (uint64_t)1 << (v % 64);
+}
+
+static void
+set_del(uint64_t *s, int v)
+{
+        s[v / 64] &= ~((uint64_t)1 << (v % 64));
+}
+
+// live = what is live before `in` given what is after it.
+static void
+step_back(uint64_t *live, const ir_insn *in)
+{
+        if (in->dst >= 0) {
+                set_del(live, in->dst);
+        }
+        for (int i = 0; i < ir_nuses(in); ++i) {
+                int v = ir_use(in, i);
+                if (v >= 0) set_add(live, v);
+        }
+}
+
+// The classic fixed point, backwards over the blocks.
+static void
+liveness(ra_context *ctx)
+{
+        const ir_proc *p = ctx->p;
+        uint64_t *live = (uint64_t *)alloc(ctx->nwords * sizeof(uint64_t));
+        int changed = 1;
+
+        while (changed) {
+                changed = 0;
+                for (size_t i = p->blocks.len; i-- > 0;) {
+                        const ir_block *b = &p->blocks.data[i];
+                        uint64_t *out = set_of(ctx, ctx->out, i);
+                        uint64_t *in = set_of(ctx, ctx->in, i);
+
+                        for (int k = 0; k < 2; ++k) {
+                                if (b->succ[k] < 0) continue;
+                                const uint64_t *sin = set_of(ctx, ctx->in, b->succ[k]);
+                                for (int w = 0; w < ctx->nwords; ++w) {
+                                        out[w] |= sin[w];
+                                }
+                        }
+
+                        memcpy(live, out, ctx->nwords * sizeof(uint64_t));
+                        for (size_t j = b->insns.len; j-- > 0;) {
+                                step_back(live, &b->insns.data[j]);
+                        }
+                        if (memcmp(live, in, ctx->nwords * sizeof(uint64_t))) {
+                                memcpy(in, live, ctx->nwords * sizeof(uint64_t));
+                                changed = 1;
+                        }
+                }
+        }
+
+        free(live);
+}
+
+static void
+extend(ra_context *ctx, int v, int pos)
+{
+        interval *iv = &ctx->iv[v];
+        if (iv->start < 0) {
+                iv->start = iv->end = pos;
+        } else {
+                if (pos < iv->start) iv->start = pos;
+                if (pos > iv->end) iv->end = pos;
+        }
+}
+
+// Registers that `in` writes behind the allocator's back.
+static uint32_t
+clobbers(const ir_insn *in)
+{
+        switch (in->op) {
+        case IR_CALL:  return CALLER_SAVED;
+        case IR_ZERO:  return BIT(X64_RDI);
+        case IR_EMBED: return CALLER_SAVED | CALLEE_SAVED;
+        default:       return 0;
+        }
+}
+
+static void
+avoid_live(ra_context *ctx, const uint64_t *live, uint32_t regs)
+{
+        for (int w = 0; w < ctx->nwords; ++w) {
+                for (uint64_t bits = live[w]; bits; bits &= bits - 1) {
+                        ctx->avoid[w * 64 + __builtin_ctzll(bits)] |= regs;
+                }
+        }
+}
+
+// The intervals, and what each must avoid: a value that is
+// live across an instruction cannot be in a register that it
+// clobbers, and until the parameters are all read their
+// registers belong to them.
+static void
+build_intervals(ra_context *ctx)
+{
+        const ir_proc *p = ctx->p;
+        uint64_t *live = (uint64_t *)alloc(ctx->nwords * sizeof(uint64_t));
+        int k = 0;
+
+        for (size_t i = 0; i < p->blocks.len; ++i) {
+                k += (int)p->blocks.data[i].insns.len;
+        }
+
+        for (size_t i = p->blocks.len; i-- > 0;) {
+                const ir_block *b = &p->blocks.data[i];
+                uint32_t params = 0;
+                int last = k - 1;
+                k -= (int)b->insns.len;
+
+                memcpy(live, set_of(ctx, ctx->out, i), ctx->nwords * sizeof(uint64_t));
+                for (int v = 0; v < p->nvregs; ++v) {
+                        if (set_has(live, v)) extend(ctx, v, 2 * last + 1);
+                }
+
+                for (size_t j = b->insns.len; j-- > 0;) {
+                        const ir_insn *in = &b->insns.data[j];
+                        int pos = 2 * (k + (int)j);
+                        uint32_t regs = params;
+
+                        if (in->dst >= 0) {
+                                extend(ctx, in->dst, pos + 1);
+                                ctx->avoid[in->dst] |= params;
+                                set_del(live, in->dst);
+                        }
+                        regs |= clobbers(in);
+                        if (regs) {
+                                avoid_live(ctx, live, regs);
+                        }
+                        if (in->op == IR_PARAM) {
+                                params |= BIT(g_arg_regs[in->imm]);
+                                ctx->hint[in->dst] = (int8_t)g_arg_regs[in->imm];
+                        }
+                        if (in->op == IR_CALL) {
+                                for (int a = 0; a < in->nargs; ++a) {
+                                        ctx->hint[in->args[a]] = (int8_t)g_arg_regs[a];
+                                }
+                        }
+
+                        for (int u = 0; u < ir_nuses(in); ++u) {
+                                int v = ir_use(in, u);
+                                if (v >= 0) {
+                                        extend(ctx, v, pos);
+                                        set_add(live, v);
+                                }
+                        }
+                }
+
+                for (int v = 0; v < p->nvregs; ++v) {
+                        if (set_has(live, v)) extend(ctx, v, 2 * k);
+                }
+        }
+
+        free(live);
+}
+
+static int
+by_start(const void *a, const void *b)
+{
+        const interval *x = (const interval *)a;
+        const interval *y = (const interval *)b;
+        if (x->start != y->start) return x->start < y->start ? -1 : 1;
+        return x->v - y->v;
+}
+
+static void
+spill(regalloc *ra, int v)
+{
+        ra->reg[v] = X64_NOREG;
+        ra->slot[v] = ra->nslots++;
+}
+
+// Poletto and Sarkar's linear scan: through the intervals by
+// their start, expiring those that ended, and when no register
+// is free, spilling whichever of the interval and those it
+// could take a register from ends last.
+static void
+scan(ra_context *ctx)
+{
+        regalloc *ra = ctx->ra;
+        interval *sorted = (interval *)alloc((ctx->p->nvregs + 1) * sizeof(interval));
+        interval active[NREGS];
+        int nsorted = 0, nactive = 0;
+        uint32_t used = 0;
+
+        for (int v = 0; v < ctx->p->nvregs; ++v) {
+                if (ctx->iv[v].start >= 0) {
+                        sorted[nsorted++] = ctx->iv[v];
+                }
+        }
+        qsort(sorted, nsorted, sizeof(interval), by_start);
+
+        for (int i = 0; i < nsorted; ++i) {
+                const interval *cur = &sorted[i];
+                uint32_t allowed = (CALLER_SAVED | CALLEE_SAVED) & ~ctx->avoid[cur->v];
+                uint32_t busy = 0;
+                int n = 0;
+
+                for (int j = 0; j < nactive; ++j) {
+                        if (active[j].end >= cur->start) {
+                                active[n++] = active[j];
+                                busy |= BIT(ra->reg[active[j].v]);
+                        }
+                }
+                nactive = n;
+
+                int reg = ctx->hint[cur->v];
+                if (reg == X64_NOREG || !(allowed & BIT(reg)) || (busy & BIT(reg))) {
+                        reg = X64_NOREG;
+                }
+                for (int j = 0; reg == X64_NOREG && j < NREGS; ++j) {
+                        if ((allowed & BIT(g_regs[j])) && !(busy & BIT(g_regs[j]))) {
+                                reg = g_regs[j];
+                                break;
+                        }
+                }
+
+                if (reg == X64_NOREG) {
+                        int victim = -1;
+                        for (int j = 0; j < nactive; ++j) {
+                                if ((allowed & BIT(ra->reg[active[j].v]))
+                                    && (victim < 0 || active[j].end > active[victim].end)) {
+                                        victim = j;
+                                }
+                        }
+                        if (victim < 0 || active[victim].end <= cur->end) {
+                                spill(ra, cur->v);
+                                continue;
+                        }
+                        reg = ra->reg[active[victim].v];
+                        spill(ra, active[victim].v);
+                        active[victim] = active[--nactive];
+                }
+
+                ra->reg[cur->v] = (int8_t)reg;
+                active[nactive++] = *cur;
+                used |= BIT(reg);
+        }
+
+        for (int j = 0; j < NREGS; ++j) {
+                if ((used & CALLEE_SAVED & BIT(g_regs[j]))) {
+                        ra->saved[ra->nsaved++] = (int8_t)g_regs[j];
+                }
+        }
+
+        free(sorted);
+}
+
+regalloc *
+regalloc_run(const ir_proc *p)
+{
+        ra_context ctx;
+        size_t nv = p->nvregs ? p->nvregs : 1;
+
+        ctx.p = p;
+        ctx.nwords = (int)((nv + 63) / 64);
+        ctx.in = (uint64_t *)alloc(p->blocks.len * ctx.nwords * sizeof(uint64_t));
+        ctx.out = (uint64_t *)alloc(p->blocks.len * ctx.nwords * sizeof(uint64_t));
+        ctx.iv = (interval *)alloc(nv * sizeof(interval));
+        ctx.avoid = (uint32_t *)alloc(nv * sizeof(uint32_t));
+        ctx.hint = (int8_t *)alloc(nv * sizeof(int8_t));
+        memset(ctx.in, 0, p->blocks.len * ctx.nwords * sizeof(uint64_t));
+        memset(ctx.out, 0, p->blocks.len * ctx.nwords * sizeof(uint64_t));
+        memset(ctx.avoid, 0, nv * sizeof(uint32_t));
+        for (size_t v = 0; v < nv; ++v) {
+                ctx.iv[v].v = (int)v;
+                ctx.iv[v].start = ctx.iv[v].end = -1;
+                ctx.hint[v] = X64_NOREG;
+        }
+
+        regalloc *ra = (regalloc *)alloc(sizeof(regalloc));
+        memset(ra, 0, sizeof(regalloc));
+        ra->reg = (int8_t *)alloc(nv * sizeof(int8_t));
+        ra->slot = (int *)alloc(nv * sizeof(int));
+        for (size_t v = 0; v < nv; ++v) {
+                ra->reg[v] = X64_NOREG;
+                ra->slot[v] = -1;
+        }
+        ctx.ra = ra;
+
+        liveness(&ctx);
+        build_intervals(&ctx);
+        scan(&ctx);
+
+        free(ctx.in);
+        free(ctx.out);
+        free(ctx.iv);
+        free(ctx.avoid);
+        free(ctx.hint);
+        return ra;
+}
+
+void
+regalloc_free(regalloc *ra)
+{
+        free(ra->reg);
+        free(ra->slot);
+        free(ra);
+}
@@ -4,8 +4,10 @@
 #include "ds/smap.h"
 #include "grammar.h"
 #include "lexer.h"
-#include "io.h"
+#include "modcache.h"
 #include "utils.h"
+#include "global.h"
+#include "flags.h"
 
 #include <forge/array.h>
 #include <forge/utils.h>
@@ -33,6 +35,15 @@ pusherr(symtbl *tbl, loc loc, const char *fmt, ...)
         dyn_array_append(tbl->errs, strdup(buf));
 }
 
+static void
+add_extern(symtbl *tbl, const char *id)
+{
+        for (size_t i = 0; i < tbl->externs.len; ++i) {
+                if (!strcmp(tbl->externs.data[i], id)) return;
+        }
+        dyn_array_append(tbl->externs, strdup(id));
+}
+
 static void
 push_scope(symtbl *tbl)
 {
@@ -200,6 +211,18 @@ visit_expr_identifier(visitor *v, expr_identifier *e)
                 sym *sym = get_sym_from_scope(tbl, e->id->lx);
                 ((expr *)e)->type = sym->ty;
                 e->resolved = sym;
+
+                // Unless a library given with -l has it, there is
+                // nothing for an extern procedure to be bound to.
+                if (sym->extern_ && (g_config.flags & FLAG_TYPE_NOLIBC) && !g_config.link_libs.len) {
+                        pusherr(tbl, ((expr *)e)->loc, "extern procedure `%s` cannot be used with --%s",
+                                e->id->lx, FLAG_2HY_NOLIBC);
+                }
+                // Through a namespace, the use is the importer's,
+                // see visit_expr_namespace().
+                if (sym->extern_ && !tbl->context_switch) {
+                        add_extern(tbl, e->id->lx);
+                }
         }
 
         return NULL;
@@ -405,6 +428,37 @@ visit_expr_brace_init(visitor *v, expr_brace_init *e)
         return NULL;
 }
 
+// Loads the wildcard-imported module named `modname`, if any.
+static symtbl *
+load_lazy_import(symtbl *tbl, const char *modname)
+{
+        for (size_t i = 0; i < tbl->lazy_imports.len; ++i) {
+                lazy_import li = tbl->lazy_imports.data[i];
+                if (strcmp(li.modname, modname)) continue;
+
+                for (size_t j = i+1; j < tbl->lazy_imports.len; ++j) {
+                        tbl->lazy_imports.data[j-1] = tbl->lazy_imports.data[j];
+                }
+                --tbl->lazy_imports.len;
+                free(li.modname);
+
+                module *m = modcache_load(li.filepath, &((stmt *)li.stmt)->loc);
+
+                dyn_array_append(tbl->imports, m->tbl);
+                dyn_array_append(li.stmt->resolved_modnames, m->tbl->modname);
+                dyn_array_append(li.stmt->resolved_tbls, m->tbl);
+
+                // The header said otherwise, keep looking.
+                if (strcmp(m->tbl->modname, modname)) {
+                        return load_lazy_import(tbl, modname);
+                }
+
+                return m->tbl;
+        }
+
+        return NULL;
+}
+
 static void *
 visit_expr_namespace(visitor *v, expr_namespace *e)
 {
@@ -420,6 +474,10 @@ visit_expr_namespace(visitor *v, expr_namespace *e)
                 }
         }
 
+        if (!other) {
+                other = load_lazy_import(tbl, e->namespace->lx);
+        }
+
         if (!other) {
                 pusherr(tbl, ((expr *)e)->loc, "module `%s` was not found", e->namespace->lx);
                 ((expr *)e)->type = (type *)type_unknown_alloc();
@@ -441,6 +499,17 @@ visit_expr_namespace(visitor *v, expr_namespace *e)
         other->context_switch = 0;
         v->context = (void *)tbl;
 
+        const expr *id = e->e;
+        if (id->kind == EXPR_KIND_PROCCALL) {
+                id = ((const expr_proccall *)id)->lhs;
+        }
+        if (id->kind == EXPR_KIND_IDENTIFIER) {
+                const sym *sym = ((const expr_identifier *)id)->resolved;
+                if (sym && sym->extern_) {
+                        add_extern(tbl, sym->id);
+                }
+        }
+
         if (other->errs.len > 0) {
                 for (size_t i = 0; i < other->errs.len; ++i) {
                         fprintf(stderr, "%s\n", other->errs.data[i]);
@@ -998,13 +1067,22 @@ visit_stmt_import(visitor *v, stmt_import *s)
         symtbl *tbl = (symtbl *)v->context;
 
         for (size_t i = 0; i < s->filepaths.len; ++i) {
-                char    *src        = read_file_from_searchpaths(&s->filepaths.data[i], &((stmt *)s)->loc);
-                lexer    l          = lexer_create(src, s->filepaths.data[i]);
-                program *p          = parser_create_program(&l);
-                symtbl  *import_tbl = sem_analysis(p);
+                if (s->wildcard) {
+                        char *modname = modcache_modname(s->filepaths.data[i]);
+                        if (modname) {
+                                lazy_import li = {modname, s->filepaths.data[i], s};
+                                dyn_array_append(tbl->lazy_imports, li);
+                                continue;
+                        }
+                        // Could not tell, load it to find out.
+                }
+
+                module *m          = modcache_load(s->filepaths.data[i], &((stmt *)s)->loc);
+                symtbl *import_tbl = m->tbl;
 
                 dyn_array_append(tbl->imports, import_tbl);
                 dyn_array_append(s->resolved_modnames, import_tbl->modname);
+                dyn_array_append(s->resolved_tbls, import_tbl);
         }
 
         return NULL;
@@ -1047,6 +1125,10 @@ visit_stmt_embed(visitor *v, stmt_embed *s)
                                 free(s->lns.data[i]->lx);
                                 forge_str_destroy(&name_buf);
                                 s->lns.data[i]->lx = newln.data;
+
+                                // `ln` is gone, and the reference was
+                                // the end of the line anyway.
+                                break;
                         }
                 }
         }
@@ -1112,14 +1194,17 @@ sem_analysis(program *p)
         tbl->program        = p;
         tbl->proc.type      = NULL;
         tbl->proc.inproc    = 0;
+        tbl->proc.rsp       = 0;
         tbl->errs           = dyn_array_empty(str_array);
         tbl->stack_offset   = 0;
         tbl->loop           = NULL;
         tbl->imports.data   = NULL;
         tbl->imports.len    = 0;
         tbl->imports.cap    = 0;
+        tbl->lazy_imports   = dyn_array_empty(lazy_import_array);
         tbl->context_switch = 0;
         tbl->export_syms    = dyn_array_empty(sym_array);
+        tbl->externs        = dyn_array_empty(str_array);
         tbl->expty          = NULL;
 
         // Need to immediately add a scope for global scope.
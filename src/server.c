@@ -0,0 +1,575 @@
+// struct ucred, SO_PEERCRED
+#define _GNU_SOURCE
+
+#include "server.h"
+#include "modcache.h"
+#include "global.h"
+#include "ds/smap.h"
+
+#include <forge/array.h>
+#include <forge/err.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Wire format
+//   request:  u32 argc, then cwd and each of argv as (u32 len, bytes)
+//   response: frames of (u8 tag, u32 len, bytes) where tag is one of
+//             FRAME_STDOUT, FRAME_STDERR or FRAME_EXIT (len = 4, i32 status).
+#define FRAME_STDOUT '1'
+#define FRAME_STDERR '2'
+#define FRAME_EXIT   'x'
+
+static int
+write_all(int fd, const void *buf, size_t n)
+{
+        const char *p = (const char *)buf;
+        while (n > 0) {
+                ssize_t w = write(fd, p, n);
+                if (w < 0 && errno == EINTR) continue;
+                if (w <= 0) return 0;
+                p += w;
+                n -= (size_t)w;
+        }
+        return 1;
+}
+
+static int
+read_all(int fd, void *buf, size_t n)
+{
+        char *p = (char *)buf;
+        while (n > 0) {
+                ssize_t r = read(fd, p, n);
+                if (r < 0 && errno == EINTR) continue;
+                if (r <= 0) return 0;
+                p += r;
+                n -= (size_t)r;
+        }
+        return 1;
+}
+
+static int
+write_str(int fd, const char *s)
+{
+        uint32_t n = (uint32_t)strlen(s);
+        return write_all(fd, &n, sizeof(n)) && write_all(fd, s, n);
+}
+
+static char *
+read_str(int fd)
+{
+        uint32_t n;
+        if (!read_all(fd, &n, sizeof(n)) || n > PATH_MAX*16) return NULL;
+        char *s = (char *)malloc(n+1);
+        if (!read_all(fd, s, n)) {
+                free(s);
+                return NULL;
+        }
+        s[n] = 0;
+        return s;
+}
+
+static int
+write_frame(int fd, char tag, const void *buf, uint32_t n)
+{
+        return write_all(fd, &tag, 1)
+                && write_all(fd, &n, sizeof(n))
+                && write_all(fd, buf, n);
+}
+
+// $XDG_RUNTIME_DIR is only the user's already. Without it,
+// the socket goes in a directory of our own under /tmp, which
+// nobody else can create first or put a socket in.
+static const char *
+default_dir(void)
+{
+        static char buf[PATH_MAX] = {0};
+        const char *xdg = getenv("XDG_RUNTIME_DIR");
+        if (xdg && *xdg) {
+                snprintf(buf, sizeof(buf), "%s", xdg);
+        } else {
+                snprintf(buf, sizeof(buf), "/tmp/cruc-%d", (int)getuid());
+        }
+        return buf;
+}
+
+const char *
+server_default_socket(void)
+{
+        static char buf[PATH_MAX] = {0};
+        const char *env = getenv("CRUC_SOCKET");
+        if (env) return env;
+        snprintf(buf, sizeof(buf), "%s/cruc.sock", default_dir());
+        return buf;
+}
+
+// Makes `dir` if need be, and checks that only we can use it.
+static void
+private_dir(const char *dir)
+{
+        struct stat st;
+
+        if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+                forge_err_wargs("could not create `%s`: %s", dir, strerror(errno));
+        }
+        if (lstat(dir, &st) != 0 || !S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077)) {
+                forge_err_wargs("`%s` is not a directory only this user can access", dir);
+        }
+}
+
+// Whether the other end of `fd` runs as the same user as us.
+static int
+same_user(int fd)
+{
+        struct ucred cred;
+        socklen_t len = sizeof(cred);
+
+        return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == getuid();
+}
+
+static int
+connect_to(const char *sockpath)
+{
+        struct sockaddr_un addr = {0};
+        addr.sun_family = AF_UNIX;
+        if (strlen(sockpath) >= sizeof(addr.sun_path)) {
+                forge_err_wargs("socket path `%s` is too long", sockpath);
+        }
+        strcpy(addr.sun_path, sockpath);
+
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) return -1;
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+                close(fd);
+                return -1;
+        }
+        if (!same_user(fd)) {
+                fprintf(stderr, "ignoring the server at `%s`, it runs as another user\n", sockpath);
+                close(fd);
+                return -1;
+        }
+        return fd;
+}
+
+/*** Server ***/
+
+// What a successful child tells us about the modules it
+// had to load, so that we can load them too.
+//   C <working directory>
+//   I <search path>
+//   B <build directory>
+//   S <prebuilt std directory>
+//   M <hash> <realpath>
+static void
+report(int fd)
+{
+        char cwd[PATH_MAX];
+        FILE *f = fdopen(fd, "w");
+        if (!f) return;
+
+        if (getcwd(cwd, sizeof(cwd))) {
+                fprintf(f, "C %s\n", cwd);
+        }
+
+        for (size_t i = 0; i < g_config.search_paths.len; ++i) {
+                fprintf(f, "I %s\n", g_config.search_paths.data[i]);
+        }
+        if (g_config.build_dir) {
+                fprintf(f, "B %s\n", g_config.build_dir);
+        }
+        if (g_config.std_dir) {
+                fprintf(f, "S %s\n", g_config.std_dir);
+        }
+
+        module_array misses = modcache_misses();
+        for (size_t i = 0; i < misses.len; ++i) {
+                fprintf(f, "M %016" PRIx64 " %s\n", misses.data[i]->hash, misses.data[i]->path);
+        }
+
+        fclose(f);
+}
+
+static void
+warm(char *rep, const char *server_cwd)
+{
+        char     *cwd          = NULL;
+        str_array search_paths = dyn_array_empty(str_array);
+        char     *build_dir    = NULL;
+        char     *std_dir      = NULL;
+        str_array paths        = dyn_array_empty(str_array);
+        smap      expect       = smap_create(NULL);
+
+        for (char *ln = strtok(rep, "\n"); ln; ln = strtok(NULL, "\n")) {
+                if (ln[0] == 'C' && ln[1] == ' ') {
+                        cwd = ln+2;
+                } else if (ln[0] == 'I' && ln[1] == ' ') {
+                        dyn_array_append(search_paths, ln+2);
+                } else if (ln[0] == 'B' && ln[1] == ' ') {
+                        build_dir = ln+2;
+                } else if (ln[0] == 'S' && ln[1] == ' ') {
+                        std_dir = ln+2;
+                } else if (ln[0] == 'M' && ln[1] == ' ') {
+                        char *end = NULL;
+                        uint64_t *hash = (uint64_t *)malloc(sizeof(uint64_t));
+                        *hash = strtoull(ln+2, &end, 16);
+                        if (!end || *end != ' ') {
+                                free(hash);
+                                continue;
+                        }
+                        smap_insert(&expect, end+1, hash);
+                        dyn_array_append(paths, end+1);
+                }
+        }
+
+        if (!cwd || chdir(cwd) != 0) goto done;
+
+        str_array saved_search_paths = g_config.search_paths;
+        char     *saved_build_dir    = g_config.build_dir;
+        char     *saved_std_dir      = g_config.std_dir;
+        g_config.search_paths        = search_paths;
+        g_config.build_dir           = build_dir;
+        g_config.std_dir             = std_dir;
+
+        modcache_begin();
+        for (size_t i = 0; i < paths.len; ++i) {
+                uint64_t *hash = (uint64_t *)smap_get(&expect, paths.data[i]);
+                if (!modcache_warm(paths.data[i], *hash, &expect)) break;
+        }
+
+        g_config.search_paths = saved_search_paths;
+        g_config.build_dir    = saved_build_dir;
+        g_config.std_dir      = saved_std_dir;
+
+        if (chdir(server_cwd) != 0) {
+                perror("chdir");
+                exit(1);
+        }
+
+ done:
+        for (size_t i = 0; i < paths.len; ++i) {
+                free(smap_get(&expect, paths.data[i]));
+        }
+        smap_free(&expect);
+        dyn_array_free(search_paths);
+        dyn_array_free(paths);
+}
+
+// Runs in a process of its own for every connection. The
+// compilation reports to `rep` if it succeeds, which stays
+// open until this process exits.
+static void
+serve(int conn, server_compile_fn compile, int rep)
+{
+        uint32_t argc;
+        if (!read_all(conn, &argc, sizeof(argc)) || argc == 0 || argc > 4096) return;
+
+        char *cwd = read_str(conn);
+        if (!cwd) return;
+
+        char **argv = (char **)calloc(argc+1, sizeof(char *));
+        for (uint32_t i = 0; i < argc; ++i) {
+                if (!(argv[i] = read_str(conn))) goto done;
+        }
+
+        int out[2], err[2];
+        if (pipe(out) != 0 || pipe(err) != 0) {
+                perror("pipe");
+                exit(1);
+        }
+
+        fflush(stdout);
+        fflush(stderr);
+
+        pid_t pid = fork();
+        if (pid < 0) {
+                perror("fork");
+                exit(1);
+        }
+
+        if (pid == 0) {
+                close(conn);
+                close(out[0]);
+                close(err[0]);
+                dup2(out[1], STDOUT_FILENO);
+                dup2(err[1], STDERR_FILENO);
+                close(out[1]);
+                close(err[1]);
+                signal(SIGPIPE, SIG_DFL);
+
+                if (chdir(cwd) != 0) {
+                        fprintf(stderr, "could not change directory to `%s`: %s\n", cwd, strerror(errno));
+                        exit(1);
+                }
+
+                int status = compile((int)argc, argv);
+                fflush(stdout);
+                fflush(stderr);
+                if (status == 0) report(rep);
+                exit(status);
+        }
+
+        close(out[1]);
+        close(err[1]);
+
+        // Relay output as it comes.
+        struct pollfd fds[2] = {
+                { .fd = out[0], .events = POLLIN },
+                { .fd = err[0], .events = POLLIN },
+        };
+        const char tags[2] = { FRAME_STDOUT, FRAME_STDERR };
+        int open_fds = 2;
+
+        while (open_fds > 0) {
+                if (poll(fds, 2, -1) < 0) {
+                        if (errno == EINTR) continue;
+                        perror("poll");
+                        break;
+                }
+                for (size_t i = 0; i < 2; ++i) {
+                        if (fds[i].fd < 0 || !fds[i].revents) continue;
+
+                        char buf[4096];
+                        ssize_t n = read(fds[i].fd, buf, sizeof(buf));
+                        if (n < 0 && errno == EINTR) continue;
+                        if (n <= 0) {
+                                close(fds[i].fd);
+                                fds[i].fd = -1;
+                                --open_fds;
+                                continue;
+                        }
+
+                        // Keep draining even if the client is gone.
+                        (void)write_frame(conn, tags[i], buf, (uint32_t)n);
+                }
+        }
+
+        int wstatus = 0;
+        while (waitpid(pid, &wstatus, 0) < 0 && errno == EINTR)
+                ;
+
+        int32_t status = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 128+WTERMSIG(wstatus);
+        (void)write_frame(conn, FRAME_EXIT, &status, sizeof(status));
+
+ done:
+        for (uint32_t i = 0; i < argc; ++i) free(argv[i]);
+        free(argv);
+        free(cwd);
+}
+
+// A connection being served, and what its compilation has
+// reported so far.
+typedef struct {
+        pid_t  pid;
+        int    fd;
+        char  *buf;
+        size_t n;
+} session;
+
+DYN_ARRAY_TYPE(session, session_array);
+
+// Reads what is there from the report of `s`. Returns 0 once
+// it is complete.
+static int
+collect(session *s)
+{
+        char buf[4096];
+        ssize_t n = read(s->fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) return 1;
+        if (n <= 0) return 0;
+
+        s->buf = (char *)realloc(s->buf, s->n+n+1);
+        memcpy(s->buf+s->n, buf, n);
+        s->n += n;
+        s->buf[s->n] = 0;
+        return 1;
+}
+
+// Hands `conn` to a process of its own, so that the next
+// client does not wait for this one.
+static void
+start_session(int listener, int conn, server_compile_fn compile, session_array *sessions)
+{
+        int rep[2];
+        if (pipe(rep) != 0) {
+                perror("pipe");
+                exit(1);
+        }
+
+        fflush(stdout);
+        fflush(stderr);
+
+        pid_t pid = fork();
+        if (pid < 0) {
+                perror("fork");
+                exit(1);
+        }
+
+        if (pid == 0) {
+                close(listener);
+                close(rep[0]);
+                for (size_t i = 0; i < sessions->len; ++i) {
+                        close(sessions->data[i].fd);
+                }
+                serve(conn, compile, rep[1]);
+                _exit(0);
+        }
+
+        close(rep[1]);
+        dyn_array_append(*sessions, ((session){ .pid = pid, .fd = rep[0], .buf = NULL, .n = 0 }));
+}
+
+void
+server_run(const char *sockpath, server_compile_fn compile)
+{
+        char server_cwd[PATH_MAX];
+        if (!getcwd(server_cwd, sizeof(server_cwd))) {
+                perror("getcwd");
+                exit(1);
+        }
+
+        struct sockaddr_un addr = {0};
+        addr.sun_family = AF_UNIX;
+        if (strlen(sockpath) >= sizeof(addr.sun_path)) {
+                forge_err_wargs("socket path `%s` is too long", sockpath);
+        }
+        strcpy(addr.sun_path, sockpath);
+
+        if (!strcmp(sockpath, server_default_socket()) && !getenv("CRUC_SOCKET")) {
+                private_dir(default_dir());
+        }
+
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+                perror("socket");
+                exit(1);
+        }
+
+        // A stale socket from a previous server is fine to
+        // replace, a live one is not.
+        int live = connect_to(sockpath);
+        if (live >= 0) {
+                close(live);
+                forge_err_wargs("a server is already listening on `%s`", sockpath);
+        }
+        unlink(sockpath);
+
+        mode_t mask = umask(077);
+        if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 16) != 0) {
+                fprintf(stderr, "could not listen on `%s`: %s\n", sockpath, strerror(errno));
+                exit(1);
+        }
+        umask(mask);
+
+        signal(SIGPIPE, SIG_IGN);
+
+        printf("cruc: listening on %s\n", sockpath);
+        fflush(stdout);
+
+        session_array sessions = dyn_array_empty(session_array);
+        struct pollfd *fds = NULL;
+
+        while (1) {
+                fds = (struct pollfd *)realloc(fds, (sessions.len+1) * sizeof(struct pollfd));
+                fds[0] = (struct pollfd){ .fd = fd, .events = POLLIN };
+                for (size_t i = 0; i < sessions.len; ++i) {
+                        fds[i+1] = (struct pollfd){ .fd = sessions.data[i].fd, .events = POLLIN };
+                }
+
+                if (poll(fds, sessions.len+1, -1) < 0) {
+                        if (errno == EINTR) continue;
+                        perror("poll");
+                        exit(1);
+                }
+
+                // Finished compilations first, the sessions started
+                // below fork with what they loaded.
+                for (size_t i = sessions.len; i-- > 0;) {
+                        session *s = &sessions.data[i];
+                        if (!fds[i+1].revents || collect(s)) continue;
+
+                        // The session is exiting.
+                        close(s->fd);
+                        while (waitpid(s->pid, NULL, 0) < 0 && errno == EINTR)
+                                ;
+                        if (s->buf) warm(s->buf, server_cwd);
+                        free(s->buf);
+                        sessions.data[i] = sessions.data[--sessions.len];
+                }
+
+                if (!fds[0].revents) continue;
+
+                int conn = accept(fd, NULL, NULL);
+                if (conn < 0) {
+                        if (errno == EINTR || errno == ECONNABORTED) continue;
+                        perror("accept");
+                        exit(1);
+                }
+                if (same_user(conn)) {
+                        start_session(fd, conn, compile, &sessions);
+                }
+                close(conn);
+        }
+}
+
+/*** Client ***/
+
+int
+client_run(const char *sockpath, int argc, char **argv)
+{
+        int fd = connect_to(sockpath);
+        if (fd < 0) return -1;
+
+        char cwd[PATH_MAX];
+        if (!getcwd(cwd, sizeof(cwd))) {
+                perror("getcwd");
+                exit(1);
+        }
+
+        uint32_t n = (uint32_t)argc;
+        int ok = write_all(fd, &n, sizeof(n)) && write_str(fd, cwd);
+        for (int i = 0; ok && i < argc; ++i) {
+                ok = write_str(fd, argv[i]);
+        }
+
+        while (ok) {
+                char tag;
+                uint32_t len;
+                if (!read_all(fd, &tag, 1) || !read_all(fd, &len, sizeof(len))) break;
+
+                if (tag == FRAME_EXIT) {
+                        int32_t status = 1;
+                        if (len != sizeof(status) || !read_all(fd, &status, sizeof(status))) break;
+                        close(fd);
+                        return status;
+                }
+
+                FILE *stream = tag == FRAME_STDOUT ? stdout : stderr;
+                char buf[4096];
+                while (len > 0) {
+                        uint32_t chunk = len < sizeof(buf) ? len : sizeof(buf);
+                        if (!read_all(fd, buf, chunk)) {
+                                ok = 0;
+                                break;
+                        }
+                        fwrite(buf, 1, chunk, stream);
+                        len -= chunk;
+                }
+                fflush(stream);
+        }
+
+        close(fd);
+        fprintf(stderr, "lost connection to the server at `%s`\n", sockpath);
+        return 1;
+}
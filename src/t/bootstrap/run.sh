@@ -11,7 +11,7 @@ function cleanup() {
     info "Removing Artifacts"
 
     set -x
-    local -a asm_files=($(find . -type f -name '*.asm'))
+    local -a asm_files=($(find . -type f -name '*.asm' -o -type f -name '*.s'))
     if [[ ${#asm_files[@]} -gt 0 ]]; then
         rm -f "${asm_files[@]}"
     fi
@@ -37,13 +37,168 @@ function compile() {
     popd
 }
 
+# The suite is built and run once per assembler, then once
+# more without an executable.
 function run_tests() {
-    info "Compiling Test Suite"
-    set -x; ../../cruc ./main.cr -o TEST.bin --asm --nostd -I ../../; set +x
-    info "Running tests"
-    ./TEST.bin
+    for asm in nasm gas integrated; do
+        info "Compiling Test Suite (${asm})"
+        set -x; ../../cruc ./main.cr -o "TEST-${asm}.bin" --asm --assembler="${asm}" --nostd -I ../../; set +x
+        info "Running tests (${asm})"
+        ./"TEST-${asm}.bin"
+    done
+
+    info "Running tests in memory"
+    set -x; ../../cruc --nostd -I ../../ --run ./main.cr; set +x
+
+    info "Running tests in the interpreter"
+    set -x; ../../cruc --nostd -I ../../ --interp ./main.cr; set +x
+}
+
+# One procedure of many branches, which the optimisers must get
+# through in about linear time.
+function large_proc() {
+    info "Compiling a large procedure"
+    local dir n=1000
+    dir=$(mktemp -d)
+    {
+        echo "module main where"
+        echo "proc big(x: i32): i32"
+        echo "{"
+        echo "        let y: i32 = 0;"
+        for ((i = 0; i < n; ++i)); do
+            echo "        if (x == $i) { y = y + $i; } else { y = y - 1; }"
+        done
+        echo "        return y;"
+        echo "}"
+        echo "export proc _start(void): !"
+        echo "{"
+        echo "        big(1);"
+        echo "        exit;"
+        echo "}"
+    } > "${dir}/big.cr"
+    set -x; timeout 30 ../../cruc "${dir}/big.cr" -o "${dir}/big.bin" --nostd -I ../../; set +x
+    rm -rf "${dir}"
+}
+
+# test/peephole.cr has a case for every rule but push-pop, which
+# generated code gives nothing to do.
+function peephole_rules() {
+    info "Checking the peephole rules"
+    local report
+    set -x; report=$(../../cruc ./main.cr -o TEST-peephole.bin --nostd -I ../../ -v | grep '^peephole: peephole:'); set +x
+    for rule in mov-self store-load copy ext-imm imm cmp-zero setcc-branch identity dead zero; do
+        if [[ "${report}" != *", ${rule} "* ]]; then
+            echo "peephole rule ${rule} was not applied: ${report}"
+            exit 1
+        fi
+    done
+}
+
+# test/dce.cr has code that is never run, which must go without
+# -v, which measures it, changing the code.
+function dce() {
+    info "Checking dead code elimination"
+    local plain report
+    set -x; ../../cruc ./main.cr -o TEST-dce.bin --asm --assembler=nasm --nostd -I ../../; set +x
+    plain=$(cat ./*.cr.asm)
+    set -x; report=$(../../cruc ./main.cr -o TEST-dce.bin --asm --assembler=nasm --nostd -I ../../ -v | grep '^dce: dce:'); set +x
+    if [[ "${plain}" != "$(cat ./*.cr.asm)" ]]; then
+        echo "-v changed the generated code"
+        exit 1
+    fi
+    if [[ "${report}" == "dce: dce: 0 of"* ]]; then
+        echo "nothing was removed: ${report}"
+        exit 1
+    fi
+}
+
+# The depfile names what the suite imports, with a phony target
+# for every import, but not the wildcard imports it never uses.
+function depfile() {
+    info "Checking the depfile"
+    set -x; ../../cruc ./main.cr -o TEST-dep.bin --nostd -I ../../ -MD -MF TEST-dep.d -MT suite -MP; set +x
+    local ok=1
+    head -1 TEST-dep.d | grep -qx 'suite: \\' || ok=0
+    grep -qx '  ./main.cr' TEST-dep.d || ok=0
+    for fp in test/dce.cr helpers/log.cr wild/used.cr; do
+        grep -qx "  ${fp} \\\\" TEST-dep.d && grep -qx "${fp}:" TEST-dep.d || ok=0
+    done
+    grep -qE 'unused|broken' TEST-dep.d && ok=0
+    if [[ ${ok} -eq 0 ]]; then
+        cat TEST-dep.d
+        exit 1
+    fi
+    rm -f TEST-dep.d
+}
+
+# Builds the program in $1 with --build-dir and prints the
+# modules whose objects were rebuilt, then its exit code.
+function rebuild() {
+    local dir="$1"
+    if [[ -d "${dir}/b" ]]; then
+        touch -d '1 minute ago' "${dir}"/b/*
+    fi
+    touch -d '30 seconds ago' "${dir}/stamp"
+    ../../cruc "${dir}/main.cr" -o "${dir}/main.bin" --nostd -I "${dir}" --build-dir "${dir}/b"
+    find "${dir}/b" -name '*.o' -newer "${dir}/stamp" | sed 's|.*/||; s|\.cr-.*||' | sort | tr '\n' ' '
+    "${dir}/main.bin" || echo $?
+}
+
+# With --build-dir, a change to the body of a module rebuilds
+# only its object, and one to its interface its importers too.
+function build_dir() {
+    info "Rebuilding with --build-dir"
+    local dir
+    dir=$(mktemp -d)
+    printf 'module lib where\nexport proc value(void): i32 { return 1; }\n' > "${dir}/lib.cr"
+    printf 'module main where\nimport lib;\nexport proc _start(void): !\n{\n        exit lib::value();\n}\n' > "${dir}/main.cr"
+
+    local -a got want=("lib main 1" "lib 2" "2" "lib main 2")
+    got+=("$(rebuild "${dir}")")
+    sed -i 's/return 1;/return 2;/' "${dir}/lib.cr"
+    got+=("$(rebuild "${dir}")")
+    got+=("$(rebuild "${dir}")")
+    echo 'export proc other(void): i32 { return 3; }' >> "${dir}/lib.cr"
+    got+=("$(rebuild "${dir}")")
+    rm -rf "${dir}"
+
+    for i in "${!want[@]}"; do
+        if [[ "${got[$i]}" != "${want[$i]}" ]]; then
+            echo "build ${i}: rebuilt and returned '${got[$i]}', not '${want[$i]}'"
+            exit 1
+        fi
+    done
+}
+
+# --nolibc rejects libc procedures also in modules reused from
+# their interface, which are not analyzed again.
+function nolibc() {
+    info "Checking --nolibc with --build-dir"
+    local dir out
+    dir=$(mktemp -d)
+    printf 'module lib where\nimport std.binds.c.stdio;\nexport proc hello(void): void { cstdio::printf("hello\\n"); }\n' > "${dir}/lib.cr"
+    printf 'module main where\nimport lib;\nexport proc _start(void): !\n{\n        lib::hello();\n        exit 0;\n}\n' > "${dir}/main.cr"
+
+    set -x; ../../cruc "${dir}/main.cr" -o "${dir}/main.bin" --nostd -I ../../ -I "${dir}" --build-dir "${dir}/b"; set +x
+    for i in 1 2; do
+        if out=$(../../cruc "${dir}/main.cr" -o "${dir}/main.bin" --nostd -I ../../ -I "${dir}" --build-dir "${dir}/b" --nolibc 2>&1); then
+            echo "build ${i}: --nolibc used printf"
+            exit 1
+        fi
+        if [[ "${out}" != *"extern procedure \`printf\` cannot be used with --nolibc"* ]]; then
+            echo "build ${i}: ${out}"
+            exit 1
+        fi
+    done
+    rm -rf "${dir}"
 }
 
 cleanup
 compile
 run_tests
+nolibc
+build_dir
+depfile
+peephole_rules
+dce
+large_proc
@@ -0,0 +1,270 @@
+#include "taskgraph.h"
+#include "mem.h"
+
+#include <forge/array.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+
+enum {
+        TASK_WAITING = 0,
+        TASK_READY,
+        TASK_RUNNING,
+        TASK_DONE,
+};
+
+static task_array g_tasks = dyn_array_empty(task_array);
+static task_array g_ready = dyn_array_empty(task_array);
+static double     g_epoch = 0;
+
+static double
+now(void)
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6 - g_epoch;
+}
+
+static void
+unready(size_t i)
+{
+        for (++i; i < g_ready.len; ++i) {
+                g_ready.data[i-1] = g_ready.data[i];
+        }
+        --g_ready.len;
+}
+
+task *
+sched_add(const char *name, const task_ops *ops, void *data)
+{
+        task *t    = (task *)alloc(sizeof(task));
+        t->name    = strdup(name);
+        t->ops     = ops;
+        t->data    = data;
+        t->deps    = dyn_array_empty(task_array);
+        t->rdeps   = dyn_array_empty(task_array);
+        t->waiting = 0;
+        t->state   = TASK_READY;
+        t->pid     = 0;
+        t->ready   = g_epoch ? now() : 0;
+        t->start   = 0;
+        t->end     = 0;
+
+        dyn_array_append(g_tasks, t);
+        dyn_array_append(g_ready, t);
+
+        return t;
+}
+
+void
+sched_depend(task *t, task *dep)
+{
+        dyn_array_append(t->deps, dep);
+        if (dep->state == TASK_DONE) return;
+
+        dyn_array_append(dep->rdeps, t);
+        if (t->waiting++ == 0) {
+                // No longer ready.
+                for (size_t i = 0; i < g_ready.len; ++i) {
+                        if (g_ready.data[i] == t) {
+                                unready(i);
+                                break;
+                        }
+                }
+                t->state = TASK_WAITING;
+        }
+}
+
+static void
+done(task *t)
+{
+        t->state = TASK_DONE;
+        t->end = now();
+
+        for (size_t i = 0; i < t->rdeps.len; ++i) {
+                task *r = t->rdeps.data[i];
+                if (--r->waiting == 0) {
+                        r->state = TASK_READY;
+                        r->ready = t->end;
+                        dyn_array_append(g_ready, r);
+                }
+        }
+}
+
+// Ready tasks are taken in the order they became ready, which
+// is more or less the order the driver found the work in.
+static task *
+take(task_kind kind)
+{
+        for (size_t i = 0; i < g_ready.len; ++i) {
+                task *t = g_ready.data[i];
+                if (t->ops->kind == kind) {
+                        unready(i);
+                        return t;
+                }
+        }
+        return NULL;
+}
+
+static task *
+running(pid_t pid)
+{
+        for (size_t i = 0; i < g_tasks.len; ++i) {
+                if (g_tasks.data[i]->state == TASK_RUNNING && g_tasks.data[i]->pid == pid) {
+                        return g_tasks.data[i];
+                }
+        }
+        return NULL;
+}
+
+// Returns 0 if nothing was reaped, also when a signal
+// interrupted the wait: the caller just tries again.
+static int
+reap(int block, int *failed)
+{
+        int status = 0;
+        pid_t pid = waitpid(-1, &status, block ? 0 : WNOHANG);
+        if (pid <= 0) {
+                return 0;
+        }
+
+        task *t = running(pid);
+        if (!t) return 1;
+
+        int code = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+        if (t->ops->finish(t, code) != 0) *failed = 1;
+        done(t);
+
+        return 1;
+}
+
+int
+sched_run(int jobs)
+{
+        int failed  = 0;
+        int nprocs  = 0;
+
+        if (jobs < 1) jobs = 1;
+        if (!g_epoch) {
+                g_epoch = now();
+                for (size_t i = 0; i < g_tasks.len; ++i) {
+                        g_tasks.data[i]->ready = 0;
+                }
+        }
+
+        for (;;) {
+                // Keep the process slots full, they run while
+                // we do CPU work below.
+                while (!failed && nprocs < jobs) {
+                        task *t = take(TASK_PROC);
+                        if (!t) break;
+
+                        t->start = now();
+                        long pid = t->ops->run(t);
+                        if (pid < 0) {
+                                failed = 1;
+                                done(t);
+                        } else if (pid == 0) {
+                                if (t->ops->finish(t, 0) != 0) failed = 1;
+                                done(t);
+                        } else {
+                                t->pid = (pid_t)pid;
+                                t->state = TASK_RUNNING;
+                                ++nprocs;
+                        }
+                }
+
+                while (nprocs > 0 && reap(0, &failed)) {
+                        --nprocs;
+                }
+
+                task *t = failed ? NULL : take(TASK_CPU);
+                if (t) {
+                        t->start = now();
+                        t->state = TASK_RUNNING;
+                        if (t->ops->run(t) != 0) failed = 1;
+                        done(t);
+                        continue;
+                }
+
+                if (nprocs > 0) {
+                        if (reap(1, &failed)) --nprocs;
+                        continue;
+                }
+
+                // What the last reap made ready still needs a
+                // process slot.
+                if (!failed && g_ready.len) continue;
+
+                // Either everything is done, or what is left
+                // waits on something that failed.
+                break;
+        }
+
+        return failed;
+}
+
+// What held up `t` the longest: the dependency that finished
+// last, if `t` had to wait for it.
+static task *
+blocker(const task *t)
+{
+        task *b = NULL;
+        for (size_t i = 0; i < t->deps.len; ++i) {
+                if (!b || t->deps.data[i]->end > b->end) b = t->deps.data[i];
+        }
+        return b;
+}
+
+void
+sched_trace(FILE *f)
+{
+        task *last = NULL;
+
+        fprintf(f, "%10s %10s %10s %10s  %s\n", "ready", "start", "end", "ms", "task");
+        for (size_t i = 0; i < g_tasks.len; ++i) {
+                task *t = g_tasks.data[i];
+                if (t->state != TASK_DONE) continue;
+                fprintf(f, "%10.2f %10.2f %10.2f %10.2f  %s\n", t->ready, t->start, t->end, t->end - t->start, t->name);
+                if (!last || t->end > last->end) last = t;
+        }
+
+        if (!last) return;
+
+        task_array path = dyn_array_empty(task_array);
+        for (task *t = last; t; t = blocker(t)) {
+                dyn_array_append(path, t);
+        }
+
+        fprintf(f, "critical path (%.2f ms):\n", last->end);
+        for (size_t i = path.len; i-- > 0;) {
+                task *t = path.data[i];
+                // Time spent waiting for a slot or for the driver
+                // to get to it, after it was ready.
+                fprintf(f, "    %10.2f ms  %s", t->end - t->start, t->name);
+                if (t->start - t->ready > 0.01) {
+                        fprintf(f, " (queued %.2f ms)", t->start - t->ready);
+                }
+                fprintf(f, "\n");
+        }
+
+        dyn_array_free(path);
+}
+
+void
+sched_reset(void)
+{
+        for (size_t i = 0; i < g_tasks.len; ++i) {
+                task *t = g_tasks.data[i];
+                free(t->name);
+                dyn_array_free(t->deps);
+                dyn_array_free(t->rdeps);
+                free(t);
+        }
+        g_tasks.len = 0;
+        g_ready.len = 0;
+        g_epoch     = 0;
+}
@@ -2,6 +2,8 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 
 char *
 int_to_cstr(int i)
@@ -23,3 +25,124 @@ int_to_cstr(int i)
         s[digits-1] = 0;
         return s;
 }
+
+// FNV-1a, used for content hashes of sources and
+// generated artifacts.
+uint64_t
+hash_bytes(const void *data, size_t n)
+{
+        const unsigned char *p = (const unsigned char *)data;
+        uint64_t h = 0xcbf29ce484222325ULL;
+
+        for (size_t i = 0; i < n; ++i) {
+                h ^= p[i];
+                h *= 0x100000001b3ULL;
+        }
+
+        return h;
+}
+
+uint64_t
+hash_cstr(const char *s)
+{
+        return hash_bytes(s, strlen(s));
+}
+
+static const uint32_t g_sha256_k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void
+sha256_block(sha256_ctx *ctx, const unsigned char *p)
+{
+        uint32_t w[64];
+        uint32_t a = ctx->h[0], b = ctx->h[1], c = ctx->h[2], d = ctx->h[3];
+        uint32_t e = ctx->h[4], f = ctx->h[5], g = ctx->h[6], h = ctx->h[7];
+
+        for (int i = 0; i < 16; ++i) {
+                w[i] = (uint32_t)p[4*i] << 24 | (uint32_t)p[4*i+1] << 16 | (uint32_t)p[4*i+2] << 8 | p[4*i+3];
+        }
+        for (int i = 16; i < 64; ++i) {
+                uint32_t s0 = ROR32(w[i-15], 7) ^ ROR32(w[i-15], 18) ^ (w[i-15] >> 3);
+                uint32_t s1 = ROR32(w[i-2], 17) ^ ROR32(w[i-2], 19) ^ (w[i-2] >> 10);
+                w[i] = w[i-16] + s0 + w[i-7] + s1;
+        }
+
+        for (int i = 0; i < 64; ++i) {
+                uint32_t t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) + ((e & f) ^ (~e & g)) + g_sha256_k[i] + w[i];
+                uint32_t t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+                h = g; g = f; f = e; e = d + t1;
+                d = c; c = b; b = a; a = t1 + t2;
+        }
+
+        ctx->h[0] += a; ctx->h[1] += b; ctx->h[2] += c; ctx->h[3] += d;
+        ctx->h[4] += e; ctx->h[5] += f; ctx->h[6] += g; ctx->h[7] += h;
+}
+
+void
+sha256_init(sha256_ctx *c)
+{
+        static const uint32_t h0[8] = {
+                0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+        };
+        memcpy(c->h, h0, sizeof(h0));
+        c->n = 0;
+}
+
+void
+sha256_update(sha256_ctx *c, const void *data, size_t n)
+{
+        const unsigned char *p = (const unsigned char *)data;
+        size_t used = c->n % 64;
+
+        c->n += n;
+        if (used) {
+                size_t k = 64 - used < n ? 64 - used : n;
+                memcpy(c->buf + used, p, k);
+                p += k;
+                n -= k;
+                if (used + k < 64) return;
+                sha256_block(c, c->buf);
+        }
+        for (; n >= 64; p += 64, n -= 64) {
+                sha256_block(c, p);
+        }
+        memcpy(c->buf, p, n);
+}
+
+// With its length, so that "ab" "c" and "a" "bc" differ.
+void
+sha256_cstr(sha256_ctx *c, const char *s)
+{
+        uint64_t n = strlen(s);
+        sha256_update(c, &n, sizeof(n));
+        sha256_update(c, s, n);
+}
+
+void
+sha256_hex(sha256_ctx *c, char out[65])
+{
+        unsigned char pad[72] = { 0x80 };
+        uint64_t bits = c->n * 8;
+        size_t npad = (c->n % 64 < 56 ? 56 : 120) - c->n % 64;
+
+        for (int i = 0; i < 8; ++i) {
+                pad[npad + i] = (unsigned char)(bits >> (56 - 8*i));
+        }
+        sha256_update(c, pad, npad + 8);
+
+        for (int i = 0; i < 8; ++i) {
+                sprintf(out + 8*i, "%08x", c->h[i]);
+        }
+        out[64] = 0;
+}
@@ -0,0 +1,1606 @@
+#include "x64.h"
+#include "mem.h"
+
+#include <forge/cstr.h>
+
+#include <ctype.h>
+#include <elf.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/*** Parsing ***/
+
+static const char *g_reg_names[16][4] = {
+        {"rax", "eax",  "ax",   "al"},
+        {"rcx", "ecx",  "cx",   "cl"},
+        {"rdx", "edx",  "dx",   "dl"},
+        {"rbx", "ebx",  "bx",   "bl"},
+        {"rsp", "esp",  "sp",   "spl"},
+        {"rbp", "ebp",  "bp",   "bpl"},
+        {"rsi", "esi",  "si",   "sil"},
+        {"rdi", "edi",  "di",   "dil"},
+        {"r8",  "r8d",  "r8w",  "r8b"},
+        {"r9",  "r9d",  "r9w",  "r9b"},
+        {"r10", "r10d", "r10w", "r10b"},
+        {"r11", "r11d", "r11w", "r11b"},
+        {"r12", "r12d", "r12w", "r12b"},
+        {"r13", "r13d", "r13w", "r13b"},
+        {"r14", "r14d", "r14w", "r14b"},
+        {"r15", "r15d", "r15w", "r15b"},
+};
+
+static const struct {
+        const char *name;
+        x64_op op;
+        x64_cc cc;
+} g_mnemonics[] = {
+        {"add",     X64_ADD,     0},
+        {"or",      X64_OR,      0},
+        {"adc",     X64_ADC,     0},
+        {"sbb",     X64_SBB,     0},
+        {"and",     X64_AND,     0},
+        {"sub",     X64_SUB,     0},
+        {"xor",     X64_XOR,     0},
+        {"cmp",     X64_CMP,     0},
+        {"mov",     X64_MOV,     0},
+        {"movzx",   X64_MOVZX,   0},
+        {"movsx",   X64_MOVSX,   0},
+        {"movsxd",  X64_MOVSX,   0},
+        {"lea",     X64_LEA,     0},
+        {"test",    X64_TEST,    0},
+        {"imul",    X64_IMUL,    0},
+        {"mul",     X64_MUL,     0},
+        {"idiv",    X64_IDIV,    0},
+        {"div",     X64_DIV,     0},
+        {"neg",     X64_NEG,     0},
+        {"not",     X64_NOT,     0},
+        {"shl",     X64_SHL,     0},
+        {"sal",     X64_SHL,     0},
+        {"shr",     X64_SHR,     0},
+        {"sar",     X64_SAR,     0},
+        {"push",    X64_PUSH,    0},
+        {"pop",     X64_POP,     0},
+        {"call",    X64_CALL,    0},
+        {"jmp",     X64_JMP,     0},
+        {"ret",     X64_RET,     0},
+        {"leave",   X64_LEAVE,   0},
+        {"syscall", X64_SYSCALL, 0},
+        {"cld",     X64_CLD,     0},
+        {"cqo",     X64_CQO,     0},
+        {"cdq",     X64_CDQ,     0},
+        {"nop",     X64_NOP,     0},
+
+        {"jo",   X64_JCC, X64_CC_O},  {"jno",  X64_JCC, X64_CC_NO},
+        {"jb",   X64_JCC, X64_CC_B},  {"jc",   X64_JCC, X64_CC_B},  {"jnae", X64_JCC, X64_CC_B},
+        {"jae",  X64_JCC, X64_CC_AE}, {"jnc",  X64_JCC, X64_CC_AE}, {"jnb",  X64_JCC, X64_CC_AE},
+        {"je",   X64_JCC, X64_CC_E},  {"jz",   X64_JCC, X64_CC_E},
+        {"jne",  X64_JCC, X64_CC_NE}, {"jnz",  X64_JCC, X64_CC_NE},
+        {"jbe",  X64_JCC, X64_CC_BE}, {"jna",  X64_JCC, X64_CC_BE},
+        {"ja",   X64_JCC, X64_CC_A},  {"jnbe", X64_JCC, X64_CC_A},
+        {"js",   X64_JCC, X64_CC_S},  {"jns",  X64_JCC, X64_CC_NS},
+        {"jp",   X64_JCC, X64_CC_P},  {"jpe",  X64_JCC, X64_CC_P},
+        {"jnp",  X64_JCC, X64_CC_NP}, {"jpo",  X64_JCC, X64_CC_NP},
+        {"jl",   X64_JCC, X64_CC_L},  {"jnge", X64_JCC, X64_CC_L},
+        {"jge",  X64_JCC, X64_CC_GE}, {"jnl",  X64_JCC, X64_CC_GE},
+        {"jle",  X64_JCC, X64_CC_LE}, {"jng",  X64_JCC, X64_CC_LE},
+        {"jg",   X64_JCC, X64_CC_G},  {"jnle", X64_JCC, X64_CC_G},
+
+        {"seto",  X64_SETCC, X64_CC_O},  {"setno", X64_SETCC, X64_CC_NO},
+        {"setb",  X64_SETCC, X64_CC_B},  {"setc",  X64_SETCC, X64_CC_B},
+        {"setae", X64_SETCC, X64_CC_AE}, {"setnc", X64_SETCC, X64_CC_AE},
+        {"sete",  X64_SETCC, X64_CC_E},  {"setz",  X64_SETCC, X64_CC_E},
+        {"setne", X64_SETCC, X64_CC_NE}, {"setnz", X64_SETCC, X64_CC_NE},
+        {"setbe", X64_SETCC, X64_CC_BE}, {"seta",  X64_SETCC, X64_CC_A},
+        {"sets",  X64_SETCC, X64_CC_S},  {"setns", X64_SETCC, X64_CC_NS},
+        {"setp",  X64_SETCC, X64_CC_P},  {"setnp", X64_SETCC, X64_CC_NP},
+        {"setl",  X64_SETCC, X64_CC_L},  {"setge", X64_SETCC, X64_CC_GE},
+        {"setle", X64_SETCC, X64_CC_LE}, {"setg",  X64_SETCC, X64_CC_G},
+};
+
+static int
+is_word_start(char c)
+{
+        return isalpha((unsigned char)c) || c == '_' || c == '.' || c == '?' || c == '$' || c == '@';
+}
+
+static int
+is_word(char c)
+{
+        return isalnum((unsigned char)c) || c == '_' || c == '.' || c == '?' || c == '$' || c == '@' || c == '#' || c == '~';
+}
+
+static char *
+skip_ws(char *s)
+{
+        while (*s == ' ' || *s == '\t') ++s;
+        return s;
+}
+
+// The word at `*s`, to be freed, or NULL.
+static char *
+take_word(char **s)
+{
+        char *p = skip_ws(*s);
+        if (!is_word_start(*p)) return NULL;
+
+        char *w = p;
+        while (is_word(*p)) ++p;
+
+        *s = p;
+        return strndup(w, p - w);
+}
+
+static int
+reg_lookup(const char *w, x64_reg *reg, int *sz)
+{
+        static const int szs[4] = {8, 4, 2, 1};
+        for (int i = 0; i < 16; ++i) {
+                for (int j = 0; j < 4; ++j) {
+                        if (!strcasecmp(w, g_reg_names[i][j])) {
+                                *reg = (x64_reg)i;
+                                *sz = szs[j];
+                                return 1;
+                        }
+                }
+        }
+        return 0;
+}
+
+static int
+size_keyword(const char *w)
+{
+        if (!strcasecmp(w, "byte"))  return 1;
+        if (!strcasecmp(w, "word"))  return 2;
+        if (!strcasecmp(w, "dword")) return 4;
+        if (!strcasecmp(w, "qword")) return 8;
+        return 0;
+}
+
+// Numbers as nasm spells them: 10, 0x0a, 0ah, 0b1010, 'a'.
+static int
+parse_num(char **s, int64_t *out)
+{
+        char *p = skip_ws(*s);
+        int neg = 0;
+
+        while (*p == '-' || *p == '+') {
+                if (*p == '-') neg = !neg;
+                p = skip_ws(p + 1);
+        }
+
+        uint64_t v = 0;
+
+        if (*p == '\'' || *p == '"' || *p == '`') {
+                char q = *p++;
+                int shift = 0;
+                while (*p && *p != q) {
+                        v |= (uint64_t)(unsigned char)*p++ << shift;
+                        shift += 8;
+                }
+                if (*p != q) return 0;
+                ++p;
+        } else if (isdigit((unsigned char)*p)) {
+                char *end = p;
+                while (isalnum((unsigned char)*end) || *end == '_') ++end;
+                size_t n = end - p;
+                int base = 10;
+                char *digits = p;
+
+                if (n > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+                        base = 16, digits += 2, n -= 2;
+                } else if (n > 2 && p[0] == '0' && (p[1] == 'b' || p[1] == 'B') && end[-1] != 'h' && end[-1] != 'H') {
+                        base = 2, digits += 2, n -= 2;
+                } else if (n > 1 && (end[-1] == 'h' || end[-1] == 'H')) {
+                        base = 16, --n;
+                }
+
+                for (size_t i = 0; i < n; ++i) {
+                        char c = (char)tolower((unsigned char)digits[i]);
+                        int d;
+                        if (c == '_') continue;
+                        if (isdigit((unsigned char)c)) d = c - '0';
+                        else if (c >= 'a' && c <= 'f') d = c - 'a' + 10;
+                        else return 0;
+                        if (d >= base) return 0;
+                        v = v * base + d;
+                }
+                p = end;
+        } else {
+                return 0;
+        }
+
+        *out = neg ? -(int64_t)v : (int64_t)v;
+        *s = p;
+        return 1;
+}
+
+static int
+parse_mem(char **s, x64_opnd *o)
+{
+        char *p = skip_ws(*s);
+        if (*p != '[') return 0;
+        ++p;
+
+        o->kind  = X64_OPND_MEM;
+        o->reg   = X64_NOREG;
+        o->index = X64_NOREG;
+        o->scale = 1;
+        o->imm   = 0;
+
+        int sign = 1;
+        for (;;) {
+                p = skip_ws(p);
+                if (*p == ']') {
+                        ++p;
+                        break;
+                }
+                if (*p == '+') { sign = 1;  ++p; continue; }
+                if (*p == '-') { sign = -1; ++p; continue; }
+
+                int64_t n;
+                x64_reg r;
+                int rsz;
+
+                if (parse_num(&p, &n)) {
+                        // scale*reg
+                        p = skip_ws(p);
+                        if (*p == '*') {
+                                ++p;
+                                char *w = take_word(&p);
+                                int ok = w && reg_lookup(w, &r, &rsz) && rsz == 8 && o->index == X64_NOREG && sign > 0
+                                        && n > 0 && n <= 8;
+                                free(w);
+                                if (!ok) return 0;
+                                o->index = r;
+                                o->scale = (int)n;
+                        } else {
+                                o->imm += sign * n;
+                        }
+                        continue;
+                }
+
+                char *w = take_word(&p);
+                if (!w) return 0;
+                int ok = reg_lookup(w, &r, &rsz) && rsz == 8 && sign > 0;
+                free(w);
+                if (!ok) return 0;
+
+                p = skip_ws(p);
+                if (*p == '*') {
+                        ++p;
+                        if (!parse_num(&p, &n) || n < 1 || n > 8 || o->index != X64_NOREG) return 0;
+                        o->index = r;
+                        o->scale = (int)n;
+                } else if (o->reg == X64_NOREG) {
+                        o->reg = r;
+                } else if (o->index == X64_NOREG) {
+                        o->index = r;
+                } else {
+                        return 0;
+                }
+        }
+
+        if (o->scale != 1 && o->scale != 2 && o->scale != 4 && o->scale != 8) return 0;
+        if (o->index == X64_RSP) return 0;
+
+        *s = p;
+        return 1;
+}
+
+static int
+parse_opnd(char **s, x64_opnd *o)
+{
+        memset(o, 0, sizeof(*o));
+        o->reg   = X64_NOREG;
+        o->index = X64_NOREG;
+
+        char *p = skip_ws(*s);
+
+        // A size keyword, which nasm also allows before registers.
+        char *save = p;
+        char *w = take_word(&p);
+        if (w && size_keyword(w)) {
+                o->sz = size_keyword(w);
+                free(w);
+                save = p;
+                w = take_word(&p);
+        }
+
+        if (w) {
+                x64_reg r;
+                int rsz;
+                if (reg_lookup(w, &r, &rsz)) {
+                        o->kind = X64_OPND_REG;
+                        o->reg  = r;
+                        o->sz   = rsz;
+                        free(w);
+                        *s = p;
+                        return 1;
+                }
+
+                // A symbol, maybe with an addend. It lives in the
+                // line, as promised.
+                size_t n = strlen(w);
+                free(w);
+                o->kind = X64_OPND_SYM;
+                o->sym  = skip_ws(save);
+                char *end = (char *)o->sym + n;
+
+                p = skip_ws(end);
+                if (*p == '+' || *p == '-') {
+                        if (!parse_num(&p, &o->imm)) return 0;
+                }
+                *end = 0;
+                *s = p;
+                return 1;
+        }
+
+        p = save;
+        if (*skip_ws(p) == '[') {
+                int sz = o->sz;
+                if (!parse_mem(&p, o)) return 0;
+                o->sz = sz;
+                *s = p;
+                return 1;
+        }
+
+        if (parse_num(&p, &o->imm)) {
+                o->kind = X64_OPND_IMM;
+                *s = p;
+                return 1;
+        }
+
+        return 0;
+}
+
+int
+x64_parse(char *s, x64_insn *in)
+{
+        memset(in, 0, sizeof(*in));
+
+        char *p = s;
+        char *w = take_word(&p);
+        if (!w) return -1;
+
+        if (!strcasecmp(w, "rep")) {
+                free(w);
+                w = take_word(&p);
+                if (!w) return -1;
+                if      (!strcasecmp(w, "stosb")) in->op = X64_REP_STOSB;
+                else if (!strcasecmp(w, "stosd")) in->op = X64_REP_STOSD;
+                else if (!strcasecmp(w, "stosq")) in->op = X64_REP_STOSQ;
+                else {
+                        free(w);
+                        return -1;
+                }
+                free(w);
+                return *skip_ws(p) ? -1 : 0;
+        }
+
+        size_t i;
+        for (i = 0; i < sizeof(g_mnemonics)/sizeof(*g_mnemonics); ++i) {
+                if (!strcasecmp(w, g_mnemonics[i].name)) break;
+        }
+        free(w);
+        if (i == sizeof(g_mnemonics)/sizeof(*g_mnemonics)) return -1;
+
+        in->op = g_mnemonics[i].op;
+        in->cc = g_mnemonics[i].cc;
+
+        // Operands, split at the commas first so that each one
+        // can be cut where it ends.
+        p = skip_ws(p);
+        while (*p) {
+                char *end = p;
+                char q = 0;
+                for (; *end && (q || *end != ','); ++end) {
+                        if (q && *end == q) q = 0;
+                        else if (!q && (*end == '\'' || *end == '"' || *end == '`')) q = *end;
+                }
+                int last = !*end;
+                *end = 0;
+
+                if (in->n == 3 || !parse_opnd(&p, &in->o[in->n])) return -1;
+                ++in->n;
+                if (*skip_ws(p)) return -1;
+
+                if (last) break;
+                p = skip_ws(end + 1);
+                if (!*p) return -1;
+        }
+
+        return 0;
+}
+
+static const char *g_op_names[] = {
+        [X64_ADD] = "add",     [X64_OR] = "or",       [X64_ADC] = "adc",
+        [X64_SBB] = "sbb",     [X64_AND] = "and",     [X64_SUB] = "sub",
+        [X64_XOR] = "xor",     [X64_CMP] = "cmp",     [X64_MOV] = "mov",
+        [X64_MOVZX] = "movzx", [X64_MOVSX] = "movsx", [X64_LEA] = "lea",
+        [X64_TEST] = "test",   [X64_IMUL] = "imul",   [X64_MUL] = "mul",
+        [X64_IDIV] = "idiv",   [X64_DIV] = "div",     [X64_NEG] = "neg",
+        [X64_NOT] = "not",     [X64_SHL] = "shl",     [X64_SHR] = "shr",
+        [X64_SAR] = "sar",     [X64_PUSH] = "push",   [X64_POP] = "pop",
+        [X64_CALL] = "call",   [X64_JMP] = "jmp",     [X64_JCC] = "j",
+        [X64_SETCC] = "set",   [X64_RET] = "ret",     [X64_LEAVE] = "leave",
+        [X64_SYSCALL] = "syscall",     [X64_CLD] = "cld",
+        [X64_REP_STOSB] = "rep stosb", [X64_REP_STOSD] = "rep stosd",
+        [X64_REP_STOSQ] = "rep stosq", [X64_CQO] = "cqo",
+        [X64_CDQ] = "cdq",     [X64_NOP] = "nop",
+};
+
+static const char *g_cc_names[16] = {
+        "o", "no", "b", "ae", "e", "ne", "be", "a",
+        "s", "ns", "p", "np", "l", "ge", "le", "g",
+};
+
+static const char *
+reg_name(int reg, int sz)
+{
+        switch (sz) {
+        case 8: return g_reg_names[reg][0];
+        case 4: return g_reg_names[reg][1];
+        case 2: return g_reg_names[reg][2];
+        default: return g_reg_names[reg][3];
+        }
+}
+
+#define APPEND(...)                                                     \
+        do {                                                            \
+                int k_ = snprintf(buf + (len < n ? len : n),            \
+                                  len < n ? n - len : 0, __VA_ARGS__);  \
+                if (k_ > 0) len += (size_t)k_;                          \
+        } while (0)
+
+static int
+format(const x64_insn *in, char *buf, size_t n, int gas)
+{
+        static const char *szs[9] = {NULL, "BYTE", "WORD", NULL, "DWORD", NULL, NULL, NULL, "QWORD"};
+        int branch = in->op == X64_CALL || in->op == X64_JMP || in->op == X64_JCC;
+        size_t len = 0;
+
+        if (n) buf[0] = 0;
+
+        // Sign-extending a dword has a name of its own.
+        if (in->op == X64_MOVSX && in->n == 2 && in->o[1].sz == 4) {
+                APPEND("movsxd");
+        } else {
+                APPEND("%s", g_op_names[in->op]);
+        }
+        if (in->op == X64_JCC || in->op == X64_SETCC) {
+                APPEND("%s", g_cc_names[in->cc]);
+        }
+
+        for (int i = 0; i < in->n; ++i) {
+                const x64_opnd *o = &in->o[i];
+                APPEND("%s", i ? ", " : " ");
+
+                switch (o->kind) {
+                case X64_OPND_REG:
+                        APPEND("%s", reg_name(o->reg, o->sz));
+                        break;
+                case X64_OPND_IMM:
+                        APPEND("%lld", (long long)o->imm);
+                        break;
+                case X64_OPND_SYM:
+                        // A bare symbol is a memory operand to gas.
+                        if (gas && !branch) APPEND("OFFSET ");
+                        APPEND("%s", o->sym);
+                        if (o->imm) APPEND("%+lld", (long long)o->imm);
+                        break;
+                case X64_OPND_MEM: {
+                        int any = 0;
+                        if (o->sz && szs[o->sz]) APPEND(gas ? "%s PTR " : "%s ", szs[o->sz]);
+                        APPEND("[");
+                        if (o->reg != X64_NOREG) {
+                                APPEND("%s", g_reg_names[o->reg][0]);
+                                any = 1;
+                        }
+                        if (o->index != X64_NOREG) {
+                                APPEND("%s%s*%d", any ? "+" : "", g_reg_names[o->index][0], o->scale);
+                                any = 1;
+                        }
+                        if (o->imm || !any) APPEND(any ? "%+lld" : "%lld", (long long)o->imm);
+                        APPEND("]");
+                        break;
+                }
+                default:
+                        break;
+                }
+        }
+
+        return (int)len;
+}
+
+#undef APPEND
+
+int
+x64_format(const x64_insn *in, char *buf, size_t n)
+{
+        return format(in, buf, n, 0);
+}
+
+int
+x64_format_gas(const x64_insn *in, char *buf, size_t n)
+{
+        return format(in, buf, n, 1);
+}
+
+/*** Encoding ***/
+
+typedef struct {
+        uint8_t *b;
+        int n;
+} ebuf;
+
+static void
+put(ebuf *e, uint8_t c)
+{
+        e->b[e->n++] = c;
+}
+
+static void
+put_le(ebuf *e, uint64_t v, int n)
+{
+        for (int i = 0; i < n; ++i) {
+                put(e, (uint8_t)(v >> (8 * i)));
+        }
+}
+
+// Whether the value of `imm` as an `sz`-byte operand sign-
+// extends from 8 bits.
+static int64_t
+sext(int64_t imm, int sz)
+{
+        switch (sz) {
+        case 1: return (int8_t)imm;
+        case 2: return (int16_t)imm;
+        case 4: return (int32_t)imm;
+        default: return imm;
+        }
+}
+
+static int
+imm_fits(int64_t imm, int sz)
+{
+        switch (sz) {
+        case 1: return imm >= -128 && imm <= 255;
+        case 2: return imm >= -32768 && imm <= 65535;
+        case 4: return imm >= INT32_MIN && imm <= (int64_t)UINT32_MAX;
+        case 8: return imm >= INT32_MIN && imm <= INT32_MAX;
+        default: return 0;
+        }
+}
+
+// spl, bpl, sil and dil need a REX prefix to not be ah..bh.
+static int
+byte_reg_needs_rex(const x64_opnd *o)
+{
+        return o->kind == X64_OPND_REG && o->sz == 1 && o->reg >= X64_RSP && o->reg <= X64_RDI;
+}
+
+// [66] [REX] opcode ModRM [SIB] [disp]. `reg` is the ModRM reg
+// field, a register or a /digit. `w` sets REX.W.
+static int
+encode_rm(ebuf *e, int sz16, int w, int force_rex,
+          const uint8_t *opc, int nopc,
+          int reg, const x64_opnd *rm)
+{
+        if (rm->kind != X64_OPND_REG && rm->kind != X64_OPND_MEM) return -1;
+
+        int rex = 0x40 | (w ? 8 : 0) | ((reg & 8) ? 4 : 0);
+        if (rm->kind == X64_OPND_REG) {
+                rex |= (rm->reg & 8) ? 1 : 0;
+                force_rex |= byte_reg_needs_rex(rm);
+        } else {
+                if (rm->index != X64_NOREG) rex |= (rm->index & 8) ? 2 : 0;
+                if (rm->reg != X64_NOREG)   rex |= (rm->reg & 8) ? 1 : 0;
+        }
+
+        if (sz16) put(e, 0x66);
+        if (rex != 0x40 || force_rex) put(e, (uint8_t)rex);
+        for (int i = 0; i < nopc; ++i) put(e, opc[i]);
+
+        if (rm->kind == X64_OPND_REG) {
+                put(e, (uint8_t)(0xC0 | ((reg & 7) << 3) | (rm->reg & 7)));
+                return 0;
+        }
+
+        static const int scales[9] = {-1, 0, 1, -1, 2, -1, -1, -1, 3};
+        int64_t disp = rm->imm;
+        if (disp < INT32_MIN || disp > INT32_MAX) return -1;
+
+        if (rm->reg == X64_NOREG) {
+                // [index*scale + disp32] or [disp32]
+                int index = rm->index == X64_NOREG ? 4 : (rm->index & 7);
+                put(e, (uint8_t)(0x04 | ((reg & 7) << 3)));
+                put(e, (uint8_t)((scales[rm->scale] << 6) | (index << 3) | 5));
+                put_le(e, (uint64_t)disp, 4);
+                return 0;
+        }
+
+        int mod = (disp == 0 && (rm->reg & 7) != 5) ? 0
+                : (disp >= -128 && disp <= 127)    ? 1
+                : 2;
+
+        if (rm->index != X64_NOREG || (rm->reg & 7) == 4) {
+                int index = rm->index == X64_NOREG ? 4 : (rm->index & 7);
+                put(e, (uint8_t)((mod << 6) | ((reg & 7) << 3) | 4));
+                put(e, (uint8_t)((scales[rm->scale] << 6) | (index << 3) | (rm->reg & 7)));
+        } else {
+                put(e, (uint8_t)((mod << 6) | ((reg & 7) << 3) | (rm->reg & 7)));
+        }
+
+        if (mod == 1) put(e, (uint8_t)disp);
+        if (mod == 2) put_le(e, (uint64_t)disp, 4);
+
+        return 0;
+}
+
+// The size of a two-operand instruction: from a register if
+// there is one, otherwise as spelled out.
+static int
+opsize(const x64_insn *in)
+{
+        for (int i = 0; i < in->n; ++i) {
+                if (in->o[i].kind == X64_OPND_REG) return in->o[i].sz;
+        }
+        for (int i = 0; i < in->n; ++i) {
+                if (in->o[i].sz) return in->o[i].sz;
+        }
+        return 0;
+}
+
+static int
+is_rm(const x64_opnd *o)
+{
+        return o->kind == X64_OPND_REG || o->kind == X64_OPND_MEM;
+}
+
+// Opcodes that come in a byte form and a full size one.
+static int
+encode_sized(ebuf *e, int sz, uint8_t opc8, int reg, int force_rex, const x64_opnd *rm)
+{
+        uint8_t opc = sz == 1 ? opc8 : (uint8_t)(opc8 + 1);
+        return encode_rm(e, sz == 2, sz == 8, force_rex, &opc, 1, reg, rm);
+}
+
+static void
+put_imm(ebuf *e, int64_t imm, int sz)
+{
+        put_le(e, (uint64_t)imm, sz == 8 ? 4 : sz);
+}
+
+static int
+encode_alu(ebuf *e, const x64_insn *in)
+{
+        const x64_opnd *d = &in->o[0], *s = &in->o[1];
+        int digit = (int)in->op;
+        int sz = opsize(in);
+
+        if (in->n != 2 || !sz) return -1;
+
+        if (is_rm(d) && s->kind == X64_OPND_REG) {
+                if (d->kind == X64_OPND_REG && d->sz != s->sz) return -1;
+                return encode_sized(e, sz, (uint8_t)(digit * 8), s->reg, byte_reg_needs_rex(s), d);
+        }
+        if (d->kind == X64_OPND_REG && s->kind == X64_OPND_MEM) {
+                return encode_sized(e, sz, (uint8_t)(digit * 8 + 2), d->reg, byte_reg_needs_rex(d), s);
+        }
+        if (is_rm(d) && s->kind == X64_OPND_IMM) {
+                if (!imm_fits(s->imm, sz)) return -1;
+                int64_t v = sext(s->imm, sz);
+                if (sz == 1) {
+                        uint8_t opc = 0x80;
+                        if (encode_rm(e, 0, 0, 0, &opc, 1, digit, d) < 0) return -1;
+                        put(e, (uint8_t)v);
+                } else if (v >= -128 && v <= 127) {
+                        uint8_t opc = 0x83;
+                        if (encode_rm(e, sz == 2, sz == 8, 0, &opc, 1, digit, d) < 0) return -1;
+                        put(e, (uint8_t)v);
+                } else {
+                        uint8_t opc = 0x81;
+                        if (encode_rm(e, sz == 2, sz == 8, 0, &opc, 1, digit, d) < 0) return -1;
+                        put_imm(e, v, sz);
+                }
+                return 0;
+        }
+
+        return -1;
+}
+
+static int
+encode_mov(ebuf *e, const x64_insn *in, x64_fixup *fix)
+{
+        const x64_opnd *d = &in->o[0], *s = &in->o[1];
+        int sz = opsize(in);
+
+        if (in->n != 2 || !sz) return -1;
+
+        if (is_rm(d) && s->kind == X64_OPND_REG) {
+                if (d->kind == X64_OPND_REG && d->sz != s->sz) return -1;
+                return encode_sized(e, sz, 0x88, s->reg, byte_reg_needs_rex(s), d);
+        }
+        if (d->kind == X64_OPND_REG && s->kind == X64_OPND_MEM) {
+                return encode_sized(e, sz, 0x8A, d->reg, byte_reg_needs_rex(d), s);
+        }
+
+        if (d->kind == X64_OPND_REG && (s->kind == X64_OPND_IMM || s->kind == X64_OPND_SYM)) {
+                int r = d->reg;
+                int rex = (r & 8) ? 0x41 : 0;
+                int isz = sz;
+
+                if (s->kind == X64_OPND_SYM) {
+                        if (sz != 8 && sz != 4) return -1;
+                } else if (sz == 8) {
+                        // The shortest that gives the same register.
+                        if (s->imm >= 0 && s->imm <= (int64_t)UINT32_MAX) {
+                                isz = 4;
+                        } else if (s->imm >= INT32_MIN && s->imm <= INT32_MAX) {
+                                uint8_t opc = 0xC7;
+                                if (encode_rm(e, 0, 1, 0, &opc, 1, 0, d) < 0) return -1;
+                                put_le(e, (uint64_t)s->imm, 4);
+                                return 0;
+                        }
+                } else if (!imm_fits(s->imm, sz)) {
+                        return -1;
+                }
+
+                if (isz == 8) rex |= 0x48;
+                if (sz == 1 && byte_reg_needs_rex(d)) rex |= 0x40;
+                if (isz == 2) put(e, 0x66);
+                if (rex) put(e, (uint8_t)rex);
+                put(e, (uint8_t)((isz == 1 ? 0xB0 : 0xB8) + (r & 7)));
+
+                if (s->kind == X64_OPND_SYM) {
+                        fix->at     = e->n;
+                        fix->type   = isz == 8 ? R_X86_64_64 : R_X86_64_32;
+                        fix->sym    = s->sym;
+                        fix->addend = s->imm;
+                        put_le(e, 0, isz);
+                } else {
+                        put_le(e, (uint64_t)s->imm, isz);
+                }
+                return 0;
+        }
+
+        if (d->kind == X64_OPND_MEM && (s->kind == X64_OPND_IMM || s->kind == X64_OPND_SYM)) {
+                if (s->kind == X64_OPND_IMM && !imm_fits(s->imm, sz)) return -1;
+                if (s->kind == X64_OPND_SYM && sz < 4) return -1;
+                if (encode_sized(e, sz, 0xC6, 0, 0, d) < 0) return -1;
+                if (s->kind == X64_OPND_SYM) {
+                        fix->at     = e->n;
+                        fix->type   = sz == 8 ? R_X86_64_32S : R_X86_64_32;
+                        fix->sym    = s->sym;
+                        fix->addend = s->imm;
+                        put_le(e, 0, 4);
+                } else {
+                        put_imm(e, sext(s->imm, sz), sz);
+                }
+                return 0;
+        }
+
+        return -1;
+}
+
+static int
+encode_ext(ebuf *e, const x64_insn *in)
+{
+        const x64_opnd *d = &in->o[0], *s = &in->o[1];
+        if (in->n != 2 || d->kind != X64_OPND_REG || !is_rm(s)) return -1;
+
+        int ssz = s->sz;
+        if (!ssz || ssz >= d->sz) return -1;
+
+        if (ssz == 4) {
+                if (d->sz != 8) return -1;
+                if (in->op == X64_MOVZX) {
+                        // Writing the 32-bit register clears the rest.
+                        uint8_t opc = 0x8B;
+                        return encode_rm(e, 0, 0, 0, &opc, 1, d->reg, s);
+                }
+                uint8_t opc = 0x63;
+                return encode_rm(e, 0, 1, 0, &opc, 1, d->reg, s);
+        }
+
+        uint8_t opc[2] = {0x0F, 0};
+        if (in->op == X64_MOVZX) opc[1] = ssz == 1 ? 0xB6 : 0xB7;
+        else                     opc[1] = ssz == 1 ? 0xBE : 0xBF;
+
+        return encode_rm(e, d->sz == 2, d->sz == 8, 0, opc, 2, d->reg, s);
+}
+
+static int
+encode_imul(ebuf *e, const x64_insn *in)
+{
+        const x64_opnd *d = &in->o[0];
+
+        if (in->n == 1) {
+                int sz = opsize(in);
+                if (!sz || !is_rm(d)) return -1;
+                return encode_sized(e, sz, 0xF6, 5, 0, d);
+        }
+
+        if (d->kind != X64_OPND_REG || d->sz == 1) return -1;
+
+        const x64_opnd *src = &in->o[1];
+        const x64_opnd *imm = NULL;
+        if (in->n == 3) {
+                imm = &in->o[2];
+        } else if (in->o[1].kind == X64_OPND_IMM) {
+                src = d;
+                imm = &in->o[1];
+        }
+
+        if (!is_rm(src)) return -1;
+        if (src->kind == X64_OPND_REG && src->sz != d->sz) return -1;
+
+        if (!imm) {
+                uint8_t opc[2] = {0x0F, 0xAF};
+                return encode_rm(e, d->sz == 2, d->sz == 8, 0, opc, 2, d->reg, src);
+        }
+
+        if (imm->kind != X64_OPND_IMM || !imm_fits(imm->imm, d->sz)) return -1;
+        int64_t v = sext(imm->imm, d->sz);
+        uint8_t opc = (v >= -128 && v <= 127) ? 0x6B : 0x69;
+        if (encode_rm(e, d->sz == 2, d->sz == 8, 0, &opc, 1, d->reg, src) < 0) return -1;
+        if (opc == 0x6B) put(e, (uint8_t)v);
+        else             put_imm(e, v, d->sz);
+        return 0;
+}
+
+static int
+encode_unary(ebuf *e, const x64_insn *in, int digit)
+{
+        int sz = opsize(in);
+        if (in->n != 1 || !sz || !is_rm(&in->o[0])) return -1;
+        return encode_sized(e, sz, 0xF6, digit, 0, &in->o[0]);
+}
+
+static int
+encode_shift(ebuf *e, const x64_insn *in, int digit)
+{
+        const x64_opnd *d = &in->o[0], *s = &in->o[1];
+        int sz = d->sz;
+
+        if (in->n != 2 || !sz || !is_rm(d)) return -1;
+
+        if (s->kind == X64_OPND_REG && s->reg == X64_RCX && s->sz == 1) {
+                return encode_sized(e, sz, 0xD2, digit, 0, d);
+        }
+        if (s->kind != X64_OPND_IMM || s->imm < 0 || s->imm > 63) return -1;
+        if (s->imm == 1) {
+                return encode_sized(e, sz, 0xD0, digit, 0, d);
+        }
+        if (encode_sized(e, sz, 0xC0, digit, 0, d) < 0) return -1;
+        put(e, (uint8_t)s->imm);
+        return 0;
+}
+
+static int
+encode_test(ebuf *e, const x64_insn *in)
+{
+        const x64_opnd *d = &in->o[0], *s = &in->o[1];
+        int sz = opsize(in);
+
+        if (in->n != 2 || !sz) return -1;
+
+        if (d->kind == X64_OPND_MEM && s->kind == X64_OPND_REG) {
+                return encode_sized(e, sz, 0x84, s->reg, byte_reg_needs_rex(s), d);
+        }
+        if (d->kind == X64_OPND_REG && is_rm(s)) {
+                if (s->kind == X64_OPND_REG && s->sz != d->sz) return -1;
+                return encode_sized(e, sz, 0x84, d->reg, byte_reg_needs_rex(d), s);
+        }
+        if (is_rm(d) && s->kind == X64_OPND_IMM) {
+                if (!imm_fits(s->imm, sz)) return -1;
+                if (encode_sized(e, sz, 0xF6, 0, 0, d) < 0) return -1;
+                put_imm(e, sext(s->imm, sz), sz);
+                return 0;
+        }
+        return -1;
+}
+
+static int
+encode_stack(ebuf *e, const x64_insn *in)
+{
+        const x64_opnd *o = &in->o[0];
+        int push = in->op == X64_PUSH;
+
+        if (in->n != 1) return -1;
+
+        if (o->kind == X64_OPND_REG) {
+                if (o->sz != 8) return -1;
+                if (o->reg & 8) put(e, 0x41);
+                put(e, (uint8_t)((push ? 0x50 : 0x58) + (o->reg & 7)));
+                return 0;
+        }
+        if (o->kind == X64_OPND_MEM) {
+                if (o->sz && o->sz != 8) return -1;
+                uint8_t opc = push ? 0xFF : 0x8F;
+                return encode_rm(e, 0, 0, 0, &opc, 1, push ? 6 : 0, o);
+        }
+        if (push && o->kind == X64_OPND_IMM) {
+                if (o->imm >= -128 && o->imm <= 127) {
+                        put(e, 0x6A);
+                        put(e, (uint8_t)o->imm);
+                } else if (o->imm >= INT32_MIN && o->imm <= INT32_MAX) {
+                        put(e, 0x68);
+                        put_le(e, (uint64_t)o->imm, 4);
+                } else {
+                        return -1;
+                }
+                return 0;
+        }
+        return -1;
+}
+
+static int
+encode_branch(ebuf *e, const x64_insn *in, x64_fixup *fix)
+{
+        const x64_opnd *o = &in->o[0];
+
+        if (in->n != 1) return -1;
+
+        if (o->kind == X64_OPND_SYM) {
+                switch (in->op) {
+                case X64_CALL: put(e, 0xE8); break;
+                case X64_JMP:  put(e, 0xE9); break;
+                default:
+                        put(e, 0x0F);
+                        put(e, (uint8_t)(0x80 + in->cc));
+                }
+                fix->at     = e->n;
+                fix->type   = in->op == X64_JCC ? R_X86_64_PC32 : R_X86_64_PLT32;
+                fix->sym    = o->sym;
+                fix->addend = o->imm - 4;
+                put_le(e, 0, 4);
+                return 0;
+        }
+
+        if (in->op == X64_JCC || !is_rm(o)) return -1;
+        if (o->kind == X64_OPND_REG && o->sz != 8) return -1;
+
+        uint8_t opc = 0xFF;
+        return encode_rm(e, 0, 0, 0, &opc, 1, in->op == X64_CALL ? 2 : 4, o);
+}
+
+int
+x64_encode(const x64_insn *in, uint8_t *buf, x64_fixup *fix)
+{
+        ebuf e = {buf, 0};
+        int r = 0;
+
+        fix->sym = NULL;
+
+        switch (in->op) {
+        case X64_ADD: case X64_OR:  case X64_ADC: case X64_SBB:
+        case X64_AND: case X64_SUB: case X64_XOR: case X64_CMP:
+                r = encode_alu(&e, in);
+                break;
+        case X64_MOV:
+                r = encode_mov(&e, in, fix);
+                break;
+        case X64_MOVZX:
+        case X64_MOVSX:
+                r = encode_ext(&e, in);
+                break;
+        case X64_LEA: {
+                const x64_opnd *d = &in->o[0];
+                uint8_t opc = 0x8D;
+                if (in->n != 2 || d->kind != X64_OPND_REG || d->sz == 1 || in->o[1].kind != X64_OPND_MEM) return -1;
+                r = encode_rm(&e, d->sz == 2, d->sz == 8, 0, &opc, 1, d->reg, &in->o[1]);
+                break;
+        }
+        case X64_TEST: r = encode_test(&e, in);      break;
+        case X64_IMUL: r = encode_imul(&e, in);      break;
+        case X64_MUL:  r = encode_unary(&e, in, 4);  break;
+        case X64_DIV:  r = encode_unary(&e, in, 6);  break;
+        case X64_IDIV: r = encode_unary(&e, in, 7);  break;
+        case X64_NEG:  r = encode_unary(&e, in, 3);  break;
+        case X64_NOT:  r = encode_unary(&e, in, 2);  break;
+        case X64_SHL:  r = encode_shift(&e, in, 4);  break;
+        case X64_SHR:  r = encode_shift(&e, in, 5);  break;
+        case X64_SAR:  r = encode_shift(&e, in, 7);  break;
+        case X64_PUSH:
+        case X64_POP:
+                r = encode_stack(&e, in);
+                break;
+        case X64_CALL:
+        case X64_JMP:
+        case X64_JCC:
+                r = encode_branch(&e, in, fix);
+                break;
+        case X64_SETCC: {
+                const x64_opnd *o = &in->o[0];
+                uint8_t opc[2] = {0x0F, (uint8_t)(0x90 + in->cc)};
+                if (in->n != 1 || (o->sz && o->sz != 1)) return -1;
+                r = encode_rm(&e, 0, 0, 0, opc, 2, 0, o);
+                break;
+        }
+        case X64_RET:       put(&e, 0xC3); break;
+        case X64_LEAVE:     put(&e, 0xC9); break;
+        case X64_SYSCALL:   put(&e, 0x0F); put(&e, 0x05); break;
+        case X64_CLD:       put(&e, 0xFC); break;
+        case X64_REP_STOSB: put(&e, 0xF3); put(&e, 0xAA); break;
+        case X64_REP_STOSD: put(&e, 0xF3); put(&e, 0xAB); break;
+        case X64_REP_STOSQ: put(&e, 0xF3); put(&e, 0x48); put(&e, 0xAB); break;
+        case X64_CQO:       put(&e, 0x48); put(&e, 0x99); break;
+        case X64_CDQ:       put(&e, 0x99); break;
+        case X64_NOP:       put(&e, 0x90); break;
+        default:
+                return -1;
+        }
+
+        if (in->op >= X64_RET && in->n != 0) return -1;
+
+        return r < 0 ? -1 : e.n;
+}
+
+/*** Assembling ***/
+
+typedef enum {
+        ITEM_CODE,   // bytes, maybe with a fixup
+        ITEM_BRANCH, // jmp/jcc to a label in the same section
+        ITEM_ALIGN,
+        ITEM_SPACE,  // resb and friends
+        ITEM_LABEL,
+} item_kind;
+
+typedef struct {
+        item_kind kind;
+        int section;
+        uint64_t off;
+        size_t size;
+
+        size_t at;      // CODE: where its bytes are in the pool
+        int has_fix;
+        x64_fixup fix;
+        int fix_sym;
+
+        int sym;        // BRANCH: target, LABEL: the label
+        int jmp;        // BRANCH: jmp, not jcc
+        x64_cc cc;
+        int is_short;
+
+        uint64_t align; // ALIGN
+} item;
+
+DYN_ARRAY_TYPE(item, item_array);
+
+struct x64_asm {
+        obj *o;
+        int section;
+        char *scope;    // the last label not starting with '.'
+        item_array items;
+        u8_array pool;
+        char *err;
+        size_t line;    // of the source, one per line or record
+};
+
+static int
+fail(x64_asm *a, const char *what, const char *ln)
+{
+        char buf[64] = {0};
+        snprintf(buf, sizeof(buf), "line %zu: ", a->line);
+        a->err = forge_cstr_builder(buf, what, " `", ln, "`", NULL);
+        return -1;
+}
+
+static void
+add_code(x64_asm *a, const uint8_t *b, size_t n, const x64_fixup *fix)
+{
+        item it = {0};
+        it.kind    = ITEM_CODE;
+        it.section = a->section;
+        it.size    = n;
+        it.at      = a->pool.len;
+        if (fix && fix->sym) {
+                it.has_fix = 1;
+                it.fix     = *fix;
+                it.fix_sym = obj_symbol_get(a->o, fix->sym);
+                it.fix.sym = NULL; // the line is gone by then
+        }
+        for (size_t i = 0; i < n; ++i) {
+                dyn_array_append(a->pool, b[i]);
+        }
+        dyn_array_append(a->items, it);
+}
+
+// nasm's local labels belong to the label before them.
+static char *
+label_name(x64_asm *a, const char *name)
+{
+        if (name[0] == '.' && name[1] != '.' && a->scope) {
+                return forge_cstr_builder(a->scope, name, NULL);
+        }
+        return strdup(name);
+}
+
+static int
+define_label(x64_asm *a, const char *name, const char *ln)
+{
+        char *full = label_name(a, name);
+        int sym = obj_symbol_get(a->o, full);
+
+        if (a->o->symbols.data[sym].section >= 0) {
+                free(full);
+                return fail(a, "label defined twice", ln);
+        }
+        a->o->symbols.data[sym].section = a->section;
+
+        if (name[0] != '.') {
+                free(a->scope);
+                a->scope = full;
+        } else {
+                free(full);
+        }
+
+        item it = {0};
+        it.kind    = ITEM_LABEL;
+        it.section = a->section;
+        it.sym     = sym;
+        dyn_array_append(a->items, it);
+        return 0;
+}
+
+static int
+data(x64_asm *a, int sz, char *p, const char *ln)
+{
+        for (;;) {
+                p = skip_ws(p);
+                if (!*p) break;
+
+                if (*p == '"' || *p == '\'' || *p == '`') {
+                        char q = *p++;
+                        uint8_t b[1];
+                        size_t n = 0;
+                        while (*p && *p != q) {
+                                b[0] = (uint8_t)*p++;
+                                add_code(a, b, 1, NULL);
+                                ++n;
+                        }
+                        if (*p != q) return fail(a, "unterminated string in", ln);
+                        ++p;
+                        // Strings in dw/dd/dq are padded to the size.
+                        while (n % sz) {
+                                b[0] = 0;
+                                add_code(a, b, 1, NULL);
+                                ++n;
+                        }
+                } else {
+                        int64_t v;
+                        uint8_t b[8] = {0};
+                        if (parse_num(&p, &v)) {
+                                for (int i = 0; i < sz; ++i) b[i] = (uint8_t)((uint64_t)v >> (8 * i));
+                                add_code(a, b, sz, NULL);
+                        } else {
+                                char *w = take_word(&p);
+                                if (!w || sz < 4) {
+                                        free(w);
+                                        return fail(a, "unsupported data", ln);
+                                }
+                                char *name = label_name(a, w);
+                                x64_fixup fix = {0, sz == 8 ? R_X86_64_64 : R_X86_64_32, name, 0};
+                                add_code(a, b, sz, &fix);
+                                free(name);
+                                free(w);
+                        }
+                }
+
+                p = skip_ws(p);
+                if (*p == ',') {
+                        ++p;
+                } else if (*p) {
+                        return fail(a, "unsupported data", ln);
+                }
+        }
+
+        return 0;
+}
+
+static int
+data_size(const char *w)
+{
+        if (!strcasecmp(w, "db")) return 1;
+        if (!strcasecmp(w, "dw")) return 2;
+        if (!strcasecmp(w, "dd")) return 4;
+        if (!strcasecmp(w, "dq")) return 8;
+        return 0;
+}
+
+static int
+res_size(const char *w)
+{
+        if (!strcasecmp(w, "resb")) return 1;
+        if (!strcasecmp(w, "resw")) return 2;
+        if (!strcasecmp(w, "resd")) return 4;
+        if (!strcasecmp(w, "resq")) return 8;
+        return 0;
+}
+
+static int
+names(x64_asm *a, char *p, int global, const char *ln)
+{
+        for (;;) {
+                char *w = take_word(&p);
+                if (!w) return fail(a, "expected a name in", ln);
+
+                // `global foo:function` and the like.
+                p = skip_ws(p);
+                if (*p == ':') {
+                        ++p;
+                        free(take_word(&p));
+                        p = skip_ws(p);
+                }
+
+                int sym = obj_symbol_get(a->o, w);
+                if (global) a->o->symbols.data[sym].global = 1;
+                free(w);
+
+                if (*p == ',') {
+                        ++p;
+                } else if (*p) {
+                        return fail(a, "unexpected text in", ln);
+                } else {
+                        return 0;
+                }
+        }
+}
+
+static int
+instruction(x64_asm *a, const x64_insn *in, const char *ln)
+{
+        // Branches within the section are resolved here, the
+        // shortest that reaches.
+        if ((in->op == X64_JMP || in->op == X64_JCC) && in->o[0].kind == X64_OPND_SYM && in->o[0].imm == 0) {
+                char *name = label_name(a, in->o[0].sym);
+                item it = {0};
+                it.kind     = ITEM_BRANCH;
+                it.section  = a->section;
+                it.sym      = obj_symbol_get(a->o, name);
+                it.jmp      = in->op == X64_JMP;
+                it.cc       = (x64_cc)in->cc;
+                it.is_short = 1;
+                free(name);
+                dyn_array_append(a->items, it);
+                return 0;
+        }
+
+        uint8_t b[X64_MAX_INSN];
+        x64_fixup fix;
+        int n = x64_encode(in, b, &fix);
+        if (n < 0) {
+                // Records only have text when something is wrong.
+                char buf[256];
+                if (!ln) x64_format(in, buf, sizeof(buf));
+                return fail(a, "cannot encode", ln ? ln : buf);
+        }
+
+        char *name = NULL;
+        if (fix.sym) {
+                name = label_name(a, fix.sym);
+                fix.sym = name;
+        }
+        add_code(a, b, n, &fix);
+        free(name);
+
+        return 0;
+}
+
+static int
+line(x64_asm *a, char *s)
+{
+        char *ln = strdup(s);
+        int r = 0;
+
+        // Comments, outside of strings.
+        char q = 0;
+        for (char *c = s; *c; ++c) {
+                if (q) {
+                        if (*c == q) q = 0;
+                } else if (*c == '"' || *c == '\'' || *c == '`') {
+                        q = *c;
+                } else if (*c == ';') {
+                        *c = 0;
+                        break;
+                }
+        }
+
+        char *p = skip_ws(s);
+        if (!*p) goto out;
+
+        // Directives.
+        char *save = p;
+        char *w = take_word(&p);
+        if (w && (!strcasecmp(w, "section") || !strcasecmp(w, "segment"))) {
+                // Names like .note.GNU-stack are not words.
+                char *name = skip_ws(p);
+                char *end = name;
+                while (*end && *end != ' ' && *end != '\t') ++end;
+                if (end == name) {
+                        r = fail(a, "expected a section name in", ln);
+                } else {
+                        *end = 0;
+                        a->section = obj_section_get(a->o, name);
+                }
+                free(w);
+                goto out;
+        }
+        if (w && (!strcasecmp(w, "global") || !strcasecmp(w, "extern"))) {
+                r = names(a, p, !strcasecmp(w, "global"), ln);
+                free(w);
+                goto out;
+        }
+        if (w && !strcasecmp(w, "bits")) {
+                int64_t bits = 0;
+                if (!parse_num(&p, &bits) || bits != 64) r = fail(a, "unsupported", ln);
+                free(w);
+                goto out;
+        }
+        if (w && !strcasecmp(w, "align")) {
+                int64_t n = 0;
+                if (!parse_num(&p, &n) || n < 1 || (n & (n - 1))) {
+                        r = fail(a, "bad alignment in", ln);
+                } else {
+                        item it = {0};
+                        it.kind    = ITEM_ALIGN;
+                        it.section = a->section;
+                        it.align   = (uint64_t)n;
+                        dyn_array_append(a->items, it);
+                }
+                free(w);
+                goto out;
+        }
+
+        // A label, maybe followed by more.
+        char *after = skip_ws(p);
+        if (w && *after == ':') {
+                r = define_label(a, w, ln);
+                free(w);
+                if (r < 0) goto out;
+                p = skip_ws(after + 1);
+                if (!*p) goto out;
+                save = p;
+                w = take_word(&p);
+        }
+
+        if (w && data_size(w)) {
+                r = data(a, data_size(w), p, ln);
+                free(w);
+                goto out;
+        }
+        if (w && res_size(w)) {
+                int64_t n = 0;
+                if (!parse_num(&p, &n) || n < 0) {
+                        r = fail(a, "bad size in", ln);
+                } else {
+                        item it = {0};
+                        it.kind    = ITEM_SPACE;
+                        it.section = a->section;
+                        it.size    = (size_t)n * res_size(w);
+                        dyn_array_append(a->items, it);
+                }
+                free(w);
+                goto out;
+        }
+
+        free(w);
+
+        x64_insn in;
+        if (x64_parse(save, &in) < 0) {
+                r = fail(a, "unsupported instruction", ln);
+        } else {
+                r = instruction(a, &in, ln);
+        }
+
+ out:
+        free(ln);
+        return r;
+}
+
+// Lays the items out, making every short branch that does not
+// reach long until none changes. Sizes only ever grow, so this
+// ends.
+static void
+layout(x64_asm *a)
+{
+        size_t nsect = a->o->sections.len;
+        uint64_t *at = (uint64_t *)alloc(sizeof(uint64_t) * (nsect + 1));
+
+        for (;;) {
+                memset(at, 0, sizeof(uint64_t) * (nsect + 1));
+
+                for (size_t i = 0; i < a->items.len; ++i) {
+                        item *it = &a->items.data[i];
+                        it->off = at[it->section];
+
+                        switch (it->kind) {
+                        case ITEM_BRANCH:
+                                it->size = it->is_short ? 2 : (it->jmp ? 5 : 6);
+                                break;
+                        case ITEM_ALIGN:
+                                it->size = (it->align - it->off % it->align) % it->align;
+                                break;
+                        case ITEM_LABEL:
+                                a->o->symbols.data[it->sym].value = it->off;
+                                break;
+                        default:
+                                break;
+                        }
+
+                        at[it->section] += it->size;
+                }
+
+                int changed = 0;
+                for (size_t i = 0; i < a->items.len; ++i) {
+                        item *it = &a->items.data[i];
+                        if (it->kind != ITEM_BRANCH || !it->is_short) continue;
+
+                        const obj_symbol *t = &a->o->symbols.data[it->sym];
+                        int64_t d = (int64_t)t->value - (int64_t)(it->off + 2);
+                        if (t->section != it->section || d < -128 || d > 127) {
+                                it->is_short = 0;
+                                changed = 1;
+                        }
+                }
+
+                if (!changed) break;
+        }
+
+        free(at);
+}
+
+static void
+reloc(x64_asm *a, int section, uint64_t offset, int sym, uint32_t type, int64_t addend)
+{
+        obj_reloc r = {offset, sym, type, addend};
+        dyn_array_append(a->o->sections.data[section].relocs, r);
+}
+
+static void
+emit(x64_asm *a)
+{
+        for (size_t i = 0; i < a->items.len; ++i) {
+                item *it = &a->items.data[i];
+                obj_section *sect = &a->o->sections.data[it->section];
+
+                switch (it->kind) {
+                case ITEM_CODE: {
+                        uint8_t *b = a->pool.data + it->at;
+                        if (it->has_fix) {
+                                const obj_symbol *t = &a->o->symbols.data[it->fix_sym];
+                                int pcrel = it->fix.type == R_X86_64_PC32 || it->fix.type == R_X86_64_PLT32;
+                                if (pcrel && t->section == it->section) {
+                                        int64_t d = (int64_t)t->value + it->fix.addend - (int64_t)(it->off + it->fix.at);
+                                        for (int k = 0; k < 4; ++k) b[it->fix.at + k] = (uint8_t)((uint64_t)d >> (8 * k));
+                                } else {
+                                        reloc(a, it->section, it->off + it->fix.at, it->fix_sym, it->fix.type, it->fix.addend);
+                                }
+                        }
+                        obj_emit(a->o, it->section, b, it->size);
+                        break;
+                }
+                case ITEM_BRANCH: {
+                        const obj_symbol *t = &a->o->symbols.data[it->sym];
+                        uint8_t b[6];
+                        int n = 0;
+
+                        if (it->is_short) {
+                                b[n++] = it->jmp ? 0xEB : (uint8_t)(0x70 + it->cc);
+                                b[n++] = (uint8_t)((int64_t)t->value - (int64_t)(it->off + 2));
+                        } else {
+                                if (it->jmp) {
+                                        b[n++] = 0xE9;
+                                } else {
+                                        b[n++] = 0x0F;
+                                        b[n++] = (uint8_t)(0x80 + it->cc);
+                                }
+                                int64_t d = (int64_t)t->value - (int64_t)(it->off + n + 4);
+                                if (t->section != it->section) {
+                                        reloc(a, it->section, it->off + n, it->sym,
+                                              it->jmp ? R_X86_64_PLT32 : R_X86_64_PC32, -4);
+                                        d = 0;
+                                }
+                                for (int k = 0; k < 4; ++k) b[n++] = (uint8_t)((uint64_t)d >> (8 * k));
+                        }
+                        obj_emit(a->o, it->section, b, n);
+                        break;
+                }
+                case ITEM_ALIGN:
+                case ITEM_SPACE: {
+                        uint8_t fill = (sect->flags & SHF_EXECINSTR) ? 0x90 : 0;
+                        if (sect->type == SHT_NOBITS) {
+                                sect->size += it->size;
+                        } else {
+                                for (size_t k = 0; k < it->size; ++k) obj_emit(a->o, it->section, &fill, 1);
+                        }
+                        break;
+                }
+                case ITEM_LABEL:
+                        break;
+                }
+        }
+}
+
+x64_asm *
+x64_asm_begin(obj *o)
+{
+        x64_asm *a = (x64_asm *)alloc(sizeof(x64_asm));
+        memset(a, 0, sizeof(x64_asm));
+        a->o       = o;
+        a->section = obj_section_get(o, ".text");
+        a->items   = dyn_array_empty(item_array);
+        a->pool    = dyn_array_empty(u8_array);
+        return a;
+}
+
+int
+x64_asm_line(x64_asm *a, const char *s)
+{
+        if (a->err) return -1;
+
+        char *copy = strndup(s, strcspn(s, "\n"));
+        ++a->line;
+        int r = line(a, copy);
+        free(copy);
+        return r;
+}
+
+int
+x64_asm_insn(x64_asm *a, const x64_insn *in)
+{
+        if (a->err) return -1;
+
+        ++a->line;
+        return instruction(a, in, NULL);
+}
+
+int
+x64_asm_label(x64_asm *a, const char *name)
+{
+        if (a->err) return -1;
+
+        ++a->line;
+        return define_label(a, name, name);
+}
+
+int
+x64_asm_end(x64_asm *a, char **err)
+{
+        int r = a->err ? -1 : 0;
+
+        if (r == 0) {
+                layout(a);
+                emit(a);
+        }
+
+        *err = a->err;
+        free(a->scope);
+        dyn_array_free(a->items);
+        dyn_array_free(a->pool);
+        free(a);
+
+        return r;
+}
+
+int
+x64_assemble(const char *src, obj *o, char **err)
+{
+        x64_asm *a = x64_asm_begin(o);
+
+        char *copy = strdup(src);
+        char *s = copy;
+        while (s && !a->err) {
+                char *nl = strchr(s, '\n');
+                if (nl) *nl = 0;
+                ++a->line;
+                line(a, s);
+                s = nl ? nl + 1 : NULL;
+        }
+        free(copy);
+
+        return x64_asm_end(a, err);
+}